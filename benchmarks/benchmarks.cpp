@@ -0,0 +1,100 @@
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include "shiny.h"
+
+// Every allocation the process makes, counted by the operator new below
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { std::free(pointer); }
+
+static std::string readProgram(const std::string& filename) {
+  std::ifstream file(std::string(SHINY_BENCHMARK_PROGRAMS) + "/" + filename);
+  std::stringstream source;
+  source << file.rdbuf();
+  return source.str();
+}
+
+// Runs a program through Shiny::run, which parses, type checks, compiles and
+// executes it from scratch every iteration. Besides the total time, reports
+// the time per phase and the allocations per run, and the peak RSS of the
+// whole process so far, which only describes this program when it is the
+// only one run (see --benchmark_filter).
+static void runProgram(benchmark::State& state, const std::string& filename) {
+  std::string source = readProgram(filename);
+  if (source.empty()) {
+    state.SkipWithError(("could not read " + filename).c_str());
+    return;
+  }
+
+  Shiny::PhaseTimes total;
+  size_t totalAllocations = 0;
+  // run prints the result of every iteration
+  std::stringstream discarded;
+  for (auto _ : state) {
+    Shiny::PhaseTimes times;
+    auto* original = std::cout.rdbuf(discarded.rdbuf());
+    size_t allocationsBefore = allocations;
+    Value result = Shiny::run(source, Shiny::Options(), times);
+    totalAllocations += allocations - allocationsBefore;
+    std::cout.rdbuf(original);
+    discarded.str("");
+    if (result.isNil()) {
+      state.SkipWithError((filename + " did not run").c_str());
+      break;
+    }
+    benchmark::DoNotOptimize(result);
+
+    total.parse += times.parse;
+    total.typeCheck += times.typeCheck;
+    total.compile += times.compile;
+    total.execute += times.execute;
+  }
+
+  auto perRun = [](auto count) {
+    return benchmark::Counter(static_cast<double>(count),
+                              benchmark::Counter::kAvgIterations);
+  };
+  state.counters["parse_ns"] = perRun(total.parse.count());
+  state.counters["type_check_ns"] = perRun(total.typeCheck.count());
+  state.counters["compile_ns"] = perRun(total.compile.count());
+  state.counters["execute_ns"] = perRun(total.execute.count());
+  state.counters["allocations"] = perRun(totalAllocations);
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // ru_maxrss is in kilobytes on Linux
+  state.counters["peak_rss_kb"] = static_cast<double>(usage.ru_maxrss);
+}
+
+BENCHMARK_CAPTURE(runProgram, fib, std::string("fib.swift"))
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(runProgram, factorial, std::string("factorial.swift"))
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(runProgram, closures, std::string("closures.swift"))
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(runProgram, many_fields, std::string("many_fields.swift"))
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(runProgram, method_calls, std::string("method_calls.swift"))
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(runProgram, nested_objects,
+                  std::string("nested_objects.swift"))
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
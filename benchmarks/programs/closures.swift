@@ -0,0 +1,23 @@
+func makeCounter() -> (Int) -> Int {
+    var count = 0
+
+    func add(x: Int) -> Int {
+        count = count + x
+        return count
+    }
+
+    return add
+}
+
+func main() -> Int {
+    var a = makeCounter()
+    var b = makeCounter()
+    var total = 0
+    for i in 0..<100000 {
+        a(1)
+        total = total + b(i % 3)
+    }
+    return total + a(0)
+}
+
+main()
@@ -0,0 +1,16 @@
+func factorial(n: Int) -> Int {
+    if n <= 1 {
+        return 1
+    }
+    return n * factorial(n - 1)
+}
+
+func main() -> Int {
+    var total = 0
+    for i in 0..<35000 {
+        total = total + factorial(i % 16) % 1009
+    }
+    return total
+}
+
+main()
@@ -0,0 +1,23 @@
+func main() -> Int {
+    class Particle {
+        var x = 0
+        var y = 0
+        var z = 0
+        var vx = 1
+        var vy = 2
+        var vz = 3
+        var mass = 10
+        var charge = 0
+    }
+
+    var total = 0
+    for i in 0..<20000 {
+        var particle = Particle()
+        particle.x = i
+        particle.charge = i % 2
+        total = total + particle.x + particle.vy + particle.mass + particle.charge
+    }
+    return total
+}
+
+main()
@@ -0,0 +1,27 @@
+func main() -> Int {
+    class Counter {
+        var value = 0
+
+        func add(n: Int) -> Int {
+            self.value = self.value + n
+            return self.value
+        }
+
+        func step() -> Int {
+            return self.add(1) + self.add(2)
+        }
+
+        func twice() -> Int {
+            return self.step() + self.step()
+        }
+    }
+
+    var counter = Counter()
+    var total = 0
+    for i in 0..<25000 {
+        total = total + counter.twice()
+    }
+    return total
+}
+
+main()
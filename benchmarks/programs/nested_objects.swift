@@ -0,0 +1,38 @@
+func main() -> Int {
+    class Vector {
+        var x = 0
+        var y = 0
+
+        func add(x: Int, y: Int) {
+            self.x = self.x + x
+            self.y = self.y + y
+        }
+    }
+
+    class Object {
+        var position = Vector()
+        var velocity = Vector()
+
+        func initialize() {
+            self.velocity.x = 1
+            self.velocity.y = 2
+        }
+
+        func update() {
+            self.position.add(self.velocity.x, self.velocity.y)
+        }
+    }
+
+    var total = 0
+    for i in 0..<5000 {
+        var object = Object()
+        object.initialize()
+        for j in 0..<10 {
+            object.update()
+        }
+        total = total + object.position.x + object.position.y
+    }
+    return total
+}
+
+main()
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <iterator>
 #include <vector>
 
 #include "runtime/value.h"
@@ -18,21 +20,20 @@ enum class Opcode : uint8_t {
   FALSE = 0x13,
   CONST = 0x14,    // operand: index of class constant
   CLOSURE = 0x15,  // operand: index of function constant
+  CLASS = 0x16,    // operand: index of class constant
 
-  ADD = 0x31,  // operand: type of operands
-  SUB = 0x32,  // operand: type of operands
-  MUL = 0x33,  // operand: type of operands
-  DIV = 0x34,  // operand: type of operands
+  ADD = 0x31,
+  SUB = 0x32,
+  MUL = 0x33,
+  DIV = 0x34,
   MOD = 0x35,
-  NEG = 0x36,  // operand: type of operands
+  NEG = 0x36,
   EQ = 0x37,
   NEQ = 0x38,
-  LT = 0x39,   // operand: type of operands
-  LTE = 0x3a,  // operand: type of operands
-  GT = 0x3b,   // operand: type of operands
-  GTE = 0x3c,  // operand: type of operands
-  AND = 0x3d,
-  OR = 0x3e,
+  LT = 0x39,
+  LTE = 0x3a,
+  GT = 0x3b,
+  GTE = 0x3c,
   NOT = 0x3f,
 
   BIT_AND = 0x40,
@@ -46,12 +47,32 @@ enum class Opcode : uint8_t {
   STORE = 0x51,  // operand: stack slot of local
   DUP = 0x52,
   POP = 0x53,
+  // Access a local of an enclosing function from the frame it is running in,
+  // for functions that never outlive that frame. Operand: how many frames
+  // down the call stack, stack slot of local (packed like the
+  // superinstructions below).
+  PARENT_LOAD = 0x54,
+  PARENT_STORE = 0x55,
+  // Keeps the value on top and pops the given number of values below it,
+  // which is how the body of an inlined call returns.
+  SLIDE = 0x56,
 
-  TEST = 0x60,
+  // Pop a bool and jump if it is false or true. Operand: offset of
+  // instruction to jump to.
+  JUMP_IF_FALSE = 0x60,
   JUMP = 0x61,  // operand: offset of instruction to jump to
   CALL = 0x62,  // operand: number of arguments
   RETURN = 0x63,
   HALT = 0x64,
+  TAIL_CALL = 0x65,  // operand: number of arguments; replaces the current frame
+  JUMP_IF_TRUE = 0x66,
+  // Jumps back to the start of a loop, counting the iteration so the JIT can
+  // find hot loops. Operand: offset of instruction to jump to.
+  LOOP = 0x67,
+  // Increments the counter of a `for` loop, the int below the end of its range
+  // on top of the stack, and jumps back like LOOP while it is still less than
+  // the end. Operand: offset of instruction to jump to.
+  FOR_RANGE = 0x68,
 
   GLOBAL_LOAD = 0x70,   // operand: index of global
   GLOBAL_STORE = 0x71,  // operand: index of global
@@ -62,12 +83,144 @@ enum class Opcode : uint8_t {
 
   MEMBER_GET = 0x90,  // operand: index of member
   MEMBER_SET = 0x91,  // operand: index of member
+  // Calls a method on the instance below its arguments, which becomes slot 0
+  // of the method's frame. Operand: number of arguments, index of method
+  // (packed like the superinstructions below).
+  INVOKE = 0x92,
+
+  // Arithmetic and comparisons specialized on the operand types inferred by
+  // TypeInference. These trust the type checker and do not check tags.
+  ADD_INT = 0xa0,
+  ADD_DOUBLE = 0xa1,
+  SUB_INT = 0xa2,
+  SUB_DOUBLE = 0xa3,
+  MUL_INT = 0xa4,
+  MUL_DOUBLE = 0xa5,
+  DIV_INT = 0xa6,
+  DIV_DOUBLE = 0xa7,
+  MOD_INT = 0xa8,
+  NEG_INT = 0xa9,
+  NEG_DOUBLE = 0xaa,
+  EQ_INT = 0xb0,
+  EQ_DOUBLE = 0xb1,
+  NEQ_INT = 0xb2,
+  NEQ_DOUBLE = 0xb3,
+  LT_INT = 0xb4,
+  LT_DOUBLE = 0xb5,
+  LTE_INT = 0xb6,
+  LTE_DOUBLE = 0xb7,
+  GT_INT = 0xb8,
+  GT_DOUBLE = 0xb9,
+  GTE_INT = 0xba,
+  GTE_DOUBLE = 0xbb,
+
+  // Superinstructions fused from common sequences after compilation. Operands
+  // pack a stack slot into the low byte and a constant, slot or member index
+  // into the upper 16 bits. The conditional jumps on a local are two words
+  // wide, the second word holding the offset of the instruction to jump to.
+  JUMP_UNLESS_LT_LOCAL_CONST = 0xc0,   // jumps unless local < constant
+  JUMP_UNLESS_LTE_LOCAL_CONST = 0xc1,  // jumps unless local <= constant
+  JUMP_UNLESS_GT_LOCAL_CONST = 0xc2,   // jumps unless local > constant
+  JUMP_UNLESS_GTE_LOCAL_CONST = 0xc3,  // jumps unless local >= constant
+  JUMP_UNLESS_EQ_LOCAL_CONST = 0xc4,   // jumps unless local == constant
+  JUMP_UNLESS_NEQ_LOCAL_CONST = 0xc5,  // jumps unless local != constant
+  ADD_INT_LOCALS = 0xc8,               // operand: stack slots of locals
+  ADD_INT_LOCAL_CONST = 0xc9,  // operand: stack slot, index of constant
+  SUB_INT_LOCAL_CONST = 0xca,  // operand: stack slot, index of constant
+  MUL_INT_LOCAL_CONST = 0xcb,  // operand: stack slot, index of constant
+  LOCAL_MEMBER_GET = 0xcc,     // operand: stack slot, index of member
+  // Pop two ints and jump unless the comparison holds. Operand: offset of
+  // instruction to jump to.
+  JUMP_UNLESS_LT_INT = 0xd0,
+  JUMP_UNLESS_LTE_INT = 0xd1,
+  JUMP_UNLESS_GT_INT = 0xd2,
+  JUMP_UNLESS_GTE_INT = 0xd3,
+  JUMP_UNLESS_EQ_INT = 0xd4,
+  JUMP_UNLESS_NEQ_INT = 0xd5,
+};
+
+// Number of 32-bit words taken up by an instruction with the given opcode.
+inline int instructionWidth(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::JUMP_UNLESS_LT_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_LTE_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_GT_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_GTE_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_EQ_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_NEQ_LOCAL_CONST:
+      return 2;
+    default:
+      return 1;
+  }
+}
+
+// Packs two fields into the 24-bit operand of a fused instruction.
+inline uint32_t packOperand(uint32_t low, uint32_t high) {
+  return (low & 0xFF) | (high << 8);
+}
+inline uint32_t operandLow(uint32_t operand) { return operand & 0xFF; }
+inline uint32_t operandHigh(uint32_t operand) { return operand >> 8; }
+
+// Where the instructions of one source line start in a Chunk
+struct LineStart {
+  uint32_t offset;
+  int line;
 };
 
 struct Chunk {
   std::vector<Instruction> instructions;
   std::vector<Value> constants;
 
-  // for error reporting and debugging
-  // TODO: add vector of line-cols where each instruction is defined
+  // values a frame running this chunk starts with: the callee and its
+  // arguments, or nothing for the top level
+  int entryDepth = 0;
+
+  // most stack slots a frame running this chunk uses, counted from its base
+  // pointer; the VM checks for overflow against it when entering the frame
+  int maxStackSize = 0;
+
+  // Source lines of the instructions, one entry per run of instructions from
+  // the same line, sorted by offset. Passes that move instructions around
+  // move the entries along with them.
+  std::vector<LineStart> lines;
+
+  // Line of the instruction at the given offset, or 0 if it is not known
+  int lineAt(size_t offset) const {
+    auto it = std::upper_bound(
+        lines.begin(), lines.end(), offset,
+        [](size_t offset, const LineStart& start) {
+          return offset < start.offset;
+        });
+    return it == lines.begin() ? 0 : std::prev(it)->line;
+  }
+
+  // Records that the instructions appended from now on come from the line
+  void markLine(int line) {
+    uint32_t offset = instructions.size();
+    if (!lines.empty() && lines.back().offset == offset) {
+      lines.pop_back();
+    }
+    if (lines.empty() || lines.back().line != line) {
+      lines.push_back({offset, line});
+    }
+  }
+
+  // Moves the line table along with the instructions after a pass rewrote
+  // them, given the new offset of every old offset and of the end. The
+  // instructions a pass inserted belong to the line of what they replaced.
+  template <typename Offsets>
+  void remapLines(const Offsets& newOffsets) {
+    std::vector<LineStart> remapped;
+    for (const LineStart& start : lines) {
+      uint32_t offset = newOffsets[start.offset];
+      // a run whose instructions were all removed gives way to the next
+      if (!remapped.empty() && remapped.back().offset == offset) {
+        remapped.pop_back();
+      }
+      if (remapped.empty() || remapped.back().line != start.line) {
+        remapped.push_back({offset, start.line});
+      }
+    }
+    lines = std::move(remapped);
+  }
 };
@@ -0,0 +1,632 @@
+#include "bytecode_file.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "error.h"
+#include "optimizer/stack_depth.h"
+
+namespace BytecodeFile {
+
+namespace {
+
+// tags of the constants in a chunk
+enum class ValueTag : uint32_t {
+  NIL,
+  TRUE,
+  FALSE,
+  INT,
+  DOUBLE,
+  FUNCTION,
+  CLOSURE,  // a closure without upvalues around a function
+  CLASS,
+  STRING,
+  OBJECT_REF,  // an object written earlier, by index
+};
+
+constexpr uint32_t NO_SYMBOL = 0xFFFFFFFF;
+
+class Writer {
+ public:
+  explicit Writer(const StringInterner& stringInterner)
+      : stringInterner(stringInterner) {}
+
+  std::string finish(const FunctionObject& function) {
+    writeFunction(function);
+
+    std::vector<uint32_t> header = {MAGIC, VERSION,
+                                    static_cast<uint32_t>(symbols.size())};
+    for (SymbolId symbol : symbols) {
+      appendString(header, stringInterner.get(symbol));
+    }
+
+    std::string data;
+    data.reserve(4 * (header.size() + words.size()));
+    for (auto* part : {&header, &words}) {
+      for (uint32_t word : *part) {
+        for (int i = 0; i < 4; i++) {
+          data.push_back(static_cast<char>(word >> 8 * i));
+        }
+      }
+    }
+    return data;
+  }
+
+ private:
+  // Appends the length of s and its bytes, padded to a whole word
+  static void appendString(std::vector<uint32_t>& out, const std::string& s) {
+    out.push_back(s.size());
+    for (size_t i = 0; i < s.size(); i += 4) {
+      uint32_t w = 0;
+      for (size_t j = i; j < std::min(i + 4, s.size()); j++) {
+        w |= static_cast<uint32_t>(static_cast<uint8_t>(s[j])) << 8 * (j - i);
+      }
+      out.push_back(w);
+    }
+  }
+
+  void word(uint32_t w) { words.push_back(w); }
+  void doubleWord(uint64_t w) {
+    word(static_cast<uint32_t>(w));
+    word(static_cast<uint32_t>(w >> 32));
+  }
+
+  uint32_t symbol(std::optional<SymbolId> id) {
+    if (!id.has_value()) {
+      return NO_SYMBOL;
+    }
+    auto [it, inserted] = symbolIndices.try_emplace(*id, symbols.size());
+    if (inserted) {
+      symbols.push_back(*id);
+    }
+    return it->second;
+  }
+
+  // Writes the reference to an object seen before and returns true, or
+  // numbers the object and returns false
+  bool writtenBefore(const void* object) {
+    auto [it, inserted] =
+        objectIndices.try_emplace(object, objectIndices.size());
+    if (!inserted) {
+      word(static_cast<uint32_t>(ValueTag::OBJECT_REF));
+      word(it->second);
+    }
+    return !inserted;
+  }
+
+  void writeFunction(const FunctionObject& function) {
+    const Chunk& chunk = function.getChunk();
+    word(symbol(function.getName()));
+    word(function.getUpvalues().size());
+    for (const Upvalue& upvalue : function.getUpvalues()) {
+      word(upvalue.index);
+      word(upvalue.isLocal);
+    }
+    word(chunk.entryDepth);
+    word(chunk.instructions.size());
+    words.insert(words.end(), chunk.instructions.begin(),
+                 chunk.instructions.end());
+    word(chunk.lines.size());
+    for (const LineStart& start : chunk.lines) {
+      word(start.offset);
+      word(start.line);
+    }
+    word(chunk.constants.size());
+    for (const Value& constant : chunk.constants) {
+      writeValue(constant);
+    }
+  }
+
+  void writeValue(const Value& value) {
+    if (value.isDouble()) {
+      word(static_cast<uint32_t>(ValueTag::DOUBLE));
+      doubleWord(std::bit_cast<uint64_t>(value.asDouble()));
+    } else if (value.isNil()) {
+      word(static_cast<uint32_t>(ValueTag::NIL));
+    } else if (value.isBool()) {
+      word(static_cast<uint32_t>(value.asBool() ? ValueTag::TRUE
+                                                : ValueTag::FALSE));
+    } else if (value.isInt()) {
+      word(static_cast<uint32_t>(ValueTag::INT));
+      doubleWord(std::bit_cast<uint64_t>(value.asInt()));
+    } else if (value.isObject<FunctionObject>()) {
+      auto function = value.asObject<FunctionObject>();
+      if (!writtenBefore(function.get())) {
+        word(static_cast<uint32_t>(ValueTag::FUNCTION));
+        writeFunction(*function.get());
+      }
+    } else if (value.isObject<ClosureObject>()) {
+      auto closure = value.asObject<ClosureObject>();
+      if (!closure->getUpvalues().empty()) {
+        throw Shiny::Error("Cannot serialize a closure with upvalues");
+      }
+      if (!writtenBefore(closure.get())) {
+        word(static_cast<uint32_t>(ValueTag::CLOSURE));
+        writeValue(Value(closure->getFunction()));
+      }
+    } else if (value.isObject<ClassObject>()) {
+      auto klass = value.asObject<ClassObject>();
+      if (!writtenBefore(klass.get())) {
+        word(static_cast<uint32_t>(ValueTag::CLASS));
+        word(symbol(klass->getName()));
+        word(klass->getFieldCount());
+        word(klass->getMembers().size());
+        for (const Value& member : klass->getMembers()) {
+          writeValue(member);
+        }
+      }
+    } else if (value.isObject<StringObject>()) {
+      auto string = value.asObject<StringObject>();
+      if (!writtenBefore(string.get())) {
+        word(static_cast<uint32_t>(ValueTag::STRING));
+        appendString(words, string->getData());
+      }
+    } else {
+      throw Shiny::Error("Cannot serialize constant");
+    }
+  }
+
+  const StringInterner& stringInterner;
+  std::vector<uint32_t> words;
+  std::vector<SymbolId> symbols;
+  std::unordered_map<SymbolId, uint32_t> symbolIndices;
+  std::unordered_map<const void*, uint32_t> objectIndices;
+};
+
+class Reader {
+ public:
+  Reader(std::string_view data, StringInterner& stringInterner)
+      : data(data), stringInterner(stringInterner) {}
+
+  ObjectPtr<FunctionObject> read() {
+    if (data.size() < 12 || word() != MAGIC) {
+      throw Shiny::Error("Not a Shiny bytecode file");
+    }
+    uint32_t version = word();
+    if (version != VERSION) {
+      throw Shiny::Error("Unsupported bytecode file version " +
+                         std::to_string(version) + ", expected " +
+                         std::to_string(VERSION));
+    }
+    uint32_t symbolCount = word();
+    for (uint32_t i = 0; i < symbolCount; i++) {
+      symbols.push_back(stringInterner.intern(string()));
+    }
+
+    auto function = readFunction();
+    if (position != data.size()) {
+      throw Shiny::Error("Corrupt bytecode file");
+    }
+    return function;
+  }
+
+ private:
+  void need(size_t bytes) {
+    if (data.size() - position < bytes) {
+      throw Shiny::Error("Corrupt bytecode file");
+    }
+  }
+
+  uint32_t word() {
+    need(4);
+    uint32_t w = 0;
+    for (int i = 0; i < 4; i++) {
+      w |= static_cast<uint32_t>(static_cast<uint8_t>(data[position++]))
+           << 8 * i;
+    }
+    return w;
+  }
+  uint64_t doubleWord() {
+    uint64_t low = word();
+    return low | static_cast<uint64_t>(word()) << 32;
+  }
+
+  std::string string() {
+    uint32_t length = word();
+    size_t padded = (static_cast<size_t>(length) + 3) / 4 * 4;
+    need(padded);
+    std::string s(data.substr(position, length));
+    position += padded;
+    return s;
+  }
+
+  std::optional<SymbolId> symbol() {
+    uint32_t index = word();
+    if (index == NO_SYMBOL) {
+      return std::nullopt;
+    }
+    if (index >= symbols.size()) {
+      throw Shiny::Error("Corrupt bytecode file");
+    }
+    return symbols[index];
+  }
+
+  static void check(bool valid) {
+    if (!valid) {
+      throw Shiny::Error("Corrupt bytecode file");
+    }
+  }
+
+  ObjectPtr<FunctionObject> readFunction() {
+    auto function = ObjectPtr<FunctionObject>(FunctionObject(symbol()));
+    uint32_t upvalueCount = word();
+    for (uint32_t i = 0; i < upvalueCount; i++) {
+      int index = word();
+      bool isLocal = word() != 0;
+      function->addUpvalue(Upvalue{index, isLocal});
+    }
+
+    Chunk& chunk = function->getChunk();
+    uint32_t entryDepth = word();
+    // the callee and at most 255 arguments
+    check(entryDepth <= 256);
+    chunk.entryDepth = entryDepth;
+    uint32_t instructionCount = word();
+    need(4 * static_cast<size_t>(instructionCount));
+    chunk.instructions.resize(instructionCount);
+    if constexpr (std::endian::native == std::endian::little) {
+      std::memcpy(chunk.instructions.data(), data.data() + position,
+                  4 * static_cast<size_t>(instructionCount));
+      position += 4 * static_cast<size_t>(instructionCount);
+    } else {
+      for (auto& instruction : chunk.instructions) {
+        instruction = word();
+      }
+    }
+
+    uint32_t lineCount = word();
+    need(8 * static_cast<size_t>(lineCount));
+    chunk.lines.reserve(lineCount);
+    for (uint32_t i = 0; i < lineCount; i++) {
+      uint32_t offset = word();
+      int line = word();
+      chunk.lines.push_back(LineStart{offset, line});
+    }
+
+    // every constant takes up at least a word
+    uint32_t constantCount = word();
+    need(4 * static_cast<size_t>(constantCount));
+    // checked before the constants, whose functions read this frame's slots
+    std::vector<int> depthAt =
+        checkInstructions(chunk, upvalueCount, constantCount);
+    chunk.maxStackSize = maxStackDepth(chunk, chunk.entryDepth);
+
+    enclosingChunks.push_back(&chunk);
+    chunk.constants.reserve(constantCount);
+    for (uint32_t i = 0; i < constantCount; i++) {
+      chunk.constants.push_back(readValue());
+    }
+    enclosingChunks.pop_back();
+    checkClosures(*function.get(), depthAt);
+    return function;
+  }
+
+  // The VM trusts the compiler to keep every operand in range, so rejects
+  // instructions that reach outside the chunk, its constants, the function's
+  // upvalues, the values on the frame's stack or the frames of the functions
+  // it is nested in. Returns the depth each instruction is reached with.
+  std::vector<int> checkInstructions(const Chunk& chunk, size_t upvalueCount,
+                                     uint32_t constantCount) const {
+    const auto& instructions = chunk.instructions;
+    auto isConstant = [&](uint32_t index) { return index < constantCount; };
+
+    // Decode the instructions in order, noting where each one starts so that
+    // jumps can be checked to land on one
+    std::vector<bool> starts(instructions.size(), false);
+    std::vector<uint32_t> targets;
+    for (size_t offset = 0; offset < instructions.size();) {
+      starts[offset] = true;
+      Opcode opcode = static_cast<Opcode>(instructions[offset] & 0xFF);
+      uint32_t operand = instructions[offset] >> 8;
+      try {
+        stackEffect(opcode, operand);
+      } catch (const std::runtime_error&) {
+        check(false);  // not an opcode
+      }
+      size_t next = offset + instructionWidth(opcode);
+      check(next <= instructions.size());
+
+      switch (opcode) {
+        case Opcode::CONST:
+        case Opcode::CLOSURE:
+        case Opcode::CLASS:
+          check(isConstant(operand));
+          break;
+        case Opcode::ADD_INT_LOCAL_CONST:
+        case Opcode::SUB_INT_LOCAL_CONST:
+        case Opcode::MUL_INT_LOCAL_CONST:
+          check(isConstant(operandHigh(operand)));
+          break;
+        case Opcode::JUMP_UNLESS_LT_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_LTE_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_GT_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_GTE_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_EQ_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_NEQ_LOCAL_CONST:
+          check(isConstant(operandHigh(operand)));
+          targets.push_back(instructions[offset + 1]);
+          break;
+        case Opcode::JUMP:
+        case Opcode::LOOP:
+        case Opcode::JUMP_IF_FALSE:
+        case Opcode::JUMP_IF_TRUE:
+        case Opcode::FOR_RANGE:
+        case Opcode::JUMP_UNLESS_LT_INT:
+        case Opcode::JUMP_UNLESS_LTE_INT:
+        case Opcode::JUMP_UNLESS_GT_INT:
+        case Opcode::JUMP_UNLESS_GTE_INT:
+        case Opcode::JUMP_UNLESS_EQ_INT:
+        case Opcode::JUMP_UNLESS_NEQ_INT:
+          targets.push_back(operand);
+          break;
+        case Opcode::UPVALUE_LOAD:
+        case Opcode::UPVALUE_STORE:
+          check(operand < upvalueCount);
+          break;
+        case Opcode::PARENT_LOAD:
+        case Opcode::PARENT_STORE: {
+          // a frame at most as far out as the functions this one is nested
+          // in, and a slot within the stack that frame uses
+          uint32_t frames = operandLow(operand);
+          check(frames >= 1 && frames <= enclosingChunks.size());
+          const Chunk* enclosing =
+              enclosingChunks[enclosingChunks.size() - frames];
+          check(operandHigh(operand) <
+                static_cast<uint32_t>(enclosing->maxStackSize));
+          break;
+        }
+        default:
+          break;
+      }
+      offset = next;
+    }
+    for (uint32_t target : targets) {
+      check(target < instructions.size() && starts[target]);
+    }
+
+    // Every path keeps the depth from going below the base pointer, and reads
+    // and writes only the locals below the current depth
+    auto depthAt = checkedDepths(chunk);
+    for (size_t offset = 0; offset < instructions.size(); offset++) {
+      int depth = depthAt[offset];
+      if (depth == -1) {
+        continue;
+      }
+      Opcode opcode = static_cast<Opcode>(instructions[offset] & 0xFF);
+      uint32_t operand = instructions[offset] >> 8;
+      int depthAfter = depth + stackEffect(opcode, operand);
+      // HALT counts as popping the result but leaves the stack alone
+      check(depthAfter >= 0 || opcode == Opcode::HALT);
+
+      auto isSlot = [&](uint32_t slot) {
+        return slot < static_cast<uint32_t>(depth);
+      };
+      switch (opcode) {
+        case Opcode::CALL:
+        case Opcode::TAIL_CALL:
+        case Opcode::INVOKE:
+        case Opcode::SLIDE:
+          // the callee or the value kept on top is below the popped values
+          check(depthAfter >= 1);
+          break;
+        case Opcode::LOAD:
+        case Opcode::STORE:
+          check(isSlot(operand));
+          break;
+        case Opcode::ADD_INT_LOCALS:
+          check(isSlot(operandLow(operand)) && isSlot(operandHigh(operand)));
+          break;
+        case Opcode::ADD_INT_LOCAL_CONST:
+        case Opcode::SUB_INT_LOCAL_CONST:
+        case Opcode::MUL_INT_LOCAL_CONST:
+        case Opcode::LOCAL_MEMBER_GET:
+        case Opcode::JUMP_UNLESS_LT_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_LTE_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_GT_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_GTE_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_EQ_LOCAL_CONST:
+        case Opcode::JUMP_UNLESS_NEQ_LOCAL_CONST:
+          check(isSlot(operandLow(operand)));
+          break;
+        default:
+          break;
+      }
+    }
+    return depthAt;
+  }
+
+  // Checks the constants of CLOSURE and CLASS instructions once they are read.
+  // The upvalues of the functions they close over are captured from the slots
+  // of this frame or the upvalues of this function's own closure.
+  static void checkClosures(const FunctionObject& function,
+                            const std::vector<int>& depthAt) {
+    const Chunk& chunk = function.getChunk();
+    const auto& instructions = chunk.instructions;
+    for (size_t offset = 0; offset < instructions.size();) {
+      Opcode opcode = static_cast<Opcode>(instructions[offset] & 0xFF);
+      uint32_t operand = instructions[offset] >> 8;
+      auto checkUpvalues = [&](const Value& value) {
+        check(value.isObject<FunctionObject>());
+        for (const Upvalue& upvalue :
+             value.asObject<FunctionObject>()->getUpvalues()) {
+          auto index = static_cast<uint32_t>(upvalue.index);
+          if (upvalue.isLocal) {
+            // unreachable instructions have no depth but never run
+            check(depthAt[offset] == -1 ||
+                  index < static_cast<uint32_t>(depthAt[offset]));
+          } else {
+            check(index < function.getUpvalues().size());
+          }
+        }
+      };
+      if (opcode == Opcode::CLOSURE) {
+        checkUpvalues(chunk.constants[operand]);
+      } else if (opcode == Opcode::CLASS) {
+        const Value& constant = chunk.constants[operand];
+        check(constant.isObject<ClassObject>());
+        auto klass = constant.asObject<ClassObject>();
+        const auto& members = klass->getMembers();
+        for (size_t i = klass->getFieldCount(); i < members.size(); i++) {
+          checkUpvalues(members[i]);
+        }
+      }
+      offset += instructionWidth(opcode);
+    }
+  }
+
+  // The depth each instruction is reached with, like stackDepths, which
+  // relies on the compiler keeping the depth the same on all paths into an
+  // instruction. A file breaking that, or running off the end of the chunk,
+  // is rejected instead of walked until the depth overflows.
+  static std::vector<int> checkedDepths(const Chunk& chunk) {
+    const auto& instructions = chunk.instructions;
+    std::vector<int> depthAt(instructions.size(), -1);
+    std::vector<size_t> worklist;
+    auto reach = [&](size_t offset, int depth) {
+      check(offset < instructions.size() && depth >= 0);
+      if (depthAt[offset] == -1) {
+        depthAt[offset] = depth;
+        worklist.push_back(offset);
+      } else {
+        check(depthAt[offset] == depth);
+      }
+    };
+
+    reach(0, chunk.entryDepth);
+    while (!worklist.empty()) {
+      size_t offset = worklist.back();
+      worklist.pop_back();
+
+      Opcode opcode = static_cast<Opcode>(instructions[offset] & 0xFF);
+      uint32_t operand = instructions[offset] >> 8;
+      int depth = depthAt[offset] + stackEffect(opcode, operand);
+      size_t next = offset + instructionWidth(opcode);
+      switch (opcode) {
+        case Opcode::RETURN:
+        case Opcode::TAIL_CALL:
+        case Opcode::HALT:
+          break;
+        case Opcode::JUMP:
+        case Opcode::LOOP:
+          reach(operand, depth);
+          break;
+        case Opcode::JUMP_IF_FALSE:
+        case Opcode::JUMP_IF_TRUE:
+        case Opcode::FOR_RANGE:
+        case Opcode::JUMP_UNLESS_LT_INT:
+        case Opcode::JUMP_UNLESS_LTE_INT:
+        case Opcode::JUMP_UNLESS_GT_INT:
+        case Opcode::JUMP_UNLESS_GTE_INT:
+        case Opcode::JUMP_UNLESS_EQ_INT:
+        case Opcode::JUMP_UNLESS_NEQ_INT:
+          reach(operand, depth);
+          reach(next, depth);
+          break;
+        default:
+          if (instructionWidth(opcode) == 2) {
+            reach(instructions[offset + 1], depth);
+          }
+          reach(next, depth);
+          break;
+      }
+    }
+    return depthAt;
+  }
+
+  Value readValue() {
+    switch (static_cast<ValueTag>(word())) {
+      case ValueTag::NIL:
+        return Value::NIL;
+      case ValueTag::TRUE:
+        return Value::TRUE;
+      case ValueTag::FALSE:
+        return Value::FALSE;
+      case ValueTag::INT:
+        return Value(std::bit_cast<int64_t>(doubleWord()));
+      case ValueTag::DOUBLE:
+        return Value(std::bit_cast<double>(doubleWord()));
+      case ValueTag::FUNCTION: {
+        // numbered before its constants, in the order the writer saw it
+        size_t index = reserveObject();
+        objects[index] = Value(readFunction());
+        return objects[index];
+      }
+      case ValueTag::CLOSURE: {
+        size_t index = reserveObject();
+        Value function = readValue();
+        // only functions without upvalues are closed over in advance
+        check(function.isObject<FunctionObject>() &&
+              function.asObject<FunctionObject>()->getUpvalues().empty());
+        objects[index] = Value(ObjectPtr<ClosureObject>(
+            ClosureObject(function.asObject<FunctionObject>())));
+        return objects[index];
+      }
+      case ValueTag::CLASS: {
+        size_t index = reserveObject();
+        std::optional<SymbolId> name = symbol();
+        uint32_t fieldCount = word();
+        uint32_t memberCount = word();
+        // every member takes up at least a word
+        need(4 * static_cast<size_t>(memberCount));
+        std::vector<Value> members;
+        members.reserve(memberCount);
+        for (uint32_t i = 0; i < memberCount; i++) {
+          members.push_back(readValue());
+        }
+        check(name.has_value() && fieldCount <= memberCount);
+        // the members after the fields are the methods
+        for (uint32_t i = fieldCount; i < memberCount; i++) {
+          check(members[i].isObject<FunctionObject>());
+        }
+        objects[index] = Value(ObjectPtr<ClassObject>(ClassObject(
+            *name, std::move(members), static_cast<int>(fieldCount))));
+        return objects[index];
+      }
+      case ValueTag::STRING: {
+        size_t index = reserveObject();
+        objects[index] = Value(ObjectPtr<StringObject>(StringObject(string())));
+        return objects[index];
+      }
+      case ValueTag::OBJECT_REF: {
+        uint32_t index = word();
+        if (index >= objects.size() || objects[index].isNil()) {
+          throw Shiny::Error("Corrupt bytecode file");
+        }
+        return objects[index];
+      }
+      default:
+        throw Shiny::Error("Corrupt bytecode file");
+    }
+  }
+
+  size_t reserveObject() {
+    objects.push_back(Value::NIL);
+    return objects.size() - 1;
+  }
+
+  std::string_view data;
+  size_t position = 0;
+  StringInterner& stringInterner;
+  std::vector<SymbolId> symbols;
+  std::vector<Value> objects;  // in the order they were first written
+  // the chunks whose constants are being read, innermost last
+  std::vector<const Chunk*> enclosingChunks;
+};
+
+}  // namespace
+
+std::string write(const FunctionObject& function,
+                  const StringInterner& stringInterner) {
+  return Writer(stringInterner).finish(function);
+}
+
+ObjectPtr<FunctionObject> read(std::string_view data,
+                               StringInterner& stringInterner) {
+  return Reader(data, stringInterner).read();
+}
+
+}  // namespace BytecodeFile
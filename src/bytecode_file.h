@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "frontend/string_interner.h"
+#include "runtime/object.h"
+#include "runtime/object_ptr.h"
+
+// Precompiled scripts (.shinyc) for the stack engine, which `shiny compile`
+// writes and runFile loads without running the front end.
+//
+// The file is a sequence of 32-bit little-endian words:
+//
+//   header:    magic "SHNY", format version, number of symbols
+//   symbols:   each a byte length followed by its bytes, padded to a word
+//   function:  the top-level function
+//
+// A function is its name, upvalues, entry depth, instructions, line table
+// and constants. Constants are tagged words, and the objects among them are
+// written in place the first time they are reached and by index after that,
+// so objects shared between chunks stay shared once loaded. Since every field
+// is word-aligned, instructions are stored exactly as in Chunk and load with a
+// single copy. Symbol ids are local to the file and re-interned on load.
+//
+// The VM trusts its bytecode, so loading checks that the instructions stay
+// within their chunk, constants, upvalues, stack slots and enclosing frames,
+// and recomputes the stack size each frame needs instead of reading it.
+// Globals are only stored at runtime, so the VM checks those loads instead.
+namespace BytecodeFile {
+
+constexpr uint32_t MAGIC = 0x594e4853;  // "SHNY"
+// bumped whenever the format or the instruction set changes
+constexpr uint32_t VERSION = 3;
+
+constexpr std::string_view EXTENSION = ".shinyc";
+
+std::string write(const FunctionObject& function,
+                  const StringInterner& stringInterner);
+
+// Throws a Shiny::Error if data is not a valid bytecode file of this version.
+ObjectPtr<FunctionObject> read(std::string_view data,
+                               StringInterner& stringInterner);
+
+}  // namespace BytecodeFile
@@ -20,6 +20,8 @@ std::string opcodeToString(Opcode opcode) {
       return "CONST";
     case Opcode::CLOSURE:
       return "CLOSURE";
+    case Opcode::CLASS:
+      return "CLASS";
     case Opcode::ADD:
       return "ADD";
     case Opcode::SUB:
@@ -44,10 +46,6 @@ std::string opcodeToString(Opcode opcode) {
       return "GT";
     case Opcode::GTE:
       return "GTE";
-    case Opcode::AND:
-      return "AND";
-    case Opcode::OR:
-      return "OR";
     case Opcode::NOT:
       return "NOT";
     case Opcode::BIT_AND:
@@ -66,18 +64,32 @@ std::string opcodeToString(Opcode opcode) {
       return "LOAD";
     case Opcode::STORE:
       return "STORE";
+    case Opcode::PARENT_LOAD:
+      return "PARENT_LOAD";
+    case Opcode::PARENT_STORE:
+      return "PARENT_STORE";
     case Opcode::DUP:
       return "DUP";
     case Opcode::POP:
       return "POP";
-    case Opcode::TEST:
-      return "TEST";
+    case Opcode::JUMP_IF_FALSE:
+      return "JUMP_IF_FALSE";
+    case Opcode::JUMP_IF_TRUE:
+      return "JUMP_IF_TRUE";
     case Opcode::JUMP:
       return "JUMP";
+    case Opcode::LOOP:
+      return "LOOP";
+    case Opcode::FOR_RANGE:
+      return "FOR_RANGE";
     case Opcode::CALL:
       return "CALL";
     case Opcode::RETURN:
       return "RETURN";
+    case Opcode::TAIL_CALL:
+      return "TAIL_CALL";
+    case Opcode::SLIDE:
+      return "SLIDE";
     case Opcode::HALT:
       return "HALT";
     case Opcode::UPVALUE_LOAD:
@@ -90,25 +102,137 @@ std::string opcodeToString(Opcode opcode) {
       return "MEMBER_GET";
     case Opcode::MEMBER_SET:
       return "MEMBER_SET";
+    case Opcode::INVOKE:
+      return "INVOKE";
     case Opcode::GLOBAL_LOAD:
       return "GLOBAL_LOAD";
     case Opcode::GLOBAL_STORE:
       return "GLOBAL_STORE";
+    case Opcode::ADD_INT:
+      return "ADD_INT";
+    case Opcode::ADD_DOUBLE:
+      return "ADD_DOUBLE";
+    case Opcode::SUB_INT:
+      return "SUB_INT";
+    case Opcode::SUB_DOUBLE:
+      return "SUB_DOUBLE";
+    case Opcode::MUL_INT:
+      return "MUL_INT";
+    case Opcode::MUL_DOUBLE:
+      return "MUL_DOUBLE";
+    case Opcode::DIV_INT:
+      return "DIV_INT";
+    case Opcode::DIV_DOUBLE:
+      return "DIV_DOUBLE";
+    case Opcode::MOD_INT:
+      return "MOD_INT";
+    case Opcode::NEG_INT:
+      return "NEG_INT";
+    case Opcode::NEG_DOUBLE:
+      return "NEG_DOUBLE";
+    case Opcode::EQ_INT:
+      return "EQ_INT";
+    case Opcode::EQ_DOUBLE:
+      return "EQ_DOUBLE";
+    case Opcode::NEQ_INT:
+      return "NEQ_INT";
+    case Opcode::NEQ_DOUBLE:
+      return "NEQ_DOUBLE";
+    case Opcode::LT_INT:
+      return "LT_INT";
+    case Opcode::LT_DOUBLE:
+      return "LT_DOUBLE";
+    case Opcode::LTE_INT:
+      return "LTE_INT";
+    case Opcode::LTE_DOUBLE:
+      return "LTE_DOUBLE";
+    case Opcode::GT_INT:
+      return "GT_INT";
+    case Opcode::GT_DOUBLE:
+      return "GT_DOUBLE";
+    case Opcode::GTE_INT:
+      return "GTE_INT";
+    case Opcode::GTE_DOUBLE:
+      return "GTE_DOUBLE";
+    case Opcode::JUMP_UNLESS_LT_LOCAL_CONST:
+      return "JUMP_UNLESS_LT_LOCAL_CONST";
+    case Opcode::JUMP_UNLESS_LTE_LOCAL_CONST:
+      return "JUMP_UNLESS_LTE_LOCAL_CONST";
+    case Opcode::JUMP_UNLESS_GT_LOCAL_CONST:
+      return "JUMP_UNLESS_GT_LOCAL_CONST";
+    case Opcode::JUMP_UNLESS_GTE_LOCAL_CONST:
+      return "JUMP_UNLESS_GTE_LOCAL_CONST";
+    case Opcode::JUMP_UNLESS_EQ_LOCAL_CONST:
+      return "JUMP_UNLESS_EQ_LOCAL_CONST";
+    case Opcode::JUMP_UNLESS_NEQ_LOCAL_CONST:
+      return "JUMP_UNLESS_NEQ_LOCAL_CONST";
+    case Opcode::ADD_INT_LOCALS:
+      return "ADD_INT_LOCALS";
+    case Opcode::ADD_INT_LOCAL_CONST:
+      return "ADD_INT_LOCAL_CONST";
+    case Opcode::SUB_INT_LOCAL_CONST:
+      return "SUB_INT_LOCAL_CONST";
+    case Opcode::MUL_INT_LOCAL_CONST:
+      return "MUL_INT_LOCAL_CONST";
+    case Opcode::LOCAL_MEMBER_GET:
+      return "LOCAL_MEMBER_GET";
+    case Opcode::JUMP_UNLESS_LT_INT:
+      return "JUMP_UNLESS_LT_INT";
+    case Opcode::JUMP_UNLESS_LTE_INT:
+      return "JUMP_UNLESS_LTE_INT";
+    case Opcode::JUMP_UNLESS_GT_INT:
+      return "JUMP_UNLESS_GT_INT";
+    case Opcode::JUMP_UNLESS_GTE_INT:
+      return "JUMP_UNLESS_GTE_INT";
+    case Opcode::JUMP_UNLESS_EQ_INT:
+      return "JUMP_UNLESS_EQ_INT";
+    case Opcode::JUMP_UNLESS_NEQ_INT:
+      return "JUMP_UNLESS_NEQ_INT";
     default:
       return "<unknown>";
   }
 }
 
+std::string opcodeClass(Opcode opcode) {
+  // the opcodes are numbered in groups of related instructions
+  switch (static_cast<uint8_t>(opcode) >> 4) {
+    case 0x1:
+      return "constants";
+    case 0x3:
+    case 0x4:
+      return "arithmetic";
+    case 0x5:
+      return "locals";
+    case 0x6:
+      return "control flow";
+    case 0x7:
+      return "globals";
+    case 0x8:
+      return "upvalues";
+    case 0x9:
+      return "members";
+    case 0xa:
+    case 0xb:
+      return "typed arithmetic";
+    case 0xc:
+    case 0xd:
+      return "superinstructions";
+    default:
+      return "other";
+  }
+}
+
 std::string chunkToString(const Chunk& chunk, const std::string& name,
                           const StringInterner& stringInterner) {
   std::stringstream ss;
 
   ss << "== " << name << " ==\n";
 
-  for (size_t offset = 0; offset < chunk.instructions.size(); ++offset) {
-    ss << instructionToString(offset, chunk.instructions[offset],
-                              stringInterner);
+  for (size_t offset = 0; offset < chunk.instructions.size();) {
+    ss << instructionToString(chunk, offset, stringInterner);
     ss << "\n";
+    offset += instructionWidth(
+        static_cast<Opcode>(chunk.instructions[offset] & 0xFF));
   }
 
   return std::move(ss.str());
@@ -123,24 +247,28 @@ std::string instructionToString(size_t offset, Instruction instr,
 
   ss << std::setw(4) << std::left << offset << "  ";
   std::string opname = opcodeToString(opcode);
-  ss << std::setw(20) << std::left << opname;
+  ss << std::setw(28) << std::left << opname;
 
   switch (opcode) {
     case Opcode::CONST:
     case Opcode::CLOSURE:
-    case Opcode::ADD:
-    case Opcode::SUB:
-    case Opcode::MUL:
-    case Opcode::DIV:
-    case Opcode::NEG:
-    case Opcode::LT:
-    case Opcode::LTE:
-    case Opcode::GT:
-    case Opcode::GTE:
+    case Opcode::CLASS:
     case Opcode::LOAD:
     case Opcode::STORE:
     case Opcode::CALL:
+    case Opcode::TAIL_CALL:
+    case Opcode::SLIDE:
     case Opcode::JUMP:
+    case Opcode::JUMP_IF_FALSE:
+    case Opcode::JUMP_IF_TRUE:
+    case Opcode::LOOP:
+    case Opcode::FOR_RANGE:
+    case Opcode::JUMP_UNLESS_LT_INT:
+    case Opcode::JUMP_UNLESS_LTE_INT:
+    case Opcode::JUMP_UNLESS_GT_INT:
+    case Opcode::JUMP_UNLESS_GTE_INT:
+    case Opcode::JUMP_UNLESS_EQ_INT:
+    case Opcode::JUMP_UNLESS_NEQ_INT:
     case Opcode::UPVALUE_LOAD:
     case Opcode::UPVALUE_STORE:
     case Opcode::GLOBAL_LOAD:
@@ -150,6 +278,17 @@ std::string instructionToString(size_t offset, Instruction instr,
       ss << operand;
       break;
     }
+    case Opcode::ADD_INT_LOCALS:
+    case Opcode::ADD_INT_LOCAL_CONST:
+    case Opcode::SUB_INT_LOCAL_CONST:
+    case Opcode::MUL_INT_LOCAL_CONST:
+    case Opcode::LOCAL_MEMBER_GET:
+    case Opcode::INVOKE:
+    case Opcode::PARENT_LOAD:
+    case Opcode::PARENT_STORE: {
+      ss << operandLow(operand) << " " << operandHigh(operand);
+      break;
+    }
     default:
       break;
   }
@@ -157,6 +296,310 @@ std::string instructionToString(size_t offset, Instruction instr,
   return std::move(ss.str());
 }
 
+std::string instructionToString(const Chunk& chunk, size_t offset,
+                                const StringInterner& stringInterner) {
+  Instruction instr = chunk.instructions[offset];
+  Opcode opcode = static_cast<Opcode>(instr & 0xFF);
+  if (instructionWidth(opcode) == 1) {
+    return instructionToString(offset, instr, stringInterner);
+  }
+
+  std::stringstream ss;
+  uint32_t operand = instr >> 8;
+  ss << std::setw(4) << std::left << offset << "  ";
+  ss << std::setw(28) << std::left << opcodeToString(opcode);
+  ss << operandLow(operand) << " " << operandHigh(operand) << " -> "
+     << chunk.instructions[offset + 1];
+  return std::move(ss.str());
+}
+
+std::string registerOpcodeToString(RegisterOpcode opcode) {
+  switch (opcode) {
+    case RegisterOpcode::NO_OP:
+      return "NO_OP";
+    case RegisterOpcode::MOVE:
+      return "MOVE";
+    case RegisterOpcode::LOAD_NIL:
+      return "LOAD_NIL";
+    case RegisterOpcode::LOAD_TRUE:
+      return "LOAD_TRUE";
+    case RegisterOpcode::LOAD_FALSE:
+      return "LOAD_FALSE";
+    case RegisterOpcode::LOAD_CONST:
+      return "LOAD_CONST";
+    case RegisterOpcode::ADD_INT:
+      return "ADD_INT";
+    case RegisterOpcode::ADD_DOUBLE:
+      return "ADD_DOUBLE";
+    case RegisterOpcode::SUB_INT:
+      return "SUB_INT";
+    case RegisterOpcode::SUB_DOUBLE:
+      return "SUB_DOUBLE";
+    case RegisterOpcode::MUL_INT:
+      return "MUL_INT";
+    case RegisterOpcode::MUL_DOUBLE:
+      return "MUL_DOUBLE";
+    case RegisterOpcode::DIV_INT:
+      return "DIV_INT";
+    case RegisterOpcode::DIV_DOUBLE:
+      return "DIV_DOUBLE";
+    case RegisterOpcode::MOD_INT:
+      return "MOD_INT";
+    case RegisterOpcode::EQ:
+      return "EQ";
+    case RegisterOpcode::EQ_INT:
+      return "EQ_INT";
+    case RegisterOpcode::EQ_DOUBLE:
+      return "EQ_DOUBLE";
+    case RegisterOpcode::NEQ:
+      return "NEQ";
+    case RegisterOpcode::NEQ_INT:
+      return "NEQ_INT";
+    case RegisterOpcode::NEQ_DOUBLE:
+      return "NEQ_DOUBLE";
+    case RegisterOpcode::LT_INT:
+      return "LT_INT";
+    case RegisterOpcode::LT_DOUBLE:
+      return "LT_DOUBLE";
+    case RegisterOpcode::LTE_INT:
+      return "LTE_INT";
+    case RegisterOpcode::LTE_DOUBLE:
+      return "LTE_DOUBLE";
+    case RegisterOpcode::GT_INT:
+      return "GT_INT";
+    case RegisterOpcode::GT_DOUBLE:
+      return "GT_DOUBLE";
+    case RegisterOpcode::GTE_INT:
+      return "GTE_INT";
+    case RegisterOpcode::GTE_DOUBLE:
+      return "GTE_DOUBLE";
+    case RegisterOpcode::NEG_INT:
+      return "NEG_INT";
+    case RegisterOpcode::NEG_DOUBLE:
+      return "NEG_DOUBLE";
+    case RegisterOpcode::NOT:
+      return "NOT";
+    case RegisterOpcode::JUMP:
+      return "JUMP";
+    case RegisterOpcode::JUMP_IF_FALSE:
+      return "JUMP_IF_FALSE";
+    case RegisterOpcode::CALL:
+      return "CALL";
+    case RegisterOpcode::RETURN:
+      return "RETURN";
+    case RegisterOpcode::HALT:
+      return "HALT";
+    case RegisterOpcode::GLOBAL_LOAD:
+      return "GLOBAL_LOAD";
+    case RegisterOpcode::GLOBAL_STORE:
+      return "GLOBAL_STORE";
+    default:
+      return "<unknown>";
+  }
+}
+
+std::string registerChunkToString(const RegisterChunk& chunk,
+                                  const std::string& name,
+                                  const StringInterner& stringInterner) {
+  std::stringstream ss;
+
+  ss << "== " << name << " (" << chunk.registerCount << " registers) ==\n";
+
+  for (size_t offset = 0; offset < chunk.instructions.size(); offset++) {
+    ss << registerInstructionToString(chunk, offset, stringInterner);
+    ss << "\n";
+  }
+
+  return std::move(ss.str());
+}
+
+std::string registerInstructionToString(const RegisterChunk& chunk,
+                                        size_t offset,
+                                        const StringInterner& stringInterner) {
+  std::stringstream ss;
+
+  RegisterInstruction instr = chunk.instructions[offset];
+  RegisterOpcode opcode = decodeOpcode(instr);
+
+  ss << std::setw(4) << std::left << offset << "  ";
+  ss << std::setw(16) << std::left << registerOpcodeToString(opcode);
+
+  switch (opcode) {
+    case RegisterOpcode::NO_OP:
+      break;
+    case RegisterOpcode::LOAD_NIL:
+    case RegisterOpcode::LOAD_TRUE:
+    case RegisterOpcode::LOAD_FALSE:
+    case RegisterOpcode::RETURN:
+    case RegisterOpcode::HALT:
+      ss << "r" << decodeA(instr);
+      break;
+    case RegisterOpcode::MOVE:
+    case RegisterOpcode::NEG_INT:
+    case RegisterOpcode::NEG_DOUBLE:
+    case RegisterOpcode::NOT:
+      ss << "r" << decodeA(instr) << " r" << decodeB(instr);
+      break;
+    case RegisterOpcode::LOAD_CONST:
+      ss << "r" << decodeA(instr) << " k" << decodeBx(instr) << " ("
+         << valueToString(chunk.constants[decodeBx(instr)], stringInterner)
+         << ")";
+      break;
+    case RegisterOpcode::GLOBAL_LOAD:
+    case RegisterOpcode::GLOBAL_STORE:
+      ss << "r" << decodeA(instr) << " g" << decodeBx(instr);
+      break;
+    case RegisterOpcode::JUMP:
+      ss << "-> " << decodeBx(instr);
+      break;
+    case RegisterOpcode::JUMP_IF_FALSE:
+      ss << "r" << decodeA(instr) << " -> " << decodeBx(instr);
+      break;
+    case RegisterOpcode::CALL:
+      ss << "r" << decodeA(instr) << " " << decodeB(instr);
+      break;
+    default:
+      ss << "r" << decodeA(instr) << " r" << decodeB(instr) << " r"
+         << decodeC(instr);
+      break;
+  }
+
+  return std::move(ss.str());
+}
+
+std::string irOpToString(IROp op) {
+  switch (op) {
+    case IROp::Param:
+      return "param";
+    case IROp::Const:
+      return "const";
+    case IROp::Nil:
+      return "nil";
+    case IROp::True:
+      return "true";
+    case IROp::False:
+      return "false";
+    case IROp::Copy:
+      return "copy";
+    case IROp::Phi:
+      return "phi";
+    case IROp::GlobalLoad:
+      return "global_load";
+    case IROp::GlobalStore:
+      return "global_store";
+    case IROp::Call:
+      return "call";
+    case IROp::Add:
+      return "add";
+    case IROp::Sub:
+      return "sub";
+    case IROp::Mul:
+      return "mul";
+    case IROp::Div:
+      return "div";
+    case IROp::Mod:
+      return "mod";
+    case IROp::Neg:
+      return "neg";
+    case IROp::Eq:
+      return "eq";
+    case IROp::Neq:
+      return "neq";
+    case IROp::Lt:
+      return "lt";
+    case IROp::Lte:
+      return "lte";
+    case IROp::Gt:
+      return "gt";
+    case IROp::Gte:
+      return "gte";
+    case IROp::Not:
+      return "not";
+    default:
+      return "<unknown>";
+  }
+}
+
+static std::string irTypeToString(IRType type) {
+  switch (type) {
+    case IRType::Nil:
+      return "Nil";
+    case IRType::Int:
+      return "Int";
+    case IRType::Double:
+      return "Double";
+    case IRType::Bool:
+      return "Bool";
+    case IRType::Object:
+      return "Object";
+    default:
+      return "<unknown>";
+  }
+}
+
+std::string irFunctionToString(const IRFunction& function,
+                               const std::string& name,
+                               const StringInterner& stringInterner) {
+  std::stringstream ss;
+
+  ss << "== " << name << " (IR) ==\n";
+
+  for (size_t block = 0; block < function.blocks.size(); block++) {
+    auto& ir = function.blocks[block];
+    ss << "block" << block << ":";
+    if (!ir.predecessors.empty()) {
+      ss << " ; preds:";
+      for (auto predecessor : ir.predecessors) {
+        ss << " block" << predecessor;
+      }
+    }
+    ss << "\n";
+
+    for (auto id : ir.instructions) {
+      auto& instruction = function.values[id];
+      ss << "  %" << id << ": " << irTypeToString(instruction.type) << " = "
+         << irOpToString(instruction.op);
+      switch (instruction.op) {
+        case IROp::Param:
+        case IROp::GlobalLoad:
+        case IROp::GlobalStore:
+          ss << " " << instruction.immediate;
+          break;
+        case IROp::Const:
+          ss << " "
+             << valueToString(function.constants[instruction.immediate],
+                              stringInterner);
+          break;
+        default:
+          break;
+      }
+      for (size_t i = 0; i < instruction.operands.size(); i++) {
+        ss << (i == 0 ? " " : ", ") << "%" << instruction.operands[i];
+      }
+      ss << "\n";
+    }
+
+    auto& terminator = ir.terminator;
+    switch (terminator.kind) {
+      case IRTerminatorKind::None:
+        ss << "  <no terminator>\n";
+        break;
+      case IRTerminatorKind::Jump:
+        ss << "  jump block" << terminator.target << "\n";
+        break;
+      case IRTerminatorKind::Branch:
+        ss << "  branch %" << terminator.value << ", block" << terminator.target
+           << ", block" << terminator.otherTarget << "\n";
+        break;
+      case IRTerminatorKind::Return:
+        ss << "  return %" << terminator.value << "\n";
+        break;
+    }
+  }
+
+  return std::move(ss.str());
+}
+
 std::string valueToString(const Value& value,
                           const StringInterner& stringInterner) {
   std::stringstream ss;
@@ -189,10 +632,8 @@ std::string valueToString(const Value& value,
   } else if (value.isObject<UpvalueObject>()) {
     auto upvalue = value.asObject<UpvalueObject>();
     ss << "(" << (upvalue->isOpen() ? "open" : "closed") << ","
-       << (upvalue->isOpen()
-               ? std::to_string(upvalue->getStackSlot())
-               : valueToString(upvalue->getClosedValue(), stringInterner))
-       << ")@" << upvalue.__getPtr();
+       << valueToString(*upvalue->getLocation(), stringInterner) << ")@"
+       << upvalue.__getPtr();
   } else if (value.isObject<StringObject>()) {
     auto string = value.asObject<StringObject>();
     ss << "\"" << string->getData() << "\"";
@@ -3,12 +3,29 @@
 #include <string>
 
 #include "bytecode.h"
+#include "ir.h"
+#include "register_bytecode.h"
 #include "frontend/string_interner.h"
 
 std::string opcodeToString(Opcode opcode);
+// the group an opcode belongs to, such as "arithmetic" or "control flow"
+std::string opcodeClass(Opcode opcode);
 std::string chunkToString(const Chunk& chunk, const std::string& name,
                           const StringInterner& stringInterner);
 std::string instructionToString(size_t offset, Instruction instr,
                                 const StringInterner& stringInterner);
+std::string instructionToString(const Chunk& chunk, size_t offset,
+                                const StringInterner& stringInterner);
+std::string registerOpcodeToString(RegisterOpcode opcode);
+std::string registerChunkToString(const RegisterChunk& chunk,
+                                  const std::string& name,
+                                  const StringInterner& stringInterner);
+std::string registerInstructionToString(const RegisterChunk& chunk,
+                                        size_t offset,
+                                        const StringInterner& stringInterner);
+std::string irOpToString(IROp op);
+std::string irFunctionToString(const IRFunction& function,
+                               const std::string& name,
+                               const StringInterner& stringInterner);
 std::string valueToString(const Value& value,
                           const StringInterner& stringInterner);
\ No newline at end of file
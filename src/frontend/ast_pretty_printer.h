@@ -279,6 +279,58 @@ public:
     }
   }
 
+  void visitWhileStmt(WhileStmt& stmt) {
+    printPrefix();
+    std::cout << "While" << std::endl;
+
+    isLastChild.push_back(false);
+    printPrefix();
+    std::cout << "Condition" << std::endl;
+    isLastChild.push_back(true);
+    visit(*stmt.condition);
+    isLastChild.pop_back();
+    isLastChild.pop_back();
+
+    isLastChild.push_back(true);
+    printPrefix();
+    std::cout << "Body" << std::endl;
+    isLastChild.push_back(true);
+    visit(*stmt.body);
+    isLastChild.pop_back();
+    isLastChild.pop_back();
+  }
+
+  void visitForStmt(ForStmt& stmt) {
+    printPrefix();
+    std::cout << "For " << stringInterner.get(stmt.var.name) << " : "
+              << (stmt.var.type.has_value() ? stmt.var.type.value()->toString() : "unknown")
+              << std::endl;
+
+    isLastChild.push_back(false);
+    printPrefix();
+    std::cout << "Start" << std::endl;
+    isLastChild.push_back(true);
+    visit(*stmt.start);
+    isLastChild.pop_back();
+    isLastChild.pop_back();
+
+    isLastChild.push_back(false);
+    printPrefix();
+    std::cout << "End" << std::endl;
+    isLastChild.push_back(true);
+    visit(*stmt.end);
+    isLastChild.pop_back();
+    isLastChild.pop_back();
+
+    isLastChild.push_back(true);
+    printPrefix();
+    std::cout << "Body" << std::endl;
+    isLastChild.push_back(true);
+    visit(*stmt.body);
+    isLastChild.pop_back();
+    isLastChild.pop_back();
+  }
+
 private:
   void printPrefix() {
     for (size_t i = 0; i < isLastChild.size(); i++) {
@@ -56,6 +56,10 @@ public:
         return static_cast<ImplClass*>(this)->visitReturnStmt(static_cast<ReturnStmt&>(stmt), std::forward<Args>(args)...);
       case StmtKind::If:
         return static_cast<ImplClass*>(this)->visitIfStmt(static_cast<IfStmt&>(stmt), std::forward<Args>(args)...);
+      case StmtKind::While:
+        return static_cast<ImplClass*>(this)->visitWhileStmt(static_cast<WhileStmt&>(stmt), std::forward<Args>(args)...);
+      case StmtKind::For:
+        return static_cast<ImplClass*>(this)->visitForStmt(static_cast<ForStmt&>(stmt), std::forward<Args>(args)...);
       default:
         throw std::runtime_error("Unknown StmtKind");
     }
@@ -2,11 +2,21 @@
 #define COMPILER_H
 #include <assert.h>
 
+#include <map>
+
 #include "../bytecode.h"
 #include "../debug.h"
 #include "../frontend/ast_visitor.h"
+#include "../frontend/escape_analysis.h"
 #include "../frontend/factory.h"
+#include "../frontend/ir_builder.h"
 #include "../frontend/stmt.h"
+#include "../optimizer/inliner.h"
+#include "../optimizer/ir_lowering.h"
+#include "../optimizer/ir_passes.h"
+#include "../optimizer/peephole.h"
+#include "../optimizer/stack_depth.h"
+#include "../optimizer/superinstructions.h"
 #include "../runtime/object.h"
 #include "string_interner.h"
 
@@ -14,11 +24,29 @@ struct Local {
   VariableName name;
   int depth;  // -1 is undefined
   bool isCaptured;
+  // a function that reads locals straight from this frame, which calls to it
+  // must not replace
+  bool readsFrame = false;
+  // the body of the function declared by the local, if calls can inline it
+  std::shared_ptr<const InlineBody> inlineBody;
 
   Local(VariableName name, int depth, bool is_captured)
       : name(name), depth(depth), isCaptured(is_captured) {}
 };
 
+// The functions and methods calls can be inlined from. It lives as long as
+// the globals, so a run can inline the functions of earlier ones.
+struct InlineCandidates {
+  // top-level functions by their global
+  std::unordered_map<int, std::shared_ptr<InlineBody>> globals;
+  // methods by the type of their class and their member index, with the
+  // types kept alive so their addresses are never reused
+  std::map<std::pair<const ClassType*, int>, std::shared_ptr<InlineBody>>
+      methods;
+  std::vector<std::shared_ptr<ClassType>> classes;
+  InlinerOptions options;
+};
+
 class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
  public:
   enum class FunctionKind { TopLevel, Function, Method, Initializer };
@@ -28,6 +56,7 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
   FunctionKind kind;
   std::vector<Local> locals;
   int scopeDepth = 0;  // starts from zero for every Compiler/function.
+  int currentLine = 0;  // line of the statement being compiled
 
   std::vector<VariableName>& globals;
   StringInterner& stringInterner;
@@ -36,13 +65,32 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
   FunctionObject function;
   std::optional<VariableName> name;
 
+  // Whether the function being compiled only runs right above the frame of
+  // the enclosing function, and the functions declared in its own body that
+  // do the same above its frame. See EscapeAnalysis.
+  bool staysInFrame = false;
+  std::unordered_set<const FunctionStmt*> nonEscaping;
+  // whether it, or a function nested in it, reads the enclosing frame
+  bool readsEnclosingFrame = false;
+
   bool verbose;
+  bool peephole;  // whether to run optimizePeephole on the compiled chunk
+  bool ssa;  // whether to compile functions through the IR when supported
+  InlineCandidates* inlining;  // nullptr to inline no calls
+  std::vector<InlineSite> inlineSites;
+  // functions declared by statements of the top level itself rather than in
+  // one of its ifs, so they are defined before anything can call them
+  std::unordered_set<const FunctionStmt*> unconditionalFunctions;
+  // the body of the function being compiled, once compiled, if it can be
+  // inlined
+  std::shared_ptr<InlineBody> inlineBody;
 
  public:
   Compiler(Compiler* enclosing_compiler, FunctionKind kind,
            std::vector<VariableName>& globals, StringInterner& stringInterner,
            Stmt& ast, std::optional<SymbolId> name = std::nullopt,
-           bool verbose = false)
+           bool verbose = false, bool peephole = true, bool ssa = false,
+           InlineCandidates* inlining = nullptr)
       : enclosingCompiler(enclosing_compiler),
         kind(kind),
         stringInterner(stringInterner),
@@ -50,12 +98,25 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
         name(name),
         globals(globals),
         function(name),
-        verbose(verbose) {}
+        verbose(verbose),
+        peephole(peephole),
+        ssa(ssa),
+        inlining(inlining) {}
 
   FunctionObject compile() {
+    // values a frame starts with, which is the callee and its arguments
+    int entryDepth = 0;
+    currentLine = ast.line;
+
     switch (kind) {
       case FunctionKind::TopLevel: {
         assert(ast.kind == StmtKind::Block);
+        for (auto& statement : static_cast<BlockStmt&>(ast).statements) {
+          if (statement->kind == StmtKind::Function) {
+            unconditionalFunctions.insert(
+                static_cast<FunctionStmt*>(statement.get()));
+          }
+        }
         visit(ast);
         emit(Opcode::HALT);
         break;
@@ -82,6 +143,14 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
           declare(param.name);
           define(param.name);
         }
+        entryDepth = locals.size();
+
+        if (kind == FunctionKind::Function && ssa &&
+            compileThroughIR(functionStmt)) {
+          break;
+        }
+
+        nonEscaping = EscapeAnalysis::nonEscaping(*functionStmt.body);
         visit(*functionStmt.body);
         emit(Opcode::NIL);
         emit(Opcode::RETURN);
@@ -100,14 +169,75 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
       chunkName = "<anonymous>";
     }
 
+    InlinerStats inlinerStats;
+    if (inlining != nullptr && !inlineSites.empty()) {
+      inlinerStats = inlineCalls(function.getChunk(), inlineSites, entryDepth,
+                                 inlining->options);
+    }
+    PeepholeStats peepholeStats;
+    if (peephole) {
+      peepholeStats = optimizePeephole(function.getChunk(),
+                                       kind == FunctionKind::TopLevel);
+    }
+    if (inlining != nullptr && kind != FunctionKind::TopLevel) {
+      inlineBody = InlineBody::of(function.getChunk(), entryDepth - 1,
+                                  inlining->options.hotBudget);
+    }
+    auto fusions = fuseSuperinstructions(function.getChunk());
+    function.getChunk().entryDepth = entryDepth;
+    function.getChunk().maxStackSize =
+        maxStackDepth(function.getChunk(), entryDepth);
+
     if (verbose) {
       std::cout << chunkToString(function.getChunk(), chunkName, stringInterner)
                 << std::endl;
+      if (inlinerStats.inlined > 0) {
+        std::cout << "== Inlining in " << chunkName << " ==\n"
+                  << inlinerStats.toString() << std::endl;
+      }
+      if (peepholeStats.total() > 0) {
+        std::cout << "== Peephole in " << chunkName << " ==\n"
+                  << peepholeStats.toString() << std::endl;
+      }
+      if (fusions.total() > 0) {
+        std::cout << "== Superinstructions in " << chunkName << " ==\n"
+                  << fusions.toString() << std::endl;
+      }
     }
 
     return function;
   }
 
+  // Builds, optimizes and lowers the IR of the function into its chunk.
+  // Returns false, leaving the chunk empty, if the function uses something
+  // the IR does not support.
+  bool compileThroughIR(FunctionStmt& functionStmt) {
+    auto ir = IRBuilder(globals).build(functionStmt);
+    if (!ir.has_value()) {
+      return false;
+    }
+
+    std::string irName = name.has_value() ? stringInterner.get(name.value())
+                                          : "<anonymous>";
+    if (verbose) {
+      std::cout << irFunctionToString(ir.value(), irName, stringInterner)
+                << std::endl;
+    }
+    auto stats = IRPassManager::standard().run(ir.value());
+    if (verbose && stats.total() > 0) {
+      std::cout << "== IR passes in " << irName << " ==\n"
+                << stats.toString() << std::endl
+                << irFunctionToString(ir.value(), irName, stringInterner)
+                << std::endl;
+    }
+
+    lowerToChunk(ir.value(), function.getChunk());
+    // the IR does not track lines, so the whole function is attributed to
+    // the line it is declared on
+    function.getChunk().lines = {{0, functionStmt.line}};
+    return true;
+  }
+
   // Expression visitors
   std::shared_ptr<Type> visitVoidExpr(IntegerExpr& expr) {
     emit(Opcode::NIL);
@@ -153,6 +283,8 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     int index = resolveLocal(name);
     if (index != -1) {
       emit(Opcode::LOAD, index);
+    } else if ((index = resolveEnclosingSlot(name)) != -1) {
+      emit(Opcode::PARENT_LOAD, index);
     } else if ((index = resolveUpvalue(name)) != -1) {
       emit(Opcode::UPVALUE_LOAD, index);
     } else if ((index = resolveGlobal(name)) != -1) {
@@ -165,6 +297,43 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
   }
 
   std::shared_ptr<Type> visitApplyExpr(ApplyExpr& expr) {
+    if (expr.callee->kind == ExprKind::Get) {
+      auto& getExpr = static_cast<GetExpr&>(*expr.callee);
+      auto objType = visit(*getExpr.obj);
+      assert(objType->kind == TypeKind::Instance);
+      auto& klass = static_cast<InstanceType&>(*objType).klass;
+      auto memberIndex = klass->getMemberIndex(getExpr.name.name);
+      assert(memberIndex != -1);
+      auto& functionType = static_cast<FunctionType&>(
+          *klass->getMemberType(memberIndex).value());
+
+      // fields holding functions still go through MEMBER_GET and CALL
+      uint32_t argCount = expr.arguments.size();
+      bool invoke = klass->isMethod(memberIndex) && argCount <= 0xFF &&
+                    memberIndex <= 0xFFFF;
+      if (!invoke) {
+        emit(Opcode::MEMBER_GET, memberIndex);
+      }
+      for (auto& arg : expr.arguments) {
+        visit(*arg);
+      }
+      if (invoke) {
+        if (inlining != nullptr) {
+          auto it = inlining->methods.find({klass.get(), memberIndex});
+          if (it != inlining->methods.end()) {
+            inlineSites.push_back({function.getChunk().instructions.size(),
+                                   std::nullopt, it->second});
+          }
+        }
+        emit(Opcode::INVOKE, packOperand(argCount, memberIndex));
+      } else {
+        emit(Opcode::CALL, argCount);
+      }
+
+      return functionType.ret;
+    }
+
+    size_t calleeLoad = function.getChunk().instructions.size();
     auto calleeType = visit(*expr.callee);
     assert(calleeType->kind == TypeKind::Function ||
            calleeType->kind == TypeKind::Class);
@@ -175,6 +344,13 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
       for (auto& arg : expr.arguments) {
         visit(*arg);
       }
+      auto body = expr.callee->kind == ExprKind::Variable
+                      ? inlineBodyOf(calleeLoad)
+                      : nullptr;
+      if (body != nullptr) {
+        inlineSites.push_back(
+            {function.getChunk().instructions.size(), calleeLoad, body});
+      }
       emit(Opcode::CALL, static_cast<uint32_t>(expr.arguments.size()));
 
       return functionType.ret;
@@ -191,9 +367,7 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
       int methodIndex = classType->getMemberIndex(initSymbol);
       assert(methodIndex != -1);
       emit(Opcode::DUP);
-      emit(Opcode::MEMBER_GET, methodIndex);
-
-      emit(Opcode::CALL, 0);
+      emit(Opcode::INVOKE, packOperand(0, methodIndex));
       emit(Opcode::POP);
 
       return std::make_shared<InstanceType>(classType);
@@ -203,6 +377,20 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
   }
 
   std::shared_ptr<Type> visitBinaryExpr(BinaryExpr& expr) {
+    if (expr.op == BinaryOperator::And || expr.op == BinaryOperator::Or) {
+      // the right operand is only evaluated if the left one does not decide
+      // the result, which is otherwise pushed as it is
+      bool isAnd = expr.op == BinaryOperator::And;
+      auto jumpsToDecided = compileBranch(*expr.left, !isAnd);
+      visit(*expr.right);
+      size_t jumpToEnd = function.getChunk().instructions.size();
+      emit(Opcode::JUMP, 0);  // will be patched later
+      patchJumps(jumpsToDecided, function.getChunk().instructions.size());
+      emit(isAnd ? Opcode::FALSE : Opcode::TRUE);
+      patchJump(jumpToEnd, function.getChunk().instructions.size());
+      return T::Bool();
+    }
+
     auto lhsType = visit(*expr.left);
     visit(*expr.right);
 
@@ -220,19 +408,13 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
         emit(Opcode::DIV, lhsType);
         return lhsType;
       case BinaryOperator::Modulo:
-        emit(Opcode::MOD);
-        return lhsType;
-      case BinaryOperator::And:
-        emit(Opcode::AND);
-        return lhsType;
-      case BinaryOperator::Or:
-        emit(Opcode::OR);
+        emit(Opcode::MOD, lhsType);
         return lhsType;
       case BinaryOperator::Eq:
-        emit(Opcode::EQ);
+        emit(Opcode::EQ, lhsType);
         return T::Bool();
       case BinaryOperator::Neq:
-        emit(Opcode::NEQ);
+        emit(Opcode::NEQ, lhsType);
         return T::Bool();
       case BinaryOperator::Lt:
         emit(Opcode::LT, lhsType);
@@ -256,7 +438,7 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
 
     switch (expr.op) {
       case UnaryOperator::Negate:
-        emit(Opcode::NEG);
+        emit(Opcode::NEG, type);
         return type;
       case UnaryOperator::Not:
         emit(Opcode::NOT);
@@ -273,6 +455,8 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     int index = resolveLocal(name);
     if (index != -1) {
       emit(Opcode::STORE, index);
+    } else if ((index = resolveEnclosingSlot(name)) != -1) {
+      emit(Opcode::PARENT_STORE, index);
     } else if ((index = resolveUpvalue(name)) != -1) {
       emit(Opcode::UPVALUE_STORE, index);
     } else if ((index = resolveGlobal(name)) != -1) {
@@ -320,12 +504,19 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
 
   // Statement visitors
   void visitBlockStmt(BlockStmt& stmt) {
+    // what the enclosing statement emits after the block, like the jump back
+    // of a loop, belongs to its own line
+    int enclosingLine = currentLine;
     if (!isTopLevel()) {
       beginScope();
     }
     for (auto& statement : stmt.statements) {
+      if (statement->line != 0) {
+        currentLine = statement->line;
+      }
       visit(*statement);
     }
+    currentLine = enclosingLine;
     if (!isTopLevel()) {
       endScope();
     }
@@ -343,14 +534,33 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     defineWithoutEmitIfGlobal(name);  // allow recursion
 
     auto compiler = Compiler(this, FunctionKind::Function, globals,
-                             stringInterner, stmt, name);
+                             stringInterner, stmt, name, verbose, peephole, ssa,
+                   inlining);
+    compiler.staysInFrame = nonEscaping.contains(&stmt);
     auto function = compiler.compile();
 
-    uint32_t constantIndex =
-        addConstant(ObjectPtr<FunctionObject>(std::move(function)));
-    emit(Opcode::CLOSURE, constantIndex);
+    // a closure without upvalues is the same every time, so it is created
+    // once as a constant rather than by every CLOSURE
+    if (function.getUpvalues().empty()) {
+      auto functionPtr = ObjectPtr<FunctionObject>(std::move(function));
+      if (compiler.inlineBody != nullptr) {
+        compiler.inlineBody->function = functionPtr;
+      }
+      emitConstant(Value(ObjectPtr<ClosureObject>(ClosureObject(functionPtr))));
+    } else {
+      uint32_t constantIndex =
+          addConstant(ObjectPtr<FunctionObject>(std::move(function)));
+      emit(Opcode::CLOSURE, constantIndex);
+    }
 
     define(name, false);
+    if (!isTopLevel()) {
+      locals.back().readsFrame = compiler.readsEnclosingFrame;
+      locals.back().inlineBody = compiler.inlineBody;
+    } else if (compiler.inlineBody != nullptr &&
+               unconditionalFunctions.contains(&stmt)) {
+      inlining->globals[resolveGlobal(name)] = compiler.inlineBody;
+    }
   }
 
   void visitClassStmt(ClassStmt& stmt) {
@@ -363,6 +573,7 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     for (auto& decl : stmt.declarations) {
       members.push_back(Value::NIL);
     }
+    int fieldCount = members.size();
 
     beginScope();
 
@@ -389,9 +600,11 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     std::vector<Var> params;
     auto initializerAst = std::make_unique<FunctionStmt>(
         initializerVar, params, T::Void(), std::move(blockStmt));
+    initializerAst->line = stmt.line;
 
     Compiler compiler(this, FunctionKind::Method, globals, stringInterner,
-                      *initializerAst, initializerName);
+                      *initializerAst, initializerName, verbose, peephole, ssa,
+                   inlining);
     auto initializer = compiler.compile();
 
     auto initFunctionPtr = ObjectPtr<FunctionObject>(std::move(initializer));
@@ -406,19 +619,28 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     // }
 
     for (auto& method : stmt.methods) {
-      auto compiler = Compiler(this, FunctionKind::Method, globals,
-                               stringInterner, *method, method->name.name);
+      auto compiler =
+          Compiler(this, FunctionKind::Method, globals, stringInterner,
+                   *method, method->name.name, verbose, peephole, ssa,
+                   inlining);
       auto function = compiler.compile();
       auto functionPtr = ObjectPtr<FunctionObject>(std::move(function));
+      if (compiler.inlineBody != nullptr) {
+        compiler.inlineBody->function = functionPtr;
+        auto klass = stmt.type.value();
+        inlining->methods[{klass.get(), static_cast<int>(members.size())}] =
+            compiler.inlineBody;
+        inlining->classes.push_back(klass);
+      }
       members.emplace_back(functionPtr);
     }
 
     endScope();
 
     auto klassObj = ObjectPtr<ClassObject>(
-        std::move(ClassObject(name, std::move(members))));
+        std::move(ClassObject(name, std::move(members), fieldCount)));
     uint32_t constantIndex = addConstant(std::move(klassObj));
-    emit(Opcode::CONST, constantIndex);
+    emit(Opcode::CLASS, constantIndex);
 
     // store and pop off the stack
     define(name, false);
@@ -434,15 +656,23 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
       throw std::runtime_error("Return invalid outside of a func");
     }
     visit(*stmt.expression);
+
+    // a function call in tail position replaces the current frame instead of
+    // returning through it, unless the callee reads locals from this frame
+    auto& instructions = function.getChunk().instructions;
+    if (stmt.expression->kind == ExprKind::Apply &&
+        static_cast<Opcode>(instructions.back() & 0xFF) == Opcode::CALL &&
+        !callsFunctionReadingFrame(
+            static_cast<ApplyExpr&>(*stmt.expression))) {
+      instructions.back() = (instructions.back() & ~0xFFu) |
+                            static_cast<uint32_t>(Opcode::TAIL_CALL);
+      return;
+    }
     emit(Opcode::RETURN);
   }
 
   void visitIfStmt(IfStmt& stmt) {
-    visit(*stmt.condition);
-    emit(Opcode::TEST);
-
-    size_t jumpToElseOffsetIndex = function.getChunk().instructions.size();
-    emit(Opcode::JUMP, 0);  // will be patched later
+    auto jumpsToElse = compileBranch(*stmt.condition, false);
 
     visit(*stmt.thenBranch);
 
@@ -453,7 +683,7 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     }
 
     size_t elseStart = function.getChunk().instructions.size();
-    patchJump(jumpToElseOffsetIndex, elseStart);
+    patchJumps(jumpsToElse, elseStart);
 
     if (stmt.elseBranch.has_value()) {
       visit(*stmt.elseBranch.value());
@@ -463,7 +693,86 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     }
   }
 
+  void visitWhileStmt(WhileStmt& stmt) {
+    size_t start = function.getChunk().instructions.size();
+    auto jumpsToEnd = compileBranch(*stmt.condition, false);
+    visit(*stmt.body);
+    emit(Opcode::LOOP, start);
+    patchJumps(jumpsToEnd, function.getChunk().instructions.size());
+  }
+
+  // The counter and the end of the range live in two hidden locals, which
+  // FOR_RANGE finds on top of the stack at the end of the body. The counter
+  // is the loop variable itself unless a function in the body could capture
+  // it, in which case every iteration gets a copy of its own.
+  void visitForStmt(ForStmt& stmt) {
+    beginScope();
+    declare(stringInterner.intern("__counter__"));
+    visit(*stmt.start);
+    define(stringInterner.intern("__counter__"));
+    declare(stringInterner.intern("__end__"));
+    visit(*stmt.end);
+    define(stringInterner.intern("__end__"));
+    int counter = locals.size() - 2;
+
+    // named only now, so that the bounds still see an outer variable of the
+    // same name
+    bool copiesVariable = declaresFunction(*stmt.body);
+    if (!copiesVariable) {
+      locals[counter].name = stmt.var.name;
+    }
+
+    emit(Opcode::LOAD, counter);
+    emit(Opcode::LOAD, counter + 1);
+    emit(Opcode::LT_INT);
+    size_t jumpToEnd = function.getChunk().instructions.size();
+    emit(Opcode::JUMP_IF_FALSE, 0);  // will be patched later
+
+    size_t bodyStart = function.getChunk().instructions.size();
+    if (copiesVariable) {
+      beginScope();
+      declare(stmt.var.name);
+      emit(Opcode::LOAD, counter);
+      define(stmt.var.name);
+    }
+    visit(*stmt.body);
+    if (copiesVariable) {
+      endScope();
+    }
+    emit(Opcode::FOR_RANGE, bodyStart);
+
+    patchJump(jumpToEnd, function.getChunk().instructions.size());
+    endScope();
+  }
+
  private:
+  static bool declaresFunction(Stmt& stmt) {
+    switch (stmt.kind) {
+      case StmtKind::Function:
+      case StmtKind::Class:
+        return true;
+      case StmtKind::Block:
+        for (auto& statement : static_cast<BlockStmt&>(stmt).statements) {
+          if (declaresFunction(*statement)) {
+            return true;
+          }
+        }
+        return false;
+      case StmtKind::If: {
+        auto& ifStmt = static_cast<IfStmt&>(stmt);
+        return declaresFunction(*ifStmt.thenBranch) ||
+               (ifStmt.elseBranch.has_value() &&
+                declaresFunction(*ifStmt.elseBranch.value()));
+      }
+      case StmtKind::While:
+        return declaresFunction(*static_cast<WhileStmt&>(stmt).body);
+      case StmtKind::For:
+        return declaresFunction(*static_cast<ForStmt&>(stmt).body);
+      default:
+        return false;
+    }
+  }
+
   int resolveLocal(VariableName name) {
     for (int i = locals.size() - 1; i >= 0; i--) {
       auto& local = locals.at(i);
@@ -479,6 +788,27 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     return -1;
   }
 
+  // The body calls to the function loaded by the instruction at the given
+  // offset can be replaced with, if it is a local or global declared with
+  // `func` whose body the compiler knows.
+  std::shared_ptr<const InlineBody> inlineBodyOf(size_t calleeLoad) {
+    if (inlining == nullptr) {
+      return nullptr;
+    }
+    Instruction instruction = function.getChunk().instructions[calleeLoad];
+    uint32_t operand = instruction >> 8;
+    switch (static_cast<Opcode>(instruction & 0xFF)) {
+      case Opcode::LOAD:
+        return locals[operand].inlineBody;
+      case Opcode::GLOBAL_LOAD: {
+        auto it = inlining->globals.find(operand);
+        return it != inlining->globals.end() ? it->second : nullptr;
+      }
+      default:
+        return nullptr;
+    }
+  }
+
   int resolveGlobal(VariableName name) {
     if (kind != FunctionKind::TopLevel) {
       return enclosingCompiler->resolveGlobal(name);
@@ -509,6 +839,36 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
     }
   }
 
+  // Resolves a local of an enclosing function that is read straight from its
+  // frame, which works while every function in between stays in the frame of
+  // the one enclosing it: the frame n functions out is then n frames down the
+  // call stack. Returns the packed operand of PARENT_LOAD and PARENT_STORE.
+  int resolveEnclosingSlot(VariableName name) {
+    int frames = 0;
+    for (Compiler* compiler = this; compiler->staysInFrame && frames < 0xFF;
+         compiler = compiler->enclosingCompiler) {
+      frames++;
+      int local = compiler->enclosingCompiler->resolveLocal(name);
+      if (local != -1) {
+        for (Compiler* reader = this; reader != compiler->enclosingCompiler;
+             reader = reader->enclosingCompiler) {
+          reader->readsEnclosingFrame = true;
+        }
+        return packOperand(frames, local);
+      }
+    }
+    return -1;
+  }
+
+  bool callsFunctionReadingFrame(ApplyExpr& expr) {
+    if (expr.callee->kind != ExprKind::Variable) {
+      return false;
+    }
+    auto& callee = static_cast<VariableExpr&>(*expr.callee);
+    int local = resolveLocal(callee.var.name);
+    return local != -1 && locals[local].readsFrame;
+  }
+
   int resolveUpvalue(VariableName name) {
     if (enclosingCompiler == nullptr) {
       return -1;
@@ -600,15 +960,116 @@ class Compiler : public ASTVisitor<Compiler, std::shared_ptr<Type>, void> {
   void emit(Opcode opcode, uint32_t operand = 0) {
     assertFits24BitOperand(operand);
     uint32_t instruction = static_cast<uint32_t>(opcode) | (operand << 8);
+    function.getChunk().markLine(currentLine);
     function.getChunk().instructions.push_back(instruction);
   }
 
+  // Emits the variant of an arithmetic or comparison opcode specialized for
+  // the operand type inferred by TypeInference.
   void emit(Opcode opcode, const std::shared_ptr<Type>& type) {
-    uint32_t opType = type->kind == TypeKind::Integer ? 1
-                      : type->kind == TypeKind::Double
-                          ? 2
-                          : throw std::runtime_error("Unexpected TypeKind");
-    emit(opcode, opType);
+    emit(specialize(opcode, type->kind));
+  }
+
+  static Opcode specialize(Opcode opcode, TypeKind kind) {
+    auto pick = [kind](Opcode intOpcode, Opcode doubleOpcode) {
+      switch (kind) {
+        case TypeKind::Integer:
+          return intOpcode;
+        case TypeKind::Double:
+          return doubleOpcode;
+        default:
+          throw std::runtime_error("Unexpected TypeKind");
+      }
+    };
+
+    switch (opcode) {
+      case Opcode::ADD:
+        return pick(Opcode::ADD_INT, Opcode::ADD_DOUBLE);
+      case Opcode::SUB:
+        return pick(Opcode::SUB_INT, Opcode::SUB_DOUBLE);
+      case Opcode::MUL:
+        return pick(Opcode::MUL_INT, Opcode::MUL_DOUBLE);
+      case Opcode::DIV:
+        return pick(Opcode::DIV_INT, Opcode::DIV_DOUBLE);
+      case Opcode::MOD:
+        if (kind != TypeKind::Integer) {
+          throw std::runtime_error("Unexpected TypeKind");
+        }
+        return Opcode::MOD_INT;
+      case Opcode::NEG:
+        return pick(Opcode::NEG_INT, Opcode::NEG_DOUBLE);
+      case Opcode::EQ:
+        // bools are compared by their bits, which the generic opcode does
+        if (kind == TypeKind::Boolean) {
+          return Opcode::EQ;
+        }
+        return pick(Opcode::EQ_INT, Opcode::EQ_DOUBLE);
+      case Opcode::NEQ:
+        if (kind == TypeKind::Boolean) {
+          return Opcode::NEQ;
+        }
+        return pick(Opcode::NEQ_INT, Opcode::NEQ_DOUBLE);
+      case Opcode::LT:
+        return pick(Opcode::LT_INT, Opcode::LT_DOUBLE);
+      case Opcode::LTE:
+        return pick(Opcode::LTE_INT, Opcode::LTE_DOUBLE);
+      case Opcode::GT:
+        return pick(Opcode::GT_INT, Opcode::GT_DOUBLE);
+      case Opcode::GTE:
+        return pick(Opcode::GTE_INT, Opcode::GTE_DOUBLE);
+      default:
+        throw std::runtime_error("Opcode has no type-specialized variant");
+    }
+  }
+
+  // Compiles a condition into code that jumps when it evaluates to jumpIf and
+  // falls through otherwise, without pushing it. Returns the jumps, still to
+  // be patched to where they go. && and || jump as soon as their left operand
+  // decides the result, and ! flips which way the jumps go.
+  std::vector<size_t> compileBranch(Expr& condition, bool jumpIf) {
+    auto& instructions = function.getChunk().instructions;
+    if (condition.kind == ExprKind::Binary) {
+      auto& binary = static_cast<BinaryExpr&>(condition);
+      if (binary.op == BinaryOperator::And ||
+          binary.op == BinaryOperator::Or) {
+        // the left operand decides the result if it is false for &&, or
+        // true for ||
+        bool decidedBy = binary.op == BinaryOperator::Or;
+        auto leftJumps = compileBranch(*binary.left, decidedBy);
+        auto rightJumps = compileBranch(*binary.right, jumpIf);
+        if (decidedBy == jumpIf) {
+          rightJumps.insert(rightJumps.end(), leftJumps.begin(),
+                            leftJumps.end());
+        } else {
+          patchJumps(leftJumps, instructions.size());
+        }
+        return rightJumps;
+      }
+    }
+    if (condition.kind == ExprKind::Unary &&
+        static_cast<UnaryExpr&>(condition).op == UnaryOperator::Not) {
+      return compileBranch(*static_cast<UnaryExpr&>(condition).operand,
+                           !jumpIf);
+    }
+    if (condition.kind == ExprKind::Boolean) {
+      // a constant condition either always jumps or never does
+      if (static_cast<BoolExpr&>(condition).getValue() != jumpIf) {
+        return {};
+      }
+      emit(Opcode::JUMP, 0);  // will be patched later
+      return {instructions.size() - 1};
+    }
+
+    visit(condition);
+    emit(jumpIf ? Opcode::JUMP_IF_TRUE : Opcode::JUMP_IF_FALSE,
+         0);  // will be patched later
+    return {instructions.size() - 1};
+  }
+
+  void patchJumps(const std::vector<size_t>& jumpIndices, size_t targetIndex) {
+    for (auto jumpIndex : jumpIndices) {
+      patchJump(jumpIndex, targetIndex);
+    }
   }
 
   void patchJump(size_t jumpIndex, size_t targetIndex) {
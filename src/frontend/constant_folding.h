@@ -0,0 +1,511 @@
+#ifndef CONSTANT_FOLDING_H
+#define CONSTANT_FOLDING_H
+
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../runtime/value.h"
+#include "expr.h"
+#include "stmt.h"
+
+// Folds operators applied to literals into the literal they evaluate to, and
+// replaces variables known to hold a literal with that literal. It runs on the
+// typed AST between TypeInference and the Compiler.
+//
+// A variable holds a literal when its initializer folds to one and it is
+// never assigned: `let` bindings, and `var` locals nothing assigns to. Globals
+// declared with `var` are left alone, since later input in the REPL may still
+// assign to them. Declarations of local constants are dropped once all their
+// uses are replaced, an `if` on a constant keeps only the branch taken, and a
+// `while` on false is dropped.
+//
+// Nothing that could fail at runtime is folded, so an integer result outside
+// the 48 bits a Value holds, or a division by zero, still reports its error
+// when it runs. Doubles follow IEEE semantics like the VM does.
+class ConstantFolding {
+ public:
+  void perform(Stmt& ast) {
+    collectAssigned(ast);
+    scopes.emplace_back();
+    fold(ast, true);
+    scopes.pop_back();
+  }
+
+ private:
+  // Literals known for each variable in scope, or null for variables that
+  // hold something else. The first scope is the global one.
+  std::vector<std::unordered_map<VariableName, const Expr*>> scopes;
+  // Names assigned to anywhere; going by name only ever folds less.
+  std::unordered_set<VariableName> assigned;
+  // Declarations dropped from the AST, kept alive for the literals in scopes
+  std::vector<std::unique_ptr<Stmt>> dropped;
+
+  void fold(Stmt& stmt, bool isTopLevel = false) {
+    switch (stmt.kind) {
+      case StmtKind::Block: {
+        auto& block = static_cast<BlockStmt&>(stmt);
+        if (!isTopLevel) {
+          scopes.emplace_back();
+        }
+        auto& statements = block.statements;
+        for (auto it = statements.begin(); it != statements.end();) {
+          foldStatement(*it);
+          if (isDroppable(**it)) {
+            dropped.push_back(std::move(*it));
+            it = statements.erase(it);
+          } else {
+            it++;
+          }
+        }
+        if (!isTopLevel) {
+          scopes.pop_back();
+        }
+        break;
+      }
+      case StmtKind::Declare: {
+        auto& declStmt = static_cast<DeclareStmt&>(stmt);
+        fold(declStmt.expression);
+        bool constant =
+            declStmt.isConstant ||
+            (!isGlobalScope() && !assigned.contains(declStmt.var.name));
+        scopes.back()[declStmt.var.name] =
+            constant && isLiteral(*declStmt.expression)
+                ? declStmt.expression.get()
+                : nullptr;
+        break;
+      }
+      case StmtKind::Function: {
+        auto& funStmt = static_cast<FunctionStmt&>(stmt);
+        scopes.back()[funStmt.name.name] = nullptr;
+        foldFunction(funStmt);
+        break;
+      }
+      case StmtKind::Class: {
+        auto& classStmt = static_cast<ClassStmt&>(stmt);
+        scopes.back()[classStmt.name.name] = nullptr;
+        for (auto& decl : classStmt.declarations) {
+          fold(decl->expression);
+        }
+        for (auto& method : classStmt.methods) {
+          foldFunction(*method);
+        }
+        break;
+      }
+      case StmtKind::Expr: {
+        auto& exprStmt = static_cast<ExprStmt&>(stmt);
+        fold(exprStmt.expression);
+        break;
+      }
+      case StmtKind::Return: {
+        auto& returnStmt = static_cast<ReturnStmt&>(stmt);
+        fold(returnStmt.expression);
+        break;
+      }
+      case StmtKind::If: {
+        auto& ifStmt = static_cast<IfStmt&>(stmt);
+        fold(ifStmt.condition);
+        foldStatement(ifStmt.thenBranch);
+        if (ifStmt.elseBranch.has_value()) {
+          foldStatement(ifStmt.elseBranch.value());
+        }
+        break;
+      }
+      case StmtKind::While: {
+        auto& whileStmt = static_cast<WhileStmt&>(stmt);
+        fold(whileStmt.condition);
+        foldStatement(whileStmt.body);
+        break;
+      }
+      case StmtKind::For: {
+        auto& forStmt = static_cast<ForStmt&>(stmt);
+        fold(forStmt.start);
+        fold(forStmt.end);
+        scopes.emplace_back();
+        scopes.back()[forStmt.var.name] = nullptr;
+        foldStatement(forStmt.body);
+        scopes.pop_back();
+        break;
+      }
+      default:
+        throw std::runtime_error("Unknown StmtKind");
+    }
+  }
+
+  // Folds a statement, replacing an `if` on a constant with its branch taken
+  // and dropping a `while` whose condition is false
+  void foldStatement(std::unique_ptr<Stmt>& stmt) {
+    fold(*stmt);
+
+    if (stmt->kind == StmtKind::While) {
+      auto& whileStmt = static_cast<WhileStmt&>(*stmt);
+      if (whileStmt.condition->kind == ExprKind::Boolean &&
+          !static_cast<BoolExpr&>(*whileStmt.condition).getValue()) {
+        stmt = std::make_unique<BlockStmt>(
+            std::vector<std::unique_ptr<Stmt>>{});
+      }
+    }
+
+    if (stmt->kind == StmtKind::If) {
+      auto& ifStmt = static_cast<IfStmt&>(*stmt);
+      if (ifStmt.condition->kind == ExprKind::Boolean) {
+        std::unique_ptr<Stmt> taken;
+        if (static_cast<BoolExpr&>(*ifStmt.condition).getValue()) {
+          taken = std::move(ifStmt.thenBranch);
+        } else if (ifStmt.elseBranch.has_value()) {
+          taken = std::move(ifStmt.elseBranch.value());
+        } else {
+          taken = std::make_unique<BlockStmt>(
+              std::vector<std::unique_ptr<Stmt>>{});
+        }
+        stmt = std::move(taken);
+      }
+    }
+  }
+
+  void foldFunction(FunctionStmt& funStmt) {
+    scopes.emplace_back();
+    for (auto& param : funStmt.params) {
+      scopes.back()[param.name] = nullptr;
+    }
+    fold(*funStmt.body);
+    scopes.pop_back();
+  }
+
+  void fold(std::unique_ptr<Expr>& expr) {
+    switch (expr->kind) {
+      case ExprKind::Void:
+      case ExprKind::Integer:
+      case ExprKind::Double:
+      case ExprKind::Boolean:
+      case ExprKind::Self:
+        break;
+      case ExprKind::Variable: {
+        auto& variableExpr = static_cast<VariableExpr&>(*expr);
+        if (const Expr* literal = lookup(variableExpr.var.name)) {
+          expr = copyLiteral(*literal);
+        }
+        break;
+      }
+      case ExprKind::Apply: {
+        auto& applyExpr = static_cast<ApplyExpr&>(*expr);
+        fold(applyExpr.callee);
+        for (auto& arg : applyExpr.arguments) {
+          fold(arg);
+        }
+        break;
+      }
+      case ExprKind::Binary: {
+        auto& binaryExpr = static_cast<BinaryExpr&>(*expr);
+        fold(binaryExpr.left);
+        fold(binaryExpr.right);
+        if (auto folded = foldBinary(binaryExpr)) {
+          expr = std::move(folded);
+        }
+        break;
+      }
+      case ExprKind::Unary: {
+        auto& unaryExpr = static_cast<UnaryExpr&>(*expr);
+        fold(unaryExpr.operand);
+        if (auto folded = foldUnary(unaryExpr)) {
+          expr = std::move(folded);
+        }
+        break;
+      }
+      case ExprKind::Assign: {
+        auto& assignExpr = static_cast<AssignExpr&>(*expr);
+        fold(assignExpr.expression);
+        break;
+      }
+      case ExprKind::Get: {
+        auto& getExpr = static_cast<GetExpr&>(*expr);
+        fold(getExpr.obj);
+        break;
+      }
+      case ExprKind::Set: {
+        auto& setExpr = static_cast<SetExpr&>(*expr);
+        fold(setExpr.obj);
+        fold(setExpr.value);
+        break;
+      }
+      default:
+        throw std::runtime_error("Unknown ExprKind");
+    }
+  }
+
+  std::unique_ptr<Expr> foldBinary(BinaryExpr& expr) {
+    auto& left = *expr.left;
+    auto& right = *expr.right;
+    if (left.kind != right.kind) {
+      return nullptr;
+    }
+
+    switch (left.kind) {
+      case ExprKind::Integer: {
+        int64_t a = static_cast<IntegerExpr&>(left).getValue();
+        int64_t b = static_cast<IntegerExpr&>(right).getValue();
+        if (!Value::fitsInt(a) || !Value::fitsInt(b)) {
+          return nullptr;  // the literal itself is the error
+        }
+        std::optional<int64_t> result;
+        int64_t value;
+        switch (expr.op) {
+          case BinaryOperator::Add:
+            if (!__builtin_add_overflow(a, b, &value)) {
+              result = value;
+            }
+            break;
+          case BinaryOperator::Minus:
+            if (!__builtin_sub_overflow(a, b, &value)) {
+              result = value;
+            }
+            break;
+          case BinaryOperator::Multiply:
+            if (!__builtin_mul_overflow(a, b, &value)) {
+              result = value;
+            }
+            break;
+          case BinaryOperator::Divide:
+            if (b != 0) {
+              result = a / b;
+            }
+            break;
+          case BinaryOperator::Modulo:
+            if (b != 0) {
+              result = a % b;
+            }
+            break;
+          default:
+            return foldComparison(expr.op, a, b);
+        }
+        if (!result.has_value() || !Value::fitsInt(result.value())) {
+          return nullptr;
+        }
+        return std::make_unique<IntegerExpr>(result.value());
+      }
+      case ExprKind::Double: {
+        double a = static_cast<DoubleExpr&>(left).getValue();
+        double b = static_cast<DoubleExpr&>(right).getValue();
+        switch (expr.op) {
+          case BinaryOperator::Add:
+            return std::make_unique<DoubleExpr>(a + b);
+          case BinaryOperator::Minus:
+            return std::make_unique<DoubleExpr>(a - b);
+          case BinaryOperator::Multiply:
+            return std::make_unique<DoubleExpr>(a * b);
+          case BinaryOperator::Divide:
+            return std::make_unique<DoubleExpr>(a / b);
+          default:
+            return foldComparison(expr.op, a, b);
+        }
+      }
+      case ExprKind::Boolean: {
+        bool a = static_cast<BoolExpr&>(left).getValue();
+        bool b = static_cast<BoolExpr&>(right).getValue();
+        switch (expr.op) {
+          case BinaryOperator::And:
+            return std::make_unique<BoolExpr>(a && b);
+          case BinaryOperator::Or:
+            return std::make_unique<BoolExpr>(a || b);
+          case BinaryOperator::Eq:
+            return std::make_unique<BoolExpr>(a == b);
+          case BinaryOperator::Neq:
+            return std::make_unique<BoolExpr>(a != b);
+          default:
+            return nullptr;
+        }
+      }
+      default:
+        return nullptr;
+    }
+  }
+
+  template <typename T>
+  static std::unique_ptr<Expr> foldComparison(BinaryOperator op, T a, T b) {
+    switch (op) {
+      case BinaryOperator::Eq:
+        return std::make_unique<BoolExpr>(a == b);
+      case BinaryOperator::Neq:
+        return std::make_unique<BoolExpr>(a != b);
+      case BinaryOperator::Lt:
+        return std::make_unique<BoolExpr>(a < b);
+      case BinaryOperator::Lte:
+        return std::make_unique<BoolExpr>(a <= b);
+      case BinaryOperator::Gt:
+        return std::make_unique<BoolExpr>(a > b);
+      case BinaryOperator::Gte:
+        return std::make_unique<BoolExpr>(a >= b);
+      default:
+        return nullptr;
+    }
+  }
+
+  std::unique_ptr<Expr> foldUnary(UnaryExpr& expr) {
+    auto& operand = *expr.operand;
+    switch (expr.op) {
+      case UnaryOperator::Negate:
+        if (operand.kind == ExprKind::Integer) {
+          int64_t value = static_cast<IntegerExpr&>(operand).getValue();
+          if (!Value::fitsInt(value) || !Value::fitsInt(-value)) {
+            return nullptr;
+          }
+          return std::make_unique<IntegerExpr>(-value);
+        }
+        if (operand.kind == ExprKind::Double) {
+          return std::make_unique<DoubleExpr>(
+              -static_cast<DoubleExpr&>(operand).getValue());
+        }
+        return nullptr;
+      case UnaryOperator::Not:
+        if (operand.kind == ExprKind::Boolean) {
+          return std::make_unique<BoolExpr>(
+              !static_cast<BoolExpr&>(operand).getValue());
+        }
+        return nullptr;
+      default:
+        return nullptr;
+    }
+  }
+
+  static bool isLiteral(const Expr& expr) {
+    return expr.kind == ExprKind::Integer || expr.kind == ExprKind::Double ||
+           expr.kind == ExprKind::Boolean;
+  }
+
+  static std::unique_ptr<Expr> copyLiteral(const Expr& literal) {
+    switch (literal.kind) {
+      case ExprKind::Integer:
+        return std::make_unique<IntegerExpr>(
+            static_cast<const IntegerExpr&>(literal).getValue());
+      case ExprKind::Double:
+        return std::make_unique<DoubleExpr>(
+            static_cast<const DoubleExpr&>(literal).getValue());
+      case ExprKind::Boolean:
+        return std::make_unique<BoolExpr>(
+            static_cast<const BoolExpr&>(literal).getValue());
+      default:
+        throw std::runtime_error("Expected a literal");
+    }
+  }
+
+  const Expr* lookup(VariableName name) {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); it++) {
+      auto found = it->find(name);
+      if (found != it->end()) {
+        return found->second;
+      }
+    }
+    return nullptr;
+  }
+
+  // A local constant is not needed anymore once it has been folded, since
+  // every use that follows gets the literal instead
+  bool isDroppable(Stmt& stmt) {
+    if (stmt.kind != StmtKind::Declare || isGlobalScope()) {
+      return false;
+    }
+    auto& declStmt = static_cast<DeclareStmt&>(stmt);
+    return scopes.back()[declStmt.var.name] == declStmt.expression.get();
+  }
+
+  bool isGlobalScope() const { return scopes.size() == 1; }
+
+  void collectAssigned(Stmt& stmt) {
+    switch (stmt.kind) {
+      case StmtKind::Block:
+        for (auto& statement : static_cast<BlockStmt&>(stmt).statements) {
+          collectAssigned(*statement);
+        }
+        break;
+      case StmtKind::Declare:
+        collectAssigned(*static_cast<DeclareStmt&>(stmt).expression);
+        break;
+      case StmtKind::Function:
+        collectAssigned(*static_cast<FunctionStmt&>(stmt).body);
+        break;
+      case StmtKind::Class: {
+        auto& classStmt = static_cast<ClassStmt&>(stmt);
+        for (auto& decl : classStmt.declarations) {
+          collectAssigned(*decl);
+        }
+        for (auto& method : classStmt.methods) {
+          collectAssigned(*method);
+        }
+        break;
+      }
+      case StmtKind::Expr:
+        collectAssigned(*static_cast<ExprStmt&>(stmt).expression);
+        break;
+      case StmtKind::Return:
+        collectAssigned(*static_cast<ReturnStmt&>(stmt).expression);
+        break;
+      case StmtKind::If: {
+        auto& ifStmt = static_cast<IfStmt&>(stmt);
+        collectAssigned(*ifStmt.condition);
+        collectAssigned(*ifStmt.thenBranch);
+        if (ifStmt.elseBranch.has_value()) {
+          collectAssigned(*ifStmt.elseBranch.value());
+        }
+        break;
+      }
+      case StmtKind::While: {
+        auto& whileStmt = static_cast<WhileStmt&>(stmt);
+        collectAssigned(*whileStmt.condition);
+        collectAssigned(*whileStmt.body);
+        break;
+      }
+      case StmtKind::For: {
+        auto& forStmt = static_cast<ForStmt&>(stmt);
+        collectAssigned(*forStmt.start);
+        collectAssigned(*forStmt.end);
+        collectAssigned(*forStmt.body);
+        break;
+      }
+      default:
+        throw std::runtime_error("Unknown StmtKind");
+    }
+  }
+
+  void collectAssigned(Expr& expr) {
+    switch (expr.kind) {
+      case ExprKind::Apply: {
+        auto& applyExpr = static_cast<ApplyExpr&>(expr);
+        collectAssigned(*applyExpr.callee);
+        for (auto& arg : applyExpr.arguments) {
+          collectAssigned(*arg);
+        }
+        break;
+      }
+      case ExprKind::Binary: {
+        auto& binaryExpr = static_cast<BinaryExpr&>(expr);
+        collectAssigned(*binaryExpr.left);
+        collectAssigned(*binaryExpr.right);
+        break;
+      }
+      case ExprKind::Unary:
+        collectAssigned(*static_cast<UnaryExpr&>(expr).operand);
+        break;
+      case ExprKind::Assign: {
+        auto& assignExpr = static_cast<AssignExpr&>(expr);
+        assigned.insert(assignExpr.var.name);
+        collectAssigned(*assignExpr.expression);
+        break;
+      }
+      case ExprKind::Get:
+        collectAssigned(*static_cast<GetExpr&>(expr).obj);
+        break;
+      case ExprKind::Set: {
+        auto& setExpr = static_cast<SetExpr&>(expr);
+        collectAssigned(*setExpr.obj);
+        collectAssigned(*setExpr.value);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+};
+
+#endif  // CONSTANT_FOLDING_H
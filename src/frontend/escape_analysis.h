@@ -0,0 +1,137 @@
+#ifndef ESCAPE_ANALYSIS_H
+#define ESCAPE_ANALYSIS_H
+
+#include <unordered_set>
+#include <vector>
+
+#include "ast_visitor.h"
+#include "expr.h"
+#include "stmt.h"
+
+// Finds the functions declared in a function body that cannot outlive the
+// frame running that body. Such a function is only ever called by name from
+// the body itself, so whenever it runs the frame of the body is the one right
+// below it and the Compiler can read the body's locals straight from that
+// frame instead of capturing them.
+//
+// Any other use of the name escapes the function: using it as a value,
+// assigning to it, or referring to it from another nested function or class,
+// which could itself escape. The analysis goes by name and does not resolve
+// shadowing, which only ever makes it more conservative.
+class EscapeAnalysis : public ASTVisitor<EscapeAnalysis> {
+ public:
+  static std::unordered_set<const FunctionStmt*> nonEscaping(BlockStmt& body) {
+    EscapeAnalysis analysis;
+    analysis.visit(body);
+
+    std::unordered_set<const FunctionStmt*> functions;
+    for (auto* function : analysis.declared) {
+      if (!analysis.escaping.contains(function->name.name)) {
+        functions.insert(function);
+      }
+    }
+    return functions;
+  }
+
+  // Expression visitors
+  void visitVoidExpr(IntegerExpr& expr) {}
+  void visitIntegerExpr(IntegerExpr& expr) {}
+  void visitDoubleExpr(DoubleExpr& expr) {}
+  void visitBoolExpr(BoolExpr& expr) {}
+  void visitSelfExpr(SelfExpr& expr) {}
+
+  void visitVariableExpr(VariableExpr& expr) {
+    escaping.insert(expr.var.name);
+  }
+
+  void visitApplyExpr(ApplyExpr& expr) {
+    // calling a function by name from the body itself is the one use that
+    // does not escape it
+    if (nestingDepth > 0 || expr.callee->kind != ExprKind::Variable) {
+      visit(*expr.callee);
+    }
+    for (auto& argument : expr.arguments) {
+      visit(*argument);
+    }
+  }
+
+  void visitBinaryExpr(BinaryExpr& expr) {
+    visit(*expr.left);
+    visit(*expr.right);
+  }
+
+  void visitUnaryExpr(UnaryExpr& expr) { visit(*expr.operand); }
+
+  void visitAssignExpr(AssignExpr& expr) {
+    escaping.insert(expr.var.name);
+    visit(*expr.expression);
+  }
+
+  void visitGetExpr(GetExpr& expr) { visit(*expr.obj); }
+
+  void visitSetExpr(SetExpr& expr) {
+    visit(*expr.obj);
+    visit(*expr.value);
+  }
+
+  // Statement visitors
+  void visitBlockStmt(BlockStmt& stmt) {
+    for (auto& statement : stmt.statements) {
+      visit(*statement);
+    }
+  }
+
+  void visitDeclareStmt(DeclareStmt& stmt) { visit(*stmt.expression); }
+
+  void visitFunctionStmt(FunctionStmt& stmt) {
+    if (nestingDepth == 0) {
+      declared.push_back(&stmt);
+    }
+    nestingDepth++;
+    visit(*stmt.body);
+    nestingDepth--;
+  }
+
+  void visitClassStmt(ClassStmt& stmt) {
+    nestingDepth++;
+    for (auto& declaration : stmt.declarations) {
+      if (declaration->expression != nullptr) {
+        visit(*declaration->expression);
+      }
+    }
+    for (auto& method : stmt.methods) {
+      visit(*method->body);
+    }
+    nestingDepth--;
+  }
+
+  void visitExprStmt(ExprStmt& stmt) { visit(*stmt.expression); }
+
+  void visitReturnStmt(ReturnStmt& stmt) { visit(*stmt.expression); }
+
+  void visitIfStmt(IfStmt& stmt) {
+    visit(*stmt.condition);
+    visit(*stmt.thenBranch);
+    if (stmt.elseBranch.has_value()) {
+      visit(*stmt.elseBranch.value());
+    }
+  }
+
+  void visitWhileStmt(WhileStmt& stmt) {
+    visit(*stmt.condition);
+    visit(*stmt.body);
+  }
+
+  void visitForStmt(ForStmt& stmt) {
+    visit(*stmt.start);
+    visit(*stmt.end);
+    visit(*stmt.body);
+  }
+
+ private:
+  std::vector<const FunctionStmt*> declared;
+  std::unordered_set<VariableName> escaping;
+  int nestingDepth = 0;  // how many functions and classes deep the visit is
+};
+
+#endif  // ESCAPE_ANALYSIS_H
@@ -1,6 +1,8 @@
 #ifndef EXPR_H
 #define EXPR_H
 
+#include <charconv>
+#include <string>
 #include <utility>
 
 #include "type.h"
@@ -45,12 +47,18 @@ public:
 };
 
 class IntegerExpr : public Expr {
+  std::string text; // backs the literal of a value computed by ConstantFolding
+
 public:
   std::string_view literal;
 
   explicit IntegerExpr(std::string_view literal)
     : Expr(ExprKind::Integer), literal(literal) {}
 
+  explicit IntegerExpr(int64_t value)
+    : Expr(ExprKind::Integer), text(std::to_string(value)), literal(text) {}
+  IntegerExpr(const IntegerExpr&) = delete;
+
   int64_t getValue() const {
     return std::stoll(std::string(literal));
   }
@@ -65,12 +73,20 @@ public:
 };
 
 class DoubleExpr : public Expr {
+  std::string text; // backs the literal of a value computed by ConstantFolding
+
 public:
   std::string_view literal;
 
   explicit DoubleExpr(std::string_view literal)
     : Expr(ExprKind::Double), literal(literal) {}
 
+  // the literal is the shortest text that reads back as the same double,
+  // including "inf" and "nan"
+  explicit DoubleExpr(double value)
+    : Expr(ExprKind::Double), text(toText(value)), literal(text) {}
+  DoubleExpr(const DoubleExpr&) = delete;
+
   double getValue() const {
     return std::stod(std::string(literal));
   }
@@ -82,6 +98,13 @@ public:
     const auto& otherDouble = static_cast<const DoubleExpr&>(other);
     return literal == otherDouble.literal;
   }
+
+private:
+  static std::string toText(double value) {
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    return std::string(buffer, result.ptr);
+  }
 };
 
 class BoolExpr : public Expr {
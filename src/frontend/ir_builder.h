@@ -0,0 +1,456 @@
+#ifndef IR_BUILDER_H
+#define IR_BUILDER_H
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "../ir.h"
+#include "ast_visitor.h"
+#include "stmt.h"
+#include "string_interner.h"
+
+// Builds the SSA form of a function from its type-annotated AST, using the
+// algorithm of Braun et al., "Simple and Efficient Construction of Static
+// Single Assignment Form": reading a variable looks for its definition in
+// the current block and then up through the predecessors, placing phis where
+// they meet. Phis of a block whose predecessors are not all known yet are
+// completed when the block is sealed.
+//
+// The builder is deliberately naive. Every write of a local goes through a
+// Copy and nothing is reused, leaving the cleanup to the passes.
+//
+// Functions that declare nested functions or classes, use objects, capture
+// variables or loop are not supported yet; build returns nothing for them and
+// the Compiler compiles them straight from the AST.
+class IRBuilder : public ASTVisitor<IRBuilder, IRValueId, void> {
+ public:
+  explicit IRBuilder(const std::vector<VariableName>& globals)
+      : globals(globals) {}
+
+  std::optional<IRFunction> build(FunctionStmt& stmt) {
+    try {
+      current = function.addBlock();
+      sealBlock(current);
+      beginScope();
+
+      function.paramCount = stmt.params.size();
+      for (uint32_t i = 0; i < stmt.params.size(); i++) {
+        auto& param = stmt.params[i];
+        // slot 0 holds the function itself
+        auto value = append({IROp::Param, irType(param.type), {}, i + 1});
+        declare(param.name, value);
+      }
+
+      visit(*stmt.body);
+      if (!isTerminated()) {
+        auto nil = append({IROp::Nil, IRType::Nil, {}});
+        terminate({IRTerminatorKind::Return, nil});
+      }
+      return std::move(function);
+    } catch (const Unsupported&) {
+      return std::nullopt;
+    }
+  }
+
+  // Expression visitors
+  IRValueId visitVoidExpr(IntegerExpr& expr) {
+    return append({IROp::Nil, IRType::Nil, {}});
+  }
+
+  IRValueId visitIntegerExpr(IntegerExpr& expr) {
+    return append({IROp::Const, IRType::Int, {},
+                   addConstant(Value(expr.getValue()))});
+  }
+
+  IRValueId visitDoubleExpr(DoubleExpr& expr) {
+    return append({IROp::Const, IRType::Double, {},
+                   addConstant(Value(expr.getValue()))});
+  }
+
+  IRValueId visitBoolExpr(BoolExpr& expr) {
+    return append(
+        {expr.getValue() ? IROp::True : IROp::False, IRType::Bool, {}});
+  }
+
+  IRValueId visitVariableExpr(VariableExpr& expr) {
+    auto name = expr.var.name;
+    if (auto variable = resolveLocal(name); variable.has_value()) {
+      return readVariable(variable.value(), current);
+    }
+    int global = resolveGlobal(name);
+    if (global == -1) {
+      // a local of an enclosing function
+      throw Unsupported();
+    }
+    return append({IROp::GlobalLoad, irType(expr.var.type), {},
+                   static_cast<uint32_t>(global)});
+  }
+
+  IRValueId visitSelfExpr(SelfExpr& expr) { throw Unsupported(); }
+
+  IRValueId visitApplyExpr(ApplyExpr& expr) {
+    auto calleeType = typeOf(*expr.callee);
+    if (expr.callee->kind == ExprKind::Get || calleeType == nullptr ||
+        calleeType->kind != TypeKind::Function) {
+      throw Unsupported();
+    }
+    auto& functionType = static_cast<FunctionType&>(*calleeType);
+
+    std::vector<IRValueId> operands = {visit(*expr.callee)};
+    for (auto& argument : expr.arguments) {
+      operands.push_back(visit(*argument));
+    }
+    return append({IROp::Call, irType(functionType.ret), std::move(operands)});
+  }
+
+  IRValueId visitBinaryExpr(BinaryExpr& expr) {
+    if (expr.op == BinaryOperator::And || expr.op == BinaryOperator::Or) {
+      return shortCircuit(expr);
+    }
+
+    auto left = visit(*expr.left);
+    auto right = visit(*expr.right);
+    IRType type = function.values[left].type;
+
+    switch (expr.op) {
+      case BinaryOperator::Add:
+        return append({IROp::Add, type, {left, right}});
+      case BinaryOperator::Minus:
+        return append({IROp::Sub, type, {left, right}});
+      case BinaryOperator::Multiply:
+        return append({IROp::Mul, type, {left, right}});
+      case BinaryOperator::Divide:
+        return append({IROp::Div, type, {left, right}});
+      case BinaryOperator::Modulo:
+        return append({IROp::Mod, type, {left, right}});
+      case BinaryOperator::Eq:
+        return append({IROp::Eq, IRType::Bool, {left, right}});
+      case BinaryOperator::Neq:
+        return append({IROp::Neq, IRType::Bool, {left, right}});
+      case BinaryOperator::Lt:
+        return append({IROp::Lt, IRType::Bool, {left, right}});
+      case BinaryOperator::Lte:
+        return append({IROp::Lte, IRType::Bool, {left, right}});
+      case BinaryOperator::Gt:
+        return append({IROp::Gt, IRType::Bool, {left, right}});
+      case BinaryOperator::Gte:
+        return append({IROp::Gte, IRType::Bool, {left, right}});
+      default:
+        throw std::runtime_error("Unknown BinaryOperator");
+    }
+  }
+
+  IRValueId visitUnaryExpr(UnaryExpr& expr) {
+    auto operand = visit(*expr.operand);
+    IRType type = function.values[operand].type;
+
+    switch (expr.op) {
+      case UnaryOperator::Negate:
+        return append({IROp::Neg, type, {operand}});
+      case UnaryOperator::Not:
+        return append({IROp::Not, type, {operand}});
+      default:
+        throw std::runtime_error("Unknown UnaryOperator");
+    }
+  }
+
+  IRValueId visitAssignExpr(AssignExpr& expr) {
+    auto value = visit(*expr.expression);
+
+    auto name = expr.var.name;
+    if (auto variable = resolveLocal(name); variable.has_value()) {
+      writeVariable(variable.value(), current, copy(value));
+    } else if (int global = resolveGlobal(name); global != -1) {
+      append({IROp::GlobalStore, IRType::Nil, {value},
+              static_cast<uint32_t>(global)});
+    } else {
+      throw Unsupported();
+    }
+
+    // an assignment evaluates to nothing
+    return append({IROp::Nil, IRType::Nil, {}});
+  }
+
+  IRValueId visitGetExpr(GetExpr& expr) { throw Unsupported(); }
+
+  IRValueId visitSetExpr(SetExpr& expr) { throw Unsupported(); }
+
+  // Statement visitors
+  void visitBlockStmt(BlockStmt& stmt) {
+    beginScope();
+    for (auto& statement : stmt.statements) {
+      // anything after a return is never run
+      if (isTerminated()) {
+        break;
+      }
+      visit(*statement);
+    }
+    endScope();
+  }
+
+  void visitDeclareStmt(DeclareStmt& stmt) {
+    auto value = visit(*stmt.expression);
+    declare(stmt.var.name, copy(value));
+  }
+
+  void visitFunctionStmt(FunctionStmt& stmt) { throw Unsupported(); }
+
+  void visitClassStmt(ClassStmt& stmt) { throw Unsupported(); }
+
+  void visitWhileStmt(WhileStmt& stmt) { throw Unsupported(); }
+
+  void visitForStmt(ForStmt& stmt) { throw Unsupported(); }
+
+  void visitExprStmt(ExprStmt& stmt) { visit(*stmt.expression); }
+
+  void visitReturnStmt(ReturnStmt& stmt) {
+    auto value = visit(*stmt.expression);
+    terminate({IRTerminatorKind::Return, value});
+  }
+
+  void visitIfStmt(IfStmt& stmt) {
+    auto condition = visit(*stmt.condition);
+
+    // both branches get a block of their own, even an else that is not
+    // there, so neither edge out of the branch is critical
+    IRBlockId thenBlock = function.addBlock();
+    IRBlockId elseBlock = function.addBlock();
+    terminate({IRTerminatorKind::Branch, condition, thenBlock, elseBlock});
+    sealBlock(thenBlock);
+    sealBlock(elseBlock);
+
+    // the join is only created if one of the branches falls through to it
+    std::optional<IRBlockId> join;
+    auto fallThrough = [&]() {
+      if (isTerminated()) {
+        return;
+      }
+      if (!join.has_value()) {
+        join = function.addBlock();
+      }
+      terminate({IRTerminatorKind::Jump, 0, join.value()});
+    };
+
+    current = thenBlock;
+    visit(*stmt.thenBranch);
+    fallThrough();
+
+    current = elseBlock;
+    if (stmt.elseBranch.has_value()) {
+      visit(*stmt.elseBranch.value());
+    }
+    fallThrough();
+
+    if (join.has_value()) {
+      current = join.value();
+      sealBlock(current);
+    }
+  }
+
+ private:
+  // Thrown for code the IR cannot express yet, see the class comment.
+  struct Unsupported {};
+
+  using VariableId = uint32_t;
+
+  const std::vector<VariableName>& globals;
+
+  IRFunction function;
+  IRBlockId current = 0;
+
+  // the variables in scope by name, innermost scope last
+  std::vector<std::unordered_map<VariableName, VariableId>> scopes;
+  std::vector<IRType> variableTypes;
+  // the value each variable was last given in each block
+  std::vector<std::unordered_map<IRBlockId, IRValueId>> currentDefs;
+  std::unordered_map<IRBlockId, std::vector<std::pair<VariableId, IRValueId>>>
+      incompletePhis;
+  std::vector<bool> sealed;
+
+  static IRType irType(const std::optional<std::shared_ptr<Type>>& type) {
+    if (!type.has_value()) {
+      throw Unsupported();
+    }
+    return irType(type.value());
+  }
+
+  static IRType irType(const std::shared_ptr<Type>& type) {
+    switch (type->kind) {
+      case TypeKind::Void:
+        return IRType::Nil;
+      case TypeKind::Integer:
+        return IRType::Int;
+      case TypeKind::Double:
+        return IRType::Double;
+      case TypeKind::Boolean:
+        return IRType::Bool;
+      default:
+        return IRType::Object;
+    }
+  }
+
+  // The inferred type of a callee, or null if the builder cannot tell it
+  // without compiling the expression.
+  static std::shared_ptr<Type> typeOf(Expr& expr) {
+    if (expr.kind == ExprKind::Variable) {
+      auto& var = static_cast<VariableExpr&>(expr).var;
+      return var.type.value_or(nullptr);
+    }
+    if (expr.kind == ExprKind::Apply) {
+      auto calleeType = typeOf(*static_cast<ApplyExpr&>(expr).callee);
+      if (calleeType != nullptr && calleeType->kind == TypeKind::Function) {
+        return static_cast<FunctionType&>(*calleeType).ret;
+      }
+    }
+    return nullptr;
+  }
+
+  // The right operand of && and || only runs if the left one does not
+  // decide the result already. Like the branches of an if, both edges out of
+  // the left operand get a block of their own.
+  IRValueId shortCircuit(BinaryExpr& expr) {
+    bool isAnd = expr.op == BinaryOperator::And;
+    auto left = visit(*expr.left);
+
+    IRBlockId rightBlock = function.addBlock();
+    IRBlockId decidedBlock = function.addBlock();
+    terminate({IRTerminatorKind::Branch, left,
+               isAnd ? rightBlock : decidedBlock,
+               isAnd ? decidedBlock : rightBlock});
+    sealBlock(rightBlock);
+    sealBlock(decidedBlock);
+    IRBlockId join = function.addBlock();
+
+    current = rightBlock;
+    auto right = visit(*expr.right);
+    terminate({IRTerminatorKind::Jump, 0, join});
+
+    current = decidedBlock;
+    auto decided =
+        append({isAnd ? IROp::False : IROp::True, IRType::Bool, {}});
+    terminate({IRTerminatorKind::Jump, 0, join});
+
+    current = join;
+    sealBlock(join);
+    auto phi = function.prependPhi(join, IRType::Bool);
+    function.values[phi].operands = {right, decided};
+    return phi;
+  }
+
+  IRValueId append(IRInstruction instruction) {
+    return function.append(current, std::move(instruction));
+  }
+
+  IRValueId copy(IRValueId value) {
+    return append({IROp::Copy, function.values[value].type, {value}});
+  }
+
+  uint32_t addConstant(Value constant) {
+    auto& constants = function.constants;
+    for (uint32_t i = 0; i < constants.size(); i++) {
+      if (constants[i] == constant) {
+        return i;
+      }
+    }
+    constants.push_back(constant);
+    return constants.size() - 1;
+  }
+
+  bool isTerminated() const {
+    return function.blocks[current].terminator.kind != IRTerminatorKind::None;
+  }
+
+  void terminate(IRTerminator terminator) {
+    function.blocks[current].terminator = terminator;
+    for (auto successor : function.blocks[current].successors()) {
+      function.blocks[successor].predecessors.push_back(current);
+    }
+  }
+
+  void beginScope() { scopes.emplace_back(); }
+
+  void endScope() { scopes.pop_back(); }
+
+  void declare(VariableName name, IRValueId value) {
+    // redeclaring in the same scope is an error the Compiler reports
+    if (scopes.back().contains(name)) {
+      throw Unsupported();
+    }
+    VariableId variable = variableTypes.size();
+    variableTypes.push_back(function.values[value].type);
+    currentDefs.emplace_back();
+    scopes.back()[name] = variable;
+    writeVariable(variable, current, value);
+  }
+
+  std::optional<VariableId> resolveLocal(VariableName name) const {
+    for (auto scope = scopes.rbegin(); scope != scopes.rend(); scope++) {
+      if (auto it = scope->find(name); it != scope->end()) {
+        return it->second;
+      }
+    }
+    return std::nullopt;
+  }
+
+  int resolveGlobal(VariableName name) const {
+    for (int i = 0; i < globals.size(); i++) {
+      if (globals[i] == name) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  void writeVariable(VariableId variable, IRBlockId block, IRValueId value) {
+    currentDefs[variable][block] = value;
+  }
+
+  IRValueId readVariable(VariableId variable, IRBlockId block) {
+    auto& defs = currentDefs[variable];
+    if (auto it = defs.find(block); it != defs.end()) {
+      return it->second;
+    }
+
+    IRValueId value;
+    auto& predecessors = function.blocks[block].predecessors;
+    if (!isSealed(block)) {
+      value = function.prependPhi(block, variableTypes[variable]);
+      incompletePhis[block].push_back({variable, value});
+    } else if (predecessors.size() == 1) {
+      value = readVariable(variable, predecessors[0]);
+    } else {
+      value = function.prependPhi(block, variableTypes[variable]);
+      // written first so that reading the variable in a loop ends at the phi
+      writeVariable(variable, block, value);
+      addPhiOperands(variable, value);
+    }
+    writeVariable(variable, block, value);
+    return value;
+  }
+
+  void addPhiOperands(VariableId variable, IRValueId phi) {
+    IRBlockId block = function.values[phi].block;
+    for (auto predecessor : function.blocks[block].predecessors) {
+      auto operand = readVariable(variable, predecessor);
+      function.values[phi].operands.push_back(operand);
+    }
+  }
+
+  bool isSealed(IRBlockId block) const {
+    return block < sealed.size() && sealed[block];
+  }
+
+  // Declares that all predecessors of the block are known.
+  void sealBlock(IRBlockId block) {
+    if (sealed.size() <= block) {
+      sealed.resize(block + 1, false);
+    }
+    for (auto [variable, phi] : incompletePhis[block]) {
+      addPhiOperands(variable, phi);
+    }
+    incompletePhis.erase(block);
+    sealed[block] = true;
+  }
+};
+
+#endif  // IR_BUILDER_H
@@ -87,6 +87,15 @@ class Parser {
   }
 
   std::unique_ptr<Stmt> statement() {
+    int line = current.line;
+    auto stmt = statementOnLine();
+    if (stmt != nullptr) {
+      stmt->line = line;
+    }
+    return stmt;
+  }
+
+  std::unique_ptr<Stmt> statementOnLine() {
     try {
       if (!current.isAtStartOfLine) {
         throw errorAtCurrent("Statement must begin on a new line");
@@ -94,6 +103,9 @@ class Parser {
       if (match(TOKEN_VAR)) {
         return declareStatement();
       }
+      if (match(TOKEN_LET)) {
+        return declareStatement(true);
+      }
       if (match(TOKEN_RETURN)) {
         return returnStatement();
       }
@@ -106,6 +118,12 @@ class Parser {
       if (match(TOKEN_IF)) {
         return ifStatement();
       }
+      if (match(TOKEN_WHILE)) {
+        return whileStatement();
+      }
+      if (match(TOKEN_FOR)) {
+        return forStatement();
+      }
       return expressionStatement();
     } catch (const ParseError& e) {
       synchronize();
@@ -113,13 +131,15 @@ class Parser {
     }
   }
 
-  std::unique_ptr<DeclareStmt> declareStatement() {
+  std::unique_ptr<DeclareStmt> declareStatement(bool isConstant = false) {
     auto identifier = consume(TOKEN_IDENTIFIER, "Expected identifier");
     consume(TOKEN_EQUAL, "Expected '='");
     auto expr = expression();
 
     auto symbol = strings.intern(std::string(identifier.lexeme));
-    return S::Declare(symbol, std::move(expr));
+    auto declaration = S::Declare(symbol, std::move(expr));
+    declaration->isConstant = isConstant;
+    return declaration;
   }
 
   std::unique_ptr<Stmt> returnStatement() {
@@ -180,7 +200,9 @@ class Parser {
         auto decl = declareStatement();
         declarations.push_back(std::move(decl));
       } else if (match(TOKEN_FUNC)) {
+        int line = previous.line;
         auto func = functionStatement();
+        func->line = line;
         methods.push_back(std::move(func));
       } else {
         throw errorAtCurrent("Expected member or method declaration");
@@ -210,6 +232,24 @@ class Parser {
     return stmt;
   }
 
+  std::unique_ptr<Stmt> whileStatement() {
+    auto condition = expression();
+    auto body = block();
+    return std::make_unique<WhileStmt>(std::move(condition), std::move(body));
+  }
+
+  std::unique_ptr<Stmt> forStatement() {
+    auto identifier = consume(TOKEN_IDENTIFIER, "Expected identifier");
+    auto symbol = strings.intern(std::string(identifier.lexeme));
+    consume(TOKEN_IN, "Expected 'in'");
+    auto start = expression();
+    consume(TOKEN_DOT_DOT_LESS, "Expected '..<'");
+    auto end = expression();
+    auto body = block();
+    return std::make_unique<ForStmt>(Var(symbol), std::move(start),
+                                     std::move(end), std::move(body));
+  }
+
   std::unique_ptr<Stmt> expressionStatement() {
     auto expr = expression();
     return S::Expression(std::move(expr));
@@ -239,7 +279,7 @@ class Parser {
   std::unique_ptr<Expr> logicalOr() {
     auto expr = logicalAnd();
     while (match(TOKEN_OR)) {
-      auto rhs = factor();
+      auto rhs = logicalAnd();
       expr = E::Binary(std::move(expr), BinaryOperator::Or, std::move(rhs));
     }
     return expr;
@@ -248,7 +288,7 @@ class Parser {
   std::unique_ptr<Expr> logicalAnd() {
     auto expr = equality();
     while (match(TOKEN_AND)) {
-      auto rhs = factor();
+      auto rhs = equality();
       expr = E::Binary(std::move(expr), BinaryOperator::And, std::move(rhs));
     }
     return expr;
@@ -473,6 +513,7 @@ class Parser {
       }
       switch (current.type) {
         case TOKEN_VAR:
+        case TOKEN_LET:
           return;
         default:
           advance();
@@ -0,0 +1,697 @@
+#ifndef REGISTER_COMPILER_H
+#define REGISTER_COMPILER_H
+#include <assert.h>
+
+#include "../debug.h"
+#include "../error.h"
+#include "../frontend/ast_visitor.h"
+#include "../frontend/stmt.h"
+#include "../register_bytecode.h"
+#include "../runtime/object.h"
+#include "compiler.h"
+#include "string_interner.h"
+
+// Compiles the AST into the three-address code of the register engine.
+//
+// Locals get the same slots as they would on the stack, and expression
+// temporaries are allocated above the locals in a stack-like fashion. Reading
+// a local needs no instruction at all, since instructions can name its
+// register directly.
+//
+// Classes and captured variables are not supported by the register engine
+// yet; compiling a program that uses them throws a Shiny::Error.
+class RegisterCompiler
+    : public ASTVisitor<RegisterCompiler, std::shared_ptr<Type>, void> {
+ public:
+  using FunctionKind = Compiler::FunctionKind;
+
+ private:
+  // Destination of an expression whose value is not needed.
+  static constexpr int NO_REGISTER = -1;
+
+  RegisterCompiler* enclosingCompiler;
+  FunctionKind kind;
+  std::vector<Local> locals;
+  int scopeDepth = 0;  // starts from zero for every Compiler/function.
+
+  int nextRegister = 0;  // first register not taken by a local or temporary
+  int target = NO_REGISTER;  // destination of the expression being visited
+
+  std::vector<VariableName>& globals;
+  StringInterner& stringInterner;
+  Stmt& ast;
+
+  FunctionObject function;
+  std::optional<VariableName> name;
+
+  bool verbose;
+
+ public:
+  RegisterCompiler(RegisterCompiler* enclosing_compiler, FunctionKind kind,
+                   std::vector<VariableName>& globals,
+                   StringInterner& stringInterner, Stmt& ast,
+                   std::optional<SymbolId> name = std::nullopt,
+                   bool verbose = false)
+      : enclosingCompiler(enclosing_compiler),
+        kind(kind),
+        globals(globals),
+        stringInterner(stringInterner),
+        ast(ast),
+        function(name),
+        name(name),
+        verbose(verbose) {}
+
+  FunctionObject compile() {
+    switch (kind) {
+      case FunctionKind::TopLevel: {
+        assert(ast.kind == StmtKind::Block);
+        // register 0 holds the value of the last expression statement, which
+        // is the result of the evaluation
+        auto result = stringInterner.intern("__result__");
+        locals.push_back(Local(result, 0, false));
+        reserveLocal();
+
+        visit(ast);
+        emitABC(RegisterOpcode::HALT, 0);
+        break;
+      }
+      case FunctionKind::Function: {
+        auto& functionStmt = static_cast<FunctionStmt&>(ast);
+        if (functionStmt.params.size() > 255) {
+          throw std::runtime_error("Too many function parameters");
+        }
+
+        auto name = stringInterner.intern("__function__");
+        locals.push_back(Local(name, 0, false));
+        reserveLocal();
+
+        for (int i = 0; i < functionStmt.params.size(); ++i) {
+          auto& param = functionStmt.params.at(i);
+          declare(param.name);
+          define(param.name);
+        }
+        visit(*functionStmt.body);
+
+        int result = allocateRegister();
+        emitABC(RegisterOpcode::LOAD_NIL, result);
+        emitABC(RegisterOpcode::RETURN, result);
+        break;
+      }
+      case FunctionKind::Method:
+      case FunctionKind::Initializer:
+        throw unsupported("Methods");
+      default:
+        throw std::runtime_error("Unknown FunctionKind");
+    }
+
+    std::string chunkName;
+    if (name.has_value()) {
+      chunkName = stringInterner.get(name.value());
+    } else if (kind == FunctionKind::TopLevel) {
+      chunkName = "<top level>";
+    } else {
+      chunkName = "<anonymous>";
+    }
+
+    if (verbose) {
+      std::cout << registerChunkToString(function.getRegisterChunk(),
+                                         chunkName, stringInterner)
+                << std::endl;
+    }
+
+    return function;
+  }
+
+  // Expression visitors. Each of them leaves the value of the expression in
+  // the target register and frees the temporaries it allocated.
+  std::shared_ptr<Type> visitVoidExpr(IntegerExpr& expr) {
+    emitABC(RegisterOpcode::LOAD_NIL, target);
+    return T::Void();
+  }
+
+  std::shared_ptr<Type> visitIntegerExpr(IntegerExpr& expr) {
+    int64_t value = expr.getValue();
+    emitABx(RegisterOpcode::LOAD_CONST, target, addConstant(value));
+    return T::Int();
+  }
+
+  std::shared_ptr<Type> visitDoubleExpr(DoubleExpr& expr) {
+    double value = expr.getValue();
+    emitABx(RegisterOpcode::LOAD_CONST, target, addConstant(value));
+    return T::Double();
+  }
+
+  std::shared_ptr<Type> visitBoolExpr(BoolExpr& expr) {
+    emitABC(expr.getValue() ? RegisterOpcode::LOAD_TRUE
+                            : RegisterOpcode::LOAD_FALSE,
+            target);
+    return T::Bool();
+  }
+
+  std::shared_ptr<Type> visitVariableExpr(VariableExpr& expr) {
+    auto name = expr.var.name;
+    int index = resolveLocal(name);
+    if (index != -1) {
+      if (index != target) {
+        emitABC(RegisterOpcode::MOVE, target, index);
+      }
+    } else if (isCaptured(name)) {
+      throw unsupported("Captured variables");
+    } else if ((index = resolveGlobal(name)) != -1) {
+      emitABx(RegisterOpcode::GLOBAL_LOAD, target, index);
+    } else {
+      throw std::runtime_error(
+          "Variable name not found");  // this should never happen; caught by
+                                       // TypeInference
+    }
+    return expr.var.type.value();
+  }
+
+  std::shared_ptr<Type> visitSelfExpr(SelfExpr& expr) {
+    throw unsupported("Methods");
+  }
+
+  std::shared_ptr<Type> visitApplyExpr(ApplyExpr& expr) {
+    int destination = target;
+    int mark = nextRegister;
+
+    // the callee and its arguments have to be in consecutive registers; if
+    // the destination is the topmost temporary the call can be made from it
+    // directly instead of moving the result there afterwards
+    int base = destination == nextRegister - 1 && destination >= locals.size()
+                   ? destination
+                   : allocateRegister();
+
+    auto calleeType = compileInto(*expr.callee, base);
+    assert(calleeType->kind == TypeKind::Function ||
+           calleeType->kind == TypeKind::Class);
+    if (calleeType->kind == TypeKind::Class) {
+      throw unsupported("Classes");
+    }
+    auto& functionType = static_cast<FunctionType&>(*calleeType);
+
+    if (expr.arguments.size() > 255) {
+      throw std::runtime_error("Too many arguments");
+    }
+    for (auto& arg : expr.arguments) {
+      compileInto(*arg, allocateRegister());
+    }
+    emitABC(RegisterOpcode::CALL, base, expr.arguments.size());
+
+    if (destination != base) {
+      emitABC(RegisterOpcode::MOVE, destination, base);
+    }
+    nextRegister = mark;
+
+    return functionType.ret;
+  }
+
+  std::shared_ptr<Type> visitBinaryExpr(BinaryExpr& expr) {
+    int destination = target;
+    int mark = nextRegister;
+
+    if (expr.op == BinaryOperator::And || expr.op == BinaryOperator::Or) {
+      // the right operand is only evaluated if the left one does not decide
+      // the result. The destination may be a local the operands read, so
+      // each path only writes it once they are done with it.
+      auto& instructions = function.getRegisterChunk().instructions;
+      int lhs;
+      compileOperand(*expr.left, lhs);
+      nextRegister = mark;
+      size_t jumpIfFalseIndex =
+          emitABx(RegisterOpcode::JUMP_IF_FALSE, lhs, 0);
+      size_t jumpToEndIndex;
+      if (expr.op == BinaryOperator::And) {
+        compileInto(*expr.right, destination);
+        jumpToEndIndex = emitABx(RegisterOpcode::JUMP, 0, 0);
+        patchJump(jumpIfFalseIndex, instructions.size());
+        emitABC(RegisterOpcode::LOAD_FALSE, destination);
+      } else {
+        emitABC(RegisterOpcode::LOAD_TRUE, destination);
+        jumpToEndIndex = emitABx(RegisterOpcode::JUMP, 0, 0);
+        patchJump(jumpIfFalseIndex, instructions.size());
+        compileInto(*expr.right, destination);
+      }
+      patchJump(jumpToEndIndex, instructions.size());
+      return T::Bool();
+    }
+
+    int lhs, rhs;
+    auto lhsType = compileOperand(*expr.left, lhs);
+    compileOperand(*expr.right, rhs);
+    nextRegister = mark;
+
+    emitABC(specialize(expr.op, lhsType->kind), destination, lhs, rhs);
+
+    switch (expr.op) {
+      case BinaryOperator::Eq:
+      case BinaryOperator::Neq:
+      case BinaryOperator::Lt:
+      case BinaryOperator::Lte:
+      case BinaryOperator::Gt:
+      case BinaryOperator::Gte:
+        return T::Bool();
+      default:
+        return lhsType;
+    }
+  }
+
+  std::shared_ptr<Type> visitUnaryExpr(UnaryExpr& expr) {
+    int destination = target;
+    int mark = nextRegister;
+
+    int operand;
+    auto type = compileOperand(*expr.operand, operand);
+    nextRegister = mark;
+
+    switch (expr.op) {
+      case UnaryOperator::Negate:
+        switch (type->kind) {
+          case TypeKind::Integer:
+            emitABC(RegisterOpcode::NEG_INT, destination, operand);
+            break;
+          case TypeKind::Double:
+            emitABC(RegisterOpcode::NEG_DOUBLE, destination, operand);
+            break;
+          default:
+            throw std::runtime_error("Unexpected TypeKind");
+        }
+        return type;
+      case UnaryOperator::Not:
+        emitABC(RegisterOpcode::NOT, destination, operand);
+        return type;
+      default:
+        throw std::runtime_error("Unknown UnaryOperator");
+    }
+  }
+
+  std::shared_ptr<Type> visitAssignExpr(AssignExpr& expr) {
+    int destination = target;
+
+    auto name = expr.var.name;
+    int index = resolveLocal(name);
+    if (index != -1) {
+      compileInto(*expr.expression, index);
+    } else if (isCaptured(name)) {
+      throw unsupported("Captured variables");
+    } else if ((index = resolveGlobal(name)) != -1) {
+      int mark = nextRegister;
+      int value;
+      compileOperand(*expr.expression, value);
+      emitABx(RegisterOpcode::GLOBAL_STORE, value, index);
+      nextRegister = mark;
+    } else {
+      throw std::runtime_error(
+          "Variable name not found");  // this should never happen; caught by
+                                       // TypeInference
+    }
+
+    // assignments evaluate to nil, like in the stack engine
+    if (destination != NO_REGISTER) {
+      emitABC(RegisterOpcode::LOAD_NIL, destination);
+    }
+
+    return T::Void();
+  }
+
+  std::shared_ptr<Type> visitGetExpr(GetExpr& expr) {
+    throw unsupported("Classes");
+  }
+
+  std::shared_ptr<Type> visitSetExpr(SetExpr& expr) {
+    throw unsupported("Classes");
+  }
+
+  // Statement visitors
+  void visitBlockStmt(BlockStmt& stmt) {
+    if (!isTopLevel()) {
+      beginScope();
+    }
+    for (auto& statement : stmt.statements) {
+      visit(*statement);
+    }
+    if (!isTopLevel()) {
+      endScope();
+    }
+  }
+
+  void visitDeclareStmt(DeclareStmt& stmt) {
+    if (isTopLevel()) {
+      int mark = nextRegister;
+      int value;
+      compileOperand(*stmt.expression, value);
+      globals.push_back(stmt.var.name);
+      emitABx(RegisterOpcode::GLOBAL_STORE, value, globals.size() - 1);
+      nextRegister = mark;
+      return;
+    }
+
+    declare(stmt.var.name);
+    compileInto(*stmt.expression, locals.size() - 1);
+    define(stmt.var.name);
+  }
+
+  void visitFunctionStmt(FunctionStmt& stmt) {
+    auto name = stmt.name.name;
+    declare(name);
+    if (isTopLevel()) {
+      globals.push_back(name);  // allow recursion
+    }
+
+    auto compiler = RegisterCompiler(this, FunctionKind::Function, globals,
+                                     stringInterner, stmt, name, verbose);
+    auto function = compiler.compile();
+    uint32_t constantIndex =
+        addConstant(ObjectPtr<FunctionObject>(std::move(function)));
+
+    if (isTopLevel()) {
+      int mark = nextRegister;
+      int value = allocateRegister();
+      emitABx(RegisterOpcode::LOAD_CONST, value, constantIndex);
+      emitABx(RegisterOpcode::GLOBAL_STORE, value, globals.size() - 1);
+      nextRegister = mark;
+      return;
+    }
+
+    emitABx(RegisterOpcode::LOAD_CONST, locals.size() - 1, constantIndex);
+    define(name);
+  }
+
+  void visitClassStmt(ClassStmt& stmt) { throw unsupported("Classes"); }
+
+  void visitExprStmt(ExprStmt& stmt) {
+    // the top level keeps the value of its last expression statement around
+    // as the result of the evaluation
+    if (kind == FunctionKind::TopLevel) {
+      compileInto(*stmt.expression, 0);
+      return;
+    }
+
+    int mark = nextRegister;
+    int destination = stmt.expression->kind == ExprKind::Assign
+                          ? NO_REGISTER
+                          : allocateRegister();
+    compileInto(*stmt.expression, destination);
+    nextRegister = mark;
+  }
+
+  void visitReturnStmt(ReturnStmt& stmt) {
+    if (kind == FunctionKind::TopLevel) {
+      throw std::runtime_error("Return invalid outside of a func");
+    }
+    int mark = nextRegister;
+    int value;
+    compileOperand(*stmt.expression, value);
+    emitABC(RegisterOpcode::RETURN, value);
+    nextRegister = mark;
+  }
+
+  void visitIfStmt(IfStmt& stmt) {
+    int mark = nextRegister;
+    int condition;
+    compileOperand(*stmt.condition, condition);
+    nextRegister = mark;
+
+    size_t jumpToElseIndex =
+        emitABx(RegisterOpcode::JUMP_IF_FALSE, condition, 0);
+
+    visit(*stmt.thenBranch);
+
+    size_t jumpToEndIndex = -1;
+    if (stmt.elseBranch.has_value()) {
+      jumpToEndIndex = emitABx(RegisterOpcode::JUMP, 0, 0);
+    }
+
+    patchJump(jumpToElseIndex,
+              function.getRegisterChunk().instructions.size());
+
+    if (stmt.elseBranch.has_value()) {
+      visit(*stmt.elseBranch.value());
+      patchJump(jumpToEndIndex,
+                function.getRegisterChunk().instructions.size());
+    }
+  }
+
+  void visitWhileStmt(WhileStmt& stmt) {
+    auto& instructions = function.getRegisterChunk().instructions;
+    size_t start = instructions.size();
+    int mark = nextRegister;
+    int condition;
+    compileOperand(*stmt.condition, condition);
+    nextRegister = mark;
+
+    size_t jumpToEndIndex = emitABx(RegisterOpcode::JUMP_IF_FALSE, condition, 0);
+    visit(*stmt.body);
+    emitABx(RegisterOpcode::JUMP, 0, start);
+    patchJump(jumpToEndIndex, instructions.size());
+  }
+
+  // The loop variable counts up in its own register, next to hidden locals
+  // holding the end of the range and the step of one.
+  void visitForStmt(ForStmt& stmt) {
+    auto& instructions = function.getRegisterChunk().instructions;
+    beginScope();
+    declare(stringInterner.intern("__counter__"));
+    int counter = locals.size() - 1;
+    compileInto(*stmt.start, counter);
+    define(stringInterner.intern("__counter__"));
+    declare(stringInterner.intern("__end__"));
+    compileInto(*stmt.end, counter + 1);
+    define(stringInterner.intern("__end__"));
+    declare(stringInterner.intern("__step__"));
+    emitABx(RegisterOpcode::LOAD_CONST, counter + 2, addConstant(Value(static_cast<int64_t>(1))));
+    define(stringInterner.intern("__step__"));
+    locals[counter].name = stmt.var.name;
+
+    size_t start = instructions.size();
+    int condition = allocateRegister();
+    emitABC(RegisterOpcode::LT_INT, condition, counter, counter + 1);
+    nextRegister = condition;
+    size_t jumpToEndIndex = emitABx(RegisterOpcode::JUMP_IF_FALSE, condition, 0);
+    visit(*stmt.body);
+    emitABC(RegisterOpcode::ADD_INT, counter, counter, counter + 2);
+    emitABx(RegisterOpcode::JUMP, 0, start);
+    patchJump(jumpToEndIndex, instructions.size());
+    endScope();
+  }
+
+ private:
+  // Compiles the expression so that its value ends up in the given register.
+  std::shared_ptr<Type> compileInto(Expr& expr, int reg) {
+    int enclosingTarget = target;
+    target = reg;
+    auto type = visit(expr);
+    target = enclosingTarget;
+    return type;
+  }
+
+  // Compiles an operand of an instruction and sets reg to the register holding
+  // its value. Locals are read in place; anything else is evaluated into a new
+  // temporary, which the caller has to free.
+  std::shared_ptr<Type> compileOperand(Expr& expr, int& reg) {
+    if (expr.kind == ExprKind::Variable) {
+      auto& variable = static_cast<VariableExpr&>(expr);
+      int index = resolveLocal(variable.var.name);
+      if (index != -1) {
+        reg = index;
+        return variable.var.type.value();
+      }
+    }
+    reg = allocateRegister();
+    return compileInto(expr, reg);
+  }
+
+  int allocateRegister() {
+    if (nextRegister == 256) {
+      throw std::runtime_error("Too many registers");
+    }
+    int reg = nextRegister++;
+    auto& chunk = function.getRegisterChunk();
+    chunk.registerCount = std::max(chunk.registerCount, nextRegister);
+    return reg;
+  }
+
+  // Takes the register of the local that was just pushed.
+  void reserveLocal() {
+    assert(nextRegister == locals.size() - 1);
+    allocateRegister();
+  }
+
+  int resolveLocal(VariableName name) {
+    for (int i = locals.size() - 1; i >= 0; i--) {
+      auto& local = locals.at(i);
+      if (local.name == name) {
+        if (local.depth == -1) {
+          throw std::runtime_error(
+              "Circular reference");  // this should never happen; caught by
+          // TypeInference
+        }
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // Whether the name refers to a local of an enclosing function, which the
+  // stack engine would capture as an upvalue.
+  bool isCaptured(VariableName name) {
+    for (auto* compiler = enclosingCompiler; compiler != nullptr;
+         compiler = compiler->enclosingCompiler) {
+      if (compiler->resolveLocal(name) != -1) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  int resolveGlobal(VariableName name) {
+    if (kind != FunctionKind::TopLevel) {
+      return enclosingCompiler->resolveGlobal(name);
+    }
+
+    for (int i = 0; i < globals.size(); i++) {
+      if (globals.at(i) == name) {
+        return i;
+      }
+    }
+
+    return -1;
+  }
+
+  void beginScope() { scopeDepth++; }
+
+  // Locals live in registers, so leaving a scope only has to give their
+  // registers back.
+  void endScope() {
+    scopeDepth--;
+    while (locals.size() > 0 && locals.back().depth > scopeDepth) {
+      locals.pop_back();
+    }
+    nextRegister = locals.size();
+  }
+
+  void declare(VariableName name) {
+    if (isTopLevel()) {
+      return;
+    }
+
+    // check that local variable is unique in the current scope
+    for (int i = locals.size() - 1; i >= 0; i--) {
+      auto& local = locals.at(i);
+      if (local.depth != -1 && local.depth < scopeDepth) {
+        break;
+      }
+
+      if (local.name == name) {
+        throw std::runtime_error("Invalid redeclaration of '" +
+                                 stringInterner.get(name) + "'");
+      }
+    }
+
+    if (locals.size() == 256) {
+      throw std::runtime_error("Too many local variables");
+    }
+    locals.push_back(Local(name, -1, false));
+    reserveLocal();
+  }
+
+  void define(VariableName name) {
+    auto& local = locals.back();
+    assert(local.name == name);
+    local.depth = scopeDepth;
+  }
+
+  bool isTopLevel() {
+    return scopeDepth == 0 && kind == FunctionKind::TopLevel;
+  }
+
+  static Error unsupported(const std::string& feature) {
+    return Error(feature + " are not supported by the register engine");
+  }
+
+  uint32_t addConstant(Value constant) {
+    auto& constants = function.getRegisterChunk().constants;
+    constants.push_back(constant);
+    auto index = static_cast<uint32_t>(constants.size() - 1);
+    assertFits16BitOperand(index);
+    return index;
+  }
+
+  size_t emitABC(RegisterOpcode opcode, uint32_t a, uint32_t b = 0,
+                 uint32_t c = 0) {
+    auto& instructions = function.getRegisterChunk().instructions;
+    instructions.push_back(encodeABC(opcode, a, b, c));
+    return instructions.size() - 1;
+  }
+
+  size_t emitABx(RegisterOpcode opcode, uint32_t a, uint32_t bx) {
+    assertFits16BitOperand(bx);
+    auto& instructions = function.getRegisterChunk().instructions;
+    instructions.push_back(encodeABx(opcode, a, bx));
+    return instructions.size() - 1;
+  }
+
+  static RegisterOpcode specialize(BinaryOperator op, TypeKind kind) {
+    auto pick = [kind](RegisterOpcode intOpcode, RegisterOpcode doubleOpcode) {
+      switch (kind) {
+        case TypeKind::Integer:
+          return intOpcode;
+        case TypeKind::Double:
+          return doubleOpcode;
+        default:
+          throw std::runtime_error("Unexpected TypeKind");
+      }
+    };
+
+    switch (op) {
+      case BinaryOperator::Add:
+        return pick(RegisterOpcode::ADD_INT, RegisterOpcode::ADD_DOUBLE);
+      case BinaryOperator::Minus:
+        return pick(RegisterOpcode::SUB_INT, RegisterOpcode::SUB_DOUBLE);
+      case BinaryOperator::Multiply:
+        return pick(RegisterOpcode::MUL_INT, RegisterOpcode::MUL_DOUBLE);
+      case BinaryOperator::Divide:
+        return pick(RegisterOpcode::DIV_INT, RegisterOpcode::DIV_DOUBLE);
+      case BinaryOperator::Modulo:
+        if (kind != TypeKind::Integer) {
+          throw std::runtime_error("Unexpected TypeKind");
+        }
+        return RegisterOpcode::MOD_INT;
+      case BinaryOperator::Eq:
+        if (kind == TypeKind::Boolean) {
+          return RegisterOpcode::EQ;
+        }
+        return pick(RegisterOpcode::EQ_INT, RegisterOpcode::EQ_DOUBLE);
+      case BinaryOperator::Neq:
+        if (kind == TypeKind::Boolean) {
+          return RegisterOpcode::NEQ;
+        }
+        return pick(RegisterOpcode::NEQ_INT, RegisterOpcode::NEQ_DOUBLE);
+      case BinaryOperator::Lt:
+        return pick(RegisterOpcode::LT_INT, RegisterOpcode::LT_DOUBLE);
+      case BinaryOperator::Lte:
+        return pick(RegisterOpcode::LTE_INT, RegisterOpcode::LTE_DOUBLE);
+      case BinaryOperator::Gt:
+        return pick(RegisterOpcode::GT_INT, RegisterOpcode::GT_DOUBLE);
+      case BinaryOperator::Gte:
+        return pick(RegisterOpcode::GTE_INT, RegisterOpcode::GTE_DOUBLE);
+      default:
+        throw std::runtime_error("Unknown BinaryOperator");
+    }
+  }
+
+  void patchJump(size_t jumpIndex, size_t targetIndex) {
+    assertFits16BitOperand(targetIndex);
+    auto& instruction = function.getRegisterChunk().instructions[jumpIndex];
+    instruction = encodeABx(decodeOpcode(instruction), decodeA(instruction),
+                            targetIndex);
+  }
+
+  void assertFits16BitOperand(uint32_t operand) {
+    constexpr uint32_t MAX_OPERAND = 0xFFFF;
+    if (operand > MAX_OPERAND) {
+      throw std::runtime_error("Operand exceeds 16-bit limit");
+    }
+  }
+};
+#endif  // REGISTER_COMPILER_H
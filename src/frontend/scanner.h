@@ -63,7 +63,12 @@ public:
       case ';': return makeToken(TOKEN_SEMICOLON);
       case ':': return makeToken(TOKEN_COLON);
       case ',': return makeToken(TOKEN_COMMA);
-      case '.': return makeToken(TOKEN_DOT);
+      case '.':
+        if (match('.')) {
+          if (match('<')) return makeToken(TOKEN_DOT_DOT_LESS);
+          throw ScanError("Expected '<' after '..'.", source.substr(start, current - start), line);
+        }
+        return makeToken(TOKEN_DOT);
       case '-':
         return makeToken(
           match('>') ? TOKEN_ARROW : TOKEN_MINUS);
@@ -150,7 +155,9 @@ private:
         if (current - start > 1) {
           switch (source.at(start+1)) {
             case 'f': return TOKEN_IF;
-            case 'n': return checkKeyword(2, "it", TOKEN_INIT);
+            case 'n':
+              if (current - start == 2) return TOKEN_IN;
+              return checkKeyword(2, "it", TOKEN_INIT);
           }
         }
         break;
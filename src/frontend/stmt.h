@@ -11,12 +11,15 @@ enum class StmtKind {
   Class,
   Expr,
   Return,
-  If
+  If,
+  While,
+  For
 };
 
 class Stmt {
 public:
   StmtKind kind;
+  int line = 0;  // source line the statement starts on, 0 if made up
 
   explicit Stmt(StmtKind kind) : kind(kind) {}
   virtual ~Stmt() = default;
@@ -61,6 +64,7 @@ class DeclareStmt : public Stmt {
 public:
   Var var;
   std::unique_ptr<Expr> expression;
+  bool isConstant = false; // declared with `let`, so never assigned to
 
   DeclareStmt(Var  var, std::unique_ptr<Expr> expression)
     : Stmt(StmtKind::Declare),
@@ -74,6 +78,7 @@ public:
 
     const auto& otherDecl = static_cast<const DeclareStmt&>(other);
     return var == otherDecl.var &&
+      isConstant == otherDecl.isConstant &&
       *expression == *otherDecl.expression;
   }
 };
@@ -221,4 +226,55 @@ public:
   }
 };
 
+class WhileStmt : public Stmt {
+public:
+  std::unique_ptr<Expr> condition;
+  std::unique_ptr<Stmt> body;
+
+  WhileStmt(std::unique_ptr<Expr> condition, std::unique_ptr<Stmt> body)
+    : Stmt(StmtKind::While),
+      condition(std::move(condition)),
+      body(std::move(body)) {}
+
+  bool operator==(const Stmt& other) const override {
+    if (kind != other.kind) {
+      return false;
+    }
+
+    const auto& otherWhile = static_cast<const WhileStmt&>(other);
+    return *condition == *otherWhile.condition && *body == *otherWhile.body;
+  }
+};
+
+// `for var in start..<end`, which binds var to every Int from start up to but
+// not including end. Both bounds are evaluated once, before the first
+// iteration.
+class ForStmt : public Stmt {
+public:
+  Var var;
+  std::unique_ptr<Expr> start;
+  std::unique_ptr<Expr> end;
+  std::unique_ptr<Stmt> body;
+
+  ForStmt(Var var, std::unique_ptr<Expr> start, std::unique_ptr<Expr> end,
+          std::unique_ptr<Stmt> body)
+    : Stmt(StmtKind::For),
+      var(std::move(var)),
+      start(std::move(start)),
+      end(std::move(end)),
+      body(std::move(body)) {}
+
+  bool operator==(const Stmt& other) const override {
+    if (kind != other.kind) {
+      return false;
+    }
+
+    const auto& otherFor = static_cast<const ForStmt&>(other);
+    return var == otherFor.var &&
+      *start == *otherFor.start &&
+      *end == *otherFor.end &&
+      *body == *otherFor.body;
+  }
+};
+
 #endif //STMT_H
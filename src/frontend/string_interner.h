@@ -1,6 +1,8 @@
 #ifndef STRING_INTERNER_H
 #define STRING_INTERNER_H
 #include <cstdint>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -32,6 +32,7 @@ enum TokenType {
   TOKEN_BITWISE_OR,
   TOKEN_OR,
   TOKEN_ARROW,
+  TOKEN_DOT_DOT_LESS,
   // Literals.
   TOKEN_IDENTIFIER,
   TOKEN_STRING,
@@ -44,6 +45,7 @@ enum TokenType {
   TOKEN_FOR,
   TOKEN_FUNC,
   TOKEN_IF,
+  TOKEN_IN,
   TOKEN_LET,
   TOKEN_NIL,
   TOKEN_PRINT,
@@ -141,6 +141,8 @@ class ClassType : public Type {
 public:
   SymbolId name;
   std::vector<std::pair<SymbolId, std::shared_ptr<Type>>> members;
+  // members are laid out as fields, then __init__, then the methods
+  int fieldCount = 0;
 
   ClassType(SymbolId name,
             std::vector<std::pair<SymbolId, std::shared_ptr<Type>>> members)
@@ -178,6 +180,10 @@ public:
     return std::nullopt;
   }
 
+  bool isMethod(int index) const {
+    return index >= fieldCount;
+  }
+
   std::optional<std::shared_ptr<Type>> getMemberType(int index) {
     if (index < 0 || index >= members.size()) {
       return std::nullopt;
@@ -3,6 +3,7 @@
 
 #include <ranges>
 #include <set>
+#include <unordered_set>
 #include <vector>
 
 #include "error.h"
@@ -33,6 +34,9 @@ class TypeInference {
   TypeEnv* globals;
   // nil value represents declared but not defined. used to prevent referencing a variable in the same assignment statement.
   std::vector<TypeEnv> envs;
+  // names declared with `let` or `func` in each of envs
+  std::vector<std::unordered_set<VariableName>> constants;
+  std::unordered_set<VariableName>* constantGlobals;
   std::vector<std::unique_ptr<TypeConstraint>> constraints;
   std::set<TypeVar> unbounded;
   // to check return type
@@ -44,13 +48,19 @@ class TypeInference {
 public:
   explicit TypeInference(
     StringInterner& stringInterner,
-    TypeEnv* globals = nullptr
-  ) : stringInterner(stringInterner), globals(globals) {
+    TypeEnv* globals = nullptr,
+    std::unordered_set<VariableName>* constantGlobals = nullptr
+  ) : stringInterner(stringInterner), globals(globals), constantGlobals(constantGlobals) {
     if (globals) {
       envs.push_back(*globals);
     } else {
       envs.push_back({});
     }
+    if (constantGlobals) {
+      constants.push_back(*constantGlobals);
+    } else {
+      constants.push_back({});
+    }
   }
 
   void perform(Stmt& stmt) {
@@ -67,6 +77,9 @@ public:
     if (globals != nullptr) {
       *globals = envs.front();
     }
+    if (constantGlobals != nullptr) {
+      *constantGlobals = constants.front();
+    }
   }
 
 private:
@@ -224,6 +237,19 @@ private:
         }
         break;
       }
+      case StmtKind::While: {
+        auto& whileStmt = static_cast<WhileStmt&>(stmt);
+        substituteAst(*whileStmt.condition);
+        substituteAst(*whileStmt.body);
+        break;
+      }
+      case StmtKind::For: {
+        auto& forStmt = static_cast<ForStmt&>(stmt);
+        substituteAst(*forStmt.start);
+        substituteAst(*forStmt.end);
+        substituteAst(*forStmt.body);
+        break;
+      }
       default:
         throw std::runtime_error("Unknown StmtKind");
     }
@@ -516,6 +542,10 @@ private:
       case ExprKind::Assign: {
         auto& assignExpr = static_cast<AssignExpr&>(expr);
         auto varType = lookup(assignExpr.var);
+        if (isConstant(assignExpr.var.name)) {
+          auto kind = varType->kind == TypeKind::Function ? "a function" : "a 'let' constant";
+          throw TypeError("Cannot assign to value: '" + stringInterner.get(assignExpr.var.name) + "' is " + kind);
+        }
         auto exprType = infer(*assignExpr.expression);
         assert(varType->kind != TypeKind::Variable);
         assert(exprType->kind != TypeKind::Variable);
@@ -601,6 +631,9 @@ private:
         auto exprType = infer(*declStmt.expression);
         define(declStmt.var, exprType);
         declStmt.var.type = exprType;
+        if (declStmt.isConstant) {
+          constants.back().insert(declStmt.var.name);
+        }
         return true;
       }
       case StmtKind::Function: {
@@ -616,6 +649,9 @@ private:
         }
         auto functionType = T::Function(paramTypes, funStmt.returnType);
         define(funStmt.name, functionType);
+        // like in Swift, the name always refers to this function, which lets
+        // the compiler inline calls to it
+        constants.back().insert(funStmt.name.name);
 
         beginScope();
         auto prevEnclosingFunction = enclosingFunction;
@@ -681,6 +717,7 @@ private:
         endScope();
 
         type->members = std::move(members);
+        type->fieldCount = classStmt.declarations.size();
 
         // 2nd pass: infer with the refined class type
         beginScope();
@@ -739,6 +776,35 @@ private:
         // The if-else falls through if any branch can fall through
         return thenFallsThrough || elseFallsThrough;
       }
+      case StmtKind::While: {
+        auto& whileStmt = static_cast<WhileStmt&>(stmt);
+        auto conditionType = infer(*whileStmt.condition);
+        if (conditionType->kind != TypeKind::Boolean) {
+          throw TypeError("While condition must be a boolean");
+        }
+        // the body may not run at all, so a loop always falls through
+        infer(*whileStmt.body);
+        return true;
+      }
+      case StmtKind::For: {
+        auto& forStmt = static_cast<ForStmt&>(stmt);
+        auto startType = infer(*forStmt.start);
+        auto endType = infer(*forStmt.end);
+        if (startType->kind != TypeKind::Integer ||
+            endType->kind != TypeKind::Integer) {
+          throw TypeError("Range bounds must be integers");
+        }
+
+        // like in Swift, the loop variable is a constant scoped to the loop
+        beginScope();
+        declare(forStmt.var);
+        define(forStmt.var, startType);
+        constants.back().insert(forStmt.var.name);
+        forStmt.var.type = startType;
+        infer(*forStmt.body);
+        endScope();
+        return true;
+      }
       default:
         throw std::runtime_error("Unknown StmtKind");
     }
@@ -781,10 +847,12 @@ private:
    */
   void beginScope() {
     envs.emplace_back();
+    constants.emplace_back();
   }
 
   void endScope() {
     envs.pop_back();
+    constants.pop_back();
   }
 
   void declare(const Var& var) {
@@ -817,6 +885,16 @@ private:
   std::shared_ptr<Type> lookup(const Var& var) {
     return lookup(var.name);
   }
+
+  // whether the innermost declaration of name in scope is a `let`
+  bool isConstant(const VariableName& name) {
+    for (int i = envs.size() - 1; i >= 0; i--) {
+      if (envs[i].contains(name)) {
+        return constants[i].contains(name);
+      }
+    }
+    return false;
+  }
 };
 
 #endif //TYPE_INFERENCE_H
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "runtime/value.h"
+
+// A function in static single assignment form, the representation between the
+// type-annotated AST and stack bytecode. IRBuilder builds it from a function's
+// AST, the passes of an IRPassManager optimize it and lowerToChunk turns it
+// into a Chunk.
+//
+// Every instruction defines one value, named by the instruction's index into
+// IRFunction::values. A block runs its instructions in order, phis first, and
+// ends in a terminator. A phi merges the values a variable has in each of the
+// block's predecessors, with one operand per predecessor in the order of
+// IRBlock::predecessors.
+//
+// There are no critical edges: a block that branches to two successors is
+// the only predecessor of each, so values for phis are always passed along a
+// Jump.
+using IRValueId = uint32_t;
+using IRBlockId = uint32_t;
+
+// What a value holds at runtime, which picks the type-specialized opcodes
+// when lowering.
+enum class IRType {
+  Nil,
+  Int,
+  Double,
+  Bool,
+  Object,  // functions, classes and instances
+};
+
+enum class IROp {
+  Param,  // immediate: stack slot of the parameter
+  Const,  // immediate: index into IRFunction::constants
+  Nil,
+  True,
+  False,
+  Copy,         // operand: the value copied
+  Phi,          // operands: the value coming from each predecessor
+  GlobalLoad,   // immediate: index of global
+  GlobalStore,  // immediate: index of global; operand: the value stored
+  Call,         // operands: the callee, then the arguments
+
+  Add,
+  Sub,
+  Mul,
+  Div,
+  Mod,
+  Neg,
+  Eq,
+  Neq,
+  Lt,
+  Lte,
+  Gt,
+  Gte,
+  Not,
+};
+
+struct IRInstruction {
+  IROp op;
+  IRType type;
+  std::vector<IRValueId> operands;
+  uint32_t immediate = 0;
+  IRBlockId block = 0;
+  bool removed = false;  // set by passes, removed from its block's list too
+};
+
+enum class IRTerminatorKind {
+  None,  // the block is still being built
+  Jump,
+  Branch,
+  Return,
+};
+
+struct IRTerminator {
+  IRTerminatorKind kind = IRTerminatorKind::None;
+  IRValueId value = 0;        // condition of a Branch, result of a Return
+  IRBlockId target = 0;       // where a Jump goes, or a Branch if true
+  IRBlockId otherTarget = 0;  // where a Branch goes if false
+};
+
+struct IRBlock {
+  std::vector<IRValueId> instructions;
+  std::vector<IRBlockId> predecessors;
+  IRTerminator terminator;
+
+  std::vector<IRBlockId> successors() const {
+    switch (terminator.kind) {
+      case IRTerminatorKind::Jump:
+        return {terminator.target};
+      case IRTerminatorKind::Branch:
+        return {terminator.target, terminator.otherTarget};
+      default:
+        return {};
+    }
+  }
+};
+
+struct IRFunction {
+  std::vector<IRInstruction> values;
+  std::vector<IRBlock> blocks;  // block 0 is the entry
+  std::vector<Value> constants;
+  int paramCount = 0;
+
+  IRBlockId addBlock() {
+    blocks.emplace_back();
+    return blocks.size() - 1;
+  }
+
+  IRValueId append(IRBlockId block, IRInstruction instruction) {
+    instruction.block = block;
+    values.push_back(std::move(instruction));
+    IRValueId id = values.size() - 1;
+    blocks[block].instructions.push_back(id);
+    return id;
+  }
+
+  // Phis go before the other instructions of their block.
+  IRValueId prependPhi(IRBlockId block, IRType type) {
+    values.push_back({IROp::Phi, type, {}, 0, block});
+    IRValueId id = values.size() - 1;
+    auto& instructions = blocks[block].instructions;
+    auto it = instructions.begin();
+    while (it != instructions.end() && values[*it].op == IROp::Phi) {
+      it++;
+    }
+    instructions.insert(it, id);
+    return id;
+  }
+
+  // Makes every operand and terminator referring to one value refer to
+  // another instead.
+  void replaceAllUses(IRValueId from, IRValueId to) {
+    for (auto& instruction : values) {
+      if (instruction.removed) {
+        continue;
+      }
+      for (auto& operand : instruction.operands) {
+        if (operand == from) {
+          operand = to;
+        }
+      }
+    }
+    for (auto& block : blocks) {
+      if (block.terminator.kind == IRTerminatorKind::Branch ||
+          block.terminator.kind == IRTerminatorKind::Return) {
+        if (block.terminator.value == from) {
+          block.terminator.value = to;
+        }
+      }
+    }
+  }
+
+  // Marks an instruction removed and takes it out of its block.
+  void remove(IRValueId id) {
+    values[id].removed = true;
+    auto& instructions = blocks[values[id].block].instructions;
+    std::erase(instructions, id);
+  }
+
+  // How many operands and terminators refer to each value.
+  std::vector<size_t> useCounts() const {
+    std::vector<size_t> counts(values.size(), 0);
+    for (auto& instruction : values) {
+      if (instruction.removed) {
+        continue;
+      }
+      for (auto operand : instruction.operands) {
+        counts[operand]++;
+      }
+    }
+    for (auto& block : blocks) {
+      if (block.terminator.kind == IRTerminatorKind::Branch ||
+          block.terminator.kind == IRTerminatorKind::Return) {
+        counts[block.terminator.value]++;
+      }
+    }
+    return counts;
+  }
+
+  size_t instructionCount() const {
+    size_t count = 0;
+    for (auto& block : blocks) {
+      count += block.instructions.size();
+    }
+    return count;
+  }
+};
+
+// Whether running the instruction does something besides computing its
+// value, so it has to run even if the value is never used.
+inline bool hasSideEffects(const IRInstruction& instruction) {
+  switch (instruction.op) {
+    case IROp::GlobalStore:
+    case IROp::Call:
+      return true;
+    // integer arithmetic raises errors on overflow and division by zero
+    case IROp::Add:
+    case IROp::Sub:
+    case IROp::Mul:
+    case IROp::Div:
+    case IROp::Mod:
+    case IROp::Neg:
+      return instruction.type == IRType::Int;
+    default:
+      return false;
+  }
+}
@@ -1,4 +1,5 @@
 #include <argparse/argparse.hpp>
+#include <filesystem>
 
 #include "shiny.h"
 
@@ -8,10 +9,64 @@ int main(int argc, char** argv) {
       .help("include output helpful for debugging")
       .default_value(false)
       .implicit_value(true);
+  program.add_argument("--engine")
+      .help("execution engine to run on: stack or register")
+      .default_value(std::string("stack"))
+      .choices("stack", "register");
+  program.add_argument("--stack-size")
+      .help("number of values the stack engine's stack can hold")
+      .default_value(Shiny::Options().stackSize)
+      .scan<'u', size_t>();
+  program.add_argument("--jit")
+      .help("compile hot functions to machine code (stack engine, x86-64)")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--jit-threshold")
+      .help("number of calls or loop iterations after which the JIT compiles "
+            "a function")
+      .default_value(Shiny::Options().jitThreshold)
+      .scan<'u', uint32_t>();
+  program.add_argument("--no-peephole")
+      .help("skip the peephole pass over the stack engine's bytecode")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--no-inline")
+      .help("call small functions and methods instead of inlining them")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--ssa")
+      .help("compile functions through the SSA IR and its passes when possible")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--profile")
+      .help("sample the stack engine's call stacks and write them to this file "
+            "as collapsed stacks for flamegraph tools (turns off --jit)");
+  program.add_argument("--opcode-stats")
+      .help("print how often each opcode, opcode pair and function ran, and "
+            "the time per opcode class, to stderr (turns off --jit)")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--opcode-stats-json")
+      .help("write the opcode statistics to this file as JSON (turns off "
+            "--jit)");
+  program.add_argument("--object-stats")
+      .help("print how many objects of each kind are still alive after the "
+            "run, and the memory they are allocated from, to stderr")
+      .default_value(false)
+      .implicit_value(true);
   program.add_argument("file")
-      .help("shiny file")
+      .help("shiny file, or a .shinyc file written by `shiny compile`")
       .nargs(argparse::nargs_pattern::optional);
 
+  argparse::ArgumentParser compileCommand("compile");
+  compileCommand.add_description(
+      "compile a shiny file to stack engine bytecode without running it");
+  compileCommand.add_argument("file").help("shiny file");
+  compileCommand.add_argument("-o", "--output")
+      .help("bytecode file to write, the input with a .shinyc extension by "
+            "default");
+  program.add_subparser(compileCommand);
+
   try {
     program.parse_args(argc, argv);
   } catch (const std::exception& err) {
@@ -20,11 +75,41 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  Shiny::Options options;
+  options.verbose = program.get<bool>("verbose");
+  options.stackSize = program.get<size_t>("stack-size");
+  options.jit = program.get<bool>("jit");
+  options.jitThreshold = program.get<uint32_t>("jit-threshold");
+  options.peephole = !program.get<bool>("no-peephole");
+  options.ssa = program.get<bool>("ssa");
+  options.inlining = !program.get<bool>("no-inline");
+  if (program.present("profile")) {
+    options.profile = program.get<std::string>("profile");
+  }
+  options.opcodeStats = program.get<bool>("opcode-stats");
+  if (program.present("opcode-stats-json")) {
+    options.opcodeStatsJson = program.get<std::string>("opcode-stats-json");
+  }
+  options.objectStats = program.get<bool>("object-stats");
+  if (program.get<std::string>("engine") == "register") {
+    options.engine = Shiny::Engine::Register;
+  }
+
+  if (program.is_subcommand_used(compileCommand)) {
+    auto file = compileCommand.get<std::string>("file");
+    std::string output;
+    if (compileCommand.present("output")) {
+      output = compileCommand.get<std::string>("output");
+    } else {
+      output = std::filesystem::path(file).replace_extension(".shinyc");
+    }
+    return Shiny::compileFile(file, output, options) ? 0 : 1;
+  }
+
   if (program.present("file")) {
-    Shiny::runFile(program.get<std::string>("file"),
-                   program.get<bool>("verbose"));
+    Shiny::runFile(program.get<std::string>("file"), options);
   } else {
-    Shiny::repl(program.get<bool>("verbose"));
+    Shiny::repl(options);
   }
   return 0;
 }
\ No newline at end of file
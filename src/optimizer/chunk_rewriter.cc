@@ -0,0 +1,160 @@
+#include "chunk_rewriter.h"
+
+#include <stdexcept>
+
+ChunkRewriter::ChunkRewriter(Chunk& chunk) : chunk(chunk) {
+  // Map word offsets to instruction indices first, so jump targets can be
+  // translated in a second pass
+  indexOfOffset.assign(chunk.instructions.size() + 1, 0);
+  for (size_t offset = 0; offset < chunk.instructions.size();) {
+    indexOfOffset[offset] = instructions.size();
+    Instruction instruction = chunk.instructions[offset];
+    Opcode opcode = static_cast<Opcode>(instruction & 0xFF);
+    instructions.push_back({opcode, instruction >> 8});
+    offset += instructionWidth(opcode);
+  }
+  indexOfOffset[chunk.instructions.size()] = instructions.size();
+
+  size_t offset = 0;
+  for (auto& instruction : instructions) {
+    if (isJump(instruction.opcode)) {
+      uint32_t targetOffset = instructionWidth(instruction.opcode) == 2
+                                  ? chunk.instructions[offset + 1]
+                                  : instruction.operand;
+      instruction.target = indexOfOffset.at(targetOffset);
+    }
+    offset += instructionWidth(instruction.opcode);
+  }
+  refreshJumpTargets();
+}
+
+void ChunkRewriter::refreshJumpTargets() {
+  jumpTargets.assign(instructions.size() + 1, false);
+  for (auto& instruction : instructions) {
+    if (instruction.removed) {
+      continue;
+    }
+    if (isJump(instruction.opcode)) {
+      jumpTargets[nextKept(instruction.target)] = true;
+    }
+  }
+}
+
+size_t ChunkRewriter::nextKept(size_t index) const {
+  while (index < instructions.size() && instructions[index].removed) {
+    index++;
+  }
+  return index;
+}
+
+bool ChunkRewriter::isJumpTarget(size_t index) const {
+  return jumpTargets[index];
+}
+
+bool ChunkRewriter::matches(size_t index,
+                            const std::vector<Opcode>& sequence) const {
+  if (index + sequence.size() > instructions.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < sequence.size(); i++) {
+    auto& instruction = instructions[index + i];
+    if (instruction.removed || instruction.opcode != sequence[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ChunkRewriter::isFusable(size_t index, size_t length) const {
+  for (size_t i = index + 1; i < index + length; i++) {
+    if (jumpTargets[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void ChunkRewriter::fuse(size_t index, size_t length,
+                         DecodedInstruction replacement) {
+  instructions[index] = replacement;
+  for (size_t i = index + 1; i < index + length; i++) {
+    instructions[i].removed = true;
+  }
+}
+
+void ChunkRewriter::remove(size_t index, size_t length) {
+  for (size_t i = index; i < index + length; i++) {
+    instructions[i].removed = true;
+  }
+}
+
+void ChunkRewriter::commit() {
+  // Compute the new offset of every instruction, removed ones get the offset
+  // of the next instruction that is kept
+  std::vector<uint32_t> newOffsets(instructions.size() + 1);
+  uint32_t offset = 0;
+  for (size_t i = 0; i < instructions.size(); i++) {
+    newOffsets[i] = offset;
+    if (!instructions[i].removed) {
+      offset += instructionWidth(instructions[i].opcode);
+    }
+  }
+  newOffsets[instructions.size()] = offset;
+
+  constexpr uint32_t MAX_OPERAND = 0xFFFFFF;
+  std::vector<Instruction> encoded;
+  encoded.reserve(offset);
+  for (auto& instruction : instructions) {
+    if (instruction.removed) {
+      continue;
+    }
+    uint32_t operand = instruction.operand;
+    uint32_t target = isJump(instruction.opcode)
+                          ? newOffsets.at(instruction.target)
+                          : 0;
+    bool isWide = instructionWidth(instruction.opcode) == 2;
+    if (isJump(instruction.opcode) && !isWide) {
+      operand = target;
+    }
+    if (operand > MAX_OPERAND) {
+      throw std::runtime_error("Operand exceeds 24-bit limit");
+    }
+    encoded.push_back(static_cast<uint32_t>(instruction.opcode) |
+                      (operand << 8));
+    if (isWide) {
+      encoded.push_back(target);
+    }
+  }
+  chunk.instructions = std::move(encoded);
+
+  std::vector<uint32_t> lineOffsets(indexOfOffset.size());
+  for (size_t i = 0; i < indexOfOffset.size(); i++) {
+    lineOffsets[i] = newOffsets[indexOfOffset[i]];
+  }
+  chunk.remapLines(lineOffsets);
+}
+
+bool ChunkRewriter::isJump(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::JUMP:
+    case Opcode::JUMP_IF_FALSE:
+    case Opcode::JUMP_IF_TRUE:
+    case Opcode::LOOP:
+    case Opcode::FOR_RANGE:
+    case Opcode::JUMP_UNLESS_LT_INT:
+    case Opcode::JUMP_UNLESS_LTE_INT:
+    case Opcode::JUMP_UNLESS_GT_INT:
+    case Opcode::JUMP_UNLESS_GTE_INT:
+    case Opcode::JUMP_UNLESS_EQ_INT:
+    case Opcode::JUMP_UNLESS_NEQ_INT:
+    case Opcode::JUMP_UNLESS_LT_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_LTE_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_GT_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_GTE_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_EQ_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_NEQ_LOCAL_CONST:
+      return true;
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "../bytecode.h"
+
+// An instruction of a decoded Chunk. Jump targets are kept as indices into the
+// decoded instructions rather than word offsets, so passes can fuse and
+// remove instructions without having to patch every jump themselves.
+struct DecodedInstruction {
+  Opcode opcode;
+  uint32_t operand = 0;
+  size_t target = 0;  // only meaningful if the opcode jumps
+  bool removed = false;
+};
+
+// Decodes a Chunk for rewriting and encodes it back once the rewrite is done.
+class ChunkRewriter {
+ public:
+  explicit ChunkRewriter(Chunk& chunk);
+
+  std::vector<DecodedInstruction>& getInstructions() { return instructions; }
+
+  // Whether the instruction at the given index can be reached by anything
+  // other than falling through from the instruction before it. Instructions
+  // that are jump targets cannot be fused into the instruction before them.
+  bool isJumpTarget(size_t index) const;
+
+  // Whether the instructions starting at the given index have exactly the
+  // opcodes of the sequence.
+  bool matches(size_t index, const std::vector<Opcode>& sequence) const;
+
+  // Whether none of the instructions after the first in the given window are
+  // jump targets, meaning the whole window may be fused into one instruction.
+  bool isFusable(size_t index, size_t length) const;
+
+  // Replaces the window starting at the given index with a single
+  // instruction.
+  void fuse(size_t index, size_t length, DecodedInstruction replacement);
+
+  // Removes the instructions of the window starting at the given index.
+  // Jumps to them land on the next instruction that is kept.
+  void remove(size_t index, size_t length);
+
+  // Recomputes which instructions are jump targets after a pass changed the
+  // targets of jumps or removed instructions.
+  void refreshJumpTargets();
+
+  // Index of the first instruction at or after the given index that has not
+  // been removed, or the number of instructions if there is none.
+  size_t nextKept(size_t index) const;
+
+  // Re-encodes the remaining instructions into the chunk. Jumps to removed
+  // instructions land on the next instruction that was kept, and so do the
+  // lines of the chunk.
+  void commit();
+
+  static bool isJump(Opcode opcode);
+
+ private:
+  Chunk& chunk;
+  std::vector<DecodedInstruction> instructions;
+  std::vector<bool> jumpTargets;
+  // index of the instruction at each word offset of the original chunk
+  std::vector<size_t> indexOfOffset;
+};
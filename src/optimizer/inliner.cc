@@ -0,0 +1,415 @@
+#include "inliner.h"
+
+#include <sstream>
+
+#include "chunk_rewriter.h"
+#include "stack_depth.h"
+
+namespace {
+
+// Whether the opcode reads or writes nothing but the stack of its frame,
+// globals and objects, and does not depend on where its frame's base is.
+bool isInlinable(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::UPVALUE_LOAD:
+    case Opcode::UPVALUE_STORE:
+    case Opcode::UPVALUE_CLOSE:
+    case Opcode::PARENT_LOAD:
+    case Opcode::PARENT_STORE:
+    case Opcode::CLOSURE:
+    case Opcode::CLASS:
+    case Opcode::HALT:
+      return false;
+    default:
+      // superinstructions pack slots and constants into their operands and
+      // are never in a chunk that has not been fused yet
+      return static_cast<uint8_t>(opcode) <
+             static_cast<uint8_t>(Opcode::JUMP_UNLESS_LT_LOCAL_CONST);
+  }
+}
+
+// Whether the opcode pushes one value without any other effect, so pushing it
+// again gives the same value as long as only slots above it were written.
+bool isPurePush(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::NIL:
+    case Opcode::TRUE:
+    case Opcode::FALSE:
+    case Opcode::CONST:
+    case Opcode::LOAD:
+      return true;
+    default:
+      return false;
+  }
+}
+
+Instruction encode(Opcode opcode, uint32_t operand = 0) {
+  return static_cast<uint32_t>(opcode) | (operand << 8);
+}
+
+class Inliner {
+ public:
+  Inliner(Chunk& chunk, const std::vector<InlineSite>& sites, int entryDepth,
+          const InlinerOptions& options)
+      : chunk(chunk),
+        sites(sites),
+        options(options),
+        depths(stackDepths(chunk, entryDepth)),
+        siteAt(chunk.instructions.size(), nullptr),
+        unusedLoad(chunk.instructions.size(), false),
+        dropped(chunk.instructions.size(), false),
+        forwarded(chunk.instructions.size(), false),
+        captured(capturedSlots(chunk)) {}
+
+  InlinerStats run() {
+    stats.wordsBefore = chunk.instructions.size();
+    for (auto instruction : chunk.instructions) {
+      if (instructionWidth(static_cast<Opcode>(instruction & 0xFF)) != 1) {
+        stats.wordsAfter = stats.wordsBefore;
+        return stats;
+      }
+    }
+
+    pickSites();
+    if (stats.inlined > 0) {
+      rewrite();
+    }
+    stats.wordsAfter = chunk.instructions.size();
+    return stats;
+  }
+
+ private:
+  Chunk& chunk;
+  const std::vector<InlineSite>& sites;
+  const InlinerOptions& options;
+  std::vector<int> depths;
+  std::vector<const InlineSite*> siteAt;
+  std::vector<bool> unusedLoad;
+  // pushes of callees and arguments the inlined bodies read from where they
+  // were pushed from instead
+  std::vector<bool> dropped;
+  std::vector<bool> forwarded;  // calls whose arguments are dropped
+  // slots of the frame that closures made by the chunk capture, and that
+  // calling them can therefore write
+  std::vector<bool> captured;
+  InlinerStats stats;
+
+  std::vector<Instruction> rewritten;
+
+  static bool isReturn(Opcode opcode) {
+    return opcode == Opcode::RETURN || opcode == Opcode::TAIL_CALL;
+  }
+
+  Opcode opcodeAt(size_t offset) const {
+    return static_cast<Opcode>(chunk.instructions[offset] & 0xFF);
+  }
+
+  // How many values below the result a return of the body leaves, when the
+  // first unpushed slots of its frame are not on the stack.
+  static int belowResult(const InlineBody& body, size_t index, int unpushed) {
+    auto opcode = static_cast<Opcode>(body.instructions[index] & 0xFF);
+    int depth = body.depths[index] - unpushed;
+    if (opcode == Opcode::TAIL_CALL) {
+      depth -= body.instructions[index] >> 8;
+    }
+    return depth - 1;
+  }
+
+  // Where each instruction of the body goes once inlined: every return is
+  // replaced by a SLIDE unless the result is already the only value left, a
+  // TAIL_CALL by a CALL first, and all but a last one jump past the rest.
+  // Inlined in place of a TAIL_CALL, the returns of the body return from
+  // the caller instead and stay as they are.
+  static std::vector<size_t> bodyOffsets(const InlineBody& body, int unpushed,
+                                         bool tail) {
+    std::vector<size_t> offsets(body.instructions.size() + 1, 0);
+    for (size_t i = 0; i < body.instructions.size(); i++) {
+      auto opcode = static_cast<Opcode>(body.instructions[i] & 0xFF);
+      size_t width = 1;
+      if (isReturn(opcode) && !tail) {
+        width = opcode == Opcode::TAIL_CALL ? 1 : 0;
+        if (belowResult(body, i, unpushed) > 0) {
+          width++;
+        }
+        if (i + 1 < body.instructions.size()) {
+          width++;
+        }
+      }
+      offsets[i + 1] = offsets[i] + width;
+    }
+    return offsets;
+  }
+
+  static std::vector<bool> capturedSlots(const Chunk& chunk) {
+    std::vector<bool> captured;
+    auto capture = [&](const FunctionObject& function) {
+      for (const Upvalue& upvalue : function.getUpvalues()) {
+        if (upvalue.isLocal) {
+          if (captured.size() <= static_cast<size_t>(upvalue.index)) {
+            captured.resize(upvalue.index + 1, false);
+          }
+          captured[upvalue.index] = true;
+        }
+      }
+    };
+    for (auto instruction : chunk.instructions) {
+      auto opcode = static_cast<Opcode>(instruction & 0xFF);
+      uint32_t operand = instruction >> 8;
+      if (opcode == Opcode::CLOSURE) {
+        capture(*chunk.constants[operand].asObject<FunctionObject>().get());
+      } else if (opcode == Opcode::CLASS) {
+        auto klass = chunk.constants[operand].asObject<ClassObject>();
+        const auto& members = klass->getMembers();
+        for (size_t i = klass->getFieldCount(); i < members.size(); i++) {
+          capture(*members[i].asObject<FunctionObject>().get());
+        }
+      }
+    }
+    return captured;
+  }
+
+  bool isCaptured(uint32_t slot) const {
+    return slot < captured.size() && captured[slot];
+  }
+
+  int argCountAt(size_t call) const {
+    uint32_t operand = chunk.instructions[call] >> 8;
+    return opcodeAt(call) == Opcode::INVOKE ? operandLow(operand) : operand;
+  }
+
+  // Whether the callee (or instance) and the arguments of the call are each
+  // pushed by a single pure push, which the body can repeat wherever it
+  // reads them. The frame of the body then starts right above where they
+  // would have been, and only has its own locals. A repeated LOAD reads the
+  // slot as it is then, so nothing the body runs may write the slot: the body
+  // makes no calls, and no closure captures the slot.
+  bool forwardsArguments(const InlineSite& site) const {
+    auto& body = *site.body;
+    int argCount = argCountAt(site.call);
+    if (site.call < static_cast<size_t>(argCount) + 1) {
+      return false;
+    }
+    size_t first = site.call - argCount - 1;
+    for (size_t offset = first; offset < site.call; offset++) {
+      if (depths[offset] != depths[first] + static_cast<int>(offset - first) ||
+          !(isPurePush(opcodeAt(offset)) ||
+            (offset == first && site.calleeLoad.has_value() &&
+             opcodeAt(offset) == Opcode::GLOBAL_LOAD)) ||
+          (opcodeAt(offset) == Opcode::LOAD &&
+           isCaptured(chunk.instructions[offset] >> 8))) {
+        return false;
+      }
+    }
+    if (site.calleeLoad.has_value() && site.calleeLoad.value() != first) {
+      return false;
+    }
+
+    for (auto instruction : body.instructions) {
+      auto opcode = static_cast<Opcode>(instruction & 0xFF);
+      uint32_t slot = instruction >> 8;
+      if (opcode == Opcode::STORE && slot <= static_cast<uint32_t>(argCount)) {
+        return false;
+      }
+      if (opcode == Opcode::CALL || opcode == Opcode::INVOKE ||
+          opcode == Opcode::TAIL_CALL) {
+        return false;
+      }
+      // the callee of a function is never read, and only pushed for the
+      // frame
+      if (opcode == Opcode::LOAD && slot == 0 && site.calleeLoad.has_value()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t budgetFor(const InlineBody& body) const {
+    if (body.function.has_value() &&
+        body.function.value()->getJitState().callCount >=
+            options.hotCallCount) {
+      return options.hotBudget;
+    }
+    return options.budget;
+  }
+
+  void pickSites() {
+    size_t growth = 0;
+    for (auto& site : sites) {
+      auto& body = *site.body;
+      if (depths[site.call] == -1) {
+        continue;  // unreachable
+      }
+      size_t size =
+          bodyOffsets(body, 0, opcodeAt(site.call) == Opcode::TAIL_CALL)
+              .back();
+      if (body.instructions.size() > budgetFor(body) ||
+          growth + size > options.maxGrowth) {
+        stats.overBudget++;
+        continue;
+      }
+
+      growth += size;
+      siteAt[site.call] = &site;
+      if (forwardsArguments(site)) {
+        forwarded[site.call] = true;
+        for (int i = 0; i <= argCountAt(site.call); i++) {
+          dropped[site.call - i - 1] = true;
+        }
+      } else if (site.calleeLoad.has_value()) {
+        unusedLoad[site.calleeLoad.value()] = true;
+      }
+      stats.inlined++;
+    }
+  }
+
+  void rewrite() {
+    std::vector<size_t> offsets(chunk.instructions.size() + 1, 0);
+    std::vector<size_t> jumps;  // jumps of the caller, still to be patched
+    for (size_t offset = 0; offset < chunk.instructions.size(); offset++) {
+      offsets[offset] = rewritten.size();
+      Instruction instruction = chunk.instructions[offset];
+      if (dropped[offset]) {
+        continue;
+      } else if (unusedLoad[offset]) {
+        // the slot of the callee stays, but is never read
+        rewritten.push_back(encode(Opcode::NIL));
+      } else if (siteAt[offset] != nullptr) {
+        inlineBody(*siteAt[offset], offset);
+      } else {
+        if (ChunkRewriter::isJump(opcodeAt(offset))) {
+          jumps.push_back(rewritten.size());
+        }
+        rewritten.push_back(instruction);
+      }
+    }
+    offsets[chunk.instructions.size()] = rewritten.size();
+
+    for (auto jump : jumps) {
+      rewritten[jump] = encode(static_cast<Opcode>(rewritten[jump] & 0xFF),
+                               offsets[rewritten[jump] >> 8]);
+    }
+    chunk.instructions = std::move(rewritten);
+    chunk.remapLines(offsets);
+  }
+
+  void inlineBody(const InlineSite& site, size_t call) {
+    auto& body = *site.body;
+    int argCount = argCountAt(call);
+    // the slot of the callee, or of the instance for a method, becomes
+    // slot 0 of the body
+    uint32_t base = depths[call] - argCount - 1;
+    // the callee and arguments are either all on the stack or all read from
+    // where they were pushed from
+    size_t firstArgument = call - argCount - 1;
+    int unpushed = forwarded[call] ? argCount + 1 : 0;
+    // the compiler turns a call in tail position into a TAIL_CALL
+    bool tail = opcodeAt(call) == Opcode::TAIL_CALL;
+
+    auto offsets = bodyOffsets(body, unpushed, tail);
+    size_t start = rewritten.size();
+    size_t end = start + offsets.back();
+    std::vector<std::optional<uint32_t>> constants(body.constants.size());
+
+    for (size_t i = 0; i < body.instructions.size(); i++) {
+      auto opcode = static_cast<Opcode>(body.instructions[i] & 0xFF);
+      uint32_t operand = body.instructions[i] >> 8;
+      switch (opcode) {
+        case Opcode::LOAD:
+        case Opcode::STORE:
+          if (operand < static_cast<uint32_t>(unpushed)) {
+            // only LOADs, the arguments are never stored to then
+            rewritten.push_back(chunk.instructions[firstArgument + operand]);
+          } else {
+            rewritten.push_back(encode(opcode, base + operand - unpushed));
+          }
+          break;
+        case Opcode::CONST:
+          if (!constants[operand].has_value()) {
+            constants[operand] = chunk.constants.size();
+            chunk.constants.push_back(body.constants[operand]);
+          }
+          rewritten.push_back(encode(opcode, constants[operand].value()));
+          break;
+        case Opcode::JUMP:
+        case Opcode::JUMP_IF_FALSE:
+        case Opcode::JUMP_IF_TRUE:
+        case Opcode::LOOP:
+        case Opcode::FOR_RANGE:
+          rewritten.push_back(encode(opcode, start + offsets[operand]));
+          break;
+        case Opcode::RETURN:
+        case Opcode::TAIL_CALL: {
+          if (tail) {
+            rewritten.push_back(body.instructions[i]);
+            break;
+          }
+          // the result ends up in the slot of the callee, with everything
+          // the body left below it popped
+          if (opcode == Opcode::TAIL_CALL) {
+            rewritten.push_back(encode(Opcode::CALL, operand));
+          }
+          int below = belowResult(body, i, unpushed);
+          if (below > 0) {
+            rewritten.push_back(encode(Opcode::SLIDE, below));
+          }
+          if (i + 1 < body.instructions.size()) {
+            rewritten.push_back(encode(Opcode::JUMP, end));
+          }
+          break;
+        }
+        default:
+          rewritten.push_back(body.instructions[i]);
+          break;
+      }
+    }
+  }
+};
+
+}  // namespace
+
+std::shared_ptr<InlineBody> InlineBody::of(const Chunk& chunk, int arity,
+                                           size_t maxSize) {
+  if (chunk.instructions.size() > maxSize) {
+    return nullptr;
+  }
+  for (auto instruction : chunk.instructions) {
+    if (!isInlinable(static_cast<Opcode>(instruction & 0xFF))) {
+      return nullptr;
+    }
+  }
+  // functions declared inside may read the frame of this one from below
+  // theirs, which inlining would move
+  for (auto& constant : chunk.constants) {
+    if (constant.isObject<ClosureObject>() ||
+        constant.isObject<FunctionObject>()) {
+      return nullptr;
+    }
+  }
+
+  auto body = std::make_shared<InlineBody>();
+  body->instructions = chunk.instructions;
+  body->constants = chunk.constants;
+  body->depths = stackDepths(chunk, arity + 1);
+  for (size_t i = 0; i < body->instructions.size(); i++) {
+    auto opcode = static_cast<Opcode>(body->instructions[i] & 0xFF);
+    // returns are replaced according to their depth
+    if ((opcode == Opcode::RETURN || opcode == Opcode::TAIL_CALL) &&
+        body->depths[i] == -1) {
+      return nullptr;
+    }
+  }
+  return body;
+}
+
+std::string InlinerStats::toString() const {
+  std::stringstream ss;
+  ss << "inlined: " << inlined << "\n";
+  ss << "over-budget: " << overBudget << "\n";
+  ss << "words: " << wordsBefore << " -> " << wordsAfter << "\n";
+  return ss.str();
+}
+
+InlinerStats inlineCalls(Chunk& chunk, const std::vector<InlineSite>& sites,
+                         int entryDepth, const InlinerOptions& options) {
+  return Inliner(chunk, sites, entryDepth, options).run();
+}
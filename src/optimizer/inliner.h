@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "../bytecode.h"
+#include "../runtime/object.h"
+
+// The bytecode of a function as it is before superinstructions are fused,
+// kept so calls to the function can be replaced with it. Only functions that
+// touch nothing but their own frame, globals and objects have one: no
+// upvalues, closures or locals of enclosing frames.
+struct InlineBody {
+  std::vector<Instruction> instructions;
+  std::vector<Value> constants;
+  // the depth each instruction is reached with, counted from the callee
+  std::vector<int> depths;
+  // the function itself once it is created, whose call count tells how hot
+  // it has been in earlier runs
+  std::optional<ObjectPtr<FunctionObject>> function;
+
+  // The body of the chunk of a function taking arity arguments, or nullptr
+  // if it cannot be inlined or is larger than maxSize words.
+  static std::shared_ptr<InlineBody> of(const Chunk& chunk, int arity,
+                                        size_t maxSize);
+};
+
+// A call the compiler knows the callee of.
+struct InlineSite {
+  size_t call;  // offset of the CALL or INVOKE
+  // offset of the instruction loading the callee of a CALL, which inlining
+  // makes unused
+  std::optional<size_t> calleeLoad;
+  std::shared_ptr<const InlineBody> body;
+};
+
+struct InlinerOptions {
+  size_t budget = 16;  // largest body inlined, in words
+  // largest body inlined for a function that was called at least
+  // hotCallCount times, as counted by the JIT in earlier runs
+  size_t hotBudget = 48;
+  uint32_t hotCallCount = 1000;
+  size_t maxGrowth = 256;  // words inlining may add to a chunk
+};
+
+struct InlinerStats {
+  size_t inlined = 0;
+  size_t overBudget = 0;
+  size_t wordsBefore = 0;
+  size_t wordsAfter = 0;
+
+  std::string toString() const;
+};
+
+// Replaces the calls at the given sites of a chunk that has not been fused
+// into superinstructions yet with the bodies of their callees. The locals of
+// a body live in the caller's frame right where the callee and arguments
+// were, and its returns become a SLIDE of the result down to the callee's
+// slot followed by a jump past the body.
+InlinerStats inlineCalls(Chunk& chunk, const std::vector<InlineSite>& sites,
+                         int entryDepth, const InlinerOptions& options = {});
@@ -0,0 +1,459 @@
+#include "ir_lowering.h"
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+
+#include "ir_passes.h"
+
+namespace {
+
+// Whether the value is cheaper to load again at every use than to keep in a
+// slot.
+bool isRematerialized(IROp op) {
+  switch (op) {
+    case IROp::Param:
+    case IROp::Const:
+    case IROp::Nil:
+    case IROp::True:
+    case IROp::False:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether evaluating the instruction later than where it is in its block
+// could change what the program does, because it reads or writes globals,
+// calls a function or can raise.
+bool isPinned(const IRInstruction& instruction) {
+  return hasSideEffects(instruction) || instruction.op == IROp::GlobalLoad;
+}
+
+Opcode opcodeFor(IROp op, IRType operandType) {
+  auto pick = [operandType](Opcode intOpcode, Opcode doubleOpcode) {
+    switch (operandType) {
+      case IRType::Int:
+        return intOpcode;
+      case IRType::Double:
+        return doubleOpcode;
+      default:
+        throw std::runtime_error("Unexpected IRType");
+    }
+  };
+
+  switch (op) {
+    case IROp::Add:
+      return pick(Opcode::ADD_INT, Opcode::ADD_DOUBLE);
+    case IROp::Sub:
+      return pick(Opcode::SUB_INT, Opcode::SUB_DOUBLE);
+    case IROp::Mul:
+      return pick(Opcode::MUL_INT, Opcode::MUL_DOUBLE);
+    case IROp::Div:
+      return pick(Opcode::DIV_INT, Opcode::DIV_DOUBLE);
+    case IROp::Mod:
+      if (operandType != IRType::Int) {
+        throw std::runtime_error("Unexpected IRType");
+      }
+      return Opcode::MOD_INT;
+    case IROp::Neg:
+      return pick(Opcode::NEG_INT, Opcode::NEG_DOUBLE);
+    case IROp::Eq:
+      // bools are compared by their bits, which the generic opcode does
+      if (operandType == IRType::Bool) {
+        return Opcode::EQ;
+      }
+      return pick(Opcode::EQ_INT, Opcode::EQ_DOUBLE);
+    case IROp::Neq:
+      if (operandType == IRType::Bool) {
+        return Opcode::NEQ;
+      }
+      return pick(Opcode::NEQ_INT, Opcode::NEQ_DOUBLE);
+    case IROp::Lt:
+      return pick(Opcode::LT_INT, Opcode::LT_DOUBLE);
+    case IROp::Lte:
+      return pick(Opcode::LTE_INT, Opcode::LTE_DOUBLE);
+    case IROp::Gt:
+      return pick(Opcode::GT_INT, Opcode::GT_DOUBLE);
+    case IROp::Gte:
+      return pick(Opcode::GTE_INT, Opcode::GTE_DOUBLE);
+    case IROp::Not:
+      return Opcode::NOT;
+    default:
+      throw std::runtime_error("IROp has no opcode");
+  }
+}
+
+class Lowering {
+ public:
+  Lowering(const IRFunction& function, Chunk& chunk)
+      : function(function),
+        chunk(chunk),
+        uses(function.useCounts()),
+        onStack(function.values.size(), false),
+        slots(function.values.size(), NO_SLOT),
+        blockOffsets(function.blocks.size(), 0) {}
+
+  void run() {
+    auto order = reversePostorder(function);
+    for (auto block : order) {
+      findValuesOnStack(block);
+    }
+    assignSlots();
+
+    for (size_t i = 0; i < order.size(); i++) {
+      blockOffsets[order[i]] = chunk.instructions.size();
+      lowerBlock(order[i]);
+    }
+    for (auto [offset, block] : jumps) {
+      chunk.instructions[offset] |= static_cast<uint32_t>(blockOffsets[block])
+                                    << 8;
+    }
+  }
+
+ private:
+  static constexpr int NO_SLOT = -1;
+
+  const IRFunction& function;
+  Chunk& chunk;
+  std::vector<size_t> uses;
+  // values left on the stack for their only user instead of stored in a slot
+  std::vector<bool> onStack;
+  std::vector<int> slots;
+  int nextSlot = 0;
+  std::vector<size_t> blockOffsets;
+  std::vector<std::pair<size_t, IRBlockId>> jumps;  // to patch once placed
+
+  bool producesValue(const IRInstruction& instruction) const {
+    return instruction.op != IROp::GlobalStore;
+  }
+
+  // The instructions of the block that are emitted where they are, along
+  // with the values on the stack for them, in order.
+  std::vector<IRValueId> roots(IRBlockId block) const {
+    std::vector<IRValueId> roots;
+    for (auto id : function.blocks[block].instructions) {
+      auto& instruction = function.values[id];
+      if (instruction.op != IROp::Phi && !isRematerialized(instruction.op) &&
+          !onStack[id]) {
+        roots.push_back(id);
+      }
+    }
+    return roots;
+  }
+
+  // Picks the values of the block that stay on the stack for their user,
+  // starting with every value used once by a later instruction of the
+  // block.
+  void findValuesOnStack(IRBlockId block) {
+    auto& ir = function.blocks[block];
+    std::vector<size_t> position(function.values.size(), 0);
+    for (size_t i = 0; i < ir.instructions.size(); i++) {
+      position[ir.instructions[i]] = i;
+    }
+
+    auto candidate = [&](IRValueId operand, bool userIsPhi) {
+      auto& instruction = function.values[operand];
+      return uses[operand] == 1 && !userIsPhi && instruction.block == block &&
+             instruction.op != IROp::Phi &&
+             !isRematerialized(instruction.op) && producesValue(instruction);
+    };
+    for (auto id : ir.instructions) {
+      auto& instruction = function.values[id];
+      for (auto operand : instruction.operands) {
+        if (candidate(operand, instruction.op == IROp::Phi)) {
+          onStack[operand] = true;
+        }
+      }
+    }
+    std::optional<IRValueId> terminatorValue;
+    if (ir.terminator.kind == IRTerminatorKind::Branch ||
+        ir.terminator.kind == IRTerminatorKind::Return) {
+      terminatorValue = ir.terminator.value;
+      if (candidate(ir.terminator.value, false)) {
+        onStack[ir.terminator.value] = true;
+      }
+    }
+
+    while (true) {
+      // the order the pinned instructions are emitted in
+      std::vector<IRValueId> emitted;
+      std::function<void(IRValueId)> emit = [&](IRValueId id) {
+        auto& instruction = function.values[id];
+        for (auto operand : instruction.operands) {
+          if (onStack[operand]) {
+            emit(operand);
+          }
+        }
+        if (isPinned(instruction)) {
+          emitted.push_back(id);
+        }
+      };
+      for (auto root : roots(block)) {
+        emit(root);
+      }
+      if (terminatorValue.has_value() && onStack[terminatorValue.value()]) {
+        emit(terminatorValue.value());
+      }
+
+      // A value on the stack is evaluated where its user is, after the
+      // instructions in between. If that moves a pinned instruction past
+      // another one, it is evaluated where it is instead.
+      bool changed = false;
+      for (size_t i = 1; i < emitted.size(); i++) {
+        if (position[emitted[i]] < position[emitted[i - 1]] &&
+            onStack[emitted[i]]) {
+          onStack[emitted[i]] = false;
+          changed = true;
+          break;
+        }
+      }
+      if (!changed) {
+        return;
+      }
+    }
+  }
+
+  // Whether the block reads the value, including as the operand of a phi
+  // of the block it jumps to.
+  bool isUsedIn(IRValueId value, IRBlockId block) const {
+    auto& ir = function.blocks[block];
+    for (auto id : ir.instructions) {
+      auto& operands = function.values[id].operands;
+      if (std::find(operands.begin(), operands.end(), value) !=
+          operands.end()) {
+        return true;
+      }
+    }
+    switch (ir.terminator.kind) {
+      case IRTerminatorKind::Branch:
+      case IRTerminatorKind::Return:
+        return ir.terminator.value == value;
+      case IRTerminatorKind::Jump: {
+        auto& target = function.blocks[ir.terminator.target];
+        for (auto id : target.instructions) {
+          auto& operands = function.values[id].operands;
+          if (function.values[id].op == IROp::Phi &&
+              std::find(operands.begin(), operands.end(), value) !=
+                  operands.end()) {
+            return true;
+          }
+        }
+        return false;
+      }
+      default:
+        return false;
+    }
+  }
+
+  // For every value only passed to a phi along the jump ending its own
+  // block, that phi. The value is stored straight into the slot of the phi
+  // instead of copied there at the jump, which is safe unless the block
+  // still reads what the phi held before.
+  std::vector<std::optional<IRValueId>> findCoalescedPhis() const {
+    std::vector<std::optional<IRValueId>> phis(function.values.size());
+    for (IRBlockId block = 0; block < function.blocks.size(); block++) {
+      auto& ir = function.blocks[block];
+      for (auto phi : ir.instructions) {
+        if (function.values[phi].op != IROp::Phi) {
+          continue;
+        }
+        auto& operands = function.values[phi].operands;
+        for (size_t i = 0; i < operands.size(); i++) {
+          auto& value = function.values[operands[i]];
+          IRBlockId predecessor = ir.predecessors[i];
+          if (uses[operands[i]] == 1 && value.block == predecessor &&
+              !onStack[operands[i]] && !isRematerialized(value.op) &&
+              function.blocks[predecessor].terminator.kind ==
+                  IRTerminatorKind::Jump) {
+            phis[operands[i]] = phi;
+          }
+        }
+      }
+    }
+
+    // phis passed along to other phis share their slot too, so every phi of
+    // the chain has to be unused by the block
+    for (IRValueId id = 0; id < function.values.size(); id++) {
+      for (auto phi = phis[id]; phi.has_value(); phi = phis[phi.value()]) {
+        if (isUsedIn(phi.value(), function.values[id].block)) {
+          phis[id].reset();
+          break;
+        }
+      }
+    }
+    return phis;
+  }
+
+  void assignSlots() {
+    auto coalescedPhis = findCoalescedPhis();
+    std::function<int(IRValueId)> assign = [&](IRValueId id) {
+      if (slots[id] == NO_SLOT) {
+        slots[id] = coalescedPhis[id].has_value()
+                        ? assign(coalescedPhis[id].value())
+                        : nextSlot++;
+      }
+      return slots[id];
+    };
+
+    // slot 0 holds the function and the parameters come right after
+    nextSlot = function.paramCount + 1;
+    for (IRValueId id = 0; id < function.values.size(); id++) {
+      auto& instruction = function.values[id];
+      if (!instruction.removed && uses[id] > 0 && !onStack[id] &&
+          !isRematerialized(instruction.op)) {
+        assign(id);
+      }
+    }
+    if (nextSlot > 0xFFFFFF) {
+      throw std::runtime_error("Too many values in function");
+    }
+  }
+
+  void emit(Opcode opcode, uint32_t operand = 0) {
+    chunk.instructions.push_back(static_cast<uint32_t>(opcode) |
+                                 (operand << 8));
+  }
+
+  void emitJump(IRBlockId target, Opcode opcode = Opcode::JUMP) {
+    jumps.push_back({chunk.instructions.size(), target});
+    emit(opcode);
+  }
+
+  // Pushes the value, evaluating it first if it is on the stack for its
+  // user.
+  void push(IRValueId id) {
+    auto& instruction = function.values[id];
+    switch (instruction.op) {
+      case IROp::Param:
+        emit(Opcode::LOAD, instruction.immediate);
+        return;
+      case IROp::Const:
+        emit(Opcode::CONST, instruction.immediate);
+        return;
+      case IROp::Nil:
+        emit(Opcode::NIL);
+        return;
+      case IROp::True:
+        emit(Opcode::TRUE);
+        return;
+      case IROp::False:
+        emit(Opcode::FALSE);
+        return;
+      default:
+        break;
+    }
+    if (onStack[id]) {
+      evaluate(id);
+    } else {
+      emit(Opcode::LOAD, slots[id]);
+    }
+  }
+
+  // Emits the instruction with its operands, leaving its value on the stack.
+  void evaluate(IRValueId id) {
+    auto& instruction = function.values[id];
+    for (auto operand : instruction.operands) {
+      push(operand);
+    }
+
+    switch (instruction.op) {
+      case IROp::Copy:
+        break;
+      case IROp::GlobalLoad:
+        emit(Opcode::GLOBAL_LOAD, instruction.immediate);
+        break;
+      case IROp::GlobalStore:
+        emit(Opcode::GLOBAL_STORE, instruction.immediate);
+        break;
+      case IROp::Call:
+        emit(Opcode::CALL, instruction.operands.size() - 1);
+        break;
+      default: {
+        IRType operandType = function.values[instruction.operands[0]].type;
+        emit(opcodeFor(instruction.op, operandType));
+        break;
+      }
+    }
+  }
+
+  void lowerBlock(IRBlockId block) {
+    auto& ir = function.blocks[block];
+    if (block == 0) {
+      // make room for the slots
+      for (int i = function.paramCount + 1; i < nextSlot; i++) {
+        emit(Opcode::NIL);
+      }
+    }
+
+    for (auto id : roots(block)) {
+      auto& instruction = function.values[id];
+      evaluate(id);
+      if (!producesValue(instruction)) {
+        continue;
+      }
+      if (slots[id] != NO_SLOT) {
+        emit(Opcode::STORE, slots[id]);
+      } else {
+        emit(Opcode::POP);
+      }
+    }
+
+    auto& terminator = ir.terminator;
+    switch (terminator.kind) {
+      case IRTerminatorKind::Jump: {
+        // every phi of the target takes the value coming from this block,
+        // all read before any is written
+        auto& target = function.blocks[terminator.target];
+        size_t predecessor = 0;
+        while (target.predecessors[predecessor] != block) {
+          predecessor++;
+        }
+        std::vector<IRValueId> phis;
+        for (auto id : target.instructions) {
+          auto& phi = function.values[id];
+          if (phi.op == IROp::Phi && slots[id] != NO_SLOT &&
+              slots[phi.operands[predecessor]] != slots[id]) {
+            phis.push_back(id);
+            push(phi.operands[predecessor]);
+          }
+        }
+        for (auto it = phis.rbegin(); it != phis.rend(); it++) {
+          emit(Opcode::STORE, slots[*it]);
+        }
+        emitJump(terminator.target);
+        break;
+      }
+      case IRTerminatorKind::Branch:
+        // the true branch usually comes next, which makes its JUMP a jump
+        // to the next instruction the peephole pass removes
+        push(terminator.value);
+        emitJump(terminator.otherTarget, Opcode::JUMP_IF_FALSE);
+        emitJump(terminator.target);
+        break;
+      case IRTerminatorKind::Return: {
+        push(terminator.value);
+        auto& value = function.values[terminator.value];
+        if (value.op == IROp::Call && onStack[terminator.value]) {
+          // the call replaces this frame instead of returning through it
+          chunk.instructions.back() =
+              static_cast<uint32_t>(Opcode::TAIL_CALL) |
+              (chunk.instructions.back() & ~0xFFu);
+          break;
+        }
+        emit(Opcode::RETURN);
+        break;
+      }
+      case IRTerminatorKind::None:
+        throw std::runtime_error("IR block has no terminator");
+    }
+  }
+};
+
+}  // namespace
+
+void lowerToChunk(const IRFunction& function, Chunk& chunk) {
+  chunk.constants = function.constants;
+  Lowering(function, chunk).run();
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "../bytecode.h"
+#include "../ir.h"
+
+// Generates stack bytecode for the function into an empty chunk.
+//
+// A value used once, by an instruction of the same block, stays on the stack
+// for its user whenever that keeps calls, stores and instructions that can
+// raise in their order, so expressions come out the way the Compiler emits
+// them. Other values get a stack slot of their own above the parameters, and
+// phis are given their value by the predecessors before jumping. Constants
+// and parameters are loaded again wherever they are used.
+void lowerToChunk(const IRFunction& function, Chunk& chunk);
@@ -0,0 +1,294 @@
+#include "ir_passes.h"
+
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <tuple>
+
+std::vector<IRBlockId> reversePostorder(const IRFunction& function) {
+  std::vector<IRBlockId> postorder;
+  std::vector<bool> visited(function.blocks.size(), false);
+
+  // each entry is a block and how many of its successors were visited
+  std::vector<std::pair<IRBlockId, size_t>> stack = {{0, 0}};
+  visited[0] = true;
+  while (!stack.empty()) {
+    auto& [block, next] = stack.back();
+    auto successors = function.blocks[block].successors();
+    if (next < successors.size()) {
+      // the last successor visited comes first, so the target of a branch
+      // taken when its condition holds comes right after it
+      IRBlockId successor = successors[successors.size() - 1 - next++];
+      if (!visited[successor]) {
+        visited[successor] = true;
+        stack.push_back({successor, 0});
+      }
+      continue;
+    }
+    postorder.push_back(block);
+    stack.pop_back();
+  }
+
+  std::reverse(postorder.begin(), postorder.end());
+  return postorder;
+}
+
+std::vector<IRBlockId> immediateDominators(const IRFunction& function) {
+  // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+  IRBlockId none = function.blocks.size();
+  auto order = reversePostorder(function);
+  std::vector<size_t> position(function.blocks.size(), 0);
+  for (size_t i = 0; i < order.size(); i++) {
+    position[order[i]] = i;
+  }
+
+  std::vector<IRBlockId> idoms(function.blocks.size(), none);
+  idoms[0] = 0;
+  auto intersect = [&](IRBlockId a, IRBlockId b) {
+    while (a != b) {
+      while (position[a] > position[b]) {
+        a = idoms[a];
+      }
+      while (position[b] > position[a]) {
+        b = idoms[b];
+      }
+    }
+    return a;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < order.size(); i++) {
+      IRBlockId block = order[i];
+      IRBlockId idom = none;
+      for (auto predecessor : function.blocks[block].predecessors) {
+        if (idoms[predecessor] == none) {
+          continue;
+        }
+        idom = idom == none ? predecessor : intersect(predecessor, idom);
+      }
+      if (idoms[block] != idom) {
+        idoms[block] = idom;
+        changed = true;
+      }
+    }
+  }
+  return idoms;
+}
+
+size_t DeadCodeElimination::run(IRFunction& function) {
+  size_t removed = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    auto uses = function.useCounts();
+    for (IRValueId id = 0; id < function.values.size(); id++) {
+      auto& instruction = function.values[id];
+      if (instruction.removed || hasSideEffects(instruction)) {
+        continue;
+      }
+      size_t selfUses = std::count(instruction.operands.begin(),
+                                   instruction.operands.end(), id);
+      if (uses[id] == selfUses) {
+        for (auto operand : instruction.operands) {
+          uses[operand]--;
+        }
+        function.remove(id);
+        removed++;
+        changed = true;
+      }
+    }
+  }
+  return removed;
+}
+
+size_t CopyPropagation::run(IRFunction& function) {
+  size_t removed = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (IRValueId id = 0; id < function.values.size(); id++) {
+      auto& instruction = function.values[id];
+      if (instruction.removed) {
+        continue;
+      }
+
+      std::optional<IRValueId> source;
+      if (instruction.op == IROp::Copy) {
+        source = instruction.operands[0];
+      } else if (instruction.op == IROp::Phi) {
+        // a phi is trivial if all its operands but itself are one value
+        for (auto operand : instruction.operands) {
+          if (operand == id || operand == source) {
+            continue;
+          }
+          if (source.has_value()) {
+            source.reset();
+            break;
+          }
+          source = operand;
+        }
+      }
+
+      if (source.has_value()) {
+        function.replaceAllUses(id, source.value());
+        function.remove(id);
+        removed++;
+        changed = true;
+      }
+    }
+  }
+  return removed;
+}
+
+namespace {
+
+bool isCommutative(IROp op) {
+  switch (op) {
+    case IROp::Add:
+    case IROp::Mul:
+    case IROp::Eq:
+    case IROp::Neq:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether two instructions of this op with the same operands always compute
+// the same value. Integer arithmetic can raise, but only the first of two
+// equal instructions ever does.
+bool isNumberable(IROp op) {
+  switch (op) {
+    case IROp::Copy:
+    case IROp::Phi:
+    case IROp::GlobalLoad:
+    case IROp::GlobalStore:
+    case IROp::Call:
+      return false;
+    default:
+      return true;
+  }
+}
+
+using ValueKey =
+    std::tuple<IROp, IRType, uint32_t, std::vector<IRValueId>>;
+
+class ValueNumbering {
+ public:
+  explicit ValueNumbering(IRFunction& function) : function(function) {
+    auto idoms = immediateDominators(function);
+    children.resize(function.blocks.size());
+    for (IRBlockId block = 1; block < function.blocks.size(); block++) {
+      if (idoms[block] < function.blocks.size()) {
+        children[idoms[block]].push_back(block);
+      }
+    }
+  }
+
+  size_t run() {
+    visit(0);
+    return removed;
+  }
+
+ private:
+  IRFunction& function;
+  std::vector<std::vector<IRBlockId>> children;  // in the dominator tree
+  // the instructions available in the block being visited, which are those
+  // of the blocks dominating it
+  std::map<ValueKey, IRValueId> available;
+  size_t removed = 0;
+
+  // Walks the dominator tree, so every instruction is compared with those
+  // of the blocks dominating its own.
+  void visit(IRBlockId block) {
+    std::vector<ValueKey> added;
+    auto instructions = function.blocks[block].instructions;
+    for (auto id : instructions) {
+      auto& instruction = function.values[id];
+      if (!isNumberable(instruction.op)) {
+        continue;
+      }
+      auto operands = instruction.operands;
+      if (isCommutative(instruction.op)) {
+        std::sort(operands.begin(), operands.end());
+      }
+      ValueKey key = {instruction.op, instruction.type, instruction.immediate,
+                      operands};
+      if (auto it = available.find(key); it != available.end()) {
+        function.replaceAllUses(id, it->second);
+        function.remove(id);
+        removed++;
+      } else {
+        available[key] = id;
+        added.push_back(key);
+      }
+    }
+
+    for (auto child : children[block]) {
+      visit(child);
+    }
+    for (auto& key : added) {
+      available.erase(key);
+    }
+  }
+};
+
+}  // namespace
+
+size_t GlobalValueNumbering::run(IRFunction& function) {
+  return ValueNumbering(function).run();
+}
+
+size_t IRPassStats::total() const {
+  size_t total = 0;
+  for (auto& [name, count] : counts) {
+    total += count;
+  }
+  return total;
+}
+
+std::string IRPassStats::toString() const {
+  std::stringstream ss;
+  for (auto& [name, count] : counts) {
+    ss << name << ": " << count << "\n";
+  }
+  ss << "instructions: " << instructionsBefore << " -> " << instructionsAfter
+     << "\n";
+  return ss.str();
+}
+
+void IRPassManager::add(std::unique_ptr<IRPass> pass) {
+  passes.push_back(std::move(pass));
+}
+
+IRPassStats IRPassManager::run(IRFunction& function) {
+  IRPassStats stats;
+  stats.instructionsBefore = function.instructionCount();
+  for (auto& pass : passes) {
+    stats.counts.push_back({pass->name(), 0});
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < passes.size(); i++) {
+      size_t removed = passes[i]->run(function);
+      stats.counts[i].second += removed;
+      changed |= removed > 0;
+    }
+  }
+
+  stats.instructionsAfter = function.instructionCount();
+  return stats;
+}
+
+IRPassManager IRPassManager::standard() {
+  IRPassManager manager;
+  manager.add(std::make_unique<CopyPropagation>());
+  manager.add(std::make_unique<GlobalValueNumbering>());
+  manager.add(std::make_unique<DeadCodeElimination>());
+  return manager;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../ir.h"
+
+// The blocks reachable from the entry, each before its successors unless the
+// edge to the successor closes a loop, and the first successor of a block
+// right after it where possible.
+std::vector<IRBlockId> reversePostorder(const IRFunction& function);
+
+// The immediate dominator of every block reachable from the entry, which is
+// its own. Unreachable blocks get the number of blocks instead.
+std::vector<IRBlockId> immediateDominators(const IRFunction& function);
+
+// An optimization of the IR of a function.
+class IRPass {
+ public:
+  virtual ~IRPass() = default;
+
+  virtual std::string name() const = 0;
+
+  // Returns how many instructions the pass removed.
+  virtual size_t run(IRFunction& function) = 0;
+};
+
+// Removes instructions whose value is never used and that have no side
+// effects, including phis only used by themselves.
+class DeadCodeElimination : public IRPass {
+ public:
+  std::string name() const override { return "dead-code-elimination"; }
+  size_t run(IRFunction& function) override;
+};
+
+// Makes the uses of a Copy use the copied value instead, and the same for
+// phis that merge one value with nothing but itself.
+class CopyPropagation : public IRPass {
+ public:
+  std::string name() const override { return "copy-propagation"; }
+  size_t run(IRFunction& function) override;
+};
+
+// Replaces an instruction computing the same value as one that dominates it
+// with that instruction. Loads from globals and calls are never numbered,
+// since the value of a global can change in between.
+class GlobalValueNumbering : public IRPass {
+ public:
+  std::string name() const override { return "global-value-numbering"; }
+  size_t run(IRFunction& function) override;
+};
+
+// How many instructions each pass removed and how many the function had
+// before and after, for reporting.
+struct IRPassStats {
+  std::vector<std::pair<std::string, size_t>> counts;
+  size_t instructionsBefore = 0;
+  size_t instructionsAfter = 0;
+
+  size_t total() const;
+  std::string toString() const;
+};
+
+class IRPassManager {
+ public:
+  void add(std::unique_ptr<IRPass> pass);
+
+  // Runs the passes in order, again and again until a round leaves the
+  // function unchanged.
+  IRPassStats run(IRFunction& function);
+
+  // Copy propagation, global value numbering and dead code elimination.
+  static IRPassManager standard();
+
+ private:
+  std::vector<std::unique_ptr<IRPass>> passes;
+};
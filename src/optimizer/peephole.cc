@@ -0,0 +1,313 @@
+#include "peephole.h"
+
+#include <sstream>
+#include <vector>
+
+#include "chunk_rewriter.h"
+
+namespace {
+
+// Whether the opcode only pushes a value, so popping the value right away
+// undoes all it did.
+bool isPurePush(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::NIL:
+    case Opcode::TRUE:
+    case Opcode::FALSE:
+    case Opcode::CONST:
+    case Opcode::LOAD:
+    case Opcode::PARENT_LOAD:
+    case Opcode::DUP:
+    case Opcode::GLOBAL_LOAD:
+    case Opcode::UPVALUE_LOAD:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether the opcode pushes a value from outside the frame's stack, so the
+// value is the same whether or not the top of the stack was popped before it.
+// DUP copies the top, and without the stack depth a LOAD cannot be told apart
+// from one of the popped slot.
+bool pushesFromOutsideStack(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::NIL:
+    case Opcode::TRUE:
+    case Opcode::FALSE:
+    case Opcode::CONST:
+    case Opcode::PARENT_LOAD:
+    case Opcode::GLOBAL_LOAD:
+    case Opcode::UPVALUE_LOAD:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether execution never falls through to the instruction after it.
+bool endsBlock(Opcode opcode) {
+  switch (opcode) {
+    case Opcode::JUMP:
+    case Opcode::LOOP:
+    case Opcode::RETURN:
+    case Opcode::TAIL_CALL:
+    case Opcode::HALT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool isConditionalJump(Opcode opcode) {
+  return opcode == Opcode::JUMP_IF_FALSE || opcode == Opcode::JUMP_IF_TRUE;
+}
+
+class PeepholeOptimizer {
+ public:
+  PeepholeOptimizer(Chunk& chunk, bool isTopLevel)
+      : rewriter(chunk), code(rewriter.getInstructions()),
+        isTopLevel(isTopLevel) {}
+
+  PeepholeStats run() {
+    bool changed = true;
+    while (changed) {
+      changed = threadJumps();
+      rewriter.refreshJumpTargets();
+      changed |= removeRedundantJumps();
+      changed |= removeUnreachableCode();
+      rewriter.refreshJumpTargets();
+      if (!isTopLevel) {
+        changed |= removeDeadPushes();
+        changed |= removePopsBeforeReturn();
+        rewriter.refreshJumpTargets();
+      }
+    }
+    rewriter.commit();
+    return stats;
+  }
+
+ private:
+  ChunkRewriter rewriter;
+  std::vector<DecodedInstruction>& code;
+  bool isTopLevel;
+  PeepholeStats stats;
+
+  size_t next(size_t index) const { return rewriter.nextKept(index + 1); }
+
+  // The instruction a jump to the given index ends up executing, following
+  // any JUMPs in between. Jumps caught in a cycle are left alone.
+  size_t finalTarget(size_t index) const {
+    size_t target = rewriter.nextKept(index);
+    for (size_t hops = 0; hops < code.size(); hops++) {
+      if (target >= code.size() || code[target].opcode != Opcode::JUMP) {
+        return target;
+      }
+      target = rewriter.nextKept(code[target].target);
+    }
+    return rewriter.nextKept(index);
+  }
+
+  bool threadJumps() {
+    bool changed = false;
+    for (auto& instruction : code) {
+      if (instruction.removed || !ChunkRewriter::isJump(instruction.opcode)) {
+        continue;
+      }
+      size_t target = finalTarget(instruction.target);
+      if (target != rewriter.nextKept(instruction.target)) {
+        instruction.target = target;
+        stats[Peephole::ThreadedJump]++;
+        changed = true;
+      }
+
+      // both leave the frame with the value on top of the stack, which is
+      // the same for the jump and its target
+      if (instruction.opcode == Opcode::JUMP && target < code.size() &&
+          (code[target].opcode == Opcode::RETURN ||
+           code[target].opcode == Opcode::HALT)) {
+        instruction = {code[target].opcode};
+        stats[Peephole::JumpToReturn]++;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  bool removeRedundantJumps() {
+    bool changed = false;
+    for (size_t i = 0; i < code.size(); i++) {
+      if (code[i].removed) {
+        continue;
+      }
+      size_t following = next(i);
+      if (isConditionalJump(code[i].opcode) &&
+          rewriter.nextKept(code[i].target) == following) {
+        // both branches continue at the same instruction, so only the popped
+        // condition is left
+        code[i] = {Opcode::POP};
+        stats[Peephole::RedundantBranch]++;
+        changed = true;
+        continue;
+      }
+      if (isConditionalJump(code[i].opcode) && following < code.size() &&
+          code[following].opcode == Opcode::JUMP &&
+          !rewriter.isJumpTarget(following) &&
+          rewriter.nextKept(code[i].target) == next(following)) {
+        // the branch only skips the JUMP, so it can go where the JUMP goes
+        // on the opposite condition instead
+        Opcode opposite = code[i].opcode == Opcode::JUMP_IF_FALSE
+                              ? Opcode::JUMP_IF_TRUE
+                              : Opcode::JUMP_IF_FALSE;
+        code[i] = {opposite, 0, code[following].target};
+        rewriter.remove(following, 1);
+        stats[Peephole::InvertedBranch]++;
+        changed = true;
+        continue;
+      }
+      if ((code[i].opcode == Opcode::TRUE ||
+           code[i].opcode == Opcode::FALSE) &&
+          following < code.size() &&
+          isConditionalJump(code[following].opcode) &&
+          !rewriter.isJumpTarget(following)) {
+        // the branch always goes the same way, like it does once a call
+        // returning a constant is inlined
+        bool jumps = (code[i].opcode == Opcode::TRUE) ==
+                     (code[following].opcode == Opcode::JUMP_IF_TRUE);
+        if (jumps) {
+          code[i] = {Opcode::JUMP, 0, code[following].target};
+        } else {
+          rewriter.remove(i, 1);
+        }
+        rewriter.remove(following, 1);
+        stats[Peephole::ConstantBranch]++;
+        changed = true;
+        continue;
+      }
+      if (code[i].opcode == Opcode::JUMP &&
+          rewriter.nextKept(code[i].target) == following) {
+        rewriter.remove(i, 1);
+        stats[Peephole::JumpToNext]++;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  bool removeUnreachableCode() {
+    std::vector<bool> reachable(code.size(), false);
+    std::vector<size_t> worklist;
+    auto reach = [&](size_t index) {
+      index = rewriter.nextKept(index);
+      if (index < code.size() && !reachable[index]) {
+        reachable[index] = true;
+        worklist.push_back(index);
+      }
+    };
+
+    reach(0);
+    while (!worklist.empty()) {
+      size_t i = worklist.back();
+      worklist.pop_back();
+      if (ChunkRewriter::isJump(code[i].opcode)) {
+        reach(code[i].target);
+      }
+      if (!endsBlock(code[i].opcode)) {
+        reach(i + 1);
+      }
+    }
+
+    bool changed = false;
+    for (size_t i = 0; i < code.size(); i++) {
+      if (!code[i].removed && !reachable[i]) {
+        rewriter.remove(i, 1);
+        stats[Peephole::UnreachableCode]++;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  bool removeDeadPushes() {
+    bool changed = false;
+    for (size_t i = 0; i < code.size(); i++) {
+      if (code[i].removed || !isPurePush(code[i].opcode)) {
+        continue;
+      }
+      size_t pop = next(i);
+      if (pop < code.size() && code[pop].opcode == Opcode::POP &&
+          !rewriter.isJumpTarget(pop)) {
+        rewriter.remove(i, 1);
+        rewriter.remove(pop, 1);
+        stats[Peephole::DeadPush]++;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  bool removePopsBeforeReturn() {
+    bool changed = false;
+    for (size_t i = 0; i < code.size(); i++) {
+      if (code[i].removed || code[i].opcode != Opcode::RETURN) {
+        continue;
+      }
+      // RETURN closes the upvalues of the frame and drops its values itself.
+      // Look for POP; <push>; RETURN with nothing jumping in between.
+      size_t push = i;
+      while (push > 0 && code[--push].removed) {
+      }
+      if (push == i || !pushesFromOutsideStack(code[push].opcode) ||
+          rewriter.isJumpTarget(i)) {
+        continue;
+      }
+      size_t pop = push;
+      while (pop > 0 && code[--pop].removed) {
+      }
+      if (pop == push || rewriter.isJumpTarget(push) ||
+          (code[pop].opcode != Opcode::POP &&
+           code[pop].opcode != Opcode::UPVALUE_CLOSE)) {
+        continue;
+      }
+      rewriter.remove(pop, 1);
+      stats[Peephole::PopBeforeReturn]++;
+      changed = true;
+    }
+    return changed;
+  }
+};
+
+size_t wordCount(const Chunk& chunk) { return chunk.instructions.size(); }
+
+}  // namespace
+
+size_t PeepholeStats::total() const {
+  size_t total = 0;
+  for (auto count : counts) {
+    total += count;
+  }
+  return total;
+}
+
+std::string PeepholeStats::toString() const {
+  std::stringstream ss;
+  ss << "threaded-jump: " << (*this)[Peephole::ThreadedJump] << "\n";
+  ss << "jump-to-return: " << (*this)[Peephole::JumpToReturn] << "\n";
+  ss << "jump-to-next: " << (*this)[Peephole::JumpToNext] << "\n";
+  ss << "redundant-branch: " << (*this)[Peephole::RedundantBranch] << "\n";
+  ss << "inverted-branch: " << (*this)[Peephole::InvertedBranch] << "\n";
+  ss << "constant-branch: " << (*this)[Peephole::ConstantBranch] << "\n";
+  ss << "unreachable-code: " << (*this)[Peephole::UnreachableCode] << "\n";
+  ss << "dead-push: " << (*this)[Peephole::DeadPush] << "\n";
+  ss << "pop-before-return: " << (*this)[Peephole::PopBeforeReturn] << "\n";
+  ss << "words: " << wordsBefore << " -> " << wordsAfter << "\n";
+  return ss.str();
+}
+
+PeepholeStats optimizePeephole(Chunk& chunk, bool isTopLevel) {
+  size_t wordsBefore = wordCount(chunk);
+  auto stats = PeepholeOptimizer(chunk, isTopLevel).run();
+  stats.wordsBefore = wordsBefore;
+  stats.wordsAfter = wordCount(chunk);
+  return stats;
+}
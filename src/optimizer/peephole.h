@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string>
+
+#include "../bytecode.h"
+
+// The rewrites that optimizePeephole knows how to make.
+enum class Peephole {
+  ThreadedJump,      // a jump to a JUMP goes straight to where that one goes
+  JumpToReturn,      // JUMP to a RETURN or HALT becomes a copy of it
+  JumpToNext,        // JUMP to the instruction after it is removed
+  RedundantBranch,   // a conditional jump to right after it becomes POP
+  InvertedBranch,    // a conditional jump over a JUMP becomes the opposite
+                     // conditional jump to where the JUMP goes
+  ConstantBranch,    // TRUE or FALSE and a conditional jump on it becomes
+                     // a JUMP or nothing
+  UnreachableCode,   // instructions no path reaches are removed
+  DeadPush,          // a push without side effects followed by POP is removed
+  PopBeforeReturn,   // POP or UPVALUE_CLOSE right before a return is removed
+  Count,
+};
+
+// How many times each rewrite fired and how many words the chunk took up
+// before and after, for reporting.
+struct PeepholeStats {
+  std::array<size_t, static_cast<size_t>(Peephole::Count)> counts = {};
+  size_t wordsBefore = 0;
+  size_t wordsAfter = 0;
+
+  size_t& operator[](Peephole rewrite) {
+    return counts[static_cast<size_t>(rewrite)];
+  }
+  size_t operator[](Peephole rewrite) const {
+    return counts[static_cast<size_t>(rewrite)];
+  }
+
+  size_t total() const;
+  std::string toString() const;
+};
+
+// Removes redundant instructions the compiler emits and threads jumps that
+// land on other jumps. Runs until none of the rewrites applies anymore.
+//
+// The value the top level pops last is the result of the program, so
+// pushes that are immediately popped are only removed from functions.
+PeepholeStats optimizePeephole(Chunk& chunk, bool isTopLevel);
@@ -0,0 +1,192 @@
+#include "stack_depth.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+int stackEffect(Opcode opcode, uint32_t operand) {
+  switch (opcode) {
+    case Opcode::NO_OP:
+    case Opcode::JUMP:
+    case Opcode::LOOP:
+    case Opcode::FOR_RANGE:
+    case Opcode::NEG:
+    case Opcode::NOT:
+    case Opcode::BIT_NOT:
+    case Opcode::NEG_INT:
+    case Opcode::NEG_DOUBLE:
+    case Opcode::MEMBER_GET:
+    case Opcode::JUMP_UNLESS_LT_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_LTE_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_GT_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_GTE_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_EQ_LOCAL_CONST:
+    case Opcode::JUMP_UNLESS_NEQ_LOCAL_CONST:
+      return 0;
+
+    case Opcode::NIL:
+    case Opcode::TRUE:
+    case Opcode::FALSE:
+    case Opcode::CONST:
+    case Opcode::CLOSURE:
+    case Opcode::CLASS:
+    case Opcode::LOAD:
+    case Opcode::PARENT_LOAD:
+    case Opcode::DUP:
+    case Opcode::GLOBAL_LOAD:
+    case Opcode::UPVALUE_LOAD:
+    case Opcode::ADD_INT_LOCALS:
+    case Opcode::ADD_INT_LOCAL_CONST:
+    case Opcode::SUB_INT_LOCAL_CONST:
+    case Opcode::MUL_INT_LOCAL_CONST:
+    case Opcode::LOCAL_MEMBER_GET:
+      return 1;
+
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::DIV:
+    case Opcode::MOD:
+    case Opcode::EQ:
+    case Opcode::NEQ:
+    case Opcode::LT:
+    case Opcode::LTE:
+    case Opcode::GT:
+    case Opcode::GTE:
+    case Opcode::BIT_AND:
+    case Opcode::BIT_OR:
+    case Opcode::BIT_XOR:
+    case Opcode::SHIFT_LEFT:
+    case Opcode::SHIFT_RIGHT:
+    case Opcode::ADD_INT:
+    case Opcode::ADD_DOUBLE:
+    case Opcode::SUB_INT:
+    case Opcode::SUB_DOUBLE:
+    case Opcode::MUL_INT:
+    case Opcode::MUL_DOUBLE:
+    case Opcode::DIV_INT:
+    case Opcode::DIV_DOUBLE:
+    case Opcode::MOD_INT:
+    case Opcode::EQ_INT:
+    case Opcode::EQ_DOUBLE:
+    case Opcode::NEQ_INT:
+    case Opcode::NEQ_DOUBLE:
+    case Opcode::LT_INT:
+    case Opcode::LT_DOUBLE:
+    case Opcode::LTE_INT:
+    case Opcode::LTE_DOUBLE:
+    case Opcode::GT_INT:
+    case Opcode::GT_DOUBLE:
+    case Opcode::GTE_INT:
+    case Opcode::GTE_DOUBLE:
+    case Opcode::STORE:
+    case Opcode::PARENT_STORE:
+    case Opcode::POP:
+    case Opcode::JUMP_IF_FALSE:
+    case Opcode::JUMP_IF_TRUE:
+    case Opcode::GLOBAL_STORE:
+    case Opcode::UPVALUE_STORE:
+    case Opcode::UPVALUE_CLOSE:
+    case Opcode::MEMBER_SET:
+    case Opcode::RETURN:
+    case Opcode::HALT:
+      return -1;
+
+    case Opcode::JUMP_UNLESS_LT_INT:
+    case Opcode::JUMP_UNLESS_LTE_INT:
+    case Opcode::JUMP_UNLESS_GT_INT:
+    case Opcode::JUMP_UNLESS_GTE_INT:
+    case Opcode::JUMP_UNLESS_EQ_INT:
+    case Opcode::JUMP_UNLESS_NEQ_INT:
+      return -2;
+
+    case Opcode::CALL:
+    case Opcode::TAIL_CALL:
+      // pops the callee and its arguments, pushes the result
+      return -static_cast<int>(operand);
+    case Opcode::INVOKE:
+      // pops the instance and the arguments, pushes the result
+      return -static_cast<int>(operandLow(operand));
+    case Opcode::SLIDE:
+      // keeps the value on top
+      return -static_cast<int>(operand);
+
+    default:
+      throw std::runtime_error("Unknown stack effect of opcode");
+  }
+}
+
+std::vector<int> stackDepths(const Chunk& chunk, int entryDepth) {
+  const auto& instructions = chunk.instructions;
+
+  // Walk every path through the chunk, recording the depth each instruction
+  // is reached with. The compiler keeps the depth the same on all paths into
+  // an instruction, so every instruction only has to be visited once.
+  std::vector<int> depthAt(instructions.size(), -1);
+  std::vector<size_t> worklist;
+  auto reach = [&](size_t offset, int depth) {
+    if (offset < instructions.size() && depthAt[offset] < depth) {
+      depthAt[offset] = depth;
+      worklist.push_back(offset);
+    }
+  };
+
+  reach(0, entryDepth);
+  while (!worklist.empty()) {
+    size_t offset = worklist.back();
+    worklist.pop_back();
+
+    Instruction instruction = instructions[offset];
+    Opcode opcode = static_cast<Opcode>(instruction & 0xFF);
+    uint32_t operand = instruction >> 8;
+    int depth = depthAt[offset] + stackEffect(opcode, operand);
+
+    size_t next = offset + instructionWidth(opcode);
+    switch (opcode) {
+      case Opcode::RETURN:
+      case Opcode::TAIL_CALL:
+      case Opcode::HALT:
+        break;
+      case Opcode::JUMP:
+      case Opcode::LOOP:
+        reach(operand, depth);
+        break;
+      case Opcode::JUMP_IF_FALSE:
+      case Opcode::JUMP_IF_TRUE:
+      case Opcode::FOR_RANGE:
+      case Opcode::JUMP_UNLESS_LT_INT:
+      case Opcode::JUMP_UNLESS_LTE_INT:
+      case Opcode::JUMP_UNLESS_GT_INT:
+      case Opcode::JUMP_UNLESS_GTE_INT:
+      case Opcode::JUMP_UNLESS_EQ_INT:
+      case Opcode::JUMP_UNLESS_NEQ_INT:
+        reach(operand, depth);
+        reach(next, depth);
+        break;
+      default:
+        if (instructionWidth(opcode) == 2) {
+          reach(instructions[offset + 1], depth);
+        }
+        reach(next, depth);
+        break;
+    }
+  }
+
+  return depthAt;
+}
+
+int maxStackDepth(const Chunk& chunk, int entryDepth) {
+  auto depthAt = stackDepths(chunk, entryDepth);
+
+  int maxDepth = entryDepth;
+  for (size_t offset = 0; offset < depthAt.size(); offset++) {
+    if (depthAt[offset] == -1) {
+      continue;
+    }
+    Instruction instruction = chunk.instructions[offset];
+    Opcode opcode = static_cast<Opcode>(instruction & 0xFF);
+    int depth = depthAt[offset] + stackEffect(opcode, instruction >> 8);
+    maxDepth = std::max(maxDepth, depth);
+  }
+  return maxDepth;
+}
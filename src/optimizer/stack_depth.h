@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+
+#include "../bytecode.h"
+
+// How many values executing the instruction leaves on the stack compared to
+// before it, e.g. -1 for a binary operation. RETURN and HALT leave the frame
+// and count as popping their result.
+int stackEffect(Opcode opcode, uint32_t operand);
+
+// The depth each instruction of the chunk is reached with, counted from the
+// base pointer, indexed by word offset. Unreachable instructions and the
+// second words of wide instructions get -1.
+std::vector<int> stackDepths(const Chunk& chunk, int entryDepth);
+
+// The most values a frame running the chunk has on the stack at any point,
+// counted from its base pointer. entryDepth is the number of values the frame
+// starts with: the callee and its arguments, or nothing for the top level.
+int maxStackDepth(const Chunk& chunk, int entryDepth);
@@ -0,0 +1,210 @@
+#include "superinstructions.h"
+
+#include <optional>
+#include <sstream>
+
+#include "chunk_rewriter.h"
+
+namespace {
+
+// Largest index that fits in the upper 16 bits of a fused operand
+constexpr uint32_t MAX_PACKED_INDEX = 0xFFFF;
+
+bool fitsPacked(uint32_t slot, uint32_t index) {
+  return slot <= 0xFF && index <= MAX_PACKED_INDEX;
+}
+
+// The comparison that holds exactly when the given one does not, which for
+// ints is always another comparison. A JUMP_IF_TRUE after a comparison is
+// a jump unless the opposite comparison holds.
+std::optional<Opcode> oppositeComparison(Opcode compare) {
+  switch (compare) {
+    case Opcode::LT_INT:
+      return Opcode::GTE_INT;
+    case Opcode::LTE_INT:
+      return Opcode::GT_INT;
+    case Opcode::GT_INT:
+      return Opcode::LTE_INT;
+    case Opcode::GTE_INT:
+      return Opcode::LT_INT;
+    case Opcode::EQ_INT:
+      return Opcode::NEQ_INT;
+    case Opcode::NEQ_INT:
+      return Opcode::EQ_INT;
+    default:
+      return std::nullopt;
+  }
+}
+
+// The comparison a conditional jump after it jumps unless holds.
+std::optional<Opcode> branchComparison(Opcode compare, Opcode jump) {
+  switch (jump) {
+    case Opcode::JUMP_IF_FALSE:
+      return oppositeComparison(compare).has_value()
+                 ? std::optional<Opcode>(compare)
+                 : std::nullopt;
+    case Opcode::JUMP_IF_TRUE:
+      return oppositeComparison(compare);
+    default:
+      return std::nullopt;
+  }
+}
+
+std::optional<Opcode> compareLocalConstAndBranchFor(Opcode compare) {
+  switch (compare) {
+    case Opcode::LT_INT:
+      return Opcode::JUMP_UNLESS_LT_LOCAL_CONST;
+    case Opcode::LTE_INT:
+      return Opcode::JUMP_UNLESS_LTE_LOCAL_CONST;
+    case Opcode::GT_INT:
+      return Opcode::JUMP_UNLESS_GT_LOCAL_CONST;
+    case Opcode::GTE_INT:
+      return Opcode::JUMP_UNLESS_GTE_LOCAL_CONST;
+    case Opcode::EQ_INT:
+      return Opcode::JUMP_UNLESS_EQ_LOCAL_CONST;
+    case Opcode::NEQ_INT:
+      return Opcode::JUMP_UNLESS_NEQ_LOCAL_CONST;
+    default:
+      return std::nullopt;
+  }
+}
+
+std::optional<Opcode> compareAndBranchFor(Opcode compare) {
+  switch (compare) {
+    case Opcode::LT_INT:
+      return Opcode::JUMP_UNLESS_LT_INT;
+    case Opcode::LTE_INT:
+      return Opcode::JUMP_UNLESS_LTE_INT;
+    case Opcode::GT_INT:
+      return Opcode::JUMP_UNLESS_GT_INT;
+    case Opcode::GTE_INT:
+      return Opcode::JUMP_UNLESS_GTE_INT;
+    case Opcode::EQ_INT:
+      return Opcode::JUMP_UNLESS_EQ_INT;
+    case Opcode::NEQ_INT:
+      return Opcode::JUMP_UNLESS_NEQ_INT;
+    default:
+      return std::nullopt;
+  }
+}
+
+std::optional<Opcode> localConstArithmeticFor(Opcode arithmetic) {
+  switch (arithmetic) {
+    case Opcode::ADD_INT:
+      return Opcode::ADD_INT_LOCAL_CONST;
+    case Opcode::SUB_INT:
+      return Opcode::SUB_INT_LOCAL_CONST;
+    case Opcode::MUL_INT:
+      return Opcode::MUL_INT_LOCAL_CONST;
+    default:
+      return std::nullopt;
+  }
+}
+
+}  // namespace
+
+SuperinstructionStats& SuperinstructionStats::operator+=(
+    const SuperinstructionStats& other) {
+  for (size_t i = 0; i < counts.size(); i++) {
+    counts[i] += other.counts[i];
+  }
+  return *this;
+}
+
+size_t SuperinstructionStats::total() const {
+  size_t total = 0;
+  for (auto count : counts) {
+    total += count;
+  }
+  return total;
+}
+
+std::string SuperinstructionStats::toString() const {
+  std::stringstream ss;
+  ss << "compare-local-const-and-branch: "
+     << (*this)[Fusion::CompareLocalConstAndBranch] << "\n";
+  ss << "compare-and-branch: " << (*this)[Fusion::CompareAndBranch] << "\n";
+  ss << "add-locals: " << (*this)[Fusion::AddLocals] << "\n";
+  ss << "local-const-arithmetic: " << (*this)[Fusion::LocalConstArithmetic]
+     << "\n";
+  ss << "local-member-get: " << (*this)[Fusion::LocalMemberGet] << "\n";
+  return ss.str();
+}
+
+SuperinstructionStats fuseSuperinstructions(Chunk& chunk) {
+  SuperinstructionStats stats;
+  ChunkRewriter rewriter(chunk);
+  auto& code = rewriter.getInstructions();
+
+  for (size_t i = 0; i < code.size(); i++) {
+    if (code[i].removed) {
+      continue;
+    }
+
+    // <cmp>_INT; JUMP_IF_FALSE/JUMP_IF_TRUE t
+    if (code[i].opcode != Opcode::LOAD) {
+      if (i + 1 < code.size() && !code[i + 1].removed &&
+          rewriter.isFusable(i, 2)) {
+        auto compare = branchComparison(code[i].opcode, code[i + 1].opcode);
+        if (compare.has_value()) {
+          rewriter.fuse(i, 2,
+                        {compareAndBranchFor(compare.value()).value(), 0,
+                         code[i + 1].target});
+          stats[Fusion::CompareAndBranch]++;
+        }
+      }
+      continue;
+    }
+    uint32_t slot = code[i].operand;
+
+    // LOAD a; CONST k; <cmp>_INT; JUMP_IF_FALSE/JUMP_IF_TRUE t
+    if (i + 3 < code.size() && rewriter.matches(i + 1, {Opcode::CONST}) &&
+        !code[i + 2].removed && !code[i + 3].removed) {
+      auto compare = branchComparison(code[i + 2].opcode, code[i + 3].opcode);
+      uint32_t constant = code[i + 1].operand;
+      if (compare.has_value() && fitsPacked(slot, constant) &&
+          rewriter.isFusable(i, 4)) {
+        rewriter.fuse(i, 4,
+                      {compareLocalConstAndBranchFor(compare.value()).value(),
+                       packOperand(slot, constant), code[i + 3].target});
+        stats[Fusion::CompareLocalConstAndBranch]++;
+        continue;
+      }
+    }
+
+    // LOAD a; LOAD b; ADD_INT
+    if (rewriter.matches(i + 1, {Opcode::LOAD, Opcode::ADD_INT}) &&
+        fitsPacked(slot, code[i + 1].operand) && rewriter.isFusable(i, 3)) {
+      rewriter.fuse(i, 3,
+                    {Opcode::ADD_INT_LOCALS,
+                     packOperand(slot, code[i + 1].operand)});
+      stats[Fusion::AddLocals]++;
+      continue;
+    }
+
+    // LOAD a; CONST k; ADD_INT/SUB_INT/MUL_INT
+    if (i + 2 < code.size() && rewriter.matches(i + 1, {Opcode::CONST})) {
+      auto fused = localConstArithmeticFor(code[i + 2].opcode);
+      uint32_t constant = code[i + 1].operand;
+      if (fused.has_value() && fitsPacked(slot, constant) &&
+          rewriter.isFusable(i, 3)) {
+        rewriter.fuse(i, 3, {fused.value(), packOperand(slot, constant)});
+        stats[Fusion::LocalConstArithmetic]++;
+        continue;
+      }
+    }
+
+    // LOAD a; MEMBER_GET m
+    if (rewriter.matches(i + 1, {Opcode::MEMBER_GET}) &&
+        fitsPacked(slot, code[i + 1].operand) && rewriter.isFusable(i, 2)) {
+      rewriter.fuse(i, 2,
+                    {Opcode::LOCAL_MEMBER_GET,
+                     packOperand(slot, code[i + 1].operand)});
+      stats[Fusion::LocalMemberGet]++;
+      continue;
+    }
+  }
+
+  rewriter.commit();
+  return stats;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+#include <string>
+
+#include "../bytecode.h"
+
+// The sequences that fuseSuperinstructions knows how to fuse.
+enum class Fusion {
+  // LOAD; CONST; <cmp>_INT; JUMP_IF_FALSE/JUMP_IF_TRUE
+  CompareLocalConstAndBranch,
+  CompareAndBranch,  // <cmp>_INT; JUMP_IF_FALSE/JUMP_IF_TRUE
+  AddLocals,                   // LOAD; LOAD; ADD_INT
+  LocalConstArithmetic,        // LOAD; CONST; ADD_INT/SUB_INT/MUL_INT
+  LocalMemberGet,              // LOAD; MEMBER_GET
+  Count,
+};
+
+// How many times each fusion fired, for reporting.
+struct SuperinstructionStats {
+  std::array<size_t, static_cast<size_t>(Fusion::Count)> counts = {};
+
+  size_t& operator[](Fusion fusion) {
+    return counts[static_cast<size_t>(fusion)];
+  }
+  size_t operator[](Fusion fusion) const {
+    return counts[static_cast<size_t>(fusion)];
+  }
+  SuperinstructionStats& operator+=(const SuperinstructionStats& other);
+
+  size_t total() const;
+  std::string toString() const;
+};
+
+// Rewrites the hottest instruction sequences in the chunk into single fused
+// instructions, so that they take one dispatch instead of several.
+SuperinstructionStats fuseSuperinstructions(Chunk& chunk);
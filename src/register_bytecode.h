@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "runtime/value.h"
+
+// Instruction set of the register engine. Like the stack engine it uses 32-bit
+// instructions with the opcode in the first byte, but the operands name
+// registers, which are the slots of the current call frame:
+//
+//   ABC: | opcode | A | B | C |  three 8-bit operands
+//   ABx: | opcode | A |   Bx  |  an 8-bit and a 16-bit operand
+//
+// Register 0 of every frame holds the function being called and its
+// parameters come right after, the same layout locals have on the stack.
+using RegisterInstruction = uint32_t;
+
+enum class RegisterOpcode : uint8_t {
+  NO_OP = 0x00,
+
+  MOVE = 0x10,        // R(A) = R(B)
+  LOAD_NIL = 0x11,    // R(A) = nil
+  LOAD_TRUE = 0x12,   // R(A) = true
+  LOAD_FALSE = 0x13,  // R(A) = false
+  LOAD_CONST = 0x14,  // R(A) = K(Bx)
+
+  // R(A) = R(B) op R(C), specialized on the operand types like the stack
+  // engine's arithmetic and comparisons
+  ADD_INT = 0x20,
+  ADD_DOUBLE = 0x21,
+  SUB_INT = 0x22,
+  SUB_DOUBLE = 0x23,
+  MUL_INT = 0x24,
+  MUL_DOUBLE = 0x25,
+  DIV_INT = 0x26,
+  DIV_DOUBLE = 0x27,
+  MOD_INT = 0x28,
+  EQ = 0x30,  // compares the raw bits, used for bools
+  EQ_INT = 0x31,
+  EQ_DOUBLE = 0x32,
+  NEQ = 0x33,
+  NEQ_INT = 0x34,
+  NEQ_DOUBLE = 0x35,
+  LT_INT = 0x36,
+  LT_DOUBLE = 0x37,
+  LTE_INT = 0x38,
+  LTE_DOUBLE = 0x39,
+  GT_INT = 0x3a,
+  GT_DOUBLE = 0x3b,
+  GTE_INT = 0x3c,
+  GTE_DOUBLE = 0x3d,
+
+  // R(A) = op R(B)
+  NEG_INT = 0x40,
+  NEG_DOUBLE = 0x41,
+  NOT = 0x42,
+
+  JUMP = 0x50,           // jump to Bx
+  JUMP_IF_FALSE = 0x51,  // jump to Bx if R(A) is false
+  CALL = 0x52,    // R(A) = R(A)(R(A + 1), ..., R(A + B))
+  RETURN = 0x53,  // return R(A) to the caller
+  HALT = 0x54,    // stop and return R(A)
+
+  GLOBAL_LOAD = 0x60,   // R(A) = G(Bx)
+  GLOBAL_STORE = 0x61,  // G(Bx) = R(A)
+};
+
+inline RegisterInstruction encodeABC(RegisterOpcode opcode, uint32_t a,
+                                     uint32_t b = 0, uint32_t c = 0) {
+  return static_cast<uint32_t>(opcode) | (a & 0xFF) << 8 | (b & 0xFF) << 16 |
+         (c & 0xFF) << 24;
+}
+inline RegisterInstruction encodeABx(RegisterOpcode opcode, uint32_t a,
+                                     uint32_t bx) {
+  return static_cast<uint32_t>(opcode) | (a & 0xFF) << 8 | (bx & 0xFFFF) << 16;
+}
+inline RegisterOpcode decodeOpcode(RegisterInstruction instruction) {
+  return static_cast<RegisterOpcode>(instruction & 0xFF);
+}
+inline uint32_t decodeA(RegisterInstruction instruction) {
+  return (instruction >> 8) & 0xFF;
+}
+inline uint32_t decodeB(RegisterInstruction instruction) {
+  return (instruction >> 16) & 0xFF;
+}
+inline uint32_t decodeC(RegisterInstruction instruction) {
+  return instruction >> 24;
+}
+inline uint32_t decodeBx(RegisterInstruction instruction) {
+  return instruction >> 16;
+}
+
+struct RegisterChunk {
+  std::vector<RegisterInstruction> instructions;
+  std::vector<Value> constants;
+
+  // number of registers a call frame running this chunk needs
+  int registerCount = 0;
+};
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <cstdint>
 #include <optional>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <variant>
+#include <vector>
 
 #include "../bytecode.h"
+#include "../register_bytecode.h"
 #include "../frontend/string_interner.h"
+#include "object_kind.h"
 #include "object_ptr.h"
 
 class Value;
@@ -15,6 +21,17 @@ struct Upvalue {
   bool isLocal;
 };
 
+// What the baseline JIT (vm/jit.h) knows about a function
+struct JitState {
+  uint32_t callCount = 0;
+  uint32_t backEdgeCount = 0;  // iterations of the function's loops
+  const void* code = nullptr;  // entry point once compiled
+  const void* body = nullptr;  // code past the prologue, where tail calls jump
+  // the machine code of each instruction a loop jumps back to, by offset
+  std::vector<std::pair<uint32_t, const void*>> loopEntries;
+  bool unsupported = false;  // has an opcode the JIT cannot compile
+};
+
 class FunctionObject {
  public:
   FunctionObject(std::optional<SymbolId> name = std::nullopt) : name(name) {}
@@ -23,8 +40,12 @@ class FunctionObject {
   std::optional<SymbolId> getName() const { return name; }
   Chunk& getChunk() { return chunk; }
   const Chunk& getChunk() const { return chunk; }
+  RegisterChunk& getRegisterChunk() { return registerChunk; }
+  const RegisterChunk& getRegisterChunk() const { return registerChunk; }
   std::vector<Upvalue>& getUpvalues() { return upvalues; }
   const std::vector<Upvalue>& getUpvalues() const { return upvalues; }
+  JitState& getJitState() { return jitState; }
+  const JitState& getJitState() const { return jitState; }
 
   int addUpvalue(Upvalue upvalue) {
     upvalues.push_back(upvalue);
@@ -33,73 +54,42 @@ class FunctionObject {
 
  private:
   Chunk chunk;
+  RegisterChunk registerChunk;  // only filled in by the RegisterCompiler
+  JitState jitState;
   std::vector<Upvalue> upvalues;
   std::optional<SymbolId> name;
 };
 
+// A variable captured by a closure. While the variable is still on the stack
+// the upvalue is open and points at its stack slot; closing it copies the
+// value into the upvalue and points there instead, so reads and writes go
+// through the location without checking which of the two it is.
 class UpvalueObject {
  public:
-  UpvalueObject(int stackSlot)
-      : closedValue(Value::NIL),
-        stackSlot(stackSlot),
-        open(true),
-        next(std::nullopt) {}
-  UpvalueObject(int stackSlot, ObjectPtr<UpvalueObject> next)
-      : closedValue(Value::NIL),
-        stackSlot(stackSlot),
-        open(true),
-        next(std::move(next)) {}
-
-  bool isOpen() const { return open; }
-
-  void close(const std::vector<Value>& stack) {
-    if (!open) {
+  UpvalueObject(Value* slot) : location(slot), closedValue(Value::NIL) {}
+  UpvalueObject(const UpvalueObject& other)
+      : location(other.isOpen() ? other.location : &closedValue),
+        closedValue(other.closedValue) {}
+  UpvalueObject(UpvalueObject&& other)
+      : location(other.isOpen() ? other.location : &closedValue),
+        closedValue(std::move(other.closedValue)) {}
+  UpvalueObject& operator=(const UpvalueObject&) = delete;
+  UpvalueObject& operator=(UpvalueObject&&) = delete;
+
+  bool isOpen() const { return location != &closedValue; }
+  Value* getLocation() const { return location; }
+
+  void close() {
+    if (!isOpen()) {
       throw std::runtime_error("Tried to close already closed upvalue");
     }
-    closedValue = getValue(stack);
-    open = false;
-  }
-
-  int getStackSlot() const {
-    if (!open) {
-      throw std::runtime_error("Tried to get stack slot of open upvalue");
-    }
-    return stackSlot;
-  }
-
-  Value getClosedValue() const {
-    if (open) {
-      throw std::runtime_error("Tried to get closed value of open upvalue");
-    }
-    return closedValue;
-  }
-
-  Value getValue(const std::vector<Value>& stack) const {
-    if (open) {
-      return stack[stackSlot];
-    } else {
-      return closedValue;
-    }
-  }
-
-  void setValue(const Value& value, std::vector<Value>& stack) {
-    if (open) {
-      stack[stackSlot] = value;
-    } else {
-      closedValue = value;
-    }
-  }
-
-  std::optional<ObjectPtr<UpvalueObject>>& getNext() { return next; }
-  const std::optional<ObjectPtr<UpvalueObject>>& getNext() const {
-    return next;
+    closedValue = *location;
+    location = &closedValue;
   }
 
  private:
+  Value* location;
   Value closedValue;
-  int stackSlot;
-  bool open;
-  std::optional<ObjectPtr<UpvalueObject>> next;
 };
 
 class ClosureObject {
@@ -108,7 +98,11 @@ class ClosureObject {
       : function(std::move(function)) {}
   ClosureObject(ObjectPtr<FunctionObject> function,
                 std::vector<ObjectPtr<UpvalueObject>>&& upvalues)
-      : function(std::move(function)), upvalues(std::move(upvalues)) {}
+      : function(std::move(function)), upvalues(std::move(upvalues)) {
+    for (auto& upvalue : this->upvalues) {
+      upvalueObjects.push_back(upvalue.get());
+    }
+  }
 
   ObjectPtr<FunctionObject>& getFunction() { return function; }
   const ObjectPtr<FunctionObject>& getFunction() const { return function; }
@@ -120,36 +114,54 @@ class ClosureObject {
   const ObjectPtr<UpvalueObject>& getUpvalue(int index) const {
     return upvalues[index];
   }
+  Value* getUpvalueLocation(int index) const {
+    return upvalueObjects[index]->getLocation();
+  }
 
  private:
   ObjectPtr<FunctionObject> function;
   std::vector<ObjectPtr<UpvalueObject>> upvalues;
+  // the objects the upvalues point to, so reading one skips the ObjectPtr
+  std::vector<UpvalueObject*> upvalueObjects;
 };
 
+// A method bound to the instance it was looked up on. Instances do not keep
+// these around, they are only created when a method is used as a value.
 class MethodObject {
  public:
-  MethodObject(ObjectPtr<FunctionObject> function, Value self)
-      : function(std::move(function)), self(std::move(self)) {}
-
-  ObjectPtr<FunctionObject>& getFunction() { return function; }
-  const ObjectPtr<FunctionObject>& getFunction() const { return function; }
+  MethodObject(ObjectPtr<ClosureObject> closure, Value self)
+      : closure(std::move(closure)), self(std::move(self)) {}
+
+  ObjectPtr<ClosureObject>& getClosure() { return closure; }
+  const ObjectPtr<ClosureObject>& getClosure() const { return closure; }
+  ObjectPtr<FunctionObject>& getFunction() { return closure->getFunction(); }
+  const ObjectPtr<FunctionObject>& getFunction() const {
+    return closure->getFunction();
+  }
   Value& getSelf() { return self; }
   const Value& getSelf() const { return self; }
 
  private:
-  ObjectPtr<FunctionObject> function;
+  ObjectPtr<ClosureObject> closure;
   Value self;
 };
 
+// Members are laid out with the fields first, followed by the methods. The
+// class only holds placeholders for the fields; the methods are shared by all
+// of its instances.
 class ClassObject {
  public:
   ClassObject(ObjectPtr<ClassObject> superklass, SymbolId name,
-              std::vector<Value> members)
+              std::vector<Value> members, int fieldCount)
       : superklass(std::move(superklass)),
         name(name),
-        members(std::move(members)) {}
-  ClassObject(SymbolId name, std::vector<Value> members)
-      : superklass(std::nullopt), name(name), members(std::move(members)) {}
+        members(std::move(members)),
+        fieldCount(fieldCount) {}
+  ClassObject(SymbolId name, std::vector<Value> members, int fieldCount)
+      : superklass(std::nullopt),
+        name(name),
+        members(std::move(members)),
+        fieldCount(fieldCount) {}
   ClassObject() : superklass(std::nullopt), name(std::nullopt) {}
 
   std::optional<ObjectPtr<ClassObject>>& getSuperklass() { return superklass; }
@@ -161,17 +173,21 @@ class ClassObject {
   std::vector<Value>& getMembers() { return members; }
   const std::vector<Value>& getMembers() const { return members; }
   Value getMember(int index) const { return members[index]; }
+  int getFieldCount() const { return fieldCount; }
+  bool isField(int index) const { return index < fieldCount; }
 
  private:
   std::optional<ObjectPtr<ClassObject>> superklass;
   std::optional<SymbolId> name;
   std::vector<Value> members;
+  int fieldCount = 0;
 };
 
+// Instances only store their fields, methods are looked up on the class.
 class InstanceObject {
  public:
   InstanceObject(ObjectPtr<ClassObject> klass) : klass(std::move(klass)) {
-    members.resize(this->klass->getMembers().size());
+    members.resize(this->klass->getFieldCount());
   }
 
   ObjectPtr<ClassObject>& getClass() { return klass; }
@@ -214,35 +230,46 @@ class BuiltInObject {
   std::function<Value(std::vector<Value>&, StringInterner&)> function;
 };
 
+template <typename T>
+class TypedObject;
+
+// The header every object starts with. The object itself is a TypedObject,
+// which follows the header with the one class its kind names, so each object
+// only takes the memory that class needs and type checks compare the kind.
 class Object {
  public:
-  template <typename T>
-  Object(T&& o) : data(std::move(o)), strongCount(1) {}
+  explicit Object(ObjectKind kind) : strongCount(1), kind(kind) {}
+  Object(const Object&) = delete;
+  Object& operator=(const Object&) = delete;
 
-  ~Object() = default;
+  ObjectKind getKind() const { return kind; }
 
   template <typename T>
   T* get() {
-    return &std::get<T>(data);
-  }
-
-  template <>
-  std::monostate* get() {
-    return nullptr;
+    if constexpr (std::is_same_v<T, std::monostate>) {
+      return nullptr;
+    } else {
+      return &static_cast<TypedObject<T>*>(this)->payload;
+    }
   }
 
+  // always false for std::monostate, which is no kind of object
   template <typename T>
   bool is() const {
-    return std::holds_alternative<T>(data);
+    return kind == objectKindOf<T>;
   }
 
-  template <>
-  bool is<std::monostate>() const {
-    return false;
-  }
+  uint32_t strongCount;
+
+ private:
+  ObjectKind kind;
+};
+
+template <typename T>
+class TypedObject : public Object {
+ public:
+  explicit TypedObject(T&& payload)
+      : Object(objectKindOf<T>), payload(std::move(payload)) {}
 
-  std::variant<FunctionObject, UpvalueObject, ClosureObject, StringObject,
-               MethodObject, ClassObject, InstanceObject, BuiltInObject>
-      data;
-  int strongCount;
+  T payload;
 };
@@ -0,0 +1,41 @@
+#include "object_allocator.h"
+
+#include <sstream>
+
+namespace {
+
+// by ObjectKind
+constexpr std::array<const char*, ObjectAllocator::KIND_COUNT> KIND_NAMES = {
+    "function", "upvalue", "closure",  "string",
+    "method",   "class",   "instance", "built-in"};
+
+}  // namespace
+
+// Slabs are only freed with the allocator, whose objects must all be gone by
+// then
+ObjectAllocator::~ObjectAllocator() {
+  for (char* slab : slabs) {
+    ::operator delete(slab);
+  }
+}
+
+// The tail of the previous slab, too small for the block that did not fit,
+// is left unused
+void ObjectAllocator::newSlab() {
+  slabNext = static_cast<char*>(::operator new(SLAB_SIZE));
+  slabEnd = slabNext + SLAB_SIZE;
+  slabs.push_back(slabNext);
+}
+
+std::string ObjectAllocator::statsToString() const {
+  std::stringstream ss;
+  uint64_t total = 0;
+  for (size_t kind = 0; kind < KIND_COUNT; kind++) {
+    ss << KIND_NAMES[kind] << ": " << liveObjects[kind] << "\n";
+    total += liveObjects[kind];
+  }
+  ss << "live objects: " << total << "\n";
+  ss << "slabs: " << slabs.size() << " (" << slabs.size() * SLAB_SIZE
+     << " bytes)\n";
+  return ss.str();
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "object.h"
+
+// Memory for Objects. Sizes up to MAX_SIZE are rounded up to a multiple of
+// GRANULE, and each of these size classes has a free list of the blocks freed
+// so far. Blocks come from that list when it is not empty and are otherwise
+// bump-allocated from the current slab, so objects are packed together and
+// freed memory is reused by the next object of the same size instead of going
+// back to malloc. Larger sizes go to operator new. Either way blocks are
+// aligned to GRANULE, which Value relies on to fit the kind into pointers.
+//
+// There is one allocator for the whole process rather than one per VM, since
+// objects outlive the VM that made them: run returns values and compiled
+// functions are shared by both engines. Like the reference counts in
+// ObjectPtr, it is not thread-safe.
+class ObjectAllocator {
+ public:
+  static constexpr size_t GRANULE = 16;
+  static constexpr size_t MAX_SIZE = 512;
+  static constexpr size_t SLAB_SIZE = 64 * 1024;
+  // slabs and large blocks come from operator new, and the blocks in a slab
+  // are multiples of GRANULE
+  static_assert(__STDCPP_DEFAULT_NEW_ALIGNMENT__ >= GRANULE);
+  static constexpr size_t KIND_COUNT = static_cast<size_t>(ObjectKind::Count);
+
+  // The allocator all ObjectPtrs use. It is never destroyed, so objects can
+  // still be released while static objects are destroyed.
+  static ObjectAllocator& get() {
+    static ObjectAllocator* allocator = new ObjectAllocator();
+    return *allocator;
+  }
+
+  ObjectAllocator() = default;
+  ObjectAllocator(const ObjectAllocator&) = delete;
+  ObjectAllocator& operator=(const ObjectAllocator&) = delete;
+  ~ObjectAllocator();
+
+  void* allocate(size_t size) {
+    if (size > MAX_SIZE) {
+      return ::operator new(size);
+    }
+    FreeBlock*& freeList = freeLists[sizeClass(size)];
+    if (freeList != nullptr) {
+      FreeBlock* block = freeList;
+      freeList = block->next;
+      return block;
+    }
+    size = (sizeClass(size) + 1) * GRANULE;
+    if (static_cast<size_t>(slabEnd - slabNext) < size) {
+      newSlab();
+    }
+    void* block = slabNext;
+    slabNext += size;
+    return block;
+  }
+
+  // Takes back a block allocate returned for the same size
+  void deallocate(void* block, size_t size) {
+    if (size > MAX_SIZE) {
+      ::operator delete(block);
+      return;
+    }
+    auto* freeBlock = static_cast<FreeBlock*>(block);
+    FreeBlock*& freeList = freeLists[sizeClass(size)];
+    freeBlock->next = freeList;
+    freeList = freeBlock;
+  }
+
+  // Keep count of the live objects of each kind
+  void created(ObjectKind kind) { liveObjects[static_cast<size_t>(kind)]++; }
+  void destroyed(ObjectKind kind) {
+    liveObjects[static_cast<size_t>(kind)]--;
+  }
+
+  uint64_t getLiveObjects(ObjectKind kind) const {
+    return liveObjects[static_cast<size_t>(kind)];
+  }
+  size_t getSlabCount() const { return slabs.size(); }
+  // The live objects of each kind and the slabs, one per line
+  std::string statsToString() const;
+
+ private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  static size_t sizeClass(size_t size) {
+    return size == 0 ? 0 : (size - 1) / GRANULE;
+  }
+  void newSlab();
+
+  std::array<FreeBlock*, MAX_SIZE / GRANULE> freeLists = {};
+  std::array<uint64_t, KIND_COUNT> liveObjects = {};
+  std::vector<char*> slabs;
+  char* slabNext = nullptr;  // the rest of the newest slab
+  char* slabEnd = nullptr;
+};
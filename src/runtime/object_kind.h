@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+class FunctionObject;
+class UpvalueObject;
+class ClosureObject;
+class StringObject;
+class MethodObject;
+class ClassObject;
+class InstanceObject;
+class BuiltInObject;
+
+// Which class an object holds. It is stored in the object's header, and
+// values pointing to an object repeat it next to the pointer, see Value.
+enum class ObjectKind : uint8_t {
+  Function,
+  Upvalue,
+  Closure,
+  String,
+  Method,
+  Class,
+  Instance,
+  BuiltIn,
+  Count,  // the number of kinds, and the kind of anything else
+};
+
+template <typename T>
+inline constexpr ObjectKind objectKindOf = ObjectKind::Count;
+template <>
+inline constexpr ObjectKind objectKindOf<FunctionObject> = ObjectKind::Function;
+template <>
+inline constexpr ObjectKind objectKindOf<UpvalueObject> = ObjectKind::Upvalue;
+template <>
+inline constexpr ObjectKind objectKindOf<ClosureObject> = ObjectKind::Closure;
+template <>
+inline constexpr ObjectKind objectKindOf<StringObject> = ObjectKind::String;
+template <>
+inline constexpr ObjectKind objectKindOf<MethodObject> = ObjectKind::Method;
+template <>
+inline constexpr ObjectKind objectKindOf<ClassObject> = ObjectKind::Class;
+template <>
+inline constexpr ObjectKind objectKindOf<InstanceObject> = ObjectKind::Instance;
+template <>
+inline constexpr ObjectKind objectKindOf<BuiltInObject> = ObjectKind::BuiltIn;
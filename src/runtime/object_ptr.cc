@@ -1,12 +1,63 @@
 #include "object_ptr.h"
 
+#include <new>
+#include <stdexcept>
 #include <variant>
 
+#include "object_allocator.h"
+
+namespace {
+
+template <typename T>
+void destroy(Object* object) {
+  static_assert(alignof(TypedObject<T>) <= ObjectAllocator::GRANULE);
+  static_cast<TypedObject<T>*>(object)->~TypedObject<T>();
+  ObjectAllocator::get().deallocate(object, sizeof(TypedObject<T>));
+}
+
+// Destroys an object nothing refers to any more and frees its memory
+void destroy(Object* object) {
+  ObjectAllocator::get().destroyed(object->getKind());
+  switch (object->getKind()) {
+    case ObjectKind::Function:
+      return destroy<FunctionObject>(object);
+    case ObjectKind::Upvalue:
+      return destroy<UpvalueObject>(object);
+    case ObjectKind::Closure:
+      return destroy<ClosureObject>(object);
+    case ObjectKind::String:
+      return destroy<StringObject>(object);
+    case ObjectKind::Method:
+      return destroy<MethodObject>(object);
+    case ObjectKind::Class:
+      return destroy<ClassObject>(object);
+    case ObjectKind::Instance:
+      return destroy<InstanceObject>(object);
+    case ObjectKind::BuiltIn:
+      return destroy<BuiltInObject>(object);
+    case ObjectKind::Count:
+      break;
+  }
+  throw std::runtime_error("Tried to destroy an object of unknown kind");
+}
+
+}  // namespace
+
 template <typename T>
 ObjectPtr<T>::ObjectPtr() : ptr(nullptr) {}
 
 template <typename T>
-ObjectPtr<T>::ObjectPtr(T&& o) : ptr(new Object(std::move(o))) {}
+ObjectPtr<T>::ObjectPtr(T&& o) {
+  ObjectAllocator& allocator = ObjectAllocator::get();
+  void* block = allocator.allocate(sizeof(TypedObject<T>));
+  try {
+    ptr = new (block) TypedObject<T>(std::move(o));
+  } catch (...) {
+    allocator.deallocate(block, sizeof(TypedObject<T>));
+    throw;
+  }
+  allocator.created(objectKindOf<T>);
+}
 
 template <>
 ObjectPtr<std::monostate>::ObjectPtr(std::monostate&& o) : ptr(nullptr) {}
@@ -18,7 +69,9 @@ ObjectPtr<T>::ObjectPtr(uint64_t raw) : ptr(std::bit_cast<Object*>(raw)) {
 
 template <typename T>
 ObjectPtr<T>::ObjectPtr(const ObjectPtr& other) : ptr(other.ptr) {
-  ptr->strongCount++;
+  if (ptr != nullptr) {
+    ptr->strongCount++;
+  }
 }
 
 template <typename T>
@@ -36,7 +89,7 @@ ObjectPtr<T>::~ObjectPtr() noexcept(false) {
   }
   ptr->strongCount--;
   if (ptr->strongCount == 0) {
-    delete ptr;
+    destroy(ptr);
   }
 }
 
@@ -45,19 +98,17 @@ T* ObjectPtr<T>::get() const {
   return ptr->get<T>();
 }
 
+// Like Value, assignments release the object being overwritten last.
 template <typename T>
 ObjectPtr<T>& ObjectPtr<T>::operator=(const ObjectPtr& other) {
-  ptr = other.ptr;
-  if (ptr != nullptr) {
-    ptr->strongCount++;
-  }
+  ObjectPtr copy(other);
+  std::swap(ptr, copy.ptr);
   return *this;
 }
 
 template <typename T>
 ObjectPtr<T>& ObjectPtr<T>::operator=(ObjectPtr&& other) {
-  ptr = other.ptr;
-  other.ptr = nullptr;
+  std::swap(ptr, other.ptr);
   return *this;
 }
 
@@ -82,8 +133,8 @@ Object* ObjectPtr<T>::__getPtr() const {
 }
 
 template <typename T>
-bool ObjectPtr<T>::__is(uint64_t raw) {
-  return std::bit_cast<Object*>(raw)->is<T>();
+ObjectKind ObjectPtr<T>::__getKind() const {
+  return ptr->getKind();
 }
 
 template <typename T>
@@ -2,6 +2,8 @@
 
 #include <cstdint>
 
+#include "object_kind.h"
+
 class Object;
 
 template <typename T>
@@ -22,7 +24,7 @@ class ObjectPtr {
   T* operator->();
 
   Object* __getPtr() const;
-  static bool __is(uint64_t raw);
+  ObjectKind __getKind() const;
   static ObjectPtr<T> __remember(uint64_t raw);
   uint64_t __forget();
 
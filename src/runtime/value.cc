@@ -11,37 +11,32 @@ const Value Value::FALSE(uint64_t(MASK_NAN | TAG_FALSE));
 
 Value::~Value() {
   if (isAnyObject()) {
-    ObjectPtr<std::monostate>::__remember((raw & MASK_PAYLOAD) >> NUM_TAG_BITS);
+    ObjectPtr<std::monostate>::__remember(getObjectPointer());
   }
 }
 
-Value::Value(const Value& other) {
-  if (other.isAnyObject()) {
-    ObjectPtr<std::monostate> ptr = other.asObject<std::monostate>();
-    initObject<std::monostate>(std::move(ptr));
-  } else {
-    raw = other.raw;
+// The copy keeps the kind bits, so it does not need to look at the object
+// beyond counting the new reference
+Value::Value(const Value& other) : raw(other.raw) {
+  if (isAnyObject()) {
+    ObjectPtr<std::monostate>(getObjectPointer()).__forget();
   }
 }
 
-Value::Value(Value&& other) {
-  raw = other.raw;
-  other = Value::NIL;
+Value::Value(Value&& other) : raw(other.raw) {
+  other.raw = MASK_NAN | TAG_NIL;
 }
 
+// Both assignments release the value being overwritten. It is released last,
+// so assigning a value that is only kept alive by the old one is safe.
 Value& Value::operator=(const Value& other) {
-  if (other.isAnyObject()) {
-    ObjectPtr<std::monostate> ptr = other.asObject<std::monostate>();
-    initObject<std::monostate>(std::move(ptr));
-  } else {
-    raw = other.raw;
-  }
+  Value copy(other);
+  std::swap(raw, copy.raw);
   return *this;
 }
 
 Value& Value::operator=(Value&& other) {
-  raw = other.raw;
-  other.raw = 0;
+  std::swap(raw, other.raw);
   return *this;
 }
 
@@ -5,6 +5,8 @@
 #include <stdexcept>
 #include <utility>
 
+#include "object_kind.h"
+
 template <typename T>
 class ObjectPtr;
 
@@ -19,16 +21,16 @@ class Value {
   Value(uint64_t raw) : raw(raw) {}
   Value(double d) : raw(std::bit_cast<uint64_t>(d)) {}
 
-  Value(bool b) {
-    if (b) {
-      *this = TRUE;
-    } else {
-      *this = FALSE;
-    }
+  // sets raw directly, since assigning would release whatever raw held
+  Value(bool b) : raw(MASK_NAN | (b ? TAG_TRUE : TAG_FALSE)) {}
+
+  // whether Value(int64_t) can hold i
+  static constexpr bool fitsInt(int64_t i) {
+    return i >= MIN_INT && i <= MAX_INT;
   }
 
   Value(int64_t i) {
-    if (i > MAX_INT || i < MIN_INT) {
+    if (!fitsInt(i)) {
       throw std::runtime_error(
           "Value is out of range, only up to 48-bit integers are supported");
     }
@@ -60,9 +62,15 @@ class Value {
     return !isDouble() && (raw & MASK_TAG) == TAG_OBJ;
   }
 
+  // Only looks at the value, not at the object it points to
   template <typename T>
   bool isObject() const {
-    return isAnyObject() && ObjectPtr<T>::__is(getPayload());
+    return isAnyObject() && getObjectKind() == objectKindOf<T>;
+  }
+
+  // the kind of object an isAnyObject value points to
+  ObjectKind getObjectKind() const {
+    return static_cast<ObjectKind>(getPayload() & MASK_OBJECT_KIND);
   }
 
   bool asBool() const { return *this == TRUE; }
@@ -81,12 +89,12 @@ class Value {
 
   template <typename T>
   const ObjectPtr<T> asObject() const {
-    return ObjectPtr<T>(getPayload());
+    return ObjectPtr<T>(getObjectPointer());
   }
 
   template <typename T>
   ObjectPtr<T> asObject() {
-    return ObjectPtr<T>(getPayload());
+    return ObjectPtr<T>(getObjectPointer());
   }
 
   uint64_t __getRaw() const { return raw; }
@@ -104,6 +112,10 @@ class Value {
   static constexpr const uint64_t MASK_INT_SIGN = 0x0000800000000000;
   static constexpr const uint64_t MASK_INT_SIGN_EXTEND = 0xFFFF000000000000;
   static constexpr const int NUM_TAG_BITS = 3;
+  // Objects are aligned to 16 bytes, which leaves the low 4 bits of their
+  // pointers free for the kind of object, so checking it needs no load
+  static constexpr const uint64_t MASK_OBJECT_KIND = 0x000000000000000F;
+  static_assert(static_cast<uint64_t>(ObjectKind::Count) <= MASK_OBJECT_KIND);
   static constexpr const uint64_t TAG_NIL = 0x0000000000000000;
   static constexpr const uint64_t TAG_TRUE = 0x0000000000000001;
   static constexpr const uint64_t TAG_FALSE = 0x0000000000000002;
@@ -114,15 +126,28 @@ class Value {
 
   template <typename T>
   void initObject(ObjectPtr<T>&& o) {
-    uint64_t payload = o.__forget() << NUM_TAG_BITS | TAG_OBJ;
+    auto pointer = std::bit_cast<uint64_t>(o.__getPtr());
+    if ((pointer & MASK_OBJECT_KIND) != 0) {
+      throw std::runtime_error(
+          "Object pointer is not aligned to 16 bytes, this is not supported");
+    }
+    // only ObjectPtr<std::monostate> has to look the kind up in the object
+    ObjectKind kind = objectKindOf<T> != ObjectKind::Count ? objectKindOf<T>
+                                                           : o.__getKind();
+    uint64_t payload =
+        (pointer | static_cast<uint64_t>(kind)) << NUM_TAG_BITS | TAG_OBJ;
     if ((MASK_PAYLOAD & payload) != payload) {
       throw std::runtime_error(
           "Object pointer occupies more than 48-bits, this is not supported");
     }
+    o.__forget();
     raw = MASK_NAN | payload;
   }
 
   uint64_t getPayload() const { return (raw & MASK_PAYLOAD) >> NUM_TAG_BITS; }
+  uint64_t getObjectPointer() const {
+    return getPayload() & ~MASK_OBJECT_KIND;
+  }
 
   uint64_t raw;
 };
@@ -3,29 +3,82 @@
 #include <readline/history.h>
 #include <readline/readline.h>
 
+#include <chrono>
 #include <fstream>
 
 #include "built_ins.h"
+#include "bytecode_file.h"
 #include "frontend/ast_pretty_printer.h"
 #include "frontend/compiler.h"
+#include "frontend/constant_folding.h"
 #include "frontend/parser.h"
+#include "frontend/register_compiler.h"
 #include "frontend/type_inference.h"
 #include "frontend/var.h"
+#include "runtime/object_allocator.h"
+#include "vm/opcode_stats.h"
+#include "vm/profiler.h"
+#include "vm/register_vm.h"
 #include "vm/vm.h"
 
 namespace Shiny {
+
+// Adds the time from its construction to its destruction to a phase
+class PhaseTimer {
+  std::chrono::nanoseconds& phase;
+  std::chrono::steady_clock::time_point start;
+
+ public:
+  explicit PhaseTimer(std::chrono::nanoseconds& phase)
+      : phase(phase), start(std::chrono::steady_clock::now()) {}
+  ~PhaseTimer() { phase += std::chrono::steady_clock::now() - start; }
+};
+
 class Interpreter {
   StringInterner interner;
   VM vm;
+  RegisterVM registerVM;
 
   TypeEnv inferenceGlobals = {};
+  std::unordered_set<VariableName> constantGlobals;  // declared with `let`
   std::vector<VariableName> compilerGlobals;
   std::vector<Value> vmGlobals;
 
   bool verbose;
+  Engine engine;
+  bool peephole;
+  bool ssa;
+  bool inlining;
+  std::string profile;
+  bool opcodeStats;
+  std::string opcodeStatsJson;
+  bool objectStats;
+  InlineCandidates inlineCandidates;
+  PhaseTimes phaseTimes;
 
  public:
-  Interpreter(bool verbose = false) : vm(interner, verbose), verbose(verbose) {
+  Interpreter(const Options& options = {})
+      : vm(interner, options.verbose, options.stackSize),
+        registerVM(interner, options.verbose),
+        verbose(options.verbose),
+        engine(options.engine),
+        peephole(options.peephole),
+        ssa(options.ssa),
+        inlining(options.inlining),
+        profile(options.profile),
+        opcodeStats(options.opcodeStats),
+        opcodeStatsJson(options.opcodeStatsJson),
+        objectStats(options.objectStats) {
+    bool countOpcodes = opcodeStats || !opcodeStatsJson.empty();
+    if (!profile.empty()) {
+      vm.enableProfiler();
+    }
+    if (countOpcodes) {
+      vm.enableOpcodeStats();
+    }
+    if (options.jit && profile.empty() && !countOpcodes) {
+      vm.enableJit(options.jitThreshold);
+    }
     // for (const auto& entry : builtIns) {
     //   VariableName name = interner.intern(entry.name);
     //   inferenceGlobals[name] = entry.type;
@@ -36,31 +89,37 @@ class Interpreter {
 
   Value run(const std::string& source) {
     try {
-      Scanner scanner(source);
-      Parser parser(scanner, interner);
-      auto ast = parser.parse();
-      if (parser.hadError()) {
+      auto ast = analyze(source);
+      if (ast == nullptr) {
         return Value::NIL;
       }
 
-      TypeInference inference(interner, &inferenceGlobals);
-      inference.perform(*ast);
-
+      Value result = engine == Engine::Register ? evaluateOnRegisters(*ast)
+                                                : evaluateOnStack(*ast);
       if (verbose) {
-        ASTPrettyPrinter printer(interner);
-        printer.print(*ast);
+        std::cout << std::endl;
       }
 
-      Compiler compiler(nullptr, Compiler::FunctionKind::TopLevel,
-                        compilerGlobals, interner, *ast, verbose);
-      auto rootFunction = ObjectPtr<FunctionObject>(compiler.compile());
+      // print the result of the last statement
+      std::cout << valueToString(result, interner) << std::endl;
 
-      Value result = vm.evaluate(rootFunction);
-      if (verbose) {
-        std::cout << std::endl;
+      return result;
+    } catch (const Error& e) {
+      std::cout << "Error: " << e.what() << std::endl;
+
+      return Value::NIL;
+    }
+  }
+
+  // Runs a script precompiled by compileFile, skipping the front end
+  Value runBytecode(const std::string& data) {
+    try {
+      if (engine != Engine::Stack) {
+        throw Error("Bytecode files only run on the stack engine");
       }
+      auto rootFunction = BytecodeFile::read(data, interner);
+      Value result = vm.evaluate(rootFunction);
 
-      // print the result of the last statement
       std::cout << valueToString(result, interner) << std::endl;
 
       return result;
@@ -71,15 +130,131 @@ class Interpreter {
     }
   }
 
+  // Parses, type checks and folds the source, which the AST refers to and
+  // has to outlive it. Returns nullptr if it does not parse, after the parser
+  // has reported the errors.
+  std::unique_ptr<BlockStmt> analyze(const std::string& source) {
+    std::unique_ptr<BlockStmt> ast;
+    {
+      PhaseTimer timer(phaseTimes.parse);
+      Scanner scanner(source);
+      Parser parser(scanner, interner);
+      ast = parser.parse();
+      if (parser.hadError()) {
+        return nullptr;
+      }
+    }
+
+    {
+      PhaseTimer timer(phaseTimes.typeCheck);
+      TypeInference inference(interner, &inferenceGlobals, &constantGlobals);
+      inference.perform(*ast);
+    }
+    {
+      PhaseTimer timer(phaseTimes.compile);
+      ConstantFolding().perform(*ast);
+    }
+
+    if (verbose) {
+      ASTPrettyPrinter printer(interner);
+      printer.print(*ast);
+    }
+    return ast;
+  }
+
+  ObjectPtr<FunctionObject> compileForStack(Stmt& ast) {
+    PhaseTimer timer(phaseTimes.compile);
+    Compiler compiler(nullptr, Compiler::FunctionKind::TopLevel,
+                      compilerGlobals, interner, ast, std::nullopt, verbose,
+                      peephole, ssa, inlining ? &inlineCandidates : nullptr);
+    return ObjectPtr<FunctionObject>(compiler.compile());
+  }
+
+  Value evaluateOnStack(Stmt& ast) {
+    auto rootFunction = compileForStack(ast);
+    PhaseTimer timer(phaseTimes.execute);
+    return vm.evaluate(rootFunction);
+  }
+
+  Value evaluateOnRegisters(Stmt& ast) {
+    ObjectPtr<FunctionObject> rootFunction;
+    {
+      PhaseTimer timer(phaseTimes.compile);
+      RegisterCompiler compiler(
+          nullptr, RegisterCompiler::FunctionKind::TopLevel, compilerGlobals,
+          interner, ast, std::nullopt, verbose);
+      rootFunction = ObjectPtr<FunctionObject>(compiler.compile());
+    }
+    PhaseTimer timer(phaseTimes.execute);
+    return registerVM.evaluate(rootFunction);
+  }
+
   Value runFile(const std::string& filename) {
-    std::ifstream file(filename);
+    std::string input = readFile(filename);
+    if (filename.ends_with(BytecodeFile::EXTENSION)) {
+      return runBytecode(input);
+    }
+    return run(input);
+  }
+
+  bool compileFile(const std::string& filename, const std::string& output) {
+    try {
+      std::string source = readFile(filename);
+      auto ast = analyze(source);
+      if (ast == nullptr) {
+        return false;
+      }
+      std::string data =
+          BytecodeFile::write(*compileForStack(*ast).get(), interner);
+
+      std::ofstream file(output, std::ios::binary);
+      if (!file.write(data.data(), data.size())) {
+        std::cerr << "Could not write file: " << output << std::endl;
+        return false;
+      }
+      return true;
+    } catch (const Error& e) {
+      std::cout << "Error: " << e.what() << std::endl;
+
+      return false;
+    }
+  }
+
+  // Writes the samples taken so far to the profile file, if profiling, and
+  // reports the opcode counts and live objects, if asked to
+  void writeReports() {
+    if (const Profiler* profiler = vm.getProfiler()) {
+      std::ofstream file(profile);
+      if (!(file << profiler->collapsedStacks())) {
+        std::cerr << "Could not write file: " << profile << std::endl;
+      }
+    }
+    if (const OpcodeStats* stats = vm.getOpcodeStats()) {
+      if (opcodeStats) {
+        std::cerr << stats->table();
+      }
+      if (!opcodeStatsJson.empty()) {
+        std::ofstream file(opcodeStatsJson);
+        if (!(file << stats->json())) {
+          std::cerr << "Could not write file: " << opcodeStatsJson << std::endl;
+        }
+      }
+    }
+    if (objectStats) {
+      std::cerr << ObjectAllocator::get().statsToString();
+    }
+  }
+
+  const PhaseTimes& getPhaseTimes() const { return phaseTimes; }
+
+  static std::string readFile(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
     if (!file) {
       std::cerr << "Could not open file: " << filename << std::endl;
       exit(1);
     }
-    std::string input((std::istreambuf_iterator<char>(file)),
-                      std::istreambuf_iterator<char>());
-    return run(input);
+    return std::string((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
   }
 
   void repl() {
@@ -125,19 +300,56 @@ class Interpreter {
 };
 
 // Public API
+Value run(const std::string& source, const Options& options) {
+  Interpreter interpreter(options);
+  Value result = interpreter.run(source);
+  interpreter.writeReports();
+  return result;
+}
+
+Value run(const std::string& source, const Options& options,
+          PhaseTimes& times) {
+  Interpreter interpreter(options);
+  Value result = interpreter.run(source);
+  interpreter.writeReports();
+  times = interpreter.getPhaseTimes();
+  return result;
+}
+
+Value runFile(const std::string& filename, const Options& options) {
+  Interpreter interpreter(options);
+  Value result = interpreter.runFile(filename);
+  interpreter.writeReports();
+  return result;
+}
+
+bool compileFile(const std::string& filename, const std::string& output,
+                 const Options& options) {
+  Interpreter interpreter(options);
+  return interpreter.compileFile(filename, output);
+}
+
+void repl(const Options& options) {
+  Interpreter interpreter(options);
+  interpreter.repl();
+}
+
 Value run(const std::string& source, bool verbose) {
-  Interpreter interpreter(verbose);
-  return interpreter.run(source);
+  Options options;
+  options.verbose = verbose;
+  return run(source, options);
 }
 
 Value runFile(const std::string& filename, bool verbose) {
-  Interpreter interpreter(verbose);
-  return interpreter.runFile(filename);
+  Options options;
+  options.verbose = verbose;
+  return runFile(filename, options);
 }
 
 void repl(bool verbose) {
-  Interpreter interpreter(verbose);
-  interpreter.repl();
+  Options options;
+  options.verbose = verbose;
+  repl(options);
 }
 
 }  // namespace Shiny
@@ -1,11 +1,63 @@
 #pragma once
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 #include "runtime/value.h"
 
 namespace Shiny {
 
+enum class Engine {
+  Stack,     // stack-based bytecode, supports the whole language
+  Register,  // register-based bytecode, no classes or captured variables yet
+};
+
+struct Options {
+  bool verbose = false;
+  Engine engine = Engine::Stack;
+  size_t stackSize = 1 << 18;  // values the stack engine's stack can hold
+  bool jit = false;  // compile hot functions of the stack engine to x86-64
+  uint32_t jitThreshold = 100;  // calls or loop iterations after which a
+                                // function is compiled
+  bool peephole = true;  // run the peephole pass over stack engine bytecode
+  bool ssa = false;  // compile functions through the SSA IR when supported
+  bool inlining = true;  // inline calls to small functions and methods
+  // File to write the stack engine's sampled call stacks to, as collapsed
+  // stacks for flamegraph tools, or empty to not profile. Turns off the JIT.
+  std::string profile;
+  // Count the opcodes, opcode pairs and functions the stack engine runs, and
+  // print them as a table to stderr if opcodeStats is set and write them to
+  // the file opcodeStatsJson names as JSON if it is not empty. Either turns
+  // off the JIT.
+  bool opcodeStats = false;
+  std::string opcodeStatsJson;
+  // Print how many objects of each kind are still alive, and the slabs they
+  // are allocated from, to stderr after running
+  bool objectStats = false;
+};
+
+// How long each phase of running a script took
+struct PhaseTimes {
+  std::chrono::nanoseconds parse{0};
+  std::chrono::nanoseconds typeCheck{0};
+  std::chrono::nanoseconds compile{0};  // includes constant folding
+  std::chrono::nanoseconds execute{0};
+};
+
+Value run(const std::string& source, const Options& options);
+// Like run, and sets times to how long each phase took, for benchmarks
+Value run(const std::string& source, const Options& options,
+          PhaseTimes& times);
+// Runs a script, or a precompiled one if the filename ends in .shinyc
+Value runFile(const std::string& filename, const Options& options);
+// Compiles a script for the stack engine and writes it to output as a .shinyc
+// file. Returns false after reporting the error if it does not compile.
+bool compileFile(const std::string& filename, const std::string& output,
+                 const Options& options);
+void repl(const Options& options);
+
 Value run(const std::string& source, bool verbose = false);
 Value runFile(const std::string& filename, bool verbose = false);
 void repl(bool verbose = false);
@@ -0,0 +1,8 @@
+#pragma once
+
+// Threaded dispatch relies on the labels-as-values extension of GCC and Clang.
+// Defining SHINY_NO_COMPUTED_GOTO falls back to a plain switch.
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    !defined(SHINY_NO_COMPUTED_GOTO)
+#define SHINY_COMPUTED_GOTO
+#endif
@@ -0,0 +1,1141 @@
+#include "jit.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#ifdef SHINY_JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+#include "../bytecode.h"
+#include "../runtime/object.h"
+#include "../runtime/object_ptr.h"
+#include "../runtime/value.h"
+#include "vm.h"
+
+// What a tail call leaves the machine code to do: jump to body, which runs the
+// callee in the same frame, or return if the callee was interpreted and has
+// already returned. Fits in rax:rdx.
+struct JitTailCall {
+  Value* sp;
+  const void* body;
+};
+
+// Entry points the machine code calls into for everything it does not do
+// inline. They take the VM, the stack pointer and the operand of the
+// instruction, and return the new stack pointer, or nullptr after storing the
+// exception the instruction threw.
+struct JitHelpers {
+  template <typename F>
+  static Value* guarded(VM* vm, Value* sp, F&& body) {
+    vm->sp = sp;
+    try {
+      body();
+      return vm->sp;
+    } catch (...) {
+      vm->jit->pendingError = std::current_exception();
+      return nullptr;
+    }
+  }
+
+  // Runs the frame that was just pushed, as machine code if possible
+  static void runFrame(VM* vm) {
+    if (!vm->runNative()) {
+      vm->run(vm->callStack.size());
+    }
+  }
+
+  static Value* constant(VM* vm, Value* sp, uint32_t index) {
+    return guarded(vm, sp, [&] { vm->push(vm->chunk->constants[index]); });
+  }
+  static Value* closure(VM* vm, Value* sp, uint32_t index) {
+    return guarded(vm, sp, [&] {
+      vm->push(Value(vm->makeClosure(
+          vm->chunk->constants[index].asObject<FunctionObject>())));
+    });
+  }
+  static Value* klass(VM* vm, Value* sp, uint32_t index) {
+    return guarded(vm, sp, [&] {
+      vm->push(Value(vm->makeClass(
+          *vm->chunk->constants[index].asObject<ClassObject>().get())));
+    });
+  }
+  static Value* equal(VM* vm, Value* sp, uint32_t negate) {
+    return guarded(vm, sp, [&] {
+      Value b = vm->pop();
+      Value a = vm->pop();
+      bool equal = a.isDouble() && b.isDouble() ? a.asDouble() == b.asDouble()
+                                                : a == b;
+      vm->push(Value(negate ? !equal : equal));
+    });
+  }
+
+  // Slow paths of the stack manipulation templates, taken when a value
+  // involved is an object and needs its reference count updated
+  static Value* load(VM* vm, Value* sp, uint32_t slot) {
+    return guarded(vm, sp, [&] { vm->push(vm->stack[vm->bp + slot]); });
+  }
+  static Value* store(VM* vm, Value* sp, uint32_t slot) {
+    return guarded(vm, sp, [&] { vm->stack[vm->bp + slot] = vm->pop(); });
+  }
+  static Value* parentLoad(VM* vm, Value* sp, uint32_t operand) {
+    return guarded(vm, sp, [&] { vm->push(vm->parentSlot(operand)); });
+  }
+  static Value* parentStore(VM* vm, Value* sp, uint32_t operand) {
+    return guarded(vm, sp, [&] { vm->parentSlot(operand) = vm->pop(); });
+  }
+  static Value* dup(VM* vm, Value* sp, uint32_t) {
+    return guarded(vm, sp, [&] { vm->push(vm->peek()); });
+  }
+  static Value* pop(VM* vm, Value* sp, uint32_t) {
+    return guarded(vm, sp, [&] { vm->lastPoppedValue = vm->pop(); });
+  }
+  static Value* slide(VM* vm, Value* sp, uint32_t count) {
+    return guarded(vm, sp, [&] {
+      *(vm->sp - count - 1) = std::move(vm->peek());
+      for (uint32_t i = 0; i < count; i++) {
+        vm->pop();
+      }
+    });
+  }
+
+  static Value* call(VM* vm, Value* sp, uint32_t arity) {
+    return guarded(vm, sp, [&] {
+      if (arity == 0 && vm->peek().isObject<ClassObject>()) {
+        vm->callClass();
+        return;
+      }
+      vm->pushFrame(arity);
+      if (vm->currentFunction.isObject<MethodObject>()) {
+        vm->stack[vm->bp] =
+            vm->currentFunction.asObject<MethodObject>()->getSelf();
+      }
+      runFrame(vm);
+    });
+  }
+  static Value* invoke(VM* vm, Value* sp, uint32_t operand) {
+    return guarded(vm, sp, [&] {
+      int arity = operandLow(operand);
+      auto instance = (vm->sp - arity - 1)->asObject<InstanceObject>();
+      vm->pushFrame(instance->getClass()->getMembers()[operandHigh(operand)],
+                    arity);
+      runFrame(vm);
+    });
+  }
+  static JitTailCall tailCall(VM* vm, Value* sp, uint32_t arity) {
+    const void* body = nullptr;
+    Value* result = guarded(vm, sp, [&] {
+      vm->replaceFrame(arity);
+      auto function = vm->getFunctionFromValue(vm->currentFunction);
+      if (vm->jit->codeFor(*function.get()) != nullptr) {
+        body = function->getJitState().body;
+      } else {
+        vm->run(vm->callStack.size());
+      }
+    });
+    return {result, body};
+  }
+  static Value* ret(VM* vm, Value* sp, uint32_t) {
+    return guarded(vm, sp, [&] {
+      vm->closeUpvalues(vm->bp);
+      Value returnValue = vm->pop();
+      while (vm->sp > vm->stack.get() + vm->bp) {
+        vm->pop();
+      }
+      vm->push(std::move(returnValue));
+      vm->popFrame();
+    });
+  }
+
+  static Value* globalLoad(VM* vm, Value* sp, uint32_t index) {
+    return guarded(vm, sp, [&] { vm->push(vm->global(index)); });
+  }
+  static Value* globalStore(VM* vm, Value* sp, uint32_t index) {
+    return guarded(vm, sp, [&] {
+      if (index >= vm->globals.size()) {
+        vm->globals.resize(index + 1);
+      }
+      vm->globals[index] = vm->pop();
+    });
+  }
+
+  static Value* upvalueLoad(VM* vm, Value* sp, uint32_t index) {
+    return guarded(vm, sp, [&] {
+      vm->push(*vm->closure->getUpvalueLocation(index));
+    });
+  }
+  static Value* upvalueStore(VM* vm, Value* sp, uint32_t index) {
+    return guarded(vm, sp, [&] {
+      *vm->closure->getUpvalueLocation(index) = vm->peek();
+      vm->pop();
+    });
+  }
+  static Value* upvalueClose(VM* vm, Value* sp, uint32_t) {
+    return guarded(vm, sp, [&] {
+      vm->closeUpvalues(vm->stackCount() - 1);
+      vm->pop();
+    });
+  }
+
+  static Value* memberGet(VM* vm, Value* sp, uint32_t index) {
+    return guarded(vm, sp, [&] {
+      auto instance = vm->peek().asObject<InstanceObject>();
+      vm->pop();
+      vm->push(vm->getMember(instance, index));
+    });
+  }
+  static Value* memberSet(VM* vm, Value* sp, uint32_t index) {
+    return guarded(vm, sp, [&] {
+      Value value = vm->pop();
+      vm->peek().asObject<InstanceObject>()->setMember(index, value);
+    });
+  }
+  static Value* localMemberGet(VM* vm, Value* sp, uint32_t operand) {
+    return guarded(vm, sp, [&] {
+      auto instance =
+          vm->stack[vm->bp + operandLow(operand)].asObject<InstanceObject>();
+      vm->push(vm->getMember(instance, operandHigh(operand)));
+    });
+  }
+
+  // Raise the errors the arithmetic templates detect
+  static Value* intOutOfRange(VM* vm, Value* sp, uint32_t) {
+    return guarded(vm, sp, [&] {
+      throw std::runtime_error(
+          "Value is out of range, only up to 48-bit integers are supported");
+    });
+  }
+  static Value* divisionByZero(VM* vm, Value* sp, uint32_t) {
+    return guarded(vm, sp,
+                   [&] { throw std::runtime_error("Division by zero"); });
+  }
+};
+
+namespace {
+
+enum Reg : uint8_t {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// condition codes of jcc and setcc; flipping the lowest bit negates
+// a condition
+enum Cond : uint8_t {
+  OVERFLOW = 0x0,
+  ABOVE_OR_EQUAL = 0x3,
+  EQUAL = 0x4,
+  NOT_EQUAL = 0x5,
+  ABOVE = 0x7,
+  PARITY = 0xa,
+  NO_PARITY = 0xb,
+  LESS = 0xc,
+  GREATER_OR_EQUAL = 0xd,
+  LESS_OR_EQUAL = 0xe,
+  GREATER = 0xf,
+};
+
+Cond negate(Cond cond) { return static_cast<Cond>(cond ^ 1); }
+
+// Two-operand arithmetic instructions, as their r/m64, r64 opcode and their
+// /digit in the r/m64, imm32 form
+struct AluOp {
+  uint8_t opcode;
+  uint8_t digit;
+};
+constexpr AluOp ADD{0x01, 0};
+constexpr AluOp OR{0x09, 1};
+constexpr AluOp AND{0x21, 4};
+constexpr AluOp SUB{0x29, 5};
+constexpr AluOp XOR{0x31, 6};
+constexpr AluOp CMP{0x39, 7};
+
+// /digit of the shift instructions
+constexpr uint8_t SHL = 4;
+constexpr uint8_t SHR = 5;
+constexpr uint8_t SAR = 7;
+
+// second opcode byte of the scalar double instructions
+constexpr uint8_t ADDSD = 0x58;
+constexpr uint8_t MULSD = 0x59;
+constexpr uint8_t SUBSD = 0x5c;
+constexpr uint8_t DIVSD = 0x5e;
+
+// Emits the handful of x86-64 instructions the templates need. Memory
+// operands are always a base register and a 32-bit displacement.
+class Assembler {
+ public:
+  using Label = size_t;
+
+  Label newLabel() {
+    labels.push_back({});
+    return labels.size() - 1;
+  }
+  void bind(Label label) { labels[label].offset = code.size(); }
+  size_t offsetOf(Label label) const { return labels[label].offset; }
+  size_t offset() const { return code.size(); }
+
+  void movImm(Reg dst, uint64_t imm) {
+    rex(true, 0, dst);
+    byte(0xb8 + (dst & 7));
+    qword(imm);
+  }
+  void mov(Reg dst, Reg src) {
+    rex(true, src, dst);
+    byte(0x89);
+    direct(src, dst);
+  }
+  void load(Reg dst, Reg base, int32_t disp) {
+    rex(true, dst, base);
+    byte(0x8b);
+    memory(dst, base, disp);
+  }
+  void store(Reg base, int32_t disp, Reg src) {
+    rex(true, src, base);
+    byte(0x89);
+    memory(src, base, disp);
+  }
+  void lea(Reg dst, Reg base, int32_t disp) {
+    rex(true, dst, base);
+    byte(0x8d);
+    memory(dst, base, disp);
+  }
+
+  void alu(AluOp op, Reg dst, Reg src) {
+    rex(true, src, dst);
+    byte(op.opcode);
+    direct(src, dst);
+  }
+  void alu(AluOp op, Reg dst, int32_t imm) {
+    rex(true, 0, dst);
+    byte(0x81);
+    direct(op.digit, dst);
+    dword(imm);
+  }
+  void test(Reg dst, Reg src) {
+    rex(true, src, dst);
+    byte(0x85);
+    direct(src, dst);
+  }
+  void shift(uint8_t digit, Reg dst, uint8_t amount) {
+    rex(true, 0, dst);
+    byte(0xc1);
+    direct(digit, dst);
+    byte(amount);
+  }
+  void imul(Reg dst, Reg src) {
+    rex(true, dst, src);
+    byte(0x0f);
+    byte(0xaf);
+    direct(dst, src);
+  }
+  void neg(Reg dst) {
+    rex(true, 0, dst);
+    byte(0xf7);
+    direct(3, dst);
+  }
+  // signed division of rdx:rax, quotient in rax and remainder in rdx
+  void cqoIdiv(Reg divisor) {
+    byte(0x48);
+    byte(0x99);
+    rex(true, 0, divisor);
+    byte(0xf7);
+    direct(7, divisor);
+  }
+  // sets the low byte of rax or rcx
+  void setcc(Cond cond, Reg dst) {
+    byte(0x0f);
+    byte(0x90 | cond);
+    direct(0, dst);
+  }
+  void andLowBytes(Reg dst, Reg src) {
+    byte(0x20);
+    direct(src, dst);
+  }
+  void orLowBytes(Reg dst, Reg src) {
+    byte(0x08);
+    direct(src, dst);
+  }
+  void movzxLowByte(Reg dst, Reg src) {
+    byte(0x0f);
+    byte(0xb6);
+    direct(dst, src);
+  }
+
+  // xmm registers are numbered from 0 like the general purpose ones
+  void movsdLoad(int dst, Reg base, int32_t disp) {
+    byte(0xf2);
+    rex(false, dst, base);
+    byte(0x0f);
+    byte(0x10);
+    memory(dst, base, disp);
+  }
+  void movsdStore(Reg base, int32_t disp, int src) {
+    byte(0xf2);
+    rex(false, src, base);
+    byte(0x0f);
+    byte(0x11);
+    memory(src, base, disp);
+  }
+  void sse(uint8_t opcode, int dst, int src) {
+    byte(0xf2);
+    byte(0x0f);
+    byte(opcode);
+    direct(dst, src);
+  }
+  void ucomisd(int a, int b) {
+    byte(0x66);
+    byte(0x0f);
+    byte(0x2e);
+    direct(a, b);
+  }
+
+  void jump(Label label) {
+    byte(0xe9);
+    use(label);
+  }
+  void jump(Cond cond, Label label) {
+    byte(0x0f);
+    byte(0x80 | cond);
+    use(label);
+  }
+  void jump(Reg target) {
+    rex(false, 0, target);
+    byte(0xff);
+    direct(4, target);
+  }
+  void call(Reg target) {
+    rex(false, 0, target);
+    byte(0xff);
+    direct(2, target);
+  }
+  void push(Reg reg) {
+    rex(false, 0, reg);
+    byte(0x50 + (reg & 7));
+  }
+  void pop(Reg reg) {
+    rex(false, 0, reg);
+    byte(0x58 + (reg & 7));
+  }
+  void ret() { byte(0xc3); }
+
+  // Resolves the jumps to labels and returns the code
+  std::vector<uint8_t> finish() {
+    for (auto& label : labels) {
+      for (size_t use : label.uses) {
+        int32_t rel = label.offset - (use + 4);
+        std::memcpy(&code[use], &rel, sizeof(rel));
+      }
+    }
+    return std::move(code);
+  }
+
+ private:
+  struct LabelInfo {
+    size_t offset = 0;
+    std::vector<size_t> uses;
+  };
+
+  void byte(uint8_t b) { code.push_back(b); }
+  void dword(uint32_t d) {
+    for (int i = 0; i < 4; i++) {
+      byte(d >> (8 * i));
+    }
+  }
+  void qword(uint64_t q) {
+    for (int i = 0; i < 8; i++) {
+      byte(q >> (8 * i));
+    }
+  }
+  void use(Label label) {
+    labels[label].uses.push_back(code.size());
+    dword(0);
+  }
+
+  void rex(bool wide, int reg, int base) {
+    uint8_t prefix = 0x40 | wide << 3 | (reg & 8) >> 1 | (base & 8) >> 3;
+    if (prefix != 0x40) {
+      byte(prefix);
+    }
+  }
+  void direct(int reg, int rm) { byte(0xc0 | (reg & 7) << 3 | (rm & 7)); }
+  void memory(int reg, Reg base, int32_t disp) {
+    byte(0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+      byte(0x24);  // rsp and r12 as a base need a SIB byte
+    }
+    dword(disp);
+  }
+
+  std::vector<uint8_t> code;
+  std::vector<LabelInfo> labels;
+};
+
+// Register assignment of the machine code; all but the scratch registers
+// rax, rcx and rdx are callee-saved
+constexpr Reg VM_REG = RBX;
+constexpr Reg SP = R12;
+constexpr Reg BP = R13;
+constexpr Reg INT_TAG = R14;      // holds the NaN and tag bits of an int
+constexpr Reg OBJECT_MASK = R15;  // holds the bits that identify an object
+
+// Bit patterns of Value, see value.h
+constexpr uint64_t NAN_AND_INT_TAG = 0x7ff8000000000003;
+constexpr uint64_t NAN_AND_TAG_MASK = 0x7ff8000000000007;
+constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+constexpr int32_t SLOT = sizeof(Value);
+
+// Translates a Chunk template by template. Returns false from compile() when
+// the chunk has an opcode without a template.
+class ChunkCompiler {
+ public:
+  explicit ChunkCompiler(const Chunk& chunk) : chunk(chunk) {}
+
+  bool compile() {
+    const auto& instructions = chunk.instructions;
+    for (size_t i = 0; i <= instructions.size(); i++) {
+      instructionLabels.push_back(as.newLabel());
+    }
+    exitLabel = as.newLabel();
+    leaveLabel = as.newLabel();
+    errorLabel = as.newLabel();
+    outOfRangeLabel = as.newLabel();
+    divisionByZeroLabel = as.newLabel();
+
+    prologue();
+    bodyOffset = as.offset();
+    for (size_t offset = 0; offset < instructions.size();
+         offset += instructionWidth(opcodeAt(offset))) {
+      as.bind(instructionLabels[offset]);
+      if (!compileInstruction(offset)) {
+        return false;
+      }
+    }
+    as.bind(instructionLabels[instructions.size()]);
+    epilogue();
+    return true;
+  }
+
+  size_t getBodyOffset() const { return bodyOffset; }
+  // Offsets into the code of the instructions loops jump back to
+  std::vector<std::pair<uint32_t, size_t>> getLoopEntryOffsets() const {
+    std::vector<std::pair<uint32_t, size_t>> entries;
+    for (uint32_t header : loopHeaders) {
+      entries.emplace_back(header, as.offsetOf(instructionLabels[header]));
+    }
+    return entries;
+  }
+  std::vector<uint8_t> finish() { return as.finish(); }
+
+ private:
+  Opcode opcodeAt(size_t offset) const {
+    return static_cast<Opcode>(chunk.instructions[offset] & 0xFF);
+  }
+
+  void prologue() {
+    // six pushes and the return address keep the stack 16-byte aligned for
+    // the helper calls once another 8 bytes are reserved
+    for (Reg reg : {RBP, RBX, R12, R13, R14, R15}) {
+      as.push(reg);
+    }
+    as.alu(SUB, RSP, 8);
+    as.mov(VM_REG, RDI);
+    as.mov(SP, RSI);
+    as.mov(BP, RDX);
+    as.movImm(INT_TAG, NAN_AND_INT_TAG);
+    as.movImm(OBJECT_MASK, NAN_AND_TAG_MASK);
+    as.jump(RCX);
+  }
+
+  void epilogue() {
+    as.bind(exitLabel);
+    as.mov(RAX, SP);
+    as.bind(leaveLabel);
+    as.alu(ADD, RSP, 8);
+    for (Reg reg : {R15, R14, R13, R12, RBX, RBP}) {
+      as.pop(reg);
+    }
+    as.ret();
+
+    // the helpers return nullptr after raising the error
+    as.bind(outOfRangeLabel);
+    callHelper(&JitHelpers::intOutOfRange, 0);
+    as.bind(divisionByZeroLabel);
+    callHelper(&JitHelpers::divisionByZero, 0);
+    as.bind(errorLabel);
+    as.alu(XOR, RAX, RAX);
+    as.jump(leaveLabel);
+  }
+
+  // Calls helper(vm, sp, operand) and continues with the stack pointer it
+  // returns, or leaves with nullptr if it threw
+  template <typename Helper>
+  void callHelper(Helper helper, uint32_t operand) {
+    as.mov(RDI, VM_REG);
+    as.mov(RSI, SP);
+    as.movImm(RDX, operand);
+    as.movImm(RAX, reinterpret_cast<uint64_t>(helper));
+    as.call(RAX);
+    as.test(RAX, RAX);
+    as.jump(EQUAL, errorLabel);
+    as.mov(SP, RAX);
+  }
+
+  // Jumps to label if the value in reg is an object; clobbers rcx
+  void jumpIfObject(Reg reg, Assembler::Label label) {
+    as.mov(RCX, reg);
+    as.alu(AND, RCX, OBJECT_MASK);
+    as.alu(SUB, RCX, INT_TAG);
+    as.alu(CMP, RCX, 1);  // TAG_OBJ is one more than TAG_INT
+    as.jump(EQUAL, label);
+  }
+
+  // Turns the int Value in reg into an int64 by sign-extending its 48 bits
+  void unboxInt(Reg reg) {
+    as.shift(SHL, reg, 13);
+    as.shift(SAR, reg, 16);
+  }
+  // Turns the int64 in rax back into a Value, raising the same error Value
+  // does if it does not fit in 48 bits; clobbers rcx
+  void boxInt() {
+    as.mov(RCX, RAX);
+    as.shift(SHL, RCX, 16);
+    as.shift(SAR, RCX, 16);
+    as.alu(CMP, RCX, RAX);
+    as.jump(NOT_EQUAL, outOfRangeLabel);
+    tagInt(RAX);
+  }
+  // Turns the int64 in reg, known to fit in 48 bits, into a Value
+  void tagInt(Reg reg) {
+    as.shift(SHL, reg, 16);
+    as.shift(SHR, reg, 13);
+    as.alu(OR, reg, INT_TAG);
+  }
+  // Turns the condition flag in the low byte of rax into a bool Value in rdx
+  void boxBool() {
+    as.movzxLowByte(RAX, RAX);
+    as.lea(RDX, INT_TAG, -1);  // FALSE, which minus one is TRUE
+    as.alu(SUB, RDX, RAX);
+  }
+
+  void pushReg(Reg reg) {
+    as.store(SP, 0, reg);
+    as.alu(ADD, SP, SLOT);
+  }
+  void pushImm(uint64_t raw) {
+    as.movImm(RAX, raw);
+    pushReg(RAX);
+  }
+  // Replaces the top two values with the one in reg
+  void replaceTopTwo(Reg reg) {
+    as.store(SP, -2 * SLOT, reg);
+    as.alu(SUB, SP, SLOT);
+  }
+  void loadLocalInt(Reg dst, uint32_t slot) {
+    as.load(dst, BP, slot * SLOT);
+    unboxInt(dst);
+  }
+  int64_t constantInt(uint32_t index) const {
+    return chunk.constants[index].asInt();
+  }
+
+  void intArithmetic(Opcode opcode) {
+    as.load(RAX, SP, -2 * SLOT);
+    unboxInt(RAX);
+    as.load(RCX, SP, -SLOT);
+    unboxInt(RCX);
+    intOperation(opcode);
+    boxInt();
+    replaceTopTwo(RAX);
+  }
+  // rax = rax op rcx for ADD_INT, SUB_INT, MUL_INT, DIV_INT and MOD_INT
+  void intOperation(Opcode opcode) {
+    switch (opcode) {
+      case Opcode::ADD_INT:
+        as.alu(ADD, RAX, RCX);
+        break;
+      case Opcode::SUB_INT:
+        as.alu(SUB, RAX, RCX);
+        break;
+      case Opcode::MUL_INT:
+        as.imul(RAX, RCX);
+        as.jump(OVERFLOW, outOfRangeLabel);
+        break;
+      case Opcode::DIV_INT:
+      case Opcode::MOD_INT:
+        as.test(RCX, RCX);
+        as.jump(EQUAL, divisionByZeroLabel);
+        as.cqoIdiv(RCX);
+        if (opcode == Opcode::MOD_INT) {
+          as.mov(RAX, RDX);
+        }
+        break;
+      default:
+        throw std::logic_error("Not an int operation");
+    }
+  }
+
+  void intComparison(Cond cond) {
+    as.load(RAX, SP, -2 * SLOT);
+    unboxInt(RAX);
+    as.load(RCX, SP, -SLOT);
+    unboxInt(RCX);
+    as.alu(CMP, RAX, RCX);
+    as.setcc(cond, RAX);
+    boxBool();
+    replaceTopTwo(RDX);
+  }
+
+  void doubleArithmetic(uint8_t opcode) {
+    as.movsdLoad(0, SP, -2 * SLOT);
+    as.movsdLoad(1, SP, -SLOT);
+    as.sse(opcode, 0, 1);
+    as.movsdStore(SP, -2 * SLOT, 0);
+    as.alu(SUB, SP, SLOT);
+  }
+
+  // Compares like C++ does, so comparisons with NaN are false except !=
+  void doubleComparison(Opcode opcode) {
+    as.movsdLoad(0, SP, -2 * SLOT);
+    as.movsdLoad(1, SP, -SLOT);
+    switch (opcode) {
+      case Opcode::LT_DOUBLE:
+        as.ucomisd(1, 0);
+        as.setcc(ABOVE, RAX);
+        break;
+      case Opcode::LTE_DOUBLE:
+        as.ucomisd(1, 0);
+        as.setcc(ABOVE_OR_EQUAL, RAX);
+        break;
+      case Opcode::GT_DOUBLE:
+        as.ucomisd(0, 1);
+        as.setcc(ABOVE, RAX);
+        break;
+      case Opcode::GTE_DOUBLE:
+        as.ucomisd(0, 1);
+        as.setcc(ABOVE_OR_EQUAL, RAX);
+        break;
+      case Opcode::EQ_DOUBLE:
+        as.ucomisd(0, 1);
+        as.setcc(EQUAL, RAX);
+        as.setcc(NO_PARITY, RCX);
+        as.andLowBytes(RAX, RCX);
+        break;
+      case Opcode::NEQ_DOUBLE:
+        as.ucomisd(0, 1);
+        as.setcc(NOT_EQUAL, RAX);
+        as.setcc(PARITY, RCX);
+        as.orLowBytes(RAX, RCX);
+        break;
+      default:
+        throw std::logic_error("Not a double comparison");
+    }
+    boxBool();
+    replaceTopTwo(RDX);
+  }
+
+  // JUMP_UNLESS_<cmp>_LOCAL_CONST
+  void compareLocalConstAndBranch(Cond cond, uint32_t operand,
+                                  uint32_t target) {
+    loadLocalInt(RAX, operandLow(operand));
+    as.movImm(RCX, constantInt(operandHigh(operand)));
+    as.alu(CMP, RAX, RCX);
+    as.jump(negate(cond), instructionLabels[target]);
+  }
+
+  // JUMP_UNLESS_<cmp>_INT
+  void compareAndBranch(Cond cond, uint32_t target) {
+    as.load(RAX, SP, -2 * SLOT);
+    unboxInt(RAX);
+    as.load(RCX, SP, -SLOT);
+    unboxInt(RCX);
+    as.alu(SUB, SP, 2 * SLOT);
+    as.alu(CMP, RAX, RCX);
+    as.jump(negate(cond), instructionLabels[target]);
+  }
+
+  // <op>_INT_LOCAL_CONST and ADD_INT_LOCALS, with the unboxed right operand
+  // already in rcx
+  void localArithmetic(Opcode opcode, uint32_t slot) {
+    loadLocalInt(RAX, slot);
+    intOperation(opcode);
+    boxInt();
+    pushReg(RAX);
+  }
+
+  bool compileInstruction(size_t offset) {
+    Instruction instruction = chunk.instructions[offset];
+    Opcode opcode = static_cast<Opcode>(instruction & 0xFF);
+    uint32_t operand = instruction >> 8;
+
+    switch (opcode) {
+      case Opcode::NO_OP:
+        return true;
+
+      case Opcode::NIL:
+        pushImm(Value::NIL.__getRaw());
+        return true;
+      case Opcode::TRUE:
+        pushImm(Value::TRUE.__getRaw());
+        return true;
+      case Opcode::FALSE:
+        pushImm(Value::FALSE.__getRaw());
+        return true;
+      case Opcode::CONST:
+        if (chunk.constants[operand].isAnyObject()) {
+          callHelper(&JitHelpers::constant, operand);
+        } else {
+          pushImm(chunk.constants[operand].__getRaw());
+        }
+        return true;
+      case Opcode::CLOSURE:
+        callHelper(&JitHelpers::closure, operand);
+        return true;
+      case Opcode::CLASS:
+        callHelper(&JitHelpers::klass, operand);
+        return true;
+
+      case Opcode::EQ:
+        callHelper(&JitHelpers::equal, 0);
+        return true;
+      case Opcode::NEQ:
+        callHelper(&JitHelpers::equal, 1);
+        return true;
+      case Opcode::NOT:
+        as.load(RAX, SP, -SLOT);
+        as.alu(XOR, RAX, 3);  // swaps TAG_TRUE and TAG_FALSE
+        as.store(SP, -SLOT, RAX);
+        return true;
+
+      case Opcode::LOAD: {
+        auto slow = as.newLabel();
+        auto done = as.newLabel();
+        as.load(RAX, BP, operand * SLOT);
+        jumpIfObject(RAX, slow);
+        pushReg(RAX);
+        as.jump(done);
+        as.bind(slow);
+        callHelper(&JitHelpers::load, operand);
+        as.bind(done);
+        return true;
+      }
+      case Opcode::STORE: {
+        auto slow = as.newLabel();
+        auto done = as.newLabel();
+        as.load(RAX, SP, -SLOT);
+        as.load(RDX, BP, operand * SLOT);
+        jumpIfObject(RAX, slow);
+        jumpIfObject(RDX, slow);
+        as.store(BP, operand * SLOT, RAX);
+        as.alu(SUB, SP, SLOT);
+        as.jump(done);
+        as.bind(slow);
+        callHelper(&JitHelpers::store, operand);
+        as.bind(done);
+        return true;
+      }
+      case Opcode::PARENT_LOAD:
+        callHelper(&JitHelpers::parentLoad, operand);
+        return true;
+      case Opcode::PARENT_STORE:
+        callHelper(&JitHelpers::parentStore, operand);
+        return true;
+      case Opcode::DUP:
+      case Opcode::POP: {
+        auto slow = as.newLabel();
+        auto done = as.newLabel();
+        as.load(RAX, SP, -SLOT);
+        jumpIfObject(RAX, slow);
+        if (opcode == Opcode::DUP) {
+          pushReg(RAX);
+        } else {
+          as.alu(SUB, SP, SLOT);
+        }
+        as.jump(done);
+        as.bind(slow);
+        callHelper(opcode == Opcode::DUP ? &JitHelpers::dup : &JitHelpers::pop,
+                   0);
+        as.bind(done);
+        return true;
+      }
+      case Opcode::SLIDE:
+        callHelper(&JitHelpers::slide, operand);
+        return true;
+
+      case Opcode::JUMP_IF_FALSE:
+      case Opcode::JUMP_IF_TRUE:
+        as.load(RAX, SP, -SLOT);
+        as.alu(SUB, SP, SLOT);
+        as.lea(RCX, INT_TAG, -2);  // TRUE
+        as.alu(CMP, RAX, RCX);
+        as.jump(opcode == Opcode::JUMP_IF_TRUE ? EQUAL : NOT_EQUAL,
+                instructionLabels[operand]);
+        return true;
+      case Opcode::JUMP:
+        as.jump(instructionLabels[operand]);
+        return true;
+      case Opcode::LOOP:
+        loopHeaders.push_back(operand);
+        as.jump(instructionLabels[operand]);
+        return true;
+      case Opcode::FOR_RANGE:
+        // the counter stays below the end, so it needs no range check
+        loopHeaders.push_back(operand);
+        as.load(RAX, SP, -2 * SLOT);
+        unboxInt(RAX);
+        as.alu(ADD, RAX, 1);
+        as.mov(RDX, RAX);
+        tagInt(RAX);
+        as.store(SP, -2 * SLOT, RAX);
+        as.load(RCX, SP, -SLOT);
+        unboxInt(RCX);
+        as.alu(CMP, RDX, RCX);
+        as.jump(LESS, instructionLabels[operand]);
+        return true;
+      case Opcode::CALL:
+        callHelper(&JitHelpers::call, operand);
+        return true;
+      case Opcode::INVOKE:
+        callHelper(&JitHelpers::invoke, operand);
+        return true;
+      case Opcode::TAIL_CALL: {
+        // the helper returns where to continue in rdx, or null if the callee
+        // has returned already
+        callHelper(&JitHelpers::tailCall, operand);
+        as.test(RDX, RDX);
+        as.jump(EQUAL, exitLabel);
+        as.jump(RDX);
+        return true;
+      }
+      case Opcode::RETURN:
+        callHelper(&JitHelpers::ret, 0);
+        as.jump(exitLabel);
+        return true;
+
+      case Opcode::GLOBAL_LOAD:
+        callHelper(&JitHelpers::globalLoad, operand);
+        return true;
+      case Opcode::GLOBAL_STORE:
+        callHelper(&JitHelpers::globalStore, operand);
+        return true;
+      case Opcode::UPVALUE_LOAD:
+        callHelper(&JitHelpers::upvalueLoad, operand);
+        return true;
+      case Opcode::UPVALUE_STORE:
+        callHelper(&JitHelpers::upvalueStore, operand);
+        return true;
+      case Opcode::UPVALUE_CLOSE:
+        callHelper(&JitHelpers::upvalueClose, 0);
+        return true;
+      case Opcode::MEMBER_GET:
+        callHelper(&JitHelpers::memberGet, operand);
+        return true;
+      case Opcode::MEMBER_SET:
+        callHelper(&JitHelpers::memberSet, operand);
+        return true;
+      case Opcode::LOCAL_MEMBER_GET:
+        callHelper(&JitHelpers::localMemberGet, operand);
+        return true;
+
+      case Opcode::ADD_INT:
+      case Opcode::SUB_INT:
+      case Opcode::MUL_INT:
+      case Opcode::DIV_INT:
+      case Opcode::MOD_INT:
+        intArithmetic(opcode);
+        return true;
+      case Opcode::NEG_INT:
+        as.load(RAX, SP, -SLOT);
+        unboxInt(RAX);
+        as.neg(RAX);
+        boxInt();
+        as.store(SP, -SLOT, RAX);
+        return true;
+      case Opcode::ADD_DOUBLE:
+        doubleArithmetic(ADDSD);
+        return true;
+      case Opcode::SUB_DOUBLE:
+        doubleArithmetic(SUBSD);
+        return true;
+      case Opcode::MUL_DOUBLE:
+        doubleArithmetic(MULSD);
+        return true;
+      case Opcode::DIV_DOUBLE:
+        doubleArithmetic(DIVSD);
+        return true;
+      case Opcode::NEG_DOUBLE:
+        as.load(RAX, SP, -SLOT);
+        as.movImm(RCX, SIGN_BIT);
+        as.alu(XOR, RAX, RCX);
+        as.store(SP, -SLOT, RAX);
+        return true;
+
+      case Opcode::EQ_INT:
+        intComparison(EQUAL);
+        return true;
+      case Opcode::NEQ_INT:
+        intComparison(NOT_EQUAL);
+        return true;
+      case Opcode::LT_INT:
+        intComparison(LESS);
+        return true;
+      case Opcode::LTE_INT:
+        intComparison(LESS_OR_EQUAL);
+        return true;
+      case Opcode::GT_INT:
+        intComparison(GREATER);
+        return true;
+      case Opcode::GTE_INT:
+        intComparison(GREATER_OR_EQUAL);
+        return true;
+      case Opcode::EQ_DOUBLE:
+      case Opcode::NEQ_DOUBLE:
+      case Opcode::LT_DOUBLE:
+      case Opcode::LTE_DOUBLE:
+      case Opcode::GT_DOUBLE:
+      case Opcode::GTE_DOUBLE:
+        doubleComparison(opcode);
+        return true;
+
+      case Opcode::JUMP_UNLESS_LT_LOCAL_CONST:
+        compareLocalConstAndBranch(LESS, operand,
+                                   chunk.instructions[offset + 1]);
+        return true;
+      case Opcode::JUMP_UNLESS_LTE_LOCAL_CONST:
+        compareLocalConstAndBranch(LESS_OR_EQUAL, operand,
+                                   chunk.instructions[offset + 1]);
+        return true;
+      case Opcode::JUMP_UNLESS_GT_LOCAL_CONST:
+        compareLocalConstAndBranch(GREATER, operand,
+                                   chunk.instructions[offset + 1]);
+        return true;
+      case Opcode::JUMP_UNLESS_GTE_LOCAL_CONST:
+        compareLocalConstAndBranch(GREATER_OR_EQUAL, operand,
+                                   chunk.instructions[offset + 1]);
+        return true;
+      case Opcode::JUMP_UNLESS_EQ_LOCAL_CONST:
+        compareLocalConstAndBranch(EQUAL, operand,
+                                   chunk.instructions[offset + 1]);
+        return true;
+      case Opcode::JUMP_UNLESS_NEQ_LOCAL_CONST:
+        compareLocalConstAndBranch(NOT_EQUAL, operand,
+                                   chunk.instructions[offset + 1]);
+        return true;
+      case Opcode::JUMP_UNLESS_LT_INT:
+        compareAndBranch(LESS, operand);
+        return true;
+      case Opcode::JUMP_UNLESS_LTE_INT:
+        compareAndBranch(LESS_OR_EQUAL, operand);
+        return true;
+      case Opcode::JUMP_UNLESS_GT_INT:
+        compareAndBranch(GREATER, operand);
+        return true;
+      case Opcode::JUMP_UNLESS_GTE_INT:
+        compareAndBranch(GREATER_OR_EQUAL, operand);
+        return true;
+      case Opcode::JUMP_UNLESS_EQ_INT:
+        compareAndBranch(EQUAL, operand);
+        return true;
+      case Opcode::JUMP_UNLESS_NEQ_INT:
+        compareAndBranch(NOT_EQUAL, operand);
+        return true;
+      case Opcode::ADD_INT_LOCALS:
+        loadLocalInt(RCX, operandHigh(operand));
+        localArithmetic(Opcode::ADD_INT, operandLow(operand));
+        return true;
+      case Opcode::ADD_INT_LOCAL_CONST:
+        as.movImm(RCX, constantInt(operandHigh(operand)));
+        localArithmetic(Opcode::ADD_INT, operandLow(operand));
+        return true;
+      case Opcode::SUB_INT_LOCAL_CONST:
+        as.movImm(RCX, constantInt(operandHigh(operand)));
+        localArithmetic(Opcode::SUB_INT, operandLow(operand));
+        return true;
+      case Opcode::MUL_INT_LOCAL_CONST:
+        as.movImm(RCX, constantInt(operandHigh(operand)));
+        localArithmetic(Opcode::MUL_INT, operandLow(operand));
+        return true;
+
+      default:
+        // untyped arithmetic, bit operations and HALT stay interpreted
+        return false;
+    }
+  }
+
+  const Chunk& chunk;
+  Assembler as;
+  std::vector<Assembler::Label> instructionLabels;
+  Assembler::Label exitLabel;
+  Assembler::Label leaveLabel;
+  Assembler::Label errorLabel;
+  Assembler::Label outOfRangeLabel;
+  Assembler::Label divisionByZeroLabel;
+  size_t bodyOffset = 0;
+  std::vector<uint32_t> loopHeaders;
+};
+
+}  // namespace
+
+Jit::~Jit() {
+#ifdef SHINY_JIT_SUPPORTED
+  for (auto [memory, size] : regions) {
+    munmap(memory, size);
+  }
+#endif
+}
+
+Jit::NativeCode Jit::codeFor(FunctionObject& function) {
+  JitState& state = function.getJitState();
+  if (state.code == nullptr && !state.unsupported &&
+      ++state.callCount >= callThreshold && !compile(function)) {
+    state.unsupported = true;
+  }
+  return reinterpret_cast<NativeCode>(const_cast<void*>(state.code));
+}
+
+const void* Jit::loopEntry(FunctionObject& function, uint32_t header) {
+  JitState& state = function.getJitState();
+  if (state.code == nullptr && !state.unsupported &&
+      ++state.backEdgeCount >= callThreshold && !compile(function)) {
+    state.unsupported = true;
+  }
+  for (auto [offset, entry] : state.loopEntries) {
+    if (offset == header) {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+bool Jit::compile(FunctionObject& function) {
+#ifdef SHINY_JIT_SUPPORTED
+  ChunkCompiler compiler(function.getChunk());
+  if (!compiler.compile()) {
+    return false;
+  }
+  std::vector<uint8_t> code = compiler.finish();
+
+  void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  std::memcpy(memory, code.data(), code.size());
+  if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, code.size());
+    return false;
+  }
+  regions.emplace_back(memory, code.size());
+
+  JitState& state = function.getJitState();
+  state.code = memory;
+  state.body = static_cast<uint8_t*>(memory) + compiler.getBodyOffset();
+  for (auto [header, offset] : compiler.getLoopEntryOffsets()) {
+    state.loopEntries.emplace_back(header,
+                                   static_cast<uint8_t*>(memory) + offset);
+  }
+  return true;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <utility>
+#include <vector>
+
+#include "../runtime/object.h"
+#include "../runtime/value.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define SHINY_JIT_SUPPORTED
+#endif
+
+class VM;
+
+// Baseline JIT for the stack engine. Once a function has been called
+// callThreshold times, or one of its loops has jumped back that many times,
+// its Chunk is translated into x86-64 machine code, one
+// fixed template per opcode. The templates keep the VM's stack pointer in a
+// register and work on the VM's stack directly, so machine code and the
+// interpreter can call each other freely. Anything that allocates, changes
+// reference counts or enters another frame calls back into the VM through
+// the helpers in jit.cc.
+//
+// Functions using an opcode without a template keep being interpreted, as
+// does everything on platforms other than x86-64.
+class Jit {
+ public:
+  // Runs the frame on top of the VM's call stack from entry until it returns
+  // and yields the stack pointer after that. Yields nullptr if the frame
+  // threw, with the exception left in pendingError. entry is the body of the
+  // code to run the frame from its start, or a loop entry to continue a frame
+  // the interpreter has been running.
+  using NativeCode = Value* (*)(VM* vm, Value* sp, Value* bp,
+                                const void* entry);
+
+  // native frames nest on the C++ stack, so deeper calls are interpreted
+  static constexpr int MAX_NATIVE_DEPTH = 1024;
+
+  explicit Jit(uint32_t callThreshold) : callThreshold(callThreshold) {}
+  Jit(const Jit&) = delete;
+  Jit& operator=(const Jit&) = delete;
+  ~Jit();
+
+  // Counts a call to the function and returns its machine code, compiling it
+  // when the function has just become hot. Returns nullptr while the function
+  // is to be interpreted.
+  NativeCode codeFor(FunctionObject& function);
+  // Counts a jump back to the start of a loop at offset header of the
+  // function's chunk and returns where its machine code continues the loop,
+  // compiling it when the loop has just become hot. Returns nullptr while the
+  // function is to be interpreted.
+  const void* loopEntry(FunctionObject& function, uint32_t header);
+
+  std::exception_ptr pendingError;
+  int nativeDepth = 0;
+
+ private:
+  bool compile(FunctionObject& function);
+
+  uint32_t callThreshold;
+
+  // executable memory holding the compiled functions
+  std::vector<std::pair<void*, size_t>> regions;
+};
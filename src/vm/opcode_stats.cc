@@ -0,0 +1,192 @@
+#include "opcode_stats.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <optional>
+#include <sstream>
+
+#include "../debug.h"
+
+void OpcodeStats::start() {
+  hasPrevious = false;
+  last = Clock::now();
+}
+
+void OpcodeStats::stop() {
+  if (hasPrevious) {
+    time[static_cast<uint8_t>(previous)] += Clock::now() - last;
+  }
+  // pairs do not span evaluations
+  hasPrevious = false;
+}
+
+void OpcodeStats::enterFunction(const ObjectPtr<FunctionObject>& function) {
+  auto [it, inserted] = functions.try_emplace(function.get());
+  if (inserted) {
+    it->second.function = function;
+    auto name = function->getName();
+    it->second.name =
+        name.has_value() ? stringInterner.get(*name) : "<top level>";
+  }
+  currentFunction = function.get();
+  currentCount = &it->second.count;
+}
+
+uint64_t OpcodeStats::total() const {
+  uint64_t total = 0;
+  for (uint64_t count : counts) {
+    total += count;
+  }
+  return total;
+}
+
+OpcodeStats::Report OpcodeStats::report() const {
+  Report report;
+  std::map<std::string, Row> classes;
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (counts[i] == 0) {
+      continue;
+    }
+    auto opcode = static_cast<Opcode>(i);
+    auto time =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(this->time[i]);
+    report.opcodes.push_back({.name = opcodeToString(opcode),
+                              .count = counts[i],
+                              .time = time,
+                              .next = ""});
+    Row& opcodeClassRow = classes[opcodeClass(opcode)];
+    opcodeClassRow.name = opcodeClass(opcode);
+    opcodeClassRow.count += counts[i];
+    opcodeClassRow.time += time;
+    report.total += counts[i];
+    report.time += time;
+  }
+  for (auto& [name, row] : classes) {
+    report.classes.push_back(row);
+  }
+
+  for (size_t i = 0; i < pairs->size(); i++) {
+    if ((*pairs)[i] > 0) {
+      report.pairs.push_back(
+          {.name = opcodeToString(static_cast<Opcode>(i >> 8)),
+           .count = (*pairs)[i],
+           .time = std::chrono::nanoseconds{0},
+           .next = opcodeToString(static_cast<Opcode>(i & 0xFF))});
+    }
+  }
+  for (const auto& [function, functionCount] : functions) {
+    report.functions.push_back({.name = functionCount.name,
+                                .count = functionCount.count,
+                                .time = std::chrono::nanoseconds{0},
+                                .next = ""});
+  }
+
+  // most frequent first, then by name so the output is stable
+  auto moreFrequent = [](const Row& a, const Row& b) {
+    if (a.count != b.count) {
+      return a.count > b.count;
+    }
+    return a.name != b.name ? a.name < b.name : a.next < b.next;
+  };
+  for (auto* rows : {&report.opcodes, &report.pairs, &report.functions,
+                     &report.classes}) {
+    std::sort(rows->begin(), rows->end(), moreFrequent);
+  }
+  return report;
+}
+
+namespace {
+
+std::string percentOf(double part, double total) {
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(1)
+     << (total == 0 ? 0.0 : 100.0 * part / total) << "%";
+  return ss.str();
+}
+
+template <typename Rows>
+void printRows(std::ostream& out, const std::string& heading, const Rows& rows,
+               size_t limit, uint64_t total,
+               std::optional<std::chrono::nanoseconds> totalTime) {
+  out << std::left << std::setw(48) << heading << std::right << std::setw(14)
+      << "Count" << std::setw(8) << "%";
+  if (totalTime.has_value()) {
+    out << std::setw(12) << "Time (ms)" << std::setw(8) << "%";
+  }
+  out << "\n";
+  for (size_t i = 0; i < std::min(limit, rows.size()); i++) {
+    std::string name = rows[i].name;
+    if (!rows[i].next.empty()) {
+      name += " -> " + rows[i].next;
+    }
+    out << std::left << std::setw(48) << name << std::right
+        << std::setw(14) << rows[i].count << std::setw(8)
+        << percentOf(rows[i].count, total);
+    if (totalTime.has_value()) {
+      out << std::setw(12) << std::fixed << std::setprecision(2)
+          << rows[i].time.count() / 1e6 << std::setw(8)
+          << percentOf(rows[i].time.count(), totalTime->count());
+    }
+    out << "\n";
+  }
+  out << "\n";
+}
+
+template <typename Rows>
+void printJsonRows(std::ostream& out, const std::string& key,
+                   const std::string& nameKey, const Rows& rows,
+                   bool withTime) {
+  out << "  \"" << key << "\": [";
+  for (size_t i = 0; i < rows.size(); i++) {
+    // names are opcodes and identifiers, which need no escaping
+    out << (i == 0 ? "\n" : ",\n") << "    {\"" << nameKey << "\": \""
+        << rows[i].name << "\", ";
+    if (!rows[i].next.empty()) {
+      out << "\"second\": \"" << rows[i].next << "\", ";
+    }
+    out << "\"count\": " << rows[i].count;
+    if (withTime) {
+      out << ", \"nanoseconds\": " << rows[i].time.count();
+    }
+    out << "}";
+  }
+  out << (rows.empty() ? "]" : "\n  ]");
+}
+
+}  // namespace
+
+std::string OpcodeStats::table(size_t topPairs) const {
+  Report report = this->report();
+  std::ostringstream out;
+  printRows(out, "Opcode", report.opcodes, report.opcodes.size(), report.total,
+            report.time);
+  printRows(out, "Opcode class", report.classes, report.classes.size(),
+            report.total, report.time);
+  uint64_t pairTotal = 0;
+  for (const Row& row : report.pairs) {
+    pairTotal += row.count;
+  }
+  printRows(out, "Opcode pair (top " + std::to_string(topPairs) + ")",
+            report.pairs, topPairs, pairTotal, std::nullopt);
+  printRows(out, "Function", report.functions, report.functions.size(),
+            report.total, std::nullopt);
+  out << "Total instructions: " << report.total << "\n";
+  return out.str();
+}
+
+std::string OpcodeStats::json() const {
+  Report report = this->report();
+  std::ostringstream out;
+  out << "{\n  \"total\": " << report.total
+      << ",\n  \"nanoseconds\": " << report.time.count() << ",\n";
+  printJsonRows(out, "opcodes", "opcode", report.opcodes, true);
+  out << ",\n";
+  printJsonRows(out, "classes", "class", report.classes, true);
+  out << ",\n";
+  printJsonRows(out, "pairs", "first", report.pairs, false);
+  out << ",\n";
+  printJsonRows(out, "functions", "function", report.functions, false);
+  out << "\n}\n";
+  return out.str();
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../bytecode.h"
+#include "../frontend/string_interner.h"
+#include "../runtime/object.h"
+#include "../runtime/object_ptr.h"
+
+// Execution counts of the stack engine's opcodes, for deciding which
+// superinstructions and specializations pay off. The dispatch loop the VM
+// runs while collecting calls count() before every instruction, which counts
+// the opcode, the pair it forms with the one before it and the function it
+// runs in, and charges the time since the previous call to the previous
+// opcode. That time includes the counting itself, so it is only good for
+// comparing opcode classes with each other.
+class OpcodeStats {
+ public:
+  explicit OpcodeStats(const StringInterner& stringInterner)
+      : stringInterner(stringInterner),
+        pairs(std::make_unique<PairCounts>()) {}
+
+  // Starts and stops the clock around an evaluation; counts from earlier
+  // evaluations are kept
+  void start();
+  void stop();
+
+  // Counts an instruction about to run in a call of the given closure
+  void count(Opcode opcode, const ClosureObject& closure) {
+    auto now = Clock::now();
+    if (hasPrevious) {
+      (*pairs)[pairIndex(previous, opcode)]++;
+      time[static_cast<uint8_t>(previous)] += now - last;
+    }
+    counts[static_cast<uint8_t>(opcode)]++;
+    if (closure.getFunction().get() != currentFunction) {
+      enterFunction(closure.getFunction());
+    }
+    (*currentCount)++;
+    previous = opcode;
+    hasPrevious = true;
+    last = now;
+  }
+
+  uint64_t total() const;
+  uint64_t count(Opcode opcode) const {
+    return counts[static_cast<uint8_t>(opcode)];
+  }
+  uint64_t count(Opcode first, Opcode second) const {
+    return (*pairs)[pairIndex(first, second)];
+  }
+
+  // A table of the opcodes, the most frequent pairs, the functions and the
+  // time per opcode class, for people
+  std::string table(size_t topPairs = 20) const;
+  // All of the above as a JSON object, with every pair that ran
+  std::string json() const;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  using PairCounts = std::array<uint64_t, 256 * 256>;
+
+  struct FunctionCount {
+    // keeps the function alive, so its address is not reused
+    ObjectPtr<FunctionObject> function;
+    std::string name;
+    uint64_t count = 0;
+  };
+
+  // a line of the output: an opcode, a pair, a function or a class
+  struct Row {
+    std::string name;
+    uint64_t count = 0;
+    std::chrono::nanoseconds time{0};  // only for opcodes and classes
+    std::string next;  // the second opcode of a pair
+  };
+  struct Report {
+    uint64_t total = 0;
+    std::chrono::nanoseconds time{0};
+    // each sorted with the most frequent first
+    std::vector<Row> opcodes;
+    std::vector<Row> pairs;
+    std::vector<Row> functions;
+    std::vector<Row> classes;
+  };
+  Report report() const;
+
+  static size_t pairIndex(Opcode first, Opcode second) {
+    return static_cast<uint8_t>(first) << 8 | static_cast<uint8_t>(second);
+  }
+  void enterFunction(const ObjectPtr<FunctionObject>& function);
+
+  const StringInterner& stringInterner;
+  std::array<uint64_t, 256> counts = {};
+  std::unique_ptr<PairCounts> pairs;  // indexed by pairIndex
+  std::array<Clock::duration, 256> time = {};
+  std::unordered_map<const FunctionObject*, FunctionCount> functions;
+  const FunctionObject* currentFunction = nullptr;
+  uint64_t* currentCount = nullptr;
+  Opcode previous = Opcode::NO_OP;
+  bool hasPrevious = false;
+  Clock::time_point last;
+};
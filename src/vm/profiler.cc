@@ -0,0 +1,59 @@
+#include "profiler.h"
+
+#include <sys/time.h>
+
+#include <stdexcept>
+
+volatile std::sig_atomic_t Profiler::pending = 0;
+
+void Profiler::handleSignal(int) { pending = 1; }
+
+void Profiler::start() {
+  if (running) {
+    return;
+  }
+  pending = 0;
+
+  struct sigaction action = {};
+  action.sa_handler = &Profiler::handleSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &previousAction) != 0) {
+    throw std::runtime_error("Could not install the profiling signal handler");
+  }
+
+  itimerval timer = {};
+  timer.it_interval.tv_sec = interval.count() / 1000000;
+  timer.it_interval.tv_usec = interval.count() % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+    sigaction(SIGPROF, &previousAction, nullptr);
+    throw std::runtime_error("Could not start the profiling timer");
+  }
+  running = true;
+}
+
+void Profiler::stop() {
+  if (!running) {
+    return;
+  }
+  itimerval timer = {};
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  sigaction(SIGPROF, &previousAction, nullptr);
+  pending = 0;
+  running = false;
+}
+
+void Profiler::record(const std::string& stack) {
+  pending = 0;
+  stacks[stack]++;
+  samples++;
+}
+
+std::string Profiler::collapsedStacks() const {
+  std::string output;
+  for (const auto& [stack, count] : stacks) {
+    output += stack + " " + std::to_string(count) + "\n";
+  }
+  return output;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <map>
+#include <string>
+
+// Sampling profiler for the stack engine. While running, a SIGPROF timer
+// fires every interval of CPU time and the signal handler only raises a flag.
+// The dispatch loop the VM runs while profiling checks that flag between
+// instructions and records the call stack at that point, so nothing is read
+// from the VM while it is halfway through changing it.
+//
+// Samples are kept as collapsed stacks, the input format of flamegraph tools:
+// one line per distinct stack, with the frames from the outermost in, each a
+// function name and the line it was on, separated by semicolons and followed
+// by the number of samples.
+//
+// The timer and the flag are process-wide, so only one Profiler can run at a
+// time.
+class Profiler {
+ public:
+  static constexpr std::chrono::microseconds DEFAULT_INTERVAL{1000};
+
+  explicit Profiler(std::chrono::microseconds interval = DEFAULT_INTERVAL)
+      : interval(interval) {}
+  Profiler(const Profiler&) = delete;
+  Profiler& operator=(const Profiler&) = delete;
+  ~Profiler() { stop(); }
+
+  // Starts and stops the timer; samples from earlier runs are kept
+  void start();
+  void stop();
+
+  static bool samplePending() { return pending != 0; }
+  // Counts a sample of the given collapsed stack and clears the flag
+  void record(const std::string& stack);
+
+  std::string collapsedStacks() const;
+  size_t sampleCount() const { return samples; }
+
+ private:
+  static void handleSignal(int);
+
+  static volatile std::sig_atomic_t pending;
+
+  std::chrono::microseconds interval;
+  bool running = false;
+  struct sigaction previousAction = {};
+  std::map<std::string, size_t> stacks;  // sorted, so output is stable
+  size_t samples = 0;
+};
@@ -0,0 +1,374 @@
+#include "register_vm.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "../debug.h"
+#include "../runtime/object.h"
+#include "../runtime/object_ptr.h"
+#include "../runtime/value.h"
+#include "dispatch.h"
+
+RegisterVM::RegisterVM(StringInterner& stringInterner, bool verbose)
+    : stringInterner(stringInterner), verbose(verbose) {}
+
+Value RegisterVM::evaluate(ObjectPtr<FunctionObject> function) {
+  if (verbose) {
+    std::cout << "==== Starting evaluation ====" << std::endl;
+  }
+
+  // Initialize the VM state for a new evaluation
+  FunctionObject* currentFunction = function.get();
+  const RegisterChunk* chunk = &currentFunction->getRegisterChunk();
+  int ip = 0;
+  int base = 0;
+  callStack.clear();
+  registers.assign(std::max(chunk->registerCount, 1), Value::NIL);
+  Value* frame = registers.data();
+
+  RegisterInstruction instruction;
+
+  // Fetch the current instruction; operands are decoded by the handlers
+#define FETCH()                                                             \
+  do {                                                                      \
+    instruction = chunk->instructions[ip++];                                \
+    if (verbose) {                                                          \
+      std::cout << registerInstructionToString(*chunk, ip - 1,              \
+                                               stringInterner)              \
+                << std::endl;                                               \
+    }                                                                       \
+  } while (false)
+
+// Operands of the current instruction; RA, RB and RC are the registers named
+// by the A, B and C operands
+#define RA frame[decodeA(instruction)]
+#define RB frame[decodeB(instruction)]
+#define RC frame[decodeC(instruction)]
+#define BX decodeBx(instruction)
+
+#ifdef SHINY_COMPUTED_GOTO
+  static void* dispatchTable[256];
+  static bool dispatchTableInitialized = false;
+  if (!dispatchTableInitialized) {
+    std::fill(std::begin(dispatchTable), std::end(dispatchTable),
+              &&op_UNIMPLEMENTED);
+#define REGISTER(name) \
+  dispatchTable[static_cast<uint8_t>(RegisterOpcode::name)] = &&op_##name
+    REGISTER(NO_OP);
+    REGISTER(MOVE);
+    REGISTER(LOAD_NIL);
+    REGISTER(LOAD_TRUE);
+    REGISTER(LOAD_FALSE);
+    REGISTER(LOAD_CONST);
+    REGISTER(ADD_INT);
+    REGISTER(ADD_DOUBLE);
+    REGISTER(SUB_INT);
+    REGISTER(SUB_DOUBLE);
+    REGISTER(MUL_INT);
+    REGISTER(MUL_DOUBLE);
+    REGISTER(DIV_INT);
+    REGISTER(DIV_DOUBLE);
+    REGISTER(MOD_INT);
+    REGISTER(EQ);
+    REGISTER(EQ_INT);
+    REGISTER(EQ_DOUBLE);
+    REGISTER(NEQ);
+    REGISTER(NEQ_INT);
+    REGISTER(NEQ_DOUBLE);
+    REGISTER(LT_INT);
+    REGISTER(LT_DOUBLE);
+    REGISTER(LTE_INT);
+    REGISTER(LTE_DOUBLE);
+    REGISTER(GT_INT);
+    REGISTER(GT_DOUBLE);
+    REGISTER(GTE_INT);
+    REGISTER(GTE_DOUBLE);
+    REGISTER(NEG_INT);
+    REGISTER(NEG_DOUBLE);
+    REGISTER(NOT);
+    REGISTER(JUMP);
+    REGISTER(JUMP_IF_FALSE);
+    REGISTER(CALL);
+    REGISTER(RETURN);
+    REGISTER(HALT);
+    REGISTER(GLOBAL_LOAD);
+    REGISTER(GLOBAL_STORE);
+#undef REGISTER
+    dispatchTableInitialized = true;
+  }
+
+#define CASE(name) op_##name:
+#define DISPATCH_QUIET()                     \
+  do {                                       \
+    FETCH();                                 \
+    goto *dispatchTable[instruction & 0xFF]; \
+  } while (false)
+#else
+#define CASE(name) case RegisterOpcode::name:
+#define DISPATCH_QUIET() continue
+#endif
+
+  // Print the registers of the frame after the instruction has executed, then
+  // move on to the next one
+#define DISPATCH()                              \
+  if (verbose) {                                \
+    printRegisters(base, chunk->registerCount); \
+  }                                             \
+  DISPATCH_QUIET()
+
+#define BINARY_INT(op)                  \
+  RA = Value(RB.asInt() op RC.asInt()); \
+  DISPATCH()
+#define BINARY_DOUBLE(op)                     \
+  RA = Value(RB.asDouble() op RC.asDouble()); \
+  DISPATCH()
+
+#ifdef SHINY_COMPUTED_GOTO
+  DISPATCH_QUIET();
+#else
+  while (true) {
+    FETCH();
+
+    // Execute the instruction
+    switch (decodeOpcode(instruction)) {
+#endif
+      CASE(NO_OP) {
+        DISPATCH();
+      }
+
+      // Opcodes that load values into registers
+      CASE(MOVE) {
+        RA = RB;
+        DISPATCH();
+      }
+      CASE(LOAD_NIL) {
+        RA = Value::NIL;
+        DISPATCH();
+      }
+      CASE(LOAD_TRUE) {
+        RA = Value::TRUE;
+        DISPATCH();
+      }
+      CASE(LOAD_FALSE) {
+        RA = Value::FALSE;
+        DISPATCH();
+      }
+      CASE(LOAD_CONST) {
+        RA = chunk->constants[BX];
+        DISPATCH();
+      }
+
+      // Arithmetic and comparisons
+      CASE(ADD_INT) {
+        BINARY_INT(+);
+      }
+      CASE(ADD_DOUBLE) {
+        BINARY_DOUBLE(+);
+      }
+      CASE(SUB_INT) {
+        BINARY_INT(-);
+      }
+      CASE(SUB_DOUBLE) {
+        BINARY_DOUBLE(-);
+      }
+      CASE(MUL_INT) {
+        BINARY_INT(*);
+      }
+      CASE(MUL_DOUBLE) {
+        BINARY_DOUBLE(*);
+      }
+      CASE(DIV_INT) {
+        if (RC.asInt() == 0) {
+          throw std::runtime_error("Division by zero");
+        }
+        BINARY_INT(/);
+      }
+      CASE(DIV_DOUBLE) {
+        BINARY_DOUBLE(/);
+      }
+      CASE(MOD_INT) {
+        if (RC.asInt() == 0) {
+          throw std::runtime_error("Division by zero");
+        }
+        BINARY_INT(%);
+      }
+      CASE(EQ) {
+        RA = Value(RB == RC);
+        DISPATCH();
+      }
+      CASE(EQ_INT) {
+        RA = Value(RB.asInt() == RC.asInt());
+        DISPATCH();
+      }
+      CASE(EQ_DOUBLE) {
+        BINARY_DOUBLE(==);
+      }
+      CASE(NEQ) {
+        RA = Value(RB != RC);
+        DISPATCH();
+      }
+      CASE(NEQ_INT) {
+        RA = Value(RB.asInt() != RC.asInt());
+        DISPATCH();
+      }
+      CASE(NEQ_DOUBLE) {
+        BINARY_DOUBLE(!=);
+      }
+      CASE(LT_INT) {
+        RA = Value(RB.asInt() < RC.asInt());
+        DISPATCH();
+      }
+      CASE(LT_DOUBLE) {
+        BINARY_DOUBLE(<);
+      }
+      CASE(LTE_INT) {
+        RA = Value(RB.asInt() <= RC.asInt());
+        DISPATCH();
+      }
+      CASE(LTE_DOUBLE) {
+        BINARY_DOUBLE(<=);
+      }
+      CASE(GT_INT) {
+        RA = Value(RB.asInt() > RC.asInt());
+        DISPATCH();
+      }
+      CASE(GT_DOUBLE) {
+        BINARY_DOUBLE(>);
+      }
+      CASE(GTE_INT) {
+        RA = Value(RB.asInt() >= RC.asInt());
+        DISPATCH();
+      }
+      CASE(GTE_DOUBLE) {
+        BINARY_DOUBLE(>=);
+      }
+      CASE(NEG_INT) {
+        RA = Value(-RB.asInt());
+        DISPATCH();
+      }
+      CASE(NEG_DOUBLE) {
+        RA = Value(-RB.asDouble());
+        DISPATCH();
+      }
+      CASE(NOT) {
+        RA = Value(!RB.asBool());
+        DISPATCH();
+      }
+
+      // Control flow
+      CASE(JUMP) {
+        ip = BX;
+        DISPATCH();
+      }
+      CASE(JUMP_IF_FALSE) {
+        if (!RA.asBool()) {
+          ip = BX;
+        }
+        DISPATCH();
+      }
+      CASE(CALL) {
+        Value& callee = RA;
+        if (!callee.isObject<FunctionObject>()) {
+          throw std::runtime_error("Tried to call a non-callable value");
+        }
+
+        callStack.push_back({currentFunction, ip, base});
+        currentFunction = callee.asObject<FunctionObject>().get();
+        chunk = &currentFunction->getRegisterChunk();
+        ip = 0;
+        base += decodeA(instruction);
+
+        // the register file may move when it grows, so the frame pointer has
+        // to be recomputed
+        size_t frameEnd = base + chunk->registerCount;
+        if (registers.size() < frameEnd) {
+          registers.resize(frameEnd, Value::NIL);
+        }
+        frame = registers.data() + base;
+
+        if (verbose) {
+          std::optional<SymbolId> name = currentFunction->getName();
+          std::cout << "== Entering "
+                    << (name.has_value() ? stringInterner.get(name.value())
+                                         : "<anonymous>")
+                    << " ==" << std::endl;
+        }
+        DISPATCH();
+      }
+      CASE(RETURN) {
+        if (callStack.empty()) {
+          throw std::runtime_error(
+              "Tried to return from the top-level function");
+        }
+
+        if (verbose) {
+          std::optional<SymbolId> name = currentFunction->getName();
+          std::cout << "== Leaving "
+                    << (name.has_value() ? stringInterner.get(name.value())
+                                         : "<anonymous>")
+                    << " ==" << std::endl;
+        }
+
+        // the result replaces the callee in the caller's register
+        frame[0] = RA;
+
+        RegisterFrame& caller = callStack.back();
+        currentFunction = caller.function;
+        chunk = &currentFunction->getRegisterChunk();
+        ip = caller.ip;
+        base = caller.base;
+        callStack.pop_back();
+        frame = registers.data() + base;
+        DISPATCH();
+      }
+      CASE(HALT) {
+        if (verbose) {
+          std::cout << "==== Evaluation complete ====" << std::endl;
+        }
+        return RA;
+      }
+
+      // Opcodes for globals
+      CASE(GLOBAL_LOAD) {
+        RA = globals[BX];
+        DISPATCH();
+      }
+      CASE(GLOBAL_STORE) {
+        if (BX >= globals.size()) {
+          globals.resize(BX + 1);  // Resize to allow new globals
+        }
+        globals[BX] = RA;
+        DISPATCH();
+      }
+
+#ifdef SHINY_COMPUTED_GOTO
+    op_UNIMPLEMENTED:
+      throw std::runtime_error("Unimplemented opcode");
+#else
+      default:
+        throw std::runtime_error("Unimplemented opcode");
+    }
+  }
+#endif
+
+#undef FETCH
+#undef RA
+#undef RB
+#undef RC
+#undef BX
+#undef CASE
+#undef DISPATCH_QUIET
+#undef DISPATCH
+#undef BINARY_INT
+#undef BINARY_DOUBLE
+}
+
+void RegisterVM::printRegisters(int base, int count) {
+  std::cout << "      ";
+  for (int i = base; i < base + count; i++) {
+    std::cout << valueToString(registers[i], stringInterner) << " ";
+  }
+  std::cout << std::endl;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+
+#include "../register_bytecode.h"
+#include "../runtime/object.h"
+#include "../runtime/object_ptr.h"
+#include "../runtime/value.h"
+
+struct RegisterFrame {
+  FunctionObject* function;
+  int ip;
+  int base;
+};
+
+// Interpreter for the register instruction set produced by the
+// RegisterCompiler. All call frames share one register file; the frame of a
+// callee starts at the register its caller placed the function in, so
+// arguments are passed without being copied.
+class RegisterVM {
+ public:
+  RegisterVM(StringInterner& stringInterner, bool verbose = false);
+
+  Value evaluate(ObjectPtr<FunctionObject> function);
+
+ private:
+  void printRegisters(int base, int count);
+
+  StringInterner& stringInterner;
+  std::vector<Value> globals;
+  std::vector<Value> registers;
+  std::vector<RegisterFrame> callStack;
+  bool verbose;
+};
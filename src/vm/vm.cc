@@ -1,19 +1,42 @@
 #include "vm.h"
 
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
 #include "../debug.h"
 #include "../runtime/object.h"
 #include "../runtime/object_ptr.h"
 #include "../runtime/value.h"
+#include "dispatch.h"
+#include "jit.h"
+#include "opcode_stats.h"
+#include "profiler.h"
 
-VM::VM(StringInterner& stringInterner, bool verbose)
-    : stringInterner(stringInterner), verbose(verbose) {}
+VM::VM(StringInterner& stringInterner, bool verbose, size_t stackSize)
+    : VM(stringInterner, {}, verbose, stackSize) {}
 VM::VM(StringInterner& stringInterner, const std::vector<Value>& globals,
-       bool verbose)
-    : stringInterner(stringInterner), globals(globals), verbose(verbose) {}
+       bool verbose, size_t stackSize)
+    : stringInterner(stringInterner),
+      globals(globals),
+      stack(new Value[stackSize]),
+      stackSize(stackSize),
+      sp(stack.get()),
+      verbose(verbose) {}
+
+VM::~VM() = default;
+
+void VM::enableJit(uint32_t callThreshold) {
+  jit = std::make_unique<Jit>(callThreshold);
+}
+
+void VM::enableProfiler() { profiler = std::make_unique<Profiler>(); }
+
+void VM::enableOpcodeStats() {
+  opcodeStats = std::make_unique<OpcodeStats>(stringInterner);
+}
 
 Value VM::evaluate(ObjectPtr<FunctionObject> function) {
   if (verbose) {
@@ -22,361 +45,561 @@ Value VM::evaluate(ObjectPtr<FunctionObject> function) {
 
   // Initialize the VM state for a new evaluation
   currentFunction = ObjectPtr<ClosureObject>(std::move(function));
+  closure = currentFunction.asObject<ClosureObject>().get();
   ip = 0;
   bp = 0;
-  chunk = &getFunctionFromValue(currentFunction)->getChunk();
+  chunk = &closure->getFunction()->getChunk();
   lastPoppedValue = Value::NIL;
 
-  while (true) {
-    // Fetch and decode the current instruction
-    Instruction instruction = chunk->instructions[ip++];
-    Opcode opcode = static_cast<Opcode>(instruction & 0xFF);
-    uint32_t operand = instruction >> 8;
-
-    if (verbose) {
-      std::cout << instructionToString(ip - 1, instruction, stringInterner)
-                << std::endl;
+  // Drop whatever an evaluation that failed halfway left behind
+  closeUpvalues(0);
+  while (sp > stack.get()) {
+    pop();
+  }
+  callStack.clear();
+  checkStackOverflow();
+
+  // Run the profiler's timer and the opcode counts' clock for just this
+  // evaluation, however it ends
+  struct Instrumentation {
+    VM& vm;
+    explicit Instrumentation(VM& vm) : vm(vm) {
+      if (vm.profiler) {
+        vm.profiler->start();
+      }
+      if (vm.opcodeStats) {
+        vm.opcodeStats->start();
+      }
     }
+    ~Instrumentation() {
+      if (vm.profiler) {
+        vm.profiler->stop();
+      }
+      if (vm.opcodeStats) {
+        vm.opcodeStats->stop();
+      }
+    }
+  } instrumentation(*this);
+  return run(0);
+}
+
+Value VM::run(size_t exitDepth) {
+  if (verbose) {
+    return execute<DispatchMode::Tracing>(exitDepth);
+  } else if (profiler) {
+    return execute<DispatchMode::Profiling>(exitDepth);
+  } else if (opcodeStats) {
+    return execute<DispatchMode::CountingOpcodes>(exitDepth);
+  }
+  return execute<DispatchMode::Plain>(exitDepth);
+}
+
+void VM::takeSample() {
+  // frame by frame from the top level, with the line of the call each
+  // caller is in and the line of the instruction about to run in the callee
+  std::string stack;
+  auto addFrame = [&](const Value& function, size_t offset) {
+    auto object = getFunctionFromValue(function);
+    auto name = object->getName();
+    if (!stack.empty()) {
+      stack += ';';
+    }
+    stack += name.has_value() ? stringInterner.get(*name) : "<top level>";
+    stack += ':';
+    stack += std::to_string(object->getChunk().lineAt(offset));
+  };
+  for (const Frame& frame : callStack) {
+    addFrame(frame.function, frame.ip - 1);
+  }
+  addFrame(currentFunction, ip);
+  profiler->record(stack);
+}
+
+template <VM::DispatchMode Mode>
+Value VM::execute(size_t exitDepth) {
+  constexpr bool Tracing = Mode == DispatchMode::Tracing;
+  constexpr bool Profiling = Mode == DispatchMode::Profiling;
+  constexpr bool CountingOpcodes = Mode == DispatchMode::CountingOpcodes;
+  Instruction instruction;
+  uint32_t operand;
+
+  // Fetch and decode the current instruction
+#define FETCH()                                                             \
+  do {                                                                      \
+    if constexpr (Profiling) {                                              \
+      if (Profiler::samplePending()) {                                      \
+        takeSample();                                                       \
+      }                                                                     \
+    }                                                                       \
+    instruction = chunk->instructions[ip++];                                \
+    operand = instruction >> 8;                                             \
+    if constexpr (CountingOpcodes) {                                        \
+      opcodeStats->count(static_cast<Opcode>(instruction & 0xFF),           \
+                         *closure);                                         \
+    }                                                                       \
+    if constexpr (Tracing) {                                                \
+      std::cout << instructionToString(*chunk, ip - 1, stringInterner)      \
+                << std::endl;                                               \
+    }                                                                       \
+  } while (false)
+
+#ifdef SHINY_COMPUTED_GOTO
+  // Every handler is followed by its own fetch and jump straight to the next
+  // handler, so each opcode gets its own indirect branch to predict. GCC only
+  // keeps them apart with -fno-crossjumping, which src/CMakeLists.txt sets.
+  static void* dispatchTable[256];
+  static bool dispatchTableInitialized = false;
+  if (!dispatchTableInitialized) {
+    std::fill(std::begin(dispatchTable), std::end(dispatchTable),
+              &&op_UNIMPLEMENTED);
+#define REGISTER(name) \
+  dispatchTable[static_cast<uint8_t>(Opcode::name)] = &&op_##name
+    REGISTER(NO_OP);
+    REGISTER(NIL);
+    REGISTER(TRUE);
+    REGISTER(FALSE);
+    REGISTER(CONST);
+    REGISTER(CLOSURE);
+    REGISTER(CLASS);
+    REGISTER(ADD);
+    REGISTER(SUB);
+    REGISTER(MUL);
+    REGISTER(DIV);
+    REGISTER(MOD);
+    REGISTER(NEG);
+    REGISTER(EQ);
+    REGISTER(NEQ);
+    REGISTER(LT);
+    REGISTER(LTE);
+    REGISTER(GT);
+    REGISTER(GTE);
+    REGISTER(NOT);
+    REGISTER(BIT_AND);
+    REGISTER(BIT_OR);
+    REGISTER(BIT_XOR);
+    REGISTER(BIT_NOT);
+    REGISTER(SHIFT_LEFT);
+    REGISTER(SHIFT_RIGHT);
+    REGISTER(LOAD);
+    REGISTER(STORE);
+    REGISTER(PARENT_LOAD);
+    REGISTER(PARENT_STORE);
+    REGISTER(DUP);
+    REGISTER(POP);
+    REGISTER(SLIDE);
+    REGISTER(JUMP_IF_FALSE);
+    REGISTER(JUMP_IF_TRUE);
+    REGISTER(JUMP);
+    REGISTER(LOOP);
+    REGISTER(FOR_RANGE);
+    REGISTER(CALL);
+    REGISTER(RETURN);
+    REGISTER(TAIL_CALL);
+    REGISTER(HALT);
+    REGISTER(GLOBAL_LOAD);
+    REGISTER(GLOBAL_STORE);
+    REGISTER(UPVALUE_LOAD);
+    REGISTER(UPVALUE_STORE);
+    REGISTER(UPVALUE_CLOSE);
+    REGISTER(MEMBER_GET);
+    REGISTER(MEMBER_SET);
+    REGISTER(INVOKE);
+    REGISTER(ADD_INT);
+    REGISTER(ADD_DOUBLE);
+    REGISTER(SUB_INT);
+    REGISTER(SUB_DOUBLE);
+    REGISTER(MUL_INT);
+    REGISTER(MUL_DOUBLE);
+    REGISTER(DIV_INT);
+    REGISTER(DIV_DOUBLE);
+    REGISTER(MOD_INT);
+    REGISTER(NEG_INT);
+    REGISTER(NEG_DOUBLE);
+    REGISTER(EQ_INT);
+    REGISTER(EQ_DOUBLE);
+    REGISTER(NEQ_INT);
+    REGISTER(NEQ_DOUBLE);
+    REGISTER(LT_INT);
+    REGISTER(LT_DOUBLE);
+    REGISTER(LTE_INT);
+    REGISTER(LTE_DOUBLE);
+    REGISTER(GT_INT);
+    REGISTER(GT_DOUBLE);
+    REGISTER(GTE_INT);
+    REGISTER(GTE_DOUBLE);
+    REGISTER(JUMP_UNLESS_LT_LOCAL_CONST);
+    REGISTER(JUMP_UNLESS_LTE_LOCAL_CONST);
+    REGISTER(JUMP_UNLESS_GT_LOCAL_CONST);
+    REGISTER(JUMP_UNLESS_GTE_LOCAL_CONST);
+    REGISTER(JUMP_UNLESS_EQ_LOCAL_CONST);
+    REGISTER(JUMP_UNLESS_NEQ_LOCAL_CONST);
+    REGISTER(ADD_INT_LOCALS);
+    REGISTER(ADD_INT_LOCAL_CONST);
+    REGISTER(SUB_INT_LOCAL_CONST);
+    REGISTER(MUL_INT_LOCAL_CONST);
+    REGISTER(LOCAL_MEMBER_GET);
+    REGISTER(JUMP_UNLESS_LT_INT);
+    REGISTER(JUMP_UNLESS_LTE_INT);
+    REGISTER(JUMP_UNLESS_GT_INT);
+    REGISTER(JUMP_UNLESS_GTE_INT);
+    REGISTER(JUMP_UNLESS_EQ_INT);
+    REGISTER(JUMP_UNLESS_NEQ_INT);
+#undef REGISTER
+    dispatchTableInitialized = true;
+  }
+
+  // A goto out of a block does not run the destructors of its locals, so each
+  // handler body sits in a switch of its own and DISPATCH_QUIET() leaves it
+  // with a break. That lands on the fetch and jump placed ahead of the next
+  // handler's label.
+#define NEXT()   \
+  FETCH();       \
+  goto *dispatchTable[instruction & 0xFF]
+#define CASE(name) \
+  NEXT();          \
+  op_##name:       \
+  switch (0)       \
+  case 0:
+#define DISPATCH_QUIET() break
+#else
+#define CASE(name) case Opcode::name:
+#define DISPATCH_QUIET() continue
+#endif
+
+  // Print the stack after the instruction has executed, then move on to the
+  // next one
+#define DISPATCH()         \
+  if constexpr (Tracing) { \
+    printStack();          \
+  }                        \
+  DISPATCH_QUIET()
+
+#ifndef SHINY_COMPUTED_GOTO
+  while (true) {
+    FETCH();
 
     // Execute the instruction
-    switch (opcode) {
-      case Opcode::NO_OP:
-        break;
+    switch (static_cast<Opcode>(instruction & 0xFF)) {
+#endif
+      CASE(NO_OP) {
+        DISPATCH();
+      }
 
       // Opcodes that push new values onto the stack
-      case Opcode::NIL: {
-        stack.push_back(Value::NIL);
-        break;
+      CASE(NIL) {
+        push(Value::NIL);
+        DISPATCH();
       }
-      case Opcode::TRUE: {
-        stack.push_back(Value::TRUE);
-        break;
+      CASE(TRUE) {
+        push(Value::TRUE);
+        DISPATCH();
       }
-      case Opcode::FALSE: {
-        stack.push_back(Value::FALSE);
-        break;
+      CASE(FALSE) {
+        push(Value::FALSE);
+        DISPATCH();
       }
-      case Opcode::CONST: {
-        stack.push_back(chunk->constants[operand]);
-        break;
+      CASE(CONST) {
+        push(chunk->constants[operand]);
+        DISPATCH();
       }
-      case Opcode::CLOSURE: {
-        ObjectPtr<FunctionObject> newFunction =
-            chunk->constants[operand].asObject<FunctionObject>();
-
-        // Capture all the upvalues to create the closure
-        std::vector<ObjectPtr<UpvalueObject>> upvalues;
-        for (auto& functionUpvalue : newFunction->getUpvalues()) {
-          upvalues.push_back(captureUpvalue(functionUpvalue));
-        }
-
-        // FIXME: what a monstrosity
-        stack.push_back(Value(std::move(ObjectPtr<ClosureObject>(
-            std::move(ClosureObject(newFunction, std::move(upvalues)))))));
-
-        break;
+      CASE(CLOSURE) {
+        push(Value(makeClosure(
+            chunk->constants[operand].asObject<FunctionObject>())));
+        DISPATCH();
+      }
+      CASE(CLASS) {
+        push(Value(makeClass(
+            *chunk->constants[operand].asObject<ClassObject>().get())));
+        DISPATCH();
       }
 
       // Opcodes to perform arithmetic
-      case Opcode::ADD: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(ADD) {
+        Value b = pop();
+        Value a = pop();
         if (a.isInt() && b.isInt()) {
-          stack.push_back(a.asInt() + b.asInt());
+          push(a.asInt() + b.asInt());
         } else if (a.isDouble() && b.isDouble()) {
-          stack.push_back(a.asDouble() + b.asDouble());
+          push(a.asDouble() + b.asDouble());
         } else if (a.isObject<StringObject>() && b.isObject<StringObject>()) {
-          stack.push_back(Value(std::move(ObjectPtr<StringObject>(std::move(
+          push(Value(std::move(ObjectPtr<StringObject>(std::move(
               StringObject(a.asObject<StringObject>()->getData() +
                            b.asObject<StringObject>()->getData()))))));
         } else {
           throw std::runtime_error("Invalid operand types for add");
         }
-        break;
+        DISPATCH();
       }
-      case Opcode::SUB: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(SUB) {
+        Value b = pop();
+        Value a = pop();
         if (a.isInt() && b.isInt()) {
-          stack.push_back(a.asInt() - b.asInt());
+          push(a.asInt() - b.asInt());
         } else if (a.isDouble() && b.isDouble()) {
-          stack.push_back(a.asDouble() - b.asDouble());
+          push(a.asDouble() - b.asDouble());
         } else {
           throw std::runtime_error("Invalid operand types for sub");
         }
-        break;
+        DISPATCH();
       }
-      case Opcode::MUL: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(MUL) {
+        Value b = pop();
+        Value a = pop();
         if (a.isInt() && b.isInt()) {
-          stack.push_back(a.asInt() * b.asInt());
+          push(a.asInt() * b.asInt());
         } else if (a.isDouble() && b.isDouble()) {
-          stack.push_back(a.asDouble() * b.asDouble());
+          push(a.asDouble() * b.asDouble());
         } else {
           throw std::runtime_error("Invalid operand types for mul");
         }
-        break;
+        DISPATCH();
       }
-      case Opcode::DIV: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(DIV) {
+        Value b = pop();
+        Value a = pop();
         if (a.isInt() && b.isInt()) {
-          stack.push_back(a.asInt() / b.asInt());
+          push(a.asInt() / b.asInt());
         } else if (a.isDouble() && b.isDouble()) {
-          stack.push_back(a.asDouble() / b.asDouble());
+          push(a.asDouble() / b.asDouble());
         } else {
           throw std::runtime_error("Invalid operand types for div");
         }
-        break;
+        DISPATCH();
       }
-      case Opcode::MOD: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(MOD) {
+        Value b = pop();
+        Value a = pop();
         if (!a.isInt() || !b.isInt()) {
           throw std::runtime_error("Invalid operand types for mod");
         }
-        stack.push_back(a.asInt() % b.asInt());
-        break;
-      }
-      case Opcode::NEG: {
-        Value a = stack.back();
-        stack.pop_back();
-        switch (operand) {
-          case 1:
-            stack.push_back(-a.asInt());
-            break;
-          case 2:
-            stack.push_back(-a.asDouble());
-            break;
-        }
-        break;
-      }
-      case Opcode::EQ: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
-        if (!a.isInt() || !b.isInt()) {
-          throw std::runtime_error("Invalid operand types for equal");
+        push(a.asInt() % b.asInt());
+        DISPATCH();
+      }
+      CASE(NEG) {
+        Value a = pop();
+        if (a.isInt()) {
+          push(-a.asInt());
+        } else if (a.isDouble()) {
+          push(-a.asDouble());
+        } else {
+          throw std::runtime_error("Invalid operand types for negate");
         }
-        stack.push_back(a == b);
-        break;
+        DISPATCH();
       }
-      case Opcode::NEQ: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
-        if (!a.isInt() || !b.isInt()) {
-          throw std::runtime_error("Invalid operand types for not-equal");
+      CASE(EQ) {
+        Value b = pop();
+        Value a = pop();
+        if (a.isDouble() && b.isDouble()) {
+          push(a.asDouble() == b.asDouble());
+        } else {
+          push(a == b);
         }
-        stack.push_back(a != b);
+        DISPATCH();
       }
-      case Opcode::LT: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(NEQ) {
+        Value b = pop();
+        Value a = pop();
+        if (a.isDouble() && b.isDouble()) {
+          push(a.asDouble() != b.asDouble());
+        } else {
+          push(a != b);
+        }
+        DISPATCH();
+      }
+      CASE(LT) {
+        Value b = pop();
+        Value a = pop();
         if (a.isInt() && b.isInt()) {
-          stack.push_back(a.asInt() < b.asInt());
+          push(a.asInt() < b.asInt());
         } else if (a.isDouble() && b.isDouble()) {
-          stack.push_back(a.asDouble() < b.asDouble());
+          push(a.asDouble() < b.asDouble());
         } else {
           throw std::runtime_error("Invalid operand types for less-than");
         }
-        break;
+        DISPATCH();
       }
-      case Opcode::LTE: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(LTE) {
+        Value b = pop();
+        Value a = pop();
         if (a.isInt() && b.isInt()) {
-          stack.push_back(a.asInt() <= b.asInt());
+          push(a.asInt() <= b.asInt());
         } else if (a.isDouble() && b.isDouble()) {
-          stack.push_back(a.asDouble() <= b.asDouble());
+          push(a.asDouble() <= b.asDouble());
         } else {
           throw std::runtime_error(
               "Invalid operand types for less-than-or-equal");
         }
-        break;
+        DISPATCH();
       }
-      case Opcode::GT: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(GT) {
+        Value b = pop();
+        Value a = pop();
         if (a.isInt() && b.isInt()) {
-          stack.push_back(a.asInt() > b.asInt());
+          push(a.asInt() > b.asInt());
         } else if (a.isDouble() && b.isDouble()) {
-          stack.push_back(a.asDouble() > b.asDouble());
+          push(a.asDouble() > b.asDouble());
         } else {
           throw std::runtime_error("Invalid operand types for greater-than");
         }
-        break;
+        DISPATCH();
       }
-      case Opcode::GTE: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(GTE) {
+        Value b = pop();
+        Value a = pop();
         if (a.isInt() && b.isInt()) {
-          stack.push_back(a.asInt() >= b.asInt());
+          push(a.asInt() >= b.asInt());
         } else if (a.isDouble() && b.isDouble()) {
-          stack.push_back(a.asDouble() >= b.asDouble());
+          push(a.asDouble() >= b.asDouble());
         } else {
           throw std::runtime_error(
               "Invalid operand types for greater-than-or-equal");
         }
-        break;
-      }
-      case Opcode::AND: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
-        if (!a.isBool() || !b.isBool()) {
-          throw std::runtime_error("Invalid operand types for and");
-        }
-        stack.push_back(a.asBool() && b.asBool());
-        break;
-      }
-      case Opcode::OR: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
-        if (!a.isBool() || !b.isBool()) {
-          throw std::runtime_error("Invalid operand types for or");
-        }
-        stack.push_back(a.asBool() || b.asBool());
-        break;
-      }
-      case Opcode::NOT: {
-        Value a = stack.back();
-        stack.pop_back();
+        DISPATCH();
+      }
+      CASE(NOT) {
+        Value a = pop();
         if (!a.isBool()) {
           throw std::runtime_error("Invalid operand types for not");
         }
-        stack.push_back(!a.asBool());
-        break;
+        push(!a.asBool());
+        DISPATCH();
       }
-      case Opcode::BIT_AND: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(BIT_AND) {
+        Value b = pop();
+        Value a = pop();
         if (!a.isInt() || !b.isInt()) {
           throw std::runtime_error("Invalid operand types for bit-and");
         }
-        stack.push_back(a.asInt() & b.asInt());
-        break;
+        push(a.asInt() & b.asInt());
+        DISPATCH();
       }
-      case Opcode::BIT_OR: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(BIT_OR) {
+        Value b = pop();
+        Value a = pop();
         if (!a.isInt() || !b.isInt()) {
           throw std::runtime_error("Invalid operand types for bit-or");
         }
-        stack.push_back(a.asInt() | b.asInt());
-        break;
+        push(a.asInt() | b.asInt());
+        DISPATCH();
       }
-      case Opcode::BIT_XOR: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(BIT_XOR) {
+        Value b = pop();
+        Value a = pop();
         if (!a.isInt() || !b.isInt()) {
           throw std::runtime_error("Invalid operand types for bit-xor");
         }
-        stack.push_back(a.asInt() ^ b.asInt());
-        break;
+        push(a.asInt() ^ b.asInt());
+        DISPATCH();
       }
-      case Opcode::BIT_NOT: {
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(BIT_NOT) {
+        Value a = pop();
         if (!a.isInt()) {
           throw std::runtime_error("Invalid operand types for bit-not");
         }
-        stack.push_back(~a.asInt());
-        break;
+        push(~a.asInt());
+        DISPATCH();
       }
-      case Opcode::SHIFT_LEFT: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(SHIFT_LEFT) {
+        Value b = pop();
+        Value a = pop();
         if (!a.isInt() || !b.isInt()) {
           throw std::runtime_error("Invalid operand types for shift-left");
         }
-        stack.push_back(a.asInt() << b.asInt());
-        break;
+        push(a.asInt() << b.asInt());
+        DISPATCH();
       }
-      case Opcode::SHIFT_RIGHT: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
+      CASE(SHIFT_RIGHT) {
+        Value b = pop();
+        Value a = pop();
         if (!a.isInt() || !b.isInt()) {
           throw std::runtime_error("Invalid operand types for shift-right");
         }
-        stack.push_back(a.asInt() >> b.asInt());
-        break;
+        push(a.asInt() >> b.asInt());
+        DISPATCH();
       }
 
       // Opcodes for stack manipulation
-      case Opcode::LOAD: {
+      CASE(LOAD) {
         int stackSlot = bp + operand;
-        stack.push_back(stack[stackSlot]);
-        break;
+        push(stack[stackSlot]);
+        DISPATCH();
       }
-      case Opcode::STORE: {
+      CASE(STORE) {
         int stackSlot = bp + operand;
-        stack[stackSlot] = stack.back();
-        stack.pop_back();
-        break;
+        stack[stackSlot] = pop();
+        DISPATCH();
+      }
+      CASE(PARENT_LOAD) {
+        push(parentSlot(operand));
+        DISPATCH();
+      }
+      CASE(PARENT_STORE) {
+        parentSlot(operand) = pop();
+        DISPATCH();
       }
 
-      case Opcode::DUP: {
-        stack.push_back(stack.back());
-        break;
+      CASE(DUP) {
+        push(peek());
+        DISPATCH();
+      }
+      CASE(POP) {
+        lastPoppedValue = pop();
+        DISPATCH();
       }
-      case Opcode::POP: {
-        lastPoppedValue = stack.back();
-        stack.pop_back();
-        break;
+      CASE(SLIDE) {
+        // the value the move swaps out ends up on top and is released by the
+        // pops
+        *(sp - operand - 1) = std::move(peek());
+        for (uint32_t i = 0; i < operand; i++) {
+          pop();
+        }
+        DISPATCH();
       }
 
       // Opcodes for control flow
-      case Opcode::TEST: {
-        Value condition = stack.back();
-        stack.pop_back();
-        if (condition.asBool()) {
-          ip++;
+      CASE(JUMP_IF_FALSE) {
+        if (!popPrimitive().asBool()) {
+          ip = operand;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_IF_TRUE) {
+        if (popPrimitive().asBool()) {
+          ip = operand;
         }
-        break;
+        DISPATCH();
       }
-      case Opcode::JUMP: {
+      CASE(JUMP) {
         ip = operand;
-        break;
+        DISPATCH();
       }
-      case Opcode::CALL: {
-        if (operand == 0 && stack.back().isObject<ClassObject>()) {
+      CASE(LOOP) {
+        ip = operand;
+        if (jit != nullptr && runNativeLoop()) {
+          if (callStack.size() < exitDepth) {
+            return Value::NIL;
+          }
+        }
+        DISPATCH();
+      }
+      CASE(FOR_RANGE) {
+        // the counter only counts up to the end, so it always fits in a Value
+        int64_t counter = sp[-2].asInt() + 1;
+        sp[-2] = Value(counter);
+        if (counter < sp[-1].asInt()) {
+          ip = operand;
+          if (jit != nullptr && runNativeLoop()) {
+            if (callStack.size() < exitDepth) {
+              return Value::NIL;
+            }
+          }
+        }
+        DISPATCH();
+      }
+      CASE(CALL) {
+        if (operand == 0 && peek().isObject<ClassObject>()) {
           callClass();
-          break;
+          DISPATCH();
         }
 
         pushFrame(operand);
@@ -384,26 +607,20 @@ Value VM::evaluate(ObjectPtr<FunctionObject> function) {
         if (currentFunction.isObject<MethodObject>()) {
           stack[bp] = currentFunction.asObject<MethodObject>()->getSelf();
         }
-
-        if (verbose) {
-          printStack();
+        if (jit != nullptr && runNative()) {
+          DISPATCH();
         }
 
-        // Print entering frame
-        std::optional<SymbolId> name =
-            getFunctionFromValue(callStack.back().function)->getName();
-        if (verbose) {
-          std::cout << "== Entering "
-                    << (name.has_value() ? stringInterner.get(name.value())
-                                         : "<anonymous>")
-                    << " ==" << std::endl;
+        if constexpr (Tracing) {
+          printStack();
+          printFrameEvent("Entering");
         }
 
         // Skip printing the stack at the end of iteration (already printed
         // the stack above)
-        continue;
+        DISPATCH_QUIET();
       }
-      case Opcode::RETURN: {
+      CASE(RETURN) {
         if (callStack.empty()) {
           throw std::runtime_error(
               "Tried to return from the top-level function");
@@ -413,123 +630,520 @@ Value VM::evaluate(ObjectPtr<FunctionObject> function) {
         closeUpvalues(bp);
 
         // Pop everything up to the base pointer
-        Value returnValue = stack.back();
-        while (stack.size() > bp) {
-          stack.pop_back();
+        Value returnValue = pop();
+        while (sp > stack.get() + bp) {
+          pop();
         }
-        stack.push_back(returnValue);
+        push(std::move(returnValue));
 
-        // Print the stack here
-        if (verbose) {
+        if constexpr (Tracing) {
           printStack();
-        }
-
-        // Print leaving frame
-        std::optional<SymbolId> name =
-            getFunctionFromValue(callStack.back().function)->getName();
-        if (verbose) {
-          std::cout << "== Leaving "
-                    << (name.has_value() ? stringInterner.get(name.value())
-                                         : "<anonymous>")
-                    << " ==" << std::endl;
+          printFrameEvent("Leaving");
         }
 
         popFrame();
+        if (callStack.size() < exitDepth) {
+          return Value::NIL;
+        }
 
         // Skip printing the stack at the end of iteration (already printed
         // the stack above)
-        continue;
+        DISPATCH_QUIET();
+      }
+      CASE(TAIL_CALL) {
+        if (callStack.empty()) {
+          throw std::runtime_error(
+              "Tried to tail call from the top-level function");
+        }
+
+        replaceFrame(operand);
+        if (jit != nullptr && runNative()) {
+          DISPATCH();
+        }
+
+        if constexpr (Tracing) {
+          printStack();
+          printFrameEvent("Tail calling");
+        }
+        DISPATCH_QUIET();
       }
-      case Opcode::HALT: {
-        if (verbose) {
+      CASE(HALT) {
+        if constexpr (Tracing) {
           std::cout << "==== Evaluation complete ====" << std::endl;
         }
         return lastPoppedValue;
       }
 
       // Opcodes for globals
-      case Opcode::GLOBAL_LOAD: {
-        stack.push_back(globals[operand]);
-        break;
+      CASE(GLOBAL_LOAD) {
+        push(global(operand));
+        DISPATCH();
       }
-      case Opcode::GLOBAL_STORE: {
+      CASE(GLOBAL_STORE) {
         if (operand >= globals.size()) {
           globals.resize(operand + 1);  // Resize to allow new globals
         }
-        globals[operand] = stack.back();
-        stack.pop_back();
-        break;
+        globals[operand] = pop();
+        DISPATCH();
       }
 
       // Opcodes for upvalue manipulation
-      case Opcode::UPVALUE_LOAD: {
-        int upvalueIndex = operand;
-        auto upvalue =
-            currentFunction.asObject<ClosureObject>()->getUpvalue(upvalueIndex);
-        stack.push_back(upvalue->getValue(stack));
-        break;
-      }
-      case Opcode::UPVALUE_STORE: {
-        int upvalueIndex = operand;
-        auto upvalue =
-            currentFunction.asObject<ClosureObject>()->getUpvalue(upvalueIndex);
-        upvalue->setValue(stack.back(), stack);
-        stack.pop_back();
-        break;
-      }
-      case Opcode::UPVALUE_CLOSE: {
-        closeUpvalues(stack.size() - 1);
-        break;
+      CASE(UPVALUE_LOAD) {
+        push(*closure->getUpvalueLocation(operand));
+        DISPATCH();
+      }
+      CASE(UPVALUE_STORE) {
+        *closure->getUpvalueLocation(operand) = peek();
+        pop();
+        DISPATCH();
+      }
+      CASE(UPVALUE_CLOSE) {
+        // closes over the local on top of the stack before popping it
+        closeUpvalues(stackCount() - 1);
+        pop();
+        DISPATCH();
       }
 
       // Opcodes for instances
-      case Opcode::MEMBER_GET: {
-        auto instance = stack.back().asObject<InstanceObject>();
-        stack.pop_back();
-        stack.push_back(instance->getMember(operand));
-        break;
-      }
-      case Opcode::MEMBER_SET: {
-        Value value = stack.back();
-        stack.pop_back();
-        auto instance = stack.back().asObject<InstanceObject>();
+      CASE(MEMBER_GET) {
+        auto instance = peek().asObject<InstanceObject>();
+        pop();
+        push(getMember(instance, operand));
+        DISPATCH();
+      }
+      CASE(MEMBER_SET) {
+        Value value = pop();
+        auto instance = peek().asObject<InstanceObject>();
         instance->setMember(operand, value);
-        break;
+        DISPATCH();
+      }
+      CASE(INVOKE) {
+        // the instance stays where the callee of a CALL would be, so it
+        // becomes slot 0 (self) of the method's frame without a MethodObject
+        int arity = operandLow(operand);
+        auto instance = (sp - arity - 1)->asObject<InstanceObject>();
+        pushFrame(instance->getClass()->getMembers()[operandHigh(operand)],
+                  arity);
+        if (jit != nullptr && runNative()) {
+          DISPATCH();
+        }
+
+        if constexpr (Tracing) {
+          printStack();
+          printFrameEvent("Entering");
+        }
+        DISPATCH_QUIET();
+      }
+
+      // Opcodes specialized on operand types, the type checker guarantees
+      // the tags so none are checked here
+      CASE(ADD_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = peek().asInt();
+        peek() = Value(a + b);
+        DISPATCH();
+      }
+      CASE(ADD_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a + b);
+        DISPATCH();
+      }
+      CASE(SUB_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = peek().asInt();
+        peek() = Value(a - b);
+        DISPATCH();
+      }
+      CASE(SUB_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a - b);
+        DISPATCH();
+      }
+      CASE(MUL_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = peek().asInt();
+        peek() = Value(a * b);
+        DISPATCH();
+      }
+      CASE(MUL_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a * b);
+        DISPATCH();
+      }
+      CASE(DIV_INT) {
+        int64_t b = popPrimitive().asInt();
+        if (b == 0) {
+          throw std::runtime_error("Division by zero");
+        }
+        int64_t a = peek().asInt();
+        peek() = Value(a / b);
+        DISPATCH();
+      }
+      CASE(DIV_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a / b);
+        DISPATCH();
+      }
+      CASE(MOD_INT) {
+        int64_t b = popPrimitive().asInt();
+        if (b == 0) {
+          throw std::runtime_error("Division by zero");
+        }
+        int64_t a = peek().asInt();
+        peek() = Value(a % b);
+        DISPATCH();
+      }
+      CASE(NEG_INT) {
+        peek() = Value(-peek().asInt());
+        DISPATCH();
+      }
+      CASE(NEG_DOUBLE) {
+        peek() = Value(-peek().asDouble());
+        DISPATCH();
+      }
+      CASE(EQ_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = peek().asInt();
+        peek() = Value(a == b);
+        DISPATCH();
+      }
+      CASE(EQ_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a == b);
+        DISPATCH();
+      }
+      CASE(NEQ_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = peek().asInt();
+        peek() = Value(a != b);
+        DISPATCH();
+      }
+      CASE(NEQ_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a != b);
+        DISPATCH();
+      }
+      CASE(LT_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = peek().asInt();
+        peek() = Value(a < b);
+        DISPATCH();
+      }
+      CASE(LT_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a < b);
+        DISPATCH();
+      }
+      CASE(LTE_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = peek().asInt();
+        peek() = Value(a <= b);
+        DISPATCH();
+      }
+      CASE(LTE_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a <= b);
+        DISPATCH();
+      }
+      CASE(GT_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = peek().asInt();
+        peek() = Value(a > b);
+        DISPATCH();
+      }
+      CASE(GT_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a > b);
+        DISPATCH();
+      }
+      CASE(GTE_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = peek().asInt();
+        peek() = Value(a >= b);
+        DISPATCH();
+      }
+      CASE(GTE_DOUBLE) {
+        double b = popPrimitive().asDouble();
+        double a = peek().asDouble();
+        peek() = Value(a >= b);
+        DISPATCH();
+      }
+
+      // Superinstructions
+      CASE(JUMP_UNLESS_LT_LOCAL_CONST) {
+        uint32_t target = chunk->instructions[ip++];
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = chunk->constants[operandHigh(operand)].asInt();
+        if (!(a < b)) {
+          ip = target;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_LTE_LOCAL_CONST) {
+        uint32_t target = chunk->instructions[ip++];
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = chunk->constants[operandHigh(operand)].asInt();
+        if (!(a <= b)) {
+          ip = target;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_GT_LOCAL_CONST) {
+        uint32_t target = chunk->instructions[ip++];
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = chunk->constants[operandHigh(operand)].asInt();
+        if (!(a > b)) {
+          ip = target;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_GTE_LOCAL_CONST) {
+        uint32_t target = chunk->instructions[ip++];
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = chunk->constants[operandHigh(operand)].asInt();
+        if (!(a >= b)) {
+          ip = target;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_EQ_LOCAL_CONST) {
+        uint32_t target = chunk->instructions[ip++];
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = chunk->constants[operandHigh(operand)].asInt();
+        if (!(a == b)) {
+          ip = target;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_NEQ_LOCAL_CONST) {
+        uint32_t target = chunk->instructions[ip++];
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = chunk->constants[operandHigh(operand)].asInt();
+        if (!(a != b)) {
+          ip = target;
+        }
+        DISPATCH();
+      }
+      CASE(ADD_INT_LOCALS) {
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = stack[bp + operandHigh(operand)].asInt();
+        push(Value(a + b));
+        DISPATCH();
+      }
+      CASE(ADD_INT_LOCAL_CONST) {
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = chunk->constants[operandHigh(operand)].asInt();
+        push(Value(a + b));
+        DISPATCH();
+      }
+      CASE(SUB_INT_LOCAL_CONST) {
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = chunk->constants[operandHigh(operand)].asInt();
+        push(Value(a - b));
+        DISPATCH();
+      }
+      CASE(MUL_INT_LOCAL_CONST) {
+        int64_t a = stack[bp + operandLow(operand)].asInt();
+        int64_t b = chunk->constants[operandHigh(operand)].asInt();
+        push(Value(a * b));
+        DISPATCH();
+      }
+      CASE(LOCAL_MEMBER_GET) {
+        auto instance =
+            stack[bp + operandLow(operand)].asObject<InstanceObject>();
+        push(getMember(instance, operandHigh(operand)));
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_LT_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = popPrimitive().asInt();
+        if (!(a < b)) {
+          ip = operand;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_LTE_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = popPrimitive().asInt();
+        if (!(a <= b)) {
+          ip = operand;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_GT_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = popPrimitive().asInt();
+        if (!(a > b)) {
+          ip = operand;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_GTE_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = popPrimitive().asInt();
+        if (!(a >= b)) {
+          ip = operand;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_EQ_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = popPrimitive().asInt();
+        if (!(a == b)) {
+          ip = operand;
+        }
+        DISPATCH();
+      }
+      CASE(JUMP_UNLESS_NEQ_INT) {
+        int64_t b = popPrimitive().asInt();
+        int64_t a = popPrimitive().asInt();
+        if (!(a != b)) {
+          ip = operand;
+        }
+        DISPATCH();
       }
 
+#ifdef SHINY_COMPUTED_GOTO
+      NEXT();
+    op_UNIMPLEMENTED:
+      throw std::runtime_error("Unimplemented opcode");
+#else
       default:
         throw std::runtime_error("Unimplemented opcode");
     }
-
-    if (verbose) {
-      printStack();
-    }
   }
+#endif
+
+#undef FETCH
+#undef NEXT
+#undef CASE
+#undef DISPATCH_QUIET
+#undef DISPATCH
 }
 
 void VM::callClass() {
   ObjectPtr<InstanceObject> instance(
-      InstanceObject(stack.back().asObject<ClassObject>()));
-  for (int i = 0; i < instance->getClass()->getMembers().size(); i++) {
-    auto member = instance->getClass()->getMembers()[i];
-    if (member.isObject<FunctionObject>()) {
-      instance->setMember(
-          i, Value(std::move(ObjectPtr<MethodObject>(std::move(MethodObject(
-                 std::move(member.asObject<FunctionObject>()), instance))))));
-    }
+      InstanceObject(peek().asObject<ClassObject>()));
+  pop();
+  push(Value(std::move(instance)));
+}
+
+Value VM::getMember(ObjectPtr<InstanceObject>& instance, int index) {
+  auto& klass = instance->getClass();
+  if (klass->isField(index)) {
+    return instance->getMember(index);
+  }
+  // bind the method to the instance it is looked up on
+  return Value(ObjectPtr<MethodObject>(MethodObject(
+      klass->getMember(index).asObject<ClosureObject>(), Value(instance))));
+}
+
+ObjectPtr<ClosureObject> VM::makeClosure(ObjectPtr<FunctionObject> function) {
+  // Capture all the upvalues to create the closure
+  std::vector<ObjectPtr<UpvalueObject>> upvalues;
+  for (auto& functionUpvalue : function->getUpvalues()) {
+    upvalues.push_back(captureUpvalue(functionUpvalue));
+  }
+  return ObjectPtr<ClosureObject>(
+      ClosureObject(std::move(function), std::move(upvalues)));
+}
+
+ObjectPtr<ClassObject> VM::makeClass(const ClassObject& declaration) {
+  // The methods close over their upvalues when the class declaration runs,
+  // the same way functions do. They are then shared by every instance of the
+  // class.
+  std::vector<Value> members = declaration.getMembers();
+  for (size_t i = declaration.getFieldCount(); i < members.size(); i++) {
+    members[i] = Value(makeClosure(members[i].asObject<FunctionObject>()));
   }
-  stack.pop_back();
-  stack.push_back(Value(std::move(instance)));
+  return ObjectPtr<ClassObject>(ClassObject(declaration.getName().value(),
+                                            std::move(members),
+                                            declaration.getFieldCount()));
 }
 
-void VM::pushFrame(int arity) {
-  int newBp = stack.size() - arity - 1;
-  Value newFunction = stack[newBp];
+void VM::pushFrame(int arity) { pushFrame(*(sp - arity - 1), arity); }
+
+void VM::pushFrame(const Value& function, int arity) {
   callStack.push_back({currentFunction, ip, bp});
-  currentFunction = newFunction;
+  currentFunction = function;
   ip = 0;
-  bp = newBp;
-  chunk = &getFunctionFromValue(currentFunction)->getChunk();
+  bp = stackCount() - arity - 1;
+  closure = getClosureFromValue(currentFunction).get();
+  chunk = &closure->getFunction()->getChunk();
+  checkStackOverflow();
+}
+
+void VM::replaceFrame(int arity) {
+  // Nothing in the current frame outlives the call, so close its upvalues and
+  // move the callee and its arguments down to the base pointer. The values the
+  // moves swap out end up above the new arguments and are released by the
+  // pops.
+  closeUpvalues(bp);
+  Value* callee = sp - arity - 1;
+  Value* base = stack.get() + bp;
+  for (int i = 0; i <= arity; i++) {
+    base[i] = std::move(callee[i]);
+  }
+  while (sp > base + arity + 1) {
+    pop();
+  }
+
+  currentFunction = base[0];
+  if (currentFunction.isObject<MethodObject>()) {
+    base[0] = currentFunction.asObject<MethodObject>()->getSelf();
+  }
+  ip = 0;
+  closure = getClosureFromValue(currentFunction).get();
+  chunk = &closure->getFunction()->getChunk();
+  checkStackOverflow();
+}
+
+bool VM::runNative() {
+  // every native frame also takes up room on the C++ stack, so calls nested
+  // too deeply are left to the interpreter
+  if (jit->nativeDepth >= Jit::MAX_NATIVE_DEPTH) {
+    return false;
+  }
+  auto function = getFunctionFromValue(currentFunction);
+  Jit::NativeCode code = jit->codeFor(*function.get());
+  if (code == nullptr) {
+    return false;
+  }
+  runNative(reinterpret_cast<const void*>(code), function->getJitState().body);
+  return true;
+}
+
+bool VM::runNativeLoop() {
+  if (jit->nativeDepth >= Jit::MAX_NATIVE_DEPTH) {
+    return false;
+  }
+  FunctionObject& function = *closure->getFunction().get();
+  const void* entry = jit->loopEntry(function, ip);
+  if (entry == nullptr) {
+    return false;
+  }
+  runNative(function.getJitState().code, entry);
+  return true;
+}
+
+void VM::runNative(const void* code, const void* entry) {
+  jit->nativeDepth++;
+  Value* result = reinterpret_cast<Jit::NativeCode>(const_cast<void*>(code))(
+      this, sp, stack.get() + bp, entry);
+  jit->nativeDepth--;
+  if (result == nullptr) {
+    std::rethrow_exception(std::exchange(jit->pendingError, nullptr));
+  }
+  sp = result;
 }
 
 void VM::popFrame() {
@@ -538,82 +1152,89 @@ void VM::popFrame() {
   currentFunction = frame.function;
   ip = frame.ip;
   bp = frame.bp;
-  chunk = &getFunctionFromValue(currentFunction)->getChunk();
+  closure = getClosureFromValue(currentFunction).get();
+  chunk = &closure->getFunction()->getChunk();
 }
 
 ObjectPtr<UpvalueObject> VM::captureUpvalue(Upvalue functionUpvalue) {
   if (functionUpvalue.isLocal) {
-    int stackSlot = bp + functionUpvalue.index;
-    auto upvalue = pushUpvalue(stackSlot);
-    return upvalue;
+    // closures capturing the same variable share its upvalue. The current
+    // frame's slots are the highest, so the search starts from the end.
+    Value* slot = stack.get() + bp + functionUpvalue.index;
+    auto it = openUpvalues.end();
+    while (it != openUpvalues.begin() && (*(it - 1))->getLocation() > slot) {
+      it--;
+    }
+    if (it != openUpvalues.begin() && (*(it - 1))->getLocation() == slot) {
+      return *(it - 1);
+    }
+    return *openUpvalues.insert(it,
+                                ObjectPtr<UpvalueObject>(UpvalueObject(slot)));
   } else {
-    auto parentClosure = callStack.back().function.asObject<ClosureObject>();
-    auto upvalue = parentClosure->getUpvalue(functionUpvalue.index);
-    return upvalue;
+    // the upvalue is one the enclosing function, which is the one currently
+    // running, captured itself
+    return closure->getUpvalue(functionUpvalue.index);
   }
 }
 
-ObjectPtr<UpvalueObject> VM::pushUpvalue(int stackSlot) {
-  ObjectPtr<UpvalueObject> upvalue(std::move(UpvalueObject(stackSlot)));
-  if (upvalueStack.has_value()) {
-    upvalue = ObjectPtr<UpvalueObject>(
-        std::move(UpvalueObject(stackSlot, upvalueStack.value())));
-  } else {
-    upvalue = ObjectPtr<UpvalueObject>(UpvalueObject(stackSlot));
+void VM::closeUpvalues(int upTillStackSlot) {
+  Value* limit = stack.get() + upTillStackSlot;
+  while (!openUpvalues.empty() &&
+         openUpvalues.back()->getLocation() >= limit) {
+    openUpvalues.back()->close();
+    openUpvalues.pop_back();
   }
-  upvalueStack = upvalue;
-  return upvalue;
 }
 
-void VM::closeUpvalues(int upTillStackSlot) {
-  std::optional<ObjectPtr<UpvalueObject>> prev = std::nullopt;
-  std::optional<ObjectPtr<UpvalueObject>> current = upvalueStack;
-  while (true) {
-    if (!current.has_value() ||
-        current.value()->getStackSlot() < upTillStackSlot) {
-      break;
-    }
-    current.value()->close(stack);
-    if (prev.has_value()) {
-      prev.value()->getNext() = current.value()->getNext();
-    } else {
-      upvalueStack = current.value()->getNext();
-    }
-    prev = current;
-    current = current.value()->getNext();
+void VM::checkStackOverflow() {
+  if (static_cast<size_t>(bp + chunk->maxStackSize) > stackSize) {
+    throw std::runtime_error("Stack overflow");
   }
 }
 
 void VM::printStack() {
-  if (stack.empty()) {
+  if (sp == stack.get()) {
     std::cout << "      <empty>" << std::endl;
   } else {
     std::cout << "      ";
-    for (auto& value : stack) {
-      std::cout << valueToString(value, stringInterner) << " ";
+    for (Value* value = stack.get(); value < sp; value++) {
+      std::cout << valueToString(*value, stringInterner) << " ";
     }
     std::cout << std::endl;
   }
 }
 
+void VM::printFrameEvent(const char* event) {
+  std::optional<SymbolId> name =
+      getFunctionFromValue(currentFunction)->getName();
+  std::cout << "== " << event << " "
+            << (name.has_value() ? stringInterner.get(name.value())
+                                 : "<anonymous>")
+            << " ==" << std::endl;
+}
+
 void VM::printUpvalueStack() {
-  if (!upvalueStack.has_value()) {
+  if (openUpvalues.empty()) {
     std::cout << "      <empty>" << std::endl;
   } else {
     std::cout << "      ";
-    std::vector<ObjectPtr<UpvalueObject>> upvalues;
-    auto current = upvalueStack;
-    while (current.has_value()) {
-      upvalues.insert(upvalues.begin(), current.value());
-      current = current.value()->getNext();
-    }
-    for (auto& upvalue : upvalues) {
+    for (auto& upvalue : openUpvalues) {
       std::cout << valueToString(Value(upvalue), stringInterner) << std::endl;
     }
   }
 }
 
-ObjectPtr<FunctionObject> VM::getFunctionFromValue(Value value) {
+ObjectPtr<ClosureObject> VM::getClosureFromValue(const Value& value) {
+  if (value.isObject<ClosureObject>()) {
+    return value.asObject<ClosureObject>();
+  } else if (value.isObject<MethodObject>()) {
+    return value.asObject<MethodObject>()->getClosure();
+  } else {
+    throw std::runtime_error("Tried to access closure from non-callable value");
+  }
+}
+
+ObjectPtr<FunctionObject> VM::getFunctionFromValue(const Value& value) {
   if (value.isObject<ClosureObject>()) {
     return value.asObject<ClosureObject>()->getFunction();
   } else if (value.isObject<MethodObject>()) {
@@ -1,11 +1,18 @@
 #pragma once
 
+#include <memory>
+#include <stdexcept>
 #include <vector>
 
 #include "../runtime/object.h"
 #include "../runtime/object_ptr.h"
 #include "../runtime/value.h"
 
+class Jit;
+struct JitHelpers;
+class OpcodeStats;
+class Profiler;
+
 struct Frame {
   Value function;
   int ip;
@@ -14,32 +21,128 @@ struct Frame {
 
 class VM {
  public:
-  VM(StringInterner& stringInterner, bool verbose = false);
+  // number of values the stack has room for, 2 MiB worth by default
+  static constexpr size_t DEFAULT_STACK_SIZE = 1 << 18;
+
+  VM(StringInterner& stringInterner, bool verbose = false,
+     size_t stackSize = DEFAULT_STACK_SIZE);
   VM(StringInterner& stringInterner, const std::vector<Value>& globals,
-     bool verbose = false);
+     bool verbose = false, size_t stackSize = DEFAULT_STACK_SIZE);
+  ~VM();
+
+  // Compiles functions to machine code once they have been called
+  // callThreshold times, see jit.h
+  void enableJit(uint32_t callThreshold);
+  // Samples the call stack while evaluating, see profiler.h. The JIT should
+  // stay off, since machine code never stops to take samples.
+  void enableProfiler();
+  // null unless the profiler is enabled
+  const Profiler* getProfiler() const { return profiler.get(); }
+  // Counts the opcodes run while evaluating, see opcode_stats.h. Like the
+  // profiler, this needs the JIT to stay off.
+  void enableOpcodeStats();
+  // null unless opcode counting is enabled
+  const OpcodeStats* getOpcodeStats() const { return opcodeStats.get(); }
 
   Value evaluate(ObjectPtr<FunctionObject> function);
 
  private:
+  // the machine code the JIT generates calls back into the VM through these
+  friend struct JitHelpers;
+
+  // Runs the dispatch loop until HALT, or until a frame returns to a caller
+  // deeper than exitDepth in the call stack, which is how the JIT hands a
+  // single frame to the interpreter.
+  Value run(size_t exitDepth);
+  // What the dispatch loop does besides running the instructions
+  enum class DispatchMode {
+    Plain,
+    Tracing,    // prints every instruction, the stack and frame changes, for -V
+    Profiling,  // checks for a pending sample before every instruction
+    CountingOpcodes,  // counts every instruction in opcodeStats
+  };
+  // The dispatch loop itself, instantiated once per mode, so the loop
+  // normally run has no tracing, profiling or counting code. Only one mode
+  // applies at a time, the first in this order that is enabled.
+  template <DispatchMode Mode>
+  Value execute(size_t exitDepth);
+  // Records the call stack, with the line each frame is on, as a sample
+  void takeSample();
+
+  // The stack has a fixed capacity and is only checked for overflow when a
+  // frame is entered, so pushing never checks for room. Slots at and above sp
+  // never hold objects: popping moves the value out and leaves nil behind.
+  void push(const Value& value) { *sp++ = value; }
+  void push(Value&& value) { *sp++ = std::move(value); }
+  Value pop() { return std::move(*--sp); }
+  // Pops a value the type checker guarantees not to be an object, which can
+  // stay behind in its slot
+  const Value& popPrimitive() { return *--sp; }
+  Value& peek() { return sp[-1]; }
+  int stackCount() const { return sp - stack.get(); }
+  // the local of an enclosing frame named by a PARENT_LOAD or PARENT_STORE
+  Value& parentSlot(uint32_t operand) {
+    const Frame& frame = callStack[callStack.size() - operandLow(operand)];
+    return stack[frame.bp + operandHigh(operand)];
+  }
+  // the global named by a GLOBAL_LOAD. The compiler only loads globals it has
+  // already stored, but a bytecode file can name any index.
+  const Value& global(uint32_t index) const {
+    if (index >= globals.size()) {
+      throw std::runtime_error("Undefined global");
+    }
+    return globals[index];
+  }
+  void checkStackOverflow();
+
   void callClass();
+  Value getMember(ObjectPtr<InstanceObject>& instance, int index);
+  ObjectPtr<ClosureObject> makeClosure(ObjectPtr<FunctionObject> function);
+  // the class a CLASS instruction creates from the declaration in its constant
+  ObjectPtr<ClassObject> makeClass(const ClassObject& declaration);
   void pushFrame(int arity);
+  void pushFrame(const Value& function, int arity);
+  // Makes the callee and arguments on top of the stack the current frame,
+  // for calls in tail position
+  void replaceFrame(int arity);
   void popFrame();
+  // Runs the frame just pushed as machine code if the JIT has compiled its
+  // function, compiling it first once it is hot. Returns whether it did, in
+  // which case the frame has already returned.
+  bool runNative();
+  // Counts an iteration of the loop whose start ip has just jumped back to,
+  // and continues the frame from there as machine code once the JIT has
+  // compiled its function. Returns whether it did, in which case the frame
+  // has already returned.
+  bool runNativeLoop();
+  void runNative(const void* code, const void* entry);
   ObjectPtr<UpvalueObject> captureUpvalue(Upvalue functionUpvalue);
-  ObjectPtr<UpvalueObject> pushUpvalue(int stackSlot);
   void closeUpvalues(int upTillStackSlot);
   void printStack();
+  // prints "== <event> <name of the current function> =="
+  void printFrameEvent(const char* event);
   void printUpvalueStack();
-  ObjectPtr<FunctionObject> getFunctionFromValue(Value value);
+  ObjectPtr<ClosureObject> getClosureFromValue(const Value& value);
+  ObjectPtr<FunctionObject> getFunctionFromValue(const Value& value);
 
   StringInterner& stringInterner;
   Value currentFunction;
+  ClosureObject* closure;  // the closure currentFunction calls
   int ip;
   int bp;
   Chunk* chunk;
   std::vector<Value> globals;
-  std::vector<Value> stack;
+  std::unique_ptr<Value[]> stack;
+  size_t stackSize;
+  Value* sp;
   std::vector<Frame> callStack;
-  std::optional<ObjectPtr<UpvalueObject>> upvalueStack;
+  // The upvalues still pointing into the stack, sorted by their slot with the
+  // lowest first. Frames only capture and close their own slots, so both
+  // happen at the end.
+  std::vector<ObjectPtr<UpvalueObject>> openUpvalues;
   Value lastPoppedValue;
+  std::unique_ptr<Jit> jit;  // null unless the JIT is enabled
+  std::unique_ptr<Profiler> profiler;  // null unless profiling
+  std::unique_ptr<OpcodeStats> opcodeStats;  // null unless counting opcodes
   bool verbose;
 };
\ No newline at end of file
@@ -0,0 +1,16 @@
+func mix(a: Int, b: Double) -> Int {
+    var x = -a * 3 % 7
+    var y = -b / 2.0
+    if y < -1.0 && (x != 0) {
+        return x + 10
+    }
+    return x
+}
+
+func same(a: Bool, b: Bool) -> Bool {
+    return a == b
+}
+
+if same(true, 2.5 >= 2.5) {
+    mix(4, 3.0)
+}
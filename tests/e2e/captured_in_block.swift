@@ -0,0 +1,14 @@
+func f() -> Int {
+    var total = 0
+    if true {
+        var x = 5
+        func g() -> Int {
+            return x
+        }
+        total = g()
+    }
+    var y = 10
+    return total + y
+}
+
+f()
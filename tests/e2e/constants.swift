@@ -0,0 +1,14 @@
+let width = 640
+let height = 480
+let debug = false
+
+func area() -> Int {
+    var border = 2 * 8
+    return (width - border) * (height - border)
+}
+
+var pixels = area()
+if debug {
+    pixels = 0
+}
+pixels + 1
@@ -0,0 +1,31 @@
+// Inlined calls read the values their arguments had when they were passed,
+// even when the body calls a closure that changes the caller's variable
+
+func f(a: Int, h: (Int) -> Int) -> Int {
+    h(0)
+    return a
+}
+
+func noop(z: Int) -> Int {
+    return 0
+}
+
+var hook = noop
+
+func g(a: Int) -> Int {
+    hook(0)
+    return a
+}
+
+func main() -> Int {
+    var x = 1
+    func bump(z: Int) -> Int {
+        x = x + 10
+        return 0
+    }
+    var passed = f(x, bump)
+    hook = bump
+    return passed * 100 + g(x)
+}
+
+main()
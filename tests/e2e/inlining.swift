@@ -0,0 +1,57 @@
+class Account {
+    var balance = 10
+    var rate = 2
+
+    func getBalance() -> Int {
+        return self.balance
+    }
+
+    func deposit(amount: Int) -> Int {
+        self.balance = self.balance + amount
+        return self.balance
+    }
+
+    // a local in the inlined body and two returns
+    func interest(years: Int) -> Int {
+        var total = self.getBalance() * self.rate
+        if years > 1 {
+            return total * years
+        }
+        return total
+    }
+}
+
+func square(n: Int) -> Int {
+    return n * n
+}
+
+func sumOfSquares(a: Int, b: Int) -> Int {
+    return square(a) + square(b)
+}
+
+// inlined in tail position
+func area(side: Int) -> Int {
+    return square(side)
+}
+
+func countdown(n: Int) -> Int {
+    if n == 0 {
+        return 0
+    }
+    return countdown(n - 1)
+}
+
+// calls nested in arguments and conditions, with the account's balance changed
+// by an inlined call
+func run(account: Int) -> Int {
+    var a = Account()
+    var result = sumOfSquares(square(2), account)
+    if a.deposit(5) > 12 {
+        result = result + a.interest(3)
+    } else {
+        result = result - 1
+    }
+    return result + a.getBalance() + area(2) + countdown(3)
+}
+
+run(3)
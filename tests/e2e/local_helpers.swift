@@ -0,0 +1,25 @@
+func accumulate(start: Int) -> Int {
+    var total = start
+
+    // only ever called from here, so `total` is read from this frame
+    func add(x: Int) -> Int {
+        total = total + x
+        return total
+    }
+
+    func twice(x: Int) -> Int {
+        func inner(y: Int) -> Int {
+            total = total + y
+            return total
+        }
+        inner(x)
+        return inner(x)
+    }
+
+    add(1)
+    add(2)
+    twice(10)
+    return add(100)
+}
+
+accumulate(1)
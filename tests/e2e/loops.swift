@@ -0,0 +1,50 @@
+func sum(n: Int) -> Int {
+    var total = 0
+    for i in 0..<n {
+        total = total + i
+    }
+    return total
+}
+
+func collatzSteps(start: Int) -> Int {
+    var n = start
+    var steps = 0
+    while n != 1 {
+        if n % 2 == 0 {
+            n = n / 2
+        } else {
+            n = 3 * n + 1
+        }
+        steps = steps + 1
+    }
+    return steps
+}
+
+// every iteration captures a variable of its own
+func capturedSum() -> Int {
+    var total = 0
+    for i in 1..<4 {
+        func get() -> Int {
+            return i
+        }
+        total = total * 10 + get()
+    }
+    return total
+}
+
+// the bounds are evaluated once, before the first iteration
+var pairs = 0
+var limit = 5
+for i in 0..<limit {
+    limit = 0
+    for j in i..<5 {
+        pairs = pairs + 1
+    }
+}
+
+// an empty range runs no iteration
+for i in 3..<3 {
+    pairs = pairs + 1000
+}
+
+sum(100) + collatzSteps(27) * 10000 + capturedSum() * 10000000 + pairs * 100000000000
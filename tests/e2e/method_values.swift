@@ -0,0 +1,14 @@
+class Counter {
+    var count = 0
+
+    func add(n: Int) -> Int {
+        self.count = self.count + n
+        return self.count
+    }
+}
+
+var counter = Counter()
+var add = counter.add
+add(2)
+counter.add(3)
+add(4)
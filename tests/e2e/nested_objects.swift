@@ -1,4 +1,4 @@
-func main() {
+func main() -> Int {
     class Vector {
         var x = 0
         var y = 0
@@ -28,7 +28,7 @@ func main() {
     object.update()
     object.update()
     object.update()
-    object.position.x + object.position.y
+    return object.position.x + object.position.y
 }
 
 main()
@@ -0,0 +1,26 @@
+func peek(x: Int) -> Int {
+    return 0
+}
+
+var read = peek
+
+func makeCounter() -> (Int) -> Int {
+    var count = 0
+
+    func add(x: Int) -> Int {
+        count = count + x
+        return count
+    }
+
+    func current(x: Int) -> Int {
+        return count
+    }
+
+    read = current
+    return add
+}
+
+var add = makeCounter()
+add(1)
+add(1)
+read(0) // returns 2, both closures share the captured `count`
@@ -0,0 +1,33 @@
+var calls = 0
+
+func touch(result: Bool) -> Bool {
+    calls = calls + 1
+    return result
+}
+
+// the right operand only runs when the left one does not decide the result
+func count(n: Int) -> Int {
+    var hits = 0
+    if n > 2 && touch(true) {
+        hits = hits + 1
+    }
+    if n < 2 || touch(false) {
+        hits = hits + 10
+    }
+    if !(n == 3) && touch(true) {
+        hits = hits + 100
+    }
+    var inRange = n >= 1 && n <= 5 || touch(true)
+    if inRange {
+        hits = hits + 1000
+    }
+    return hits
+}
+
+// && binds tighter than ||, and both looser than comparisons and arithmetic
+var precedence = false || true && 1 + 1 == 2
+var result = count(1) + count(3) * 10000
+if precedence {
+    result = result + calls * 100000000
+}
+result
@@ -0,0 +1,16 @@
+func sum(n: Int, acc: Int) -> Int {
+    if n == 0 {
+        return acc
+    }
+    var captured = n
+    func get() -> Int {
+        return captured
+    }
+    return sum(n - 1, acc + get())
+}
+
+func main() -> Int {
+    return sum(10000, 0)
+}
+
+main()
@@ -1,17 +1,31 @@
 #include <gtest/gtest.h>
 
+#include <filesystem>
+#include <fstream>
+#include <sstream>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
+#include "bytecode_file.h"
+#include "error.h"
+#include "runtime/object_allocator.h"
 #include "shiny.h"
 
 class E2ETest : public ::testing::Test {
  protected:
   std::unordered_map<std::string, Value> testCases = {
       {"adder.swift", Value(static_cast<int64_t>(3))},
+      {"arithmetic.swift", Value(static_cast<int64_t>(5))},
       {"assign.swift", Value(static_cast<int64_t>(2))},
       {"assign_in_func.swift", Value(static_cast<int64_t>(2))},
       {"assign_in_closure.swift", Value(static_cast<int64_t>(2))},
+      {"captured_in_block.swift", Value(static_cast<int64_t>(15))},
+      {"shared_upvalue.swift", Value(static_cast<int64_t>(2))},
+      {"short_circuit.swift", Value(static_cast<int64_t>(310011110))},
+      {"loops.swift", Value(static_cast<int64_t>(1501231114950))},
+      {"local_helpers.swift", Value(static_cast<int64_t>(124))},
+      {"constants.swift", Value(static_cast<int64_t>(289537))},
       {"factorial.swift", Value(static_cast<int64_t>(120))},
       {"boolean.swift", Value::TRUE},
       {"nested_func.swift", Value(static_cast<int64_t>(25))},
@@ -19,30 +33,359 @@ class E2ETest : public ::testing::Test {
       {"objects.swift", Value(static_cast<int64_t>(8))},
       {"simple_function.swift", Value(static_cast<int64_t>(1000))},
       {"ifs.swift", Value(static_cast<int64_t>(4))},
+      {"inlining.swift", Value(static_cast<int64_t>(134))},
+      {"inlined_arguments.swift", Value(static_cast<int64_t>(111))},
       {"nested_objects.swift", Value(static_cast<int64_t>(9))},
-      {"method_calls.swift", Value(static_cast<int64_t>(3))}};
+      {"method_calls.swift", Value(static_cast<int64_t>(3))},
+      {"method_values.swift", Value(static_cast<int64_t>(9))},
+      {"tail_calls.swift", Value(static_cast<int64_t>(50005000))}};
+
+  // Runs every test case with the options and checks its result
+  void expectAllCases(const Shiny::Options& options);
 };
 
+void expectResult(const Value& result, const Value& expectedResult,
+                  const std::string& filepath) {
+  if (result.isInt()) {
+    EXPECT_TRUE(expectedResult.isInt());
+    EXPECT_EQ(result.asInt(), expectedResult.asInt())
+        << "Failed on file: " << filepath;
+  } else if (result.isDouble()) {
+    EXPECT_TRUE(expectedResult.isDouble());
+    EXPECT_DOUBLE_EQ(result.asDouble(), expectedResult.asDouble())
+        << "Failed on file: " << filepath;
+  } else if (result.isBool()) {
+    EXPECT_TRUE(expectedResult.isBool());
+    EXPECT_EQ(result.asBool(), expectedResult.asBool())
+        << "Failed on file: " << filepath;
+  } else {
+    FAIL() << "Failed on file: " << filepath;
+  }
+}
+
+void E2ETest::expectAllCases(const Shiny::Options& options) {
+  for (const auto& [filename, expectedResult] : testCases) {
+    std::string filepath = "tests/e2e/" + filename;
+    Value result = Shiny::runFile(filepath, options);
+    expectResult(result, expectedResult, filepath);
+  }
+}
+
 // Run each test case
-TEST_F(E2ETest, RunAllTests) {
+TEST_F(E2ETest, RunAllTests) { expectAllCases(Shiny::Options()); }
+
+// factorial(5) needs more than four stack slots
+TEST_F(E2ETest, DetectsStackOverflow) {
+  Shiny::Options options;
+  options.stackSize = 4;
+  EXPECT_THROW(Shiny::runFile("tests/e2e/factorial.swift", options),
+               std::runtime_error);
+}
+
+// 10000 nested calls only fit in a small stack if they reuse one frame
+TEST_F(E2ETest, TailCallsRunInConstantStack) {
+  Shiny::Options options;
+  options.stackSize = 64;
+  Value result = Shiny::runFile("tests/e2e/tail_calls.swift", options);
+  expectResult(result, testCases.at("tail_calls.swift"),
+               "tests/e2e/tail_calls.swift");
+}
+
+// the peephole pass only removes instructions that do not change the result
+TEST_F(E2ETest, RunWithoutPeephole) {
+  Shiny::Options options;
+  options.peephole = false;
+  expectAllCases(options);
+}
+
+// inlined calls compute the same results as calls
+TEST_F(E2ETest, RunWithoutInlining) {
+  Shiny::Options options;
+  options.inlining = false;
+  expectAllCases(options);
+}
+
+TEST_F(E2ETest, InliningKeepsRuntimeErrors) {
+  EXPECT_THROW(Shiny::run("func inc(n: Int) -> Int {\n"
+                          "  return n + 1\n"
+                          "}\n"
+                          "func max() -> Int {\n"
+                          "  return inc(140737488355327)\n"
+                          "}\n"
+                          "max()"),
+               std::runtime_error);
+}
+
+// Functions the IR supports run from the bytecode lowered from it, on the
+// interpreter and as machine code
+TEST_F(E2ETest, RunThroughSSA) {
+  for (bool jit : {false, true}) {
+    Shiny::Options options;
+    options.ssa = true;
+    options.jit = jit;
+    options.jitThreshold = 1;
+    expectAllCases(options);
+  }
+}
+
+// Scripts written to .shinyc files and loaded back run the same bytecode
+TEST_F(E2ETest, RunPrecompiled) {
+  auto directory = std::filesystem::temp_directory_path();
   for (const auto& [filename, expectedResult] : testCases) {
     std::string filepath = "tests/e2e/" + filename;
-    Value result = Shiny::runFile(filepath);
-
-    if (result.isInt()) {
-      EXPECT_TRUE(expectedResult.isInt());
-      EXPECT_EQ(result.asInt(), expectedResult.asInt())
-          << "Failed on file: " << filepath;
-    } else if (result.isDouble()) {
-      EXPECT_TRUE(expectedResult.isDouble());
-      EXPECT_DOUBLE_EQ(result.asDouble(), expectedResult.asDouble())
-          << "Failed on file: " << filepath;
-    } else if (result.isBool()) {
-      EXPECT_TRUE(expectedResult.isBool());
-      EXPECT_EQ(result.asBool(), expectedResult.asBool())
-          << "Failed on file: " << filepath;
-    } else {
-      FAIL() << "Failed on file: " << filepath;
+    auto output = (directory / filename).replace_extension(".shinyc");
+    ASSERT_TRUE(Shiny::compileFile(filepath, output, Shiny::Options()))
+        << "Failed on file: " << filepath;
+    Value result = Shiny::runFile(output);
+    expectResult(result, expectedResult, filepath);
+    std::filesystem::remove(output);
+  }
+}
+
+TEST_F(E2ETest, RejectsInvalidBytecodeFile) {
+  auto output = std::filesystem::temp_directory_path() / "invalid.shinyc";
+  std::ofstream(output) << "not bytecode";
+  EXPECT_TRUE(Shiny::runFile(output).isNil());
+  std::filesystem::remove(output);
+}
+
+// Counts and operands out of range are rejected on load instead of crashing
+TEST_F(E2ETest, RejectsCorruptBytecodeFile) {
+  // a file holding a top-level function with the given instructions and
+  // number of constants, followed by the words of any constants
+  auto file = [](std::vector<uint32_t> instructions, uint32_t constantCount,
+                 std::vector<uint32_t> constants = {}) {
+    std::vector<uint32_t> words = {BytecodeFile::MAGIC, BytecodeFile::VERSION,
+                                   0, 0xFFFFFFFF, 0, 0,
+                                   static_cast<uint32_t>(instructions.size())};
+    words.insert(words.end(), instructions.begin(), instructions.end());
+    words.push_back(0);
+    words.push_back(constantCount);
+    words.insert(words.end(), constants.begin(), constants.end());
+    std::string data;
+    for (uint32_t word : words) {
+      for (int i = 0; i < 4; i++) {
+        data.push_back(static_cast<char>(word >> 8 * i));
+      }
     }
+    return data;
+  };
+  auto instruction = [](Opcode opcode, uint32_t operand) {
+    return static_cast<uint32_t>(opcode) | operand << 8;
+  };
+  uint32_t halt = instruction(Opcode::HALT, 0);
+
+  StringInterner interner;
+  EXPECT_NO_THROW(BytecodeFile::read(
+      file({instruction(Opcode::NIL, 0), halt}, 0), interner));
+  EXPECT_THROW(BytecodeFile::read(file({}, 0xFFFFFFFF), interner),
+               Shiny::Error);
+  EXPECT_THROW(BytecodeFile::read(
+                   file({instruction(Opcode::CONST, 100000), halt}, 0),
+                   interner),
+               Shiny::Error);
+  EXPECT_THROW(BytecodeFile::read(
+                   file({instruction(Opcode::LOAD, 5), halt}, 0), interner),
+               Shiny::Error);
+  EXPECT_THROW(BytecodeFile::read(
+                   file({instruction(Opcode::JUMP, 7), halt}, 0), interner),
+               Shiny::Error);
+  EXPECT_THROW(BytecodeFile::read(file({instruction(Opcode::UPVALUE_LOAD, 0),
+                                        halt},
+                                       0),
+                                  interner),
+               Shiny::Error);
+  // a loop that pushes a value every time around
+  EXPECT_THROW(
+      BytecodeFile::read(
+          file({instruction(Opcode::NIL, 0), instruction(Opcode::LOOP, 0)}, 0),
+          interner),
+      Shiny::Error);
+  // running off the end of the chunk
+  EXPECT_THROW(
+      BytecodeFile::read(file({instruction(Opcode::NIL, 0)}, 0), interner),
+      Shiny::Error);
+  // the top level has no enclosing frame
+  EXPECT_THROW(BytecodeFile::read(
+                   file({instruction(Opcode::PARENT_LOAD, packOperand(1, 0)),
+                         halt},
+                        0),
+                   interner),
+               Shiny::Error);
+
+  // a file whose top level pushes nil and makes a closure of a function with
+  // the given upvalue and instructions
+  auto nested = [&](Upvalue upvalue, std::vector<uint32_t> body) {
+    std::vector<uint32_t> function = {
+        5,           // tag of a function
+        0xFFFFFFFF,  // no name
+        1, static_cast<uint32_t>(upvalue.index), upvalue.isLocal,
+        1,  // entry depth
+        static_cast<uint32_t>(body.size())};
+    function.insert(function.end(), body.begin(), body.end());
+    function.push_back(0);
+    function.push_back(0);
+    return file({instruction(Opcode::NIL, 0), instruction(Opcode::CLOSURE, 0),
+                 halt},
+                1, function);
+  };
+  uint32_t ret = instruction(Opcode::RETURN, 0);
+  auto upvalueLoad = instruction(Opcode::UPVALUE_LOAD, 0);
+  EXPECT_NO_THROW(
+      BytecodeFile::read(nested({0, true}, {upvalueLoad, ret}), interner));
+  EXPECT_THROW(
+      BytecodeFile::read(nested({1, true}, {upvalueLoad, ret}), interner),
+      Shiny::Error);
+  EXPECT_THROW(
+      BytecodeFile::read(nested({0, false}, {upvalueLoad, ret}), interner),
+      Shiny::Error);
+  auto parentLoad = [&](uint32_t frames, uint32_t slot) {
+    return instruction(Opcode::PARENT_LOAD, packOperand(frames, slot));
+  };
+  EXPECT_NO_THROW(
+      BytecodeFile::read(nested({0, true}, {parentLoad(1, 0), ret}), interner));
+  EXPECT_THROW(
+      BytecodeFile::read(nested({0, true}, {parentLoad(2, 0), ret}), interner),
+      Shiny::Error);
+  EXPECT_THROW(
+      BytecodeFile::read(nested({0, true}, {parentLoad(1, 5), ret}), interner),
+      Shiny::Error);
+
+  // globals are only stored at runtime, so loading one nothing stored fails
+  // when it runs
+  auto output = std::filesystem::temp_directory_path() / "global.shinyc";
+  std::ofstream(output, std::ios::binary)
+      << file({instruction(Opcode::GLOBAL_LOAD, 100000), halt}, 0);
+  EXPECT_THROW(Shiny::runFile(output), std::runtime_error);
+  std::filesystem::remove(output);
+}
+
+// every sample names the functions on the stack and the lines they are on
+TEST_F(E2ETest, ProfileWritesCollapsedStacks) {
+  auto profile = std::filesystem::temp_directory_path() / "shiny.folded";
+  Shiny::Options options;
+  options.profile = profile;
+  Value result = Shiny::run("func fib(n: Int) -> Int {\n"
+                            "    if n < 2 {\n"
+                            "        return n\n"
+                            "    }\n"
+                            "    return fib(n - 1) + fib(n - 2)\n"
+                            "}\n"
+                            "fib(27)",
+                            options);
+  EXPECT_EQ(result.asInt(), 196418);
+
+  std::ifstream file(profile);
+  std::string line;
+  size_t samples = 0;
+  while (std::getline(file, line)) {
+    EXPECT_TRUE(line.starts_with("<top level>:7;fib:")) << line;
+    size_t count = line.rfind(' ');
+    ASSERT_NE(count, std::string::npos) << line;
+    samples += std::stoul(line.substr(count + 1));
+    for (size_t frame = line.find(";fib:"); frame < count;
+         frame = line.find(";fib:", frame + 1)) {
+      char fibLine = line[frame + 5];
+      EXPECT_TRUE(fibLine >= '2' && fibLine <= '5') << line;
+    }
+  }
+  EXPECT_GT(samples, 0u);
+  std::filesystem::remove(profile);
+}
+
+// the JSON dump counts every opcode, pair and function that ran
+TEST_F(E2ETest, OpcodeStatsWritesJson) {
+  auto output = std::filesystem::temp_directory_path() / "shiny_opcodes.json";
+  Shiny::Options options;
+  options.opcodeStatsJson = output;
+  Value result = Shiny::run("func fib(n: Int) -> Int {\n"
+                            "    if n < 2 {\n"
+                            "        return n\n"
+                            "    }\n"
+                            "    return fib(n - 1) + fib(n - 2)\n"
+                            "}\n"
+                            "fib(10)",
+                            options);
+  EXPECT_EQ(result.asInt(), 55);
+
+  std::ifstream file(output);
+  std::stringstream json;
+  json << file.rdbuf();
+  EXPECT_TRUE(json.str().starts_with("{\n  \"total\": ")) << json.str();
+  EXPECT_NE(json.str().find("\"opcode\": \"CALL\""), std::string::npos);
+  EXPECT_NE(json.str().find("\"class\": \"control flow\""), std::string::npos);
+  EXPECT_NE(json.str().find("\"first\": "), std::string::npos);
+  EXPECT_NE(json.str().find("\"function\": \"fib\""), std::string::npos);
+  // fib(10) calls fib 177 times, and only fib's frames return
+  EXPECT_NE(json.str().find("{\"opcode\": \"RETURN\", \"count\": 177,"),
+            std::string::npos);
+  std::filesystem::remove(output);
+}
+
+// every instance the loop makes is released by the end of its iteration
+TEST_F(E2ETest, ReleasesTemporaryObjects) {
+  ObjectAllocator& allocator = ObjectAllocator::get();
+  uint64_t instances = allocator.getLiveObjects(ObjectKind::Instance);
+  Value result = Shiny::run("func main() -> Int {\n"
+                            "    class Point {\n"
+                            "        var x = 0\n"
+                            "    }\n"
+                            "    var total = 0\n"
+                            "    for i in 0..<100 {\n"
+                            "        var point = Point()\n"
+                            "        point.x = i\n"
+                            "        total = total + point.x\n"
+                            "    }\n"
+                            "    return total\n"
+                            "}\n"
+                            "main()",
+                            Shiny::Options());
+  EXPECT_EQ(result.asInt(), 4950);
+  EXPECT_EQ(allocator.getLiveObjects(ObjectKind::Instance), instances);
+}
+
+// Compile every function on its first call so all of them run as machine code
+TEST_F(E2ETest, RunWithJit) {
+  Shiny::Options options;
+  options.jit = true;
+  options.jitThreshold = 1;
+  expectAllCases(options);
+}
+
+// errors raised by machine code propagate like the interpreter's
+TEST_F(E2ETest, JitRaisesErrors) {
+  Shiny::Options options;
+  options.jit = true;
+  options.jitThreshold = 1;
+  EXPECT_THROW(Shiny::run("func div(a: Int, b: Int) -> Int {\n"
+                          "    return a / b\n"
+                          "}\n"
+                          "div(1, 0)",
+                          options),
+               std::runtime_error);
+}
+
+// operations that fail at runtime are left for the runtime to report
+TEST_F(E2ETest, FoldingKeepsRuntimeErrors) {
+  EXPECT_THROW(Shiny::run("1 / 0"), std::runtime_error);
+  EXPECT_THROW(Shiny::run("let max = 140737488355327\nmax + 1"),
+               std::runtime_error);
+}
+
+// Run the test cases the register engine supports, which are the ones without
+// classes or captured variables
+TEST_F(E2ETest, RunOnRegisterEngine) {
+  std::vector<std::string> supported = {
+      "adder.swift",          "arithmetic.swift", "assign.swift",
+      "assign_in_func.swift", "boolean.swift",    "double.swift",
+      "factorial.swift",      "ifs.swift",        "short_circuit.swift",
+      "simple_function.swift"};
+
+  Shiny::Options options;
+  options.engine = Shiny::Engine::Register;
+  for (const auto& filename : supported) {
+    std::string filepath = "tests/e2e/" + filename;
+    Value result = Shiny::runFile(filepath, options);
+    expectResult(result, testCases.at(filename), filepath);
   }
 }
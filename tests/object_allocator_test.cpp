@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+
+#include "runtime/object_allocator.h"
+#include "runtime/object_ptr.h"
+
+TEST(ObjectAllocatorTest, ReusesFreedBlocksOfTheSameSizeClass) {
+  ObjectAllocator allocator;
+  void* first = allocator.allocate(40);
+  allocator.deallocate(first, 40);
+  // 33 to 48 bytes share a size class
+  EXPECT_EQ(allocator.allocate(48), first);
+  EXPECT_NE(allocator.allocate(40), first);
+  EXPECT_EQ(allocator.getSlabCount(), 1u);
+}
+
+TEST(ObjectAllocatorTest, BumpAllocatesFromSlabs) {
+  ObjectAllocator allocator;
+  auto* first = static_cast<char*>(allocator.allocate(20));
+  auto* second = static_cast<char*>(allocator.allocate(64));
+  EXPECT_EQ(second - first, 32);
+  for (size_t i = 0; i < ObjectAllocator::SLAB_SIZE / 64; i++) {
+    allocator.allocate(64);
+  }
+  EXPECT_EQ(allocator.getSlabCount(), 2u);
+}
+
+TEST(ObjectAllocatorTest, CountsLiveObjectsPerKind) {
+  ObjectAllocator& allocator = ObjectAllocator::get();
+  uint64_t live = allocator.getLiveObjects(ObjectKind::String);
+  {
+    ObjectPtr<StringObject> string(StringObject("shiny"));
+    EXPECT_EQ(allocator.getLiveObjects(ObjectKind::String), live + 1);
+  }
+  EXPECT_EQ(allocator.getLiveObjects(ObjectKind::String), live);
+}
+
+// small objects only take the memory of their own class, not of the largest
+TEST(ObjectAllocatorTest, ObjectsAreSizedByKind) {
+  EXPECT_LT(sizeof(TypedObject<UpvalueObject>),
+            sizeof(TypedObject<FunctionObject>));
+  EXPECT_EQ(sizeof(TypedObject<StringObject>),
+            sizeof(Object) + sizeof(StringObject));
+  ObjectPtr<StringObject> string(StringObject("shiny"));
+  EXPECT_TRUE(string.__getPtr()->is<StringObject>());
+  EXPECT_FALSE(string.__getPtr()->is<FunctionObject>());
+}
@@ -222,3 +222,63 @@ TEST(ParserTest, FunctionAsParameter) {
   ASSERT_EQ(*function.params[1].type.value(), *T::Int());
   ASSERT_EQ(*function.returnType, *T::Int());
 }
+
+TEST(ParserTest, LogicalOperatorPrecedence) {
+  std::string source = R"(
+  a || b && c + 1 == d
+  )";
+  Scanner scanner(source);
+  StringInterner strings;
+  Parser parser(scanner, strings);
+  auto ast = parser.parse();
+  ASSERT_FALSE(parser.hadError());
+
+  ASSERT_EQ(ast->statements.size(), 1);
+  auto& stmt = static_cast<ExprStmt&>(*ast->statements[0]);
+  auto& logicalOr = static_cast<BinaryExpr&>(*stmt.expression);
+  ASSERT_EQ(logicalOr.op, BinaryOperator::Or);
+  ASSERT_EQ(logicalOr.left->kind, ExprKind::Variable);
+  auto& logicalAnd = static_cast<BinaryExpr&>(*logicalOr.right);
+  ASSERT_EQ(logicalAnd.op, BinaryOperator::And);
+  ASSERT_EQ(logicalAnd.left->kind, ExprKind::Variable);
+  auto& equality = static_cast<BinaryExpr&>(*logicalAnd.right);
+  ASSERT_EQ(equality.op, BinaryOperator::Eq);
+}
+
+TEST(ParserTest, ForInRange) {
+  std::string source = R"(
+  for i in 0..<n {
+    while i > 0 {
+      i
+    }
+  }
+  )";
+  Scanner scanner(source);
+  StringInterner strings;
+  Parser parser(scanner, strings);
+  auto ast = parser.parse();
+  ASSERT_FALSE(parser.hadError());
+
+  ASSERT_EQ(ast->statements.size(), 1);
+  ASSERT_EQ(ast->statements[0]->kind, StmtKind::For);
+  auto& forStmt = static_cast<ForStmt&>(*ast->statements[0]);
+  ASSERT_EQ(strings.get(forStmt.var.name), "i");
+  ASSERT_EQ(forStmt.start->kind, ExprKind::Integer);
+  ASSERT_EQ(forStmt.end->kind, ExprKind::Variable);
+  auto& body = static_cast<BlockStmt&>(*forStmt.body);
+  ASSERT_EQ(body.statements.size(), 1);
+  ASSERT_EQ(body.statements[0]->kind, StmtKind::While);
+}
+
+TEST(ParserTest, ForWithoutRange) {
+  std::string source = R"(
+  for i in 0 {
+  }
+  )";
+  Scanner scanner(source);
+  StringInterner strings;
+  Parser parser(scanner, strings);
+  parser.parse();
+  ASSERT_TRUE(parser.hadError());
+  ASSERT_NE(std::string(parser.errors[0].what()).find("Expected '..<'"), std::string::npos);
+}
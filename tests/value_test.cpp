@@ -0,0 +1,35 @@
+#include <gtest/gtest.h>
+
+#include "runtime/object.h"
+#include "runtime/object_allocator.h"
+#include "runtime/value.h"
+
+// the kind travels with the value, so checks agree with the object's header
+TEST(ValueTest, ObjectValuesKnowTheirKind) {
+  Value string(ObjectPtr<StringObject>(StringObject("shiny")));
+  Value function{ObjectPtr<FunctionObject>(FunctionObject())};
+  ASSERT_TRUE(string.isAnyObject());
+  EXPECT_EQ(string.getObjectKind(), ObjectKind::String);
+  EXPECT_TRUE(string.isObject<StringObject>());
+  EXPECT_FALSE(string.isObject<FunctionObject>());
+  EXPECT_TRUE(function.isObject<FunctionObject>());
+  EXPECT_FALSE(function.isObject<ClosureObject>());
+  EXPECT_EQ(string.asObject<StringObject>()->getData(), "shiny");
+  EXPECT_FALSE(Value(static_cast<int64_t>(3)).isObject<StringObject>());
+}
+
+TEST(ValueTest, CopiesKeepTheKindAndTheObjectAlive) {
+  ObjectAllocator& allocator = ObjectAllocator::get();
+  uint64_t strings = allocator.getLiveObjects(ObjectKind::String);
+  {
+    Value copy;
+    {
+      Value string(ObjectPtr<StringObject>(StringObject("shiny")));
+      copy = string;
+    }
+    EXPECT_TRUE(copy.isObject<StringObject>());
+    EXPECT_EQ(copy.asObject<StringObject>()->getData(), "shiny");
+    EXPECT_EQ(allocator.getLiveObjects(ObjectKind::String), strings + 1);
+  }
+  EXPECT_EQ(allocator.getLiveObjects(ObjectKind::String), strings);
+}